@@ -0,0 +1,163 @@
+/*
+ * Сравнение реализаций обращения порядка байт
+ *
+ * Для каждого размера данных от 16 байт до 64 Мб (шаг - умножение на 4)
+ * и каждой поддерживаемой процессором реализации (с записью в другую
+ * область и на месте - суффикс -inplace) выводится строка:
+ *   kernel size iterations ns_per_call bytes_per_cycle gbytes_per_sec
+ * Циклы считаются по счетчику TSC (на других архитектурах - 0).
+ */
+
+#include "reverse.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <err.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES() __rdtsc()
+#else
+#define CYCLES() 0
+#endif
+
+static const size_t MIN_SIZE = 16;
+static const size_t MAX_SIZE = 64 * 1024 * 1024;
+
+/*
+ * Объем данных на одно измерение и минимальное число вызовов
+ */
+static const size_t BYTES_PER_RUN = 256 * 1024 * 1024;
+static const size_t MIN_ITERATIONS = 4;
+
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * обращение на месте текущей реализацией (для run)
+ */
+static reverse_inplace_fn inplace;
+
+static void run_inplace(char * dst, const char * src, size_t size)
+{
+  inplace(dst, size);
+}
+
+/*
+ * сравнение результата с побайтовым обращением
+ */
+static int check(reverse_fn reverse, char * dst, const char * src, size_t size)
+{
+  memset(dst, 0, size);
+  reverse(dst, src, size);
+  for (size_t i = 0; i < size; ++i)
+  {
+    if (dst[i] != src[size-1 - i])
+      return -1;
+  }
+  return 0;
+}
+
+static void run(const char * name, reverse_fn reverse, char * dst, const char * src, size_t size)
+{
+  size_t iterations = BYTES_PER_RUN / size;
+  uint64_t cycles;
+  double ns;
+
+  if (iterations < MIN_ITERATIONS)
+    iterations = MIN_ITERATIONS;
+
+  // прогрев
+  reverse(dst, src, size);
+
+  ns = now_ns();
+  cycles = CYCLES();
+  for (size_t i = 0; i < iterations; ++i)
+  {
+    reverse(dst, src, size);
+    __asm__ __volatile__("" : : "r"(dst) : "memory");
+  }
+  cycles = CYCLES() - cycles;
+  ns = now_ns() - ns;
+
+  fprintf(stdout, "%-16s %10zu %10zu %14.1f %8.3f %8.3f\n", name, size, iterations,
+          ns / iterations,
+          cycles ? (double)(size) * iterations / cycles : 0.0,
+          (double)(size) * iterations / ns);
+}
+
+int main(int argc, const char * argv[])
+{
+  const reverse_kernel_t * kernels;
+  size_t count;
+  size_t max_size = MAX_SIZE;
+  char * src;
+  char * dst;
+
+  if (argc > 1 && (max_size = strtoul(argv[1], NULL, 10)) < MIN_SIZE)
+  {
+    errx(EXIT_FAILURE, "Использование: %s [максимальный размер, не меньше %zu]", argv[0], MIN_SIZE);
+  }
+
+  reverse_init();
+  kernels = reverse_kernels(&count);
+
+  if (posix_memalign((void **)(&src), 64, max_size) != 0 ||
+      posix_memalign((void **)(&dst), 64, max_size) != 0)
+  {
+    err(EXIT_FAILURE, "Ошибка выделения памяти");
+  }
+  for (size_t i = 0; i < max_size; ++i)
+  {
+    src[i] = (char)(i * 7 + i / 251);
+  }
+  memset(dst, 0, max_size);
+
+  fprintf(stdout, "# selected: %s, non-temporal threshold: %d\n", reverse_kernel_name(), REVERSE_NT_THRESHOLD);
+  fprintf(stdout, "# kernel size iterations ns_per_call bytes_per_cycle gbytes_per_sec\n");
+  for (size_t size = MIN_SIZE; size <= max_size; size *= 4)
+  {
+    for (size_t k = 0; k < count; ++k)
+    {
+      if (!kernels[k].supported)
+        continue;
+      // проверка на размере, не кратном ширине блока
+      if (check(kernels[k].reverse, dst, src + 1, size - 1) != 0)
+      {
+        errx(EXIT_FAILURE, "Неверный результат реализации %s для размера %zu", kernels[k].name, size - 1);
+      }
+      run(kernels[k].name, kernels[k].reverse, dst, src, size);
+
+      if (kernels[k].reverse_inplace != NULL)
+      {
+        char name[32];
+
+        inplace = kernels[k].reverse_inplace;
+        memcpy(dst, src + 1, size - 1);
+        inplace(dst, size - 1);
+        for (size_t i = 0; i < size - 1; ++i)
+        {
+          if (dst[i] != src[size-1 - i])
+          {
+            errx(EXIT_FAILURE, "Неверный результат реализации %s на месте для размера %zu", kernels[k].name, size - 1);
+          }
+        }
+        snprintf(name, sizeof(name), "%s-inplace", kernels[k].name);
+        run(name, run_inplace, dst, src, size);
+      }
+    }
+    run("dispatch", reverse_bytes, dst, src, size);
+  }
+
+  free(src);
+  free(dst);
+  return 0;
+}
@@ -0,0 +1,482 @@
+/*
+ * Измерение очередей сообщений и буферов сообщений
+ *
+ * Очередь: цикл get_free -> add_ready -> get_ready -> release
+ *   inline  - все операции в одном потоке (стоимость цикла без конкуренции);
+ *   threads - producers потоков заполняют буферы, consumers потоков их
+ *             разбирают; задержка - от add_ready до получения буфера
+ *             потребителем (время записывается в начало сообщения).
+ *   contention - равное число производителей и потребителей, всего от 1
+ *             до 32 потоков (при одном потоке - inline): масштабирование
+ *             очередей для многих потоков (locked и mpmc).
+ *   server  - как у сервера: очереди 10 и 20 буферов переменной емкости
+ *             (бюджет -Q по умолчанию), буферы получает один поток,
+ *             освобождает другой.
+ * При отсутствии свободного (заполненного) буфера поток уступает процессор.
+ * locks_per_msg - захватов общей блокировки очереди на сообщение (locked),
+ * включая добавление в список заполненных и получение из него.
+ * Строки:
+ *   queue backend mode producers consumers queue_size message_size messages
+ *         seconds msgs_per_sec ns_per_msg lat_p50_ns lat_p99_ns lat_max_ns wakeups locks_per_msg
+ *
+ * Буфер: смена размера по шаблонам (рост удвоением и сброс, чередование
+ * малого и большого размера, случайные размеры, дописывание частями)
+ * Строки:
+ *   buffer pattern operations seconds ns_per_op
+ *
+ * Параметр - число сообщений на одно измерение очереди.
+ */
+
+#include "message_queue.h"
+#include "message_buffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <err.h>
+
+static const size_t DEFAULT_MESSAGES = 200000;
+
+/*
+ * Размеры очереди: используемые сервером (10 и 20) и большие
+ */
+static const size_t QUEUE_SIZES[] = { 10, 20, 64, 256, 1024 };
+static const int MESSAGE_SIZES[] = { 64, 4096 };
+
+/*
+ * Число потоков (производители, потребители) для очередей многих потоков
+ */
+static const int THREADS[][2] = { { 1, 1 }, { 2, 2 }, { 4, 4 }, { 1, 4 }, { 4, 1 } };
+
+/*
+ * Измерение масштабирования: всего потоков, размер очереди и сообщения
+ */
+static const int CONTENTION_THREADS[] = { 1, 2, 4, 8, 16, 32 };
+static const size_t CONTENTION_QUEUE_SIZE = 256;
+static const int CONTENTION_MESSAGE_SIZE = 64;
+
+/*
+ * Очереди сервера: размеры и бюджет роста по умолчанию
+ */
+static const size_t SERVER_QUEUE_SIZES[] = { 10, 20 };
+static const size_t SERVER_QUEUE_BUDGET = 64 * 1024;
+
+#define COUNT(a) (sizeof(a) / sizeof(a[0]))
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Гистограмма задержек: 8 линейных частей на каждую степень двойки
+ * (погрешность до 12.5%)
+ */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SIZE ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct histogram_t
+{
+  uint64_t counts[HISTOGRAM_SIZE];
+  uint64_t total;
+  uint64_t max;
+}; // struct histogram_t
+typedef struct histogram_t histogram_t;
+
+static int histogram_index(uint64_t value)
+{
+  int exponent;
+
+  if (value < (1u << HISTOGRAM_SUB_BITS))
+    return (int)(value);
+  exponent = 63 - __builtin_clzll(value);
+  return ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) +
+         (int)((value >> (exponent - HISTOGRAM_SUB_BITS)) & ((1u << HISTOGRAM_SUB_BITS) - 1));
+}
+
+/*
+ * наибольшее значение элемента index
+ */
+static uint64_t histogram_value(int index)
+{
+  int exponent = (index >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+  uint64_t sub = index & ((1u << HISTOGRAM_SUB_BITS) - 1);
+
+  if (index < (1 << HISTOGRAM_SUB_BITS))
+    return (uint64_t)(index);
+  return (((1ull << HISTOGRAM_SUB_BITS) + sub + 1) << (exponent - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+static void histogram_record(histogram_t * histogram, uint64_t value)
+{
+  ++histogram->counts[histogram_index(value)];
+  ++histogram->total;
+  if (value > histogram->max)
+    histogram->max = value;
+}
+
+static void histogram_merge(histogram_t * to, const histogram_t * from)
+{
+  for (int i = 0; i < HISTOGRAM_SIZE; ++i)
+  {
+    to->counts[i] += from->counts[i];
+  }
+  to->total += from->total;
+  if (from->max > to->max)
+    to->max = from->max;
+}
+
+static uint64_t histogram_percentile(const histogram_t * histogram, double percentile)
+{
+  uint64_t target = (uint64_t)(histogram->total * percentile / 100.0);
+  uint64_t count = 0;
+
+  for (int i = 0; i < HISTOGRAM_SIZE; ++i)
+  {
+    count += histogram->counts[i];
+    if (count > target)
+      return histogram_value(i) < histogram->max ? histogram_value(i) : histogram->max;
+  }
+  return histogram->max;
+}
+
+static const char * backend_name(message_queue_backend_t backend)
+{
+  switch (backend)
+  {
+    case MESSAGE_QUEUE_SPSC:
+      return "spsc";
+    case MESSAGE_QUEUE_MPMC:
+      return "mpmc";
+    default:
+      return "locked";
+  }
+}
+
+/*
+ * Заполнение буфера: размер и время отправки в начале сообщения
+ */
+static message_buffer_t * produce(message_queue_t * queue, int message_size)
+{
+  message_buffer_t * buffer;
+
+  while ((buffer = message_queue_get_free_buffer(queue)) == NULL)
+  {
+    sched_yield();
+  }
+  if (message_buffer_resize(buffer, message_size) != 0)
+    err(EXIT_FAILURE, "Ошибка выделения памяти");
+  buffer->size = message_size;
+  return buffer;
+}
+
+static void print_queue(message_queue_t * queue, message_queue_backend_t backend, const char * mode,
+                        int producers, int consumers, size_t queue_size, int message_size,
+                        size_t messages, uint64_t ns, const histogram_t * latency)
+{
+  message_queue_stats_t stats;
+
+  message_queue_get_stats(queue, &stats);
+  fprintf(stdout, "queue %s %s %d %d %zu %d %zu %.6f %.0f %.1f %lu %lu %lu %lu %.2f\n",
+          backend_name(backend), mode, producers, consumers, queue_size, message_size, messages,
+          ns / 1e9, messages * 1e9 / ns, (double)(ns) / messages,
+          (unsigned long)(histogram_percentile(latency, 50.0)),
+          (unsigned long)(histogram_percentile(latency, 99.0)),
+          (unsigned long)(latency->max), stats.wakeups, (double)(stats.locks) / messages);
+}
+
+/*
+ * Все операции в одном потоке; время каждого цикла
+ */
+static void run_inline(message_queue_backend_t backend, const char * mode, size_t queue_size, int message_size,
+                       size_t messages)
+{
+  message_queue_t * queue = message_queue_create_backend(queue_size, backend);
+  histogram_t * latency = calloc(1, sizeof(histogram_t));
+  uint64_t start;
+  uint64_t previous;
+
+  if (queue == NULL || latency == NULL)
+    err(EXIT_FAILURE, "Ошибка создания очереди");
+
+  start = previous = now_ns();
+  for (size_t i = 0; i < messages; ++i)
+  {
+    message_buffer_t * buffer = produce(queue, message_size);
+    uint64_t now;
+
+    message_queue_add_ready_buffer(queue, buffer);
+    buffer = message_queue_get_ready_buffer(queue);
+    message_queue_release_buffer(queue, buffer);
+
+    now = now_ns();
+    histogram_record(latency, now - previous);
+    previous = now;
+  }
+
+  print_queue(queue, backend, mode, 1, 1, queue_size, message_size, messages, previous - start, latency);
+  free(latency);
+  message_queue_destroy(queue);
+}
+
+/*
+ * Измерение с отдельными потоками производителей и потребителей
+ */
+struct thread_run_t
+{
+  message_queue_t * queue;
+  int               message_size;
+  size_t            messages;        // сообщений на производителя
+  size_t            total;           // сообщений всего
+  size_t            consumed;        // разобрано (общий счетчик потребителей)
+  volatile int      go;
+}; // struct thread_run_t
+typedef struct thread_run_t thread_run_t;
+
+struct thread_arg_t
+{
+  thread_run_t * run;
+  pthread_t      thread;
+  histogram_t    latency;
+}; // struct thread_arg_t
+typedef struct thread_arg_t thread_arg_t;
+
+static void * producer_routine(void * arg)
+{
+  thread_run_t * run = ((thread_arg_t *)(arg))->run;
+
+  while (!run->go)
+  {
+    sched_yield();
+  }
+  for (size_t i = 0; i < run->messages; ++i)
+  {
+    message_buffer_t * buffer = produce(run->queue, run->message_size);
+    uint64_t now = now_ns();
+
+    memcpy(buffer->buffer, &now, sizeof(now));
+    message_queue_add_ready_buffer(run->queue, buffer);
+  }
+  return NULL;
+}
+
+static void * consumer_routine(void * arg)
+{
+  thread_arg_t * consumer = (thread_arg_t *)(arg);
+  thread_run_t * run = consumer->run;
+
+  while (!run->go)
+  {
+    sched_yield();
+  }
+  while (__atomic_load_n(&run->consumed, __ATOMIC_RELAXED) < run->total)
+  {
+    message_buffer_t * buffer = message_queue_get_ready_buffer(run->queue);
+    uint64_t sent;
+
+    if (buffer == NULL)
+    {
+      sched_yield();
+      continue;
+    }
+    memcpy(&sent, buffer->buffer, sizeof(sent));
+    histogram_record(&consumer->latency, now_ns() - sent);
+    message_queue_release_buffer(run->queue, buffer);
+    __atomic_add_fetch(&run->consumed, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+static void run_threads(message_queue_backend_t backend, const char * mode, int producers, int consumers,
+                        size_t queue_size, size_t queue_budget, int message_size, size_t messages)
+{
+  thread_run_t run;
+  thread_arg_t * args = calloc(producers + consumers, sizeof(thread_arg_t));
+  histogram_t * latency = calloc(1, sizeof(histogram_t));
+  uint64_t start;
+
+  if (args == NULL || latency == NULL)
+    err(EXIT_FAILURE, "Ошибка выделения памяти");
+
+  memset(&run, 0, sizeof(run));
+  run.queue = message_queue_create_elastic(queue_size, queue_budget, backend);
+  if (run.queue == NULL)
+    err(EXIT_FAILURE, "Ошибка создания очереди");
+  run.message_size = message_size;
+  run.messages = messages / producers;
+  run.total = run.messages * producers;
+
+  for (int i = 0; i < producers + consumers; ++i)
+  {
+    args[i].run = &run;
+    if (pthread_create(&args[i].thread, NULL, i < producers ? producer_routine : consumer_routine, args + i) != 0)
+      err(EXIT_FAILURE, "Ошибка создания потока");
+  }
+
+  start = now_ns();
+  run.go = 1;
+  for (int i = 0; i < producers + consumers; ++i)
+  {
+    pthread_join(args[i].thread, NULL);
+    histogram_merge(latency, &args[i].latency);
+  }
+
+  print_queue(run.queue, backend, mode, producers, consumers, queue_size, message_size, run.total,
+              now_ns() - start, latency);
+  message_queue_destroy(run.queue);
+  free(latency);
+  free(args);
+}
+
+/*
+ * Смена размера буфера
+ */
+static uint64_t random_state = 0x9E3779B97F4A7C15ull;
+
+static uint64_t next_random(void)
+{
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+  return random_state * 2685821657736338717ull;
+}
+
+static void print_buffer(const char * pattern, size_t operations, uint64_t ns)
+{
+  fprintf(stdout, "buffer %s %zu %.6f %.1f\n", pattern, operations, ns / 1e9, (double)(ns) / operations);
+}
+
+static void run_buffer(size_t iterations)
+{
+  static char chunk[1024];
+  message_buffer_t buffer;
+  size_t operations;
+  uint64_t start;
+
+  if (message_buffer_init(&buffer, 64) != 0)
+    err(EXIT_FAILURE, "Ошибка выделения памяти");
+
+  // рост удвоением от 64 байт до 1 Мб и сброс
+  operations = 0;
+  start = now_ns();
+  for (size_t i = 0; i < iterations / 16; ++i)
+  {
+    for (size_t size = 64; size <= 1024 * 1024; size *= 2, ++operations)
+    {
+      if (message_buffer_resize(&buffer, size) != 0)
+        err(EXIT_FAILURE, "Ошибка выделения памяти");
+      buffer.buffer[size - 1] = 0;
+    }
+    message_buffer_resize(&buffer, 64);
+    ++operations;
+  }
+  print_buffer("grow", operations, now_ns() - start);
+
+  // чередование малого и большого сообщения
+  start = now_ns();
+  for (size_t i = 0; i < iterations; ++i)
+  {
+    if (message_buffer_resize(&buffer, (i & 1) ? 64 * 1024 : 64) != 0)
+      err(EXIT_FAILURE, "Ошибка выделения памяти");
+    buffer.buffer[0] = 0;
+  }
+  print_buffer("alternate", iterations, now_ns() - start);
+
+  // размеры, равномерно распределенные по порядку величины (64 байта - 256 Кб)
+  start = now_ns();
+  for (size_t i = 0; i < iterations; ++i)
+  {
+    uint64_t random = next_random();
+    size_t size = (size_t)(64) << (random % 12);
+
+    size += (random >> 8) % size;
+    if (message_buffer_resize(&buffer, size) != 0)
+      err(EXIT_FAILURE, "Ошибка выделения памяти");
+    buffer.buffer[size - 1] = 0;
+  }
+  print_buffer("random", iterations, now_ns() - start);
+
+  // дописывание частями по 1 Кб до 64 Кб
+  operations = 0;
+  start = now_ns();
+  for (size_t i = 0; i < iterations / 64; ++i)
+  {
+    message_buffer_resize(&buffer, 64);
+    for (int j = 0; j < 64; ++j, ++operations)
+    {
+      if (message_buffer_append(&buffer, chunk, sizeof(chunk)) != 0)
+        err(EXIT_FAILURE, "Ошибка выделения памяти");
+    }
+  }
+  print_buffer("append", operations, now_ns() - start);
+
+  message_buffer_destroy(&buffer);
+}
+
+int main(int argc, const char * argv[])
+{
+  size_t messages = DEFAULT_MESSAGES;
+
+  if (argc > 1 && (messages = strtoul(argv[1], NULL, 10)) == 0)
+  {
+    errx(EXIT_FAILURE, "Использование: %s [число сообщений на измерение]", argv[0]);
+  }
+
+  fprintf(stdout, "# queue backend mode producers consumers queue_size message_size messages"
+                  " seconds msgs_per_sec ns_per_msg lat_p50_ns lat_p99_ns lat_max_ns wakeups locks_per_msg\n");
+  for (size_t q = 0; q < COUNT(QUEUE_SIZES); ++q)
+  {
+    for (size_t m = 0; m < COUNT(MESSAGE_SIZES); ++m)
+    {
+      run_inline(MESSAGE_QUEUE_LOCKED, "inline", QUEUE_SIZES[q], MESSAGE_SIZES[m], messages);
+      run_inline(MESSAGE_QUEUE_SPSC, "inline", QUEUE_SIZES[q], MESSAGE_SIZES[m], messages);
+      run_inline(MESSAGE_QUEUE_MPMC, "inline", QUEUE_SIZES[q], MESSAGE_SIZES[m], messages);
+      run_threads(MESSAGE_QUEUE_SPSC, "threads", 1, 1, QUEUE_SIZES[q], 0, MESSAGE_SIZES[m], messages);
+      for (size_t t = 0; t < COUNT(THREADS); ++t)
+      {
+        run_threads(MESSAGE_QUEUE_LOCKED, "threads", THREADS[t][0], THREADS[t][1], QUEUE_SIZES[q], 0,
+                    MESSAGE_SIZES[m], messages);
+        run_threads(MESSAGE_QUEUE_MPMC, "threads", THREADS[t][0], THREADS[t][1], QUEUE_SIZES[q], 0,
+                    MESSAGE_SIZES[m], messages);
+      }
+    }
+  }
+
+  for (size_t q = 0; q < COUNT(SERVER_QUEUE_SIZES); ++q)
+  {
+    for (size_t m = 0; m < COUNT(MESSAGE_SIZES); ++m)
+    {
+      run_threads(MESSAGE_QUEUE_LOCKED, "server", 1, 1, SERVER_QUEUE_SIZES[q], SERVER_QUEUE_BUDGET,
+                  MESSAGE_SIZES[m], messages);
+      run_threads(MESSAGE_QUEUE_MPMC, "server", 1, 1, SERVER_QUEUE_SIZES[q], SERVER_QUEUE_BUDGET,
+                  MESSAGE_SIZES[m], messages);
+    }
+  }
+
+  for (size_t t = 0; t < COUNT(CONTENTION_THREADS); ++t)
+  {
+    int threads = CONTENTION_THREADS[t];
+
+    if (threads == 1)
+    {
+      run_inline(MESSAGE_QUEUE_LOCKED, "contention", CONTENTION_QUEUE_SIZE, CONTENTION_MESSAGE_SIZE, messages);
+      run_inline(MESSAGE_QUEUE_MPMC, "contention", CONTENTION_QUEUE_SIZE, CONTENTION_MESSAGE_SIZE, messages);
+      continue;
+    }
+    run_threads(MESSAGE_QUEUE_LOCKED, "contention", threads / 2, threads / 2, CONTENTION_QUEUE_SIZE, 0,
+                CONTENTION_MESSAGE_SIZE, messages);
+    run_threads(MESSAGE_QUEUE_MPMC, "contention", threads / 2, threads / 2, CONTENTION_QUEUE_SIZE, 0,
+                CONTENTION_MESSAGE_SIZE, messages);
+  }
+
+  fprintf(stdout, "# buffer pattern operations seconds ns_per_op\n");
+  run_buffer(messages);
+  return 0;
+}
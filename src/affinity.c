@@ -0,0 +1,240 @@
+/*
+ * Привязка потоков к процессорам и размещение памяти по узлам NUMA
+ */
+
+#define _GNU_SOURCE
+
+#include "affinity.h"
+#include "buffer_pool.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+/*
+ * Процессоры назначений
+ */
+static int    affinity_cpus[AFFINITY_ROLES][CPU_SETSIZE];
+static size_t affinity_count[AFFINITY_ROLES];
+
+static const char * const AFFINITY_NAMES[AFFINITY_ROLES] =
+{
+  "socket",
+  "main",
+  "workers",
+  "stages",
+  "shards",
+};
+
+/*
+ * Число узлов NUMA (определяется при первом обращении)
+ */
+static int            affinity_node_count = 1;
+static pthread_once_t affinity_nodes_once = PTHREAD_ONCE_INIT;
+
+/*
+ * номер из имени вида prefixN (-1 - имя другого вида)
+ */
+static int affinity_entry_number(const char * name, const char * prefix)
+{
+  size_t length = strlen(prefix);
+
+  if (strncmp(name, prefix, length) != 0 || !isdigit(name[length]))
+    return -1;
+  for (const char * c = name + length; *c != 0; ++c)
+  {
+    if (!isdigit(*c))
+      return -1;
+  }
+  return atoi(name + length);
+}
+
+static void affinity_count_nodes(void)
+{
+  DIR * dir = opendir("/sys/devices/system/node");
+  struct dirent * entry;
+  int count = 0;
+
+  if (dir == NULL)
+    return;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    if (affinity_entry_number(entry->d_name, "node") >= 0)
+      ++count;
+  }
+  closedir(dir);
+  if (count > 0)
+    affinity_node_count = count;
+}
+
+/*
+ * узел NUMA процессора (0, если не определяется)
+ */
+static int affinity_cpu_node(int cpu)
+{
+  char path[64];
+  DIR * dir;
+  struct dirent * entry;
+  int node = 0;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  dir = opendir(path);
+  if (dir == NULL)
+    return 0;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    int number = affinity_entry_number(entry->d_name, "node");
+    if (number >= 0)
+    {
+      node = number;
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+/*
+ * поток назначения с единственным экземпляром привязывается ко всему списку
+ */
+static int affinity_single(affinity_role_t role)
+{
+  return role == AFFINITY_SOCKET || role == AFFINITY_MAIN;
+}
+
+/*
+ * задать процессоры назначения
+ */
+int affinity_set(const char * spec)
+{
+  const char * list = strchr(spec, '=');
+  int cpus[CPU_SETSIZE];
+  size_t count = 0;
+  int role;
+
+  if (list == NULL)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  for (role = 0; role < AFFINITY_ROLES; ++role)
+  {
+    if (strlen(AFFINITY_NAMES[role]) == (size_t)(list - spec) &&
+        strncmp(spec, AFFINITY_NAMES[role], list - spec) == 0)
+      break;
+  }
+  if (role == AFFINITY_ROLES)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // номера и диапазоны через ','
+  for (const char * c = list + 1; ; ++c)
+  {
+    char * end;
+    long first, last;
+
+    if (!isdigit(*c))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+    first = last = strtol(c, &end, 10);
+    if (*end == '-')
+    {
+      if (!isdigit(end[1]))
+      {
+        errno = EINVAL;
+        return -1;
+      }
+      last = strtol(end + 1, &end, 10);
+    }
+    if (first > last || last >= CPU_SETSIZE || count + (last - first + 1) > CPU_SETSIZE)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+    for (long cpu = first; cpu <= last; ++cpu)
+    {
+      cpus[count++] = (int)(cpu);
+    }
+    if (*end == 0)
+      break;
+    if (*end != ',')
+    {
+      errno = EINVAL;
+      return -1;
+    }
+    c = end;
+  }
+
+  memcpy(affinity_cpus[role], cpus, count * sizeof(int));
+  affinity_count[role] = count;
+  return 0;
+}
+
+/*
+ * привязать текущий поток к процессорам назначения
+ */
+int affinity_bind(affinity_role_t role, size_t index)
+{
+  cpu_set_t set;
+  int rc;
+
+  if (affinity_count[role] == 0)
+    return 0;
+
+  CPU_ZERO(&set);
+  if (affinity_single(role))
+  {
+    for (size_t i = 0; i < affinity_count[role]; ++i)
+    {
+      CPU_SET(affinity_cpus[role][i], &set);
+    }
+  }
+  else
+  {
+    CPU_SET(affinity_cpus[role][index % affinity_count[role]], &set);
+  }
+
+  rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (rc != 0)
+  {
+    fflush(stdout);
+    fprintf(stderr, "Ошибка привязки потока %s %zu к процессорам: %s (%d)\n",
+            AFFINITY_NAMES[role], index, strerror(rc), rc);
+    errno = rc;
+    return -1;
+  }
+
+  // блоки пула буферов - с узла NUMA потока
+  if (affinity_nodes() > 1)
+  {
+    buffer_pool_set_node(affinity_node(role, index));
+  }
+  return 0;
+}
+
+/*
+ * узел NUMA потока с номером index
+ */
+int affinity_node(affinity_role_t role, size_t index)
+{
+  if (affinity_count[role] == 0)
+    return -1;
+  return affinity_cpu_node(affinity_cpus[role][affinity_single(role) ? 0 : index % affinity_count[role]]);
+}
+
+/*
+ * число узлов NUMA
+ */
+int affinity_nodes(void)
+{
+  pthread_once(&affinity_nodes_once, affinity_count_nodes);
+  return affinity_node_count;
+}
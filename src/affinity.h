@@ -0,0 +1,56 @@
+/*
+ * Привязка потоков к процессорам и размещение памяти по узлам NUMA
+ *
+ * Для каждого назначения потоков задается список процессоров. Поток
+ * с единственным экземпляром (сокеты, основной) привязывается ко всему
+ * списку, потоки пулов (обработки, этапов, шарды) - каждый к одному
+ * процессору списка по номеру потока.
+ * Если узлов NUMA больше одного, привязанный поток получает блоки пула
+ * буферов своего узла (см. buffer_pool_set_node)
+ */
+
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#include <stdlib.h>
+
+/*
+ * Назначение потока
+ */
+enum affinity_role_t
+{
+  AFFINITY_SOCKET = 0, // поток работы с сокетами
+  AFFINITY_MAIN,       // основной поток (обработка без пула потоков)
+  AFFINITY_WORKER,     // потоки обработки
+  AFFINITY_STAGE,      // потоки этапов обработки
+  AFFINITY_SHARD,      // потоки шардов
+  AFFINITY_ROLES,
+}; // enum affinity_role_t
+typedef enum affinity_role_t affinity_role_t;
+
+/*
+ * задать процессоры назначения: "роль=список", список - номера
+ * и диапазоны через ',' (например "workers=2-5,8")
+ * роли: socket, main, workers, stages, shards
+ * возвращает -1 при ошибке (errno = EINVAL)
+ */
+int affinity_set(const char * spec);
+
+/*
+ * привязать текущий поток с номером index к процессорам назначения
+ * (без заданных процессоров поток не привязывается)
+ * возвращает -1 при ошибке (errno)
+ */
+int affinity_bind(affinity_role_t role, size_t index);
+
+/*
+ * узел NUMA потока с номером index (-1 - процессоры не заданы)
+ */
+int affinity_node(affinity_role_t role, size_t index);
+
+/*
+ * число узлов NUMA
+ */
+int affinity_nodes(void);
+
+#endif // __AFFINITY_H__
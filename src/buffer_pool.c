@@ -0,0 +1,639 @@
+/*
+ * Пул памяти для буферов сообщений
+ */
+
+#include "buffer_pool.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#ifdef _DEBUG
+#include <stdio.h>
+#define DEBUG(msg...) fprintf(stderr, "%u: ", (int)(pthread_self())); fprintf(stderr, msg)
+#else
+#define DEBUG(mag...)
+#endif
+
+/*
+ * Число классов: степени двойки от BUFFER_POOL_MIN_SIZE (2^8) до BUFFER_POOL_MAX_SIZE (2^26)
+ */
+#define BUFFER_POOL_MIN_SHIFT 8
+#define BUFFER_POOL_CLASSES   19
+
+/*
+ * Наименьшее число блоков в слэбе (первый блок занимает заголовок)
+ */
+#define BUFFER_POOL_SLAB_BLOCKS 16
+
+/*
+ * Внутренние структуры
+ *
+ * Свободный блок (ссылка на следующий хранится в самом блоке)
+ */
+struct buffer_pool_block_t
+{
+  struct buffer_pool_block_t * next;
+}; // struct buffer_pool_block_t
+typedef struct buffer_pool_block_t buffer_pool_block_t;
+
+struct buffer_pool_class_t;
+
+/*
+ * Внутренние структуры
+ *
+ * Заголовок слэба (в первом блоке слэба, слэб выровнен по своему размеру)
+ * Слэбы со свободными блоками входят в список класса: частично занятые -
+ * в начале, полностью свободные - в конце
+ */
+struct buffer_pool_slab_t
+{
+  struct buffer_pool_class_t * cls;
+  buffer_pool_block_t *        free_blocks;
+  size_t                       free_count;
+  size_t                       block_count;
+  struct buffer_pool_slab_t *  next;
+  struct buffer_pool_slab_t *  prev;
+}; // struct buffer_pool_slab_t
+typedef struct buffer_pool_slab_t buffer_pool_slab_t;
+
+/*
+ * Внутренние структуры
+ *
+ * Класс блоков одного размера
+ * Свободные блоки малого класса - в слэбах, большого - в списке free_blocks
+ */
+struct buffer_pool_class_t
+{
+  pthread_mutex_t       lock;
+  buffer_pool_block_t * free_blocks;
+  buffer_pool_slab_t *  slabs;
+  buffer_pool_slab_t *  slabs_last;
+  size_t                free_count;
+  size_t                allocated;
+  size_t                block_size;
+} __attribute__((aligned(64))); // struct buffer_pool_class_t
+typedef struct buffer_pool_class_t buffer_pool_class_t;
+
+/*
+ * Внутренние структуры
+ *
+ * Блоки одного узла NUMA
+ * Свободные блоки частей больших сообщений - отдельный массив
+ * (после MADV_DONTNEED содержимое блока теряется)
+ */
+struct buffer_pool_node_t
+{
+  buffer_pool_class_t classes[BUFFER_POOL_CLASSES];
+
+  pthread_mutex_t chunks_lock;
+  void *          chunks_free[BUFFER_POOL_CHUNK_CACHE];
+  size_t          chunks_free_count;
+  size_t          chunks_allocated;
+}; // struct buffer_pool_node_t
+typedef struct buffer_pool_node_t buffer_pool_node_t;
+
+static buffer_pool_node_t nodes[BUFFER_POOL_NODES];
+static pthread_once_t     nodes_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Внутренние структуры
+ *
+ * Заголовок блока большого класса и блока части большого сообщения
+ * (страница перед блоком): узел, за которым блок учтен при выделении
+ */
+struct buffer_pool_header_t
+{
+  buffer_pool_node_t * node;
+}; // struct buffer_pool_header_t
+typedef struct buffer_pool_header_t buffer_pool_header_t;
+
+/*
+ * Узел NUMA, на котором размещается новая память текущего потока
+ * (-1 - без размещения, блоки узла 0)
+ */
+static __thread int buffer_pool_thread_node = -1;
+
+static void buffer_pool_init(void)
+{
+  for (int n = 0; n < BUFFER_POOL_NODES; ++n)
+  {
+    for (int i = 0; i < BUFFER_POOL_CLASSES; ++i)
+    {
+      pthread_mutex_init(&(nodes[n].classes[i].lock), NULL);
+      nodes[n].classes[i].block_size = (size_t)(1) << (BUFFER_POOL_MIN_SHIFT + i);
+    }
+    pthread_mutex_init(&(nodes[n].chunks_lock), NULL);
+  }
+}
+
+/*
+ * блоки узла текущего потока
+ */
+static buffer_pool_node_t * buffer_pool_local(void)
+{
+  pthread_once(&nodes_once, buffer_pool_init);
+  return nodes + (buffer_pool_thread_node < 0 ? 0 : buffer_pool_thread_node);
+}
+
+/*
+ * новая память размещается на узле текущего потока
+ * (до первого обращения к страницам)
+ */
+static void buffer_pool_bind(void * ptr, size_t size)
+{
+  unsigned long mask;
+
+  if (buffer_pool_thread_node < 0)
+    return;
+  mask = 1UL << buffer_pool_thread_node;
+  syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+}
+
+/*
+ * выделить у системы блок size байт с заголовком, блок учитывается за узлом node
+ */
+static void * buffer_pool_map_block(buffer_pool_node_t * node, size_t size, int flags)
+{
+  size_t header = (size_t)(sysconf(_SC_PAGESIZE));
+  char * area = mmap(NULL, header + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+
+  if (area == MAP_FAILED)
+    return NULL;
+  buffer_pool_bind(area, header + size);
+  ((buffer_pool_header_t *)(area))->node = node;
+  return area + header;
+}
+
+static void buffer_pool_unmap_block(void * ptr, size_t size)
+{
+  size_t header = (size_t)(sysconf(_SC_PAGESIZE));
+  munmap((char *)(ptr) - header, header + size);
+}
+
+/*
+ * узел, за которым учтен блок с заголовком
+ * (страницы могут оказаться не на этом узле, если его память занята)
+ */
+static buffer_pool_node_t * buffer_pool_block_node(void * ptr)
+{
+  size_t header = (size_t)(sysconf(_SC_PAGESIZE));
+  return ((buffer_pool_header_t *)((char *)(ptr) - header))->node;
+}
+
+/*
+ * класс блоков для size байт (-1 - блок вне пула)
+ */
+static int buffer_pool_class(size_t size)
+{
+  if (size <= BUFFER_POOL_MIN_SIZE)
+    return 0;
+  if (size > BUFFER_POOL_MAX_SIZE)
+    return -1;
+  return (int)(sizeof(unsigned long long) * 8) - __builtin_clzll(size - 1) - BUFFER_POOL_MIN_SHIFT;
+}
+
+static size_t buffer_pool_page_round(size_t size)
+{
+  size_t page = (size_t)(sysconf(_SC_PAGESIZE));
+  return (size + page - 1) & ~(page - 1);
+}
+
+/*
+ * размер слэба для блоков block_size байт (степень двойки)
+ */
+static size_t buffer_pool_slab_size(size_t block_size)
+{
+  size_t size = block_size * BUFFER_POOL_SLAB_BLOCKS;
+  return size < BUFFER_POOL_SLAB_SIZE ? BUFFER_POOL_SLAB_SIZE : size;
+}
+
+/*
+ * слэб, из которого нарезан блок
+ */
+static buffer_pool_slab_t * buffer_pool_slab_of(void * ptr, size_t block_size)
+{
+  return (buffer_pool_slab_t *)((uintptr_t)(ptr) & ~(uintptr_t)(buffer_pool_slab_size(block_size) - 1));
+}
+
+/*
+ * выделить у системы size байт, выровненных по size
+ */
+static void * buffer_pool_map_aligned(size_t size)
+{
+  char * area = mmap(NULL, size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  char * start;
+
+  if (area == MAP_FAILED)
+    return NULL;
+  start = (char *)(((uintptr_t)(area) + size - 1) & ~(uintptr_t)(size - 1));
+  if (start > area)
+  {
+    munmap(area, start - area);
+  }
+  if (start + size < area + size * 2)
+  {
+    munmap(start + size, area + size * 2 - (start + size));
+  }
+  return start;
+}
+
+/*
+ * список слэбов класса со свободными блоками (под блокировкой класса)
+ */
+static void buffer_pool_slab_unlink(buffer_pool_class_t * cls, buffer_pool_slab_t * slab)
+{
+  if (slab->prev != NULL)
+    slab->prev->next = slab->next;
+  else
+    cls->slabs = slab->next;
+  if (slab->next != NULL)
+    slab->next->prev = slab->prev;
+  else
+    cls->slabs_last = slab->prev;
+  slab->next = slab->prev = NULL;
+}
+
+static void buffer_pool_slab_push_front(buffer_pool_class_t * cls, buffer_pool_slab_t * slab)
+{
+  slab->prev = NULL;
+  slab->next = cls->slabs;
+  if (cls->slabs != NULL)
+    cls->slabs->prev = slab;
+  else
+    cls->slabs_last = slab;
+  cls->slabs = slab;
+}
+
+static void buffer_pool_slab_push_back(buffer_pool_class_t * cls, buffer_pool_slab_t * slab)
+{
+  slab->next = NULL;
+  slab->prev = cls->slabs_last;
+  if (cls->slabs_last != NULL)
+    cls->slabs_last->next = slab;
+  else
+    cls->slabs = slab;
+  cls->slabs_last = slab;
+}
+
+/*
+ * выделить у системы не меньше count блоков класса cls узла node
+ * (вызывается под блокировкой класса)
+ */
+static int buffer_pool_grow(buffer_pool_node_t * node, buffer_pool_class_t * cls, size_t count, int prefault)
+{
+  if (cls->block_size <= BUFFER_POOL_SLAB_MAX_SIZE)
+  {
+    // слэбы нарезаются на блоки и всегда заполняются сразу
+    size_t slab_size = buffer_pool_slab_size(cls->block_size);
+    size_t blocks = slab_size / cls->block_size - 1;
+
+    for (size_t made = 0; made < count; made += blocks)
+    {
+      buffer_pool_slab_t * slab = buffer_pool_map_aligned(slab_size);
+
+      if (slab == NULL)
+        return -1;
+      buffer_pool_bind(slab, slab_size);
+      memset(slab, 0, slab_size);
+
+      slab->cls = cls;
+      slab->block_count = slab->free_count = blocks;
+      for (size_t offset = slab_size - cls->block_size; offset > 0; offset -= cls->block_size)
+      {
+        buffer_pool_block_t * block = (buffer_pool_block_t *)((char *)(slab) + offset);
+        block->next = slab->free_blocks;
+        slab->free_blocks = block;
+      }
+      buffer_pool_slab_push_front(cls, slab);
+      cls->free_count += blocks;
+      cls->allocated += blocks;
+      DEBUG("buffer_pool_grow: slab %zu bytes for class %zu\n", slab_size, cls->block_size);
+    }
+    return 0;
+  }
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    // с выбранным узлом страницы заполняются после размещения
+    int populate = prefault && buffer_pool_thread_node < 0;
+    buffer_pool_block_t * block = buffer_pool_map_block(node, cls->block_size, populate ? MAP_POPULATE : 0);
+
+    if (block == NULL)
+      return -1;
+    if (prefault && !populate)
+    {
+      memset(block, 0, cls->block_size);
+    }
+    block->next = cls->free_blocks;
+    cls->free_blocks = block;
+    ++cls->free_count;
+    ++cls->allocated;
+  }
+  return 0;
+}
+
+/*
+ * размер блока, выделяемого для size байт
+ */
+size_t buffer_pool_block_size(size_t size)
+{
+  int index = buffer_pool_class(size);
+
+  if (index < 0)
+    return buffer_pool_page_round(size);
+  return (size_t)(1) << (BUFFER_POOL_MIN_SHIFT + index);
+}
+
+/*
+ * получить блок не меньше size байт
+ */
+void * buffer_pool_alloc(size_t size, size_t * capacity)
+{
+  int index = buffer_pool_class(size);
+  buffer_pool_node_t * node;
+  buffer_pool_class_t * cls;
+  buffer_pool_block_t * block;
+
+  if (index < 0)
+  {
+    // слишком большой блок выделяется и освобождается напрямую
+    void * ptr;
+
+    size = buffer_pool_page_round(size);
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+      return NULL;
+    buffer_pool_bind(ptr, size);
+    *capacity = size;
+    return ptr;
+  }
+
+  node = buffer_pool_local();
+  cls  = node->classes + index;
+
+  pthread_mutex_lock(&(cls->lock));
+  if (cls->free_count == 0 && buffer_pool_grow(node, cls, 1, 0) != 0)
+  {
+    int error = errno;
+    pthread_mutex_unlock(&(cls->lock));
+    errno = error;
+    return NULL;
+  }
+  if (cls->slabs != NULL)
+  {
+    // сначала - частично занятые слэбы (свободные остаются для возврата системе)
+    buffer_pool_slab_t * slab = cls->slabs;
+
+    block = slab->free_blocks;
+    slab->free_blocks = block->next;
+    if (--slab->free_count == 0)
+    {
+      buffer_pool_slab_unlink(cls, slab);
+    }
+  }
+  else
+  {
+    block = cls->free_blocks;
+    cls->free_blocks = block->next;
+  }
+  --cls->free_count;
+  pthread_mutex_unlock(&(cls->lock));
+
+  *capacity = cls->block_size;
+  return block;
+}
+
+/*
+ * вернуть блок размера capacity в пул
+ */
+void buffer_pool_free(void * ptr, size_t capacity)
+{
+  int index = buffer_pool_class(capacity);
+  buffer_pool_class_t * cls;
+  buffer_pool_block_t * block = (buffer_pool_block_t *)(ptr);
+
+  if (ptr == NULL)
+    return;
+
+  if (index < 0)
+  {
+    munmap(ptr, capacity);
+    return;
+  }
+
+  if (((size_t)(1) << (BUFFER_POOL_MIN_SHIFT + index)) <= BUFFER_POOL_SLAB_MAX_SIZE)
+  {
+    // блок возвращается в свой слэб (класс - узла, на котором выделен слэб)
+    buffer_pool_slab_t * slab = buffer_pool_slab_of(ptr, (size_t)(1) << (BUFFER_POOL_MIN_SHIFT + index));
+
+    cls = slab->cls;
+    pthread_mutex_lock(&(cls->lock));
+    block->next = slab->free_blocks;
+    slab->free_blocks = block;
+    ++cls->free_count;
+    if (++slab->free_count == 1)
+    {
+      buffer_pool_slab_push_front(cls, slab);
+    }
+    if (slab->free_count == slab->block_count)
+    {
+      buffer_pool_slab_unlink(cls, slab);
+      if (cls->free_count * cls->block_size > BUFFER_POOL_SLAB_HIGH_WATER)
+      {
+        // свободных блоков класса больше порога - свободный слэб возвращается системе
+        cls->free_count -= slab->block_count;
+        cls->allocated -= slab->block_count;
+        pthread_mutex_unlock(&(cls->lock));
+        munmap(slab, buffer_pool_slab_size(cls->block_size));
+        return;
+      }
+      buffer_pool_slab_push_back(cls, slab);
+    }
+    pthread_mutex_unlock(&(cls->lock));
+    return;
+  }
+
+  // блок возвращается в списки узла, за которым учтен при выделении
+  cls = buffer_pool_block_node(ptr)->classes + index;
+  pthread_mutex_lock(&(cls->lock));
+  if ((cls->free_count + 1) * cls->block_size > BUFFER_POOL_HIGH_WATER)
+  {
+    // свободных блоков больше порога - память возвращается системе
+    --cls->allocated;
+    pthread_mutex_unlock(&(cls->lock));
+    buffer_pool_unmap_block(ptr, cls->block_size);
+    return;
+  }
+  block->next = cls->free_blocks;
+  cls->free_blocks = block;
+  ++cls->free_count;
+  pthread_mutex_unlock(&(cls->lock));
+}
+
+/*
+ * получить блок части большого сообщения
+ */
+void * buffer_pool_chunk_alloc(void)
+{
+  buffer_pool_node_t * node = buffer_pool_local();
+  void * chunk = NULL;
+
+  pthread_mutex_lock(&(node->chunks_lock));
+  if (node->chunks_free_count > 0)
+  {
+    chunk = node->chunks_free[--node->chunks_free_count];
+  }
+  pthread_mutex_unlock(&(node->chunks_lock));
+
+  if (chunk == NULL)
+  {
+    chunk = buffer_pool_map_block(node, BUFFER_POOL_CHUNK_SIZE, 0);
+    if (chunk == NULL)
+      return NULL;
+    __atomic_add_fetch(&(node->chunks_allocated), 1, __ATOMIC_RELAXED);
+  }
+  return chunk;
+}
+
+/*
+ * вернуть блок части большого сообщения в пул
+ */
+void buffer_pool_chunk_free(void * chunk)
+{
+  buffer_pool_node_t * node;
+
+  if (chunk == NULL)
+    return;
+
+  node = buffer_pool_block_node(chunk);
+
+  // страницы освобождаются до попадания блока в список: блок могут сразу получить снова
+  // (страница заголовка остается)
+  if (__atomic_load_n(&(node->chunks_free_count), __ATOMIC_RELAXED) >= BUFFER_POOL_CHUNK_HOT)
+  {
+    madvise(chunk, BUFFER_POOL_CHUNK_SIZE, MADV_DONTNEED);
+  }
+
+  pthread_mutex_lock(&(node->chunks_lock));
+  if (node->chunks_free_count < BUFFER_POOL_CHUNK_CACHE)
+  {
+    node->chunks_free[node->chunks_free_count++] = chunk;
+    chunk = NULL;
+  }
+  pthread_mutex_unlock(&(node->chunks_lock));
+
+  if (chunk != NULL)
+  {
+    __atomic_sub_fetch(&(node->chunks_allocated), 1, __ATOMIC_RELAXED);
+    buffer_pool_unmap_block(chunk, BUFFER_POOL_CHUNK_SIZE);
+  }
+}
+
+/*
+ * заранее выделить count свободных блоков для size байт
+ */
+int buffer_pool_reserve(size_t size, size_t count)
+{
+  int index = buffer_pool_class(size);
+  buffer_pool_node_t * node;
+  buffer_pool_class_t * cls;
+  int rc = 0;
+
+  if (index < 0)
+    return 0;
+
+  node = buffer_pool_local();
+  cls  = node->classes + index;
+
+  pthread_mutex_lock(&(cls->lock));
+  if (cls->free_count < count)
+  {
+    rc = buffer_pool_grow(node, cls, count - cls->free_count, 1);
+  }
+  pthread_mutex_unlock(&(cls->lock));
+  return rc;
+}
+
+/*
+ * состояние классов блоков (всех узлов)
+ */
+size_t buffer_pool_get_stats(buffer_pool_stats_t * stats, size_t count)
+{
+  pthread_once(&nodes_once, buffer_pool_init);
+
+  if (count > BUFFER_POOL_CLASSES)
+    count = BUFFER_POOL_CLASSES;
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    stats[i].block_size = nodes[0].classes[i].block_size;
+    stats[i].allocated  = stats[i].free = 0;
+    for (int n = 0; n < BUFFER_POOL_NODES; ++n)
+    {
+      buffer_pool_class_t * cls = nodes[n].classes + i;
+
+      pthread_mutex_lock(&(cls->lock));
+      stats[i].allocated += cls->allocated;
+      stats[i].free      += cls->free_count;
+      pthread_mutex_unlock(&(cls->lock));
+    }
+  }
+  return count;
+}
+
+/*
+ * выбрать узел NUMA для новой памяти текущего потока
+ */
+int buffer_pool_set_node(int node)
+{
+  int previous = buffer_pool_thread_node;
+
+  if (node >= BUFFER_POOL_NODES)
+    node = -1;
+  buffer_pool_thread_node = node;
+  return previous;
+}
+
+/*
+ * узел NUMA для новой памяти текущего потока
+ */
+int buffer_pool_get_node(void)
+{
+  return buffer_pool_thread_node;
+}
+
+/*
+ * память блоков по узлам NUMA
+ */
+size_t buffer_pool_get_node_stats(buffer_pool_node_stats_t * stats, size_t count)
+{
+  pthread_once(&nodes_once, buffer_pool_init);
+
+  if (count > BUFFER_POOL_NODES)
+    count = BUFFER_POOL_NODES;
+
+  for (size_t n = 0; n < count; ++n)
+  {
+    stats[n].allocated = stats[n].free = 0;
+    for (int i = 0; i < BUFFER_POOL_CLASSES; ++i)
+    {
+      buffer_pool_class_t * cls = nodes[n].classes + i;
+
+      pthread_mutex_lock(&(cls->lock));
+      stats[n].allocated += cls->allocated * cls->block_size;
+      stats[n].free      += cls->free_count * cls->block_size;
+      pthread_mutex_unlock(&(cls->lock));
+    }
+    pthread_mutex_lock(&(nodes[n].chunks_lock));
+    stats[n].allocated += nodes[n].chunks_allocated * BUFFER_POOL_CHUNK_SIZE;
+    stats[n].free      += nodes[n].chunks_free_count * BUFFER_POOL_CHUNK_SIZE;
+    pthread_mutex_unlock(&(nodes[n].chunks_lock));
+  }
+  return count;
+}
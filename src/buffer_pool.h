@@ -0,0 +1,141 @@
+/*
+ * Пул памяти для буферов сообщений
+ *
+ * Память выделяется блоками фиксированных размеров (классов): степени двойки
+ * от BUFFER_POOL_MIN_SIZE до BUFFER_POOL_MAX_SIZE. Освобожденные блоки
+ * попадают в список свободных блоков своего класса и используются повторно.
+ *
+ * Блоки малых классов (до BUFFER_POOL_SLAB_MAX_SIZE) нарезаются из слэбов.
+ * Слэб, все блоки которого свободны, возвращается системе, если свободных
+ * блоков класса больше BUFFER_POOL_SLAB_HIGH_WATER байт. Блоки больших
+ * классов выделяются через mmap, в списке свободных блоков класса остается
+ * не больше BUFFER_POOL_HIGH_WATER байт, остальные возвращаются системе.
+ * Блоки больше BUFFER_POOL_MAX_SIZE в пуле не хранятся.
+ *
+ * Блоки частей больших сообщений (BUFFER_POOL_CHUNK_SIZE, см. message_buffer.h)
+ * выделяются через mmap и хранятся отдельно: сверх BUFFER_POOL_CHUNK_HOT
+ * свободных блоков страницы возвращаются системе (MADV_DONTNEED), адреса
+ * остаются за пулом до BUFFER_POOL_CHUNK_CACHE блоков.
+ *
+ * Блоки хранятся отдельно для каждого узла NUMA (до BUFFER_POOL_NODES).
+ * Поток получает блоки узла, выбранного buffer_pool_set_node, новая память
+ * размещается на этом узле (mbind, MPOL_PREFERRED) и учитывается за ним;
+ * освобожденный блок возвращается в списки узла, за которым учтен. Узел
+ * записывается при выделении: в заголовок слэба, для блоков больших классов
+ * и частей больших сообщений - в страницу перед блоком.
+ * Без выбора узла все блоки - в списках узла 0.
+ */
+
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+
+#include <stdlib.h>
+
+#define BUFFER_POOL_MIN_SIZE      (256)
+#define BUFFER_POOL_SLAB_MAX_SIZE (16 * 1024)
+#define BUFFER_POOL_MAX_SIZE      (64 * 1024 * 1024)
+
+/*
+ * Наименьший размер слэба для блоков малых классов
+ * (слэб крупного класса - не меньше 16 блоков)
+ */
+#define BUFFER_POOL_SLAB_SIZE     (64 * 1024)
+
+/*
+ * Объем свободных блоков малого класса, сверх которого полностью
+ * свободные слэбы возвращаются системе
+ */
+#define BUFFER_POOL_SLAB_HIGH_WATER (1024 * 1024)
+
+/*
+ * Объем свободных блоков большого класса, остающихся в пуле
+ */
+#define BUFFER_POOL_HIGH_WATER    (8 * 1024 * 1024)
+
+/*
+ * Размер блока части большого сообщения и число свободных блоков:
+ * с памятью и всего (без памяти - после MADV_DONTNEED)
+ */
+#define BUFFER_POOL_CHUNK_SIZE    (1024 * 1024)
+#define BUFFER_POOL_CHUNK_HOT     (BUFFER_POOL_HIGH_WATER / BUFFER_POOL_CHUNK_SIZE)
+#define BUFFER_POOL_CHUNK_CACHE   (256)
+
+/*
+ * Наибольшее число узлов NUMA (память остальных узлов не размещается)
+ */
+#define BUFFER_POOL_NODES         8
+
+/*
+ * Состояние класса блоков
+ */
+struct buffer_pool_stats_t
+{
+  size_t block_size;
+  size_t allocated;   // блоков выделено у системы и не возвращено
+  size_t free;        // блоков в списке свободных
+}; // struct buffer_pool_stats_t
+typedef struct buffer_pool_stats_t buffer_pool_stats_t;
+
+/*
+ * Память блоков узла NUMA, байт
+ */
+struct buffer_pool_node_stats_t
+{
+  size_t allocated;   // выделено у системы и не возвращено
+  size_t free;        // в списках свободных
+}; // struct buffer_pool_node_stats_t
+typedef struct buffer_pool_node_stats_t buffer_pool_node_stats_t;
+
+/*
+ * размер блока, выделяемого для size байт
+ */
+size_t buffer_pool_block_size(size_t size);
+
+/*
+ * получить блок не меньше size байт, capacity - размер блока
+ * если памяти недостаточно, возвращается NULL
+ */
+void * buffer_pool_alloc(size_t size, size_t * capacity);
+
+/*
+ * вернуть блок размера capacity в пул
+ */
+void buffer_pool_free(void * block, size_t capacity);
+
+/*
+ * получить блок части большого сообщения (BUFFER_POOL_CHUNK_SIZE байт)
+ * если памяти недостаточно, возвращается NULL
+ */
+void * buffer_pool_chunk_alloc(void);
+
+/*
+ * вернуть блок части большого сообщения в пул
+ */
+void buffer_pool_chunk_free(void * chunk);
+
+/*
+ * заранее выделить count свободных блоков для size байт
+ * страницы выделенной памяти заполняются сразу (prefault)
+ */
+int buffer_pool_reserve(size_t size, size_t count);
+
+/*
+ * состояние классов блоков, возвращает число классов (не больше count)
+ */
+size_t buffer_pool_get_stats(buffer_pool_stats_t * stats, size_t count);
+
+/*
+ * выбрать узел NUMA для блоков текущего потока (-1 - без размещения)
+ * возвращает ранее выбранный узел
+ */
+int buffer_pool_set_node(int node);
+int buffer_pool_get_node(void);
+
+/*
+ * память блоков по узлам NUMA, возвращает число узлов (не больше count)
+ * (учет по выбранному узлу: при нехватке его памяти или переносе ядром
+ * страницы могут оказаться на другом узле)
+ */
+size_t buffer_pool_get_node_stats(buffer_pool_node_stats_t * stats, size_t count);
+
+#endif // __BUFFER_POOL_H__
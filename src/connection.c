@@ -0,0 +1,282 @@
+/*
+ * Соединение с клиентом и пул соединений
+ */
+
+#include "connection.h"
+#include "buffer_pool.h"
+
+#include <errno.h>
+#include <string.h>
+
+/*
+ * Размер буфера чтения из сокета в режиме кадров
+ */
+static const size_t CONNECTION_INPUT_SIZE = 16 * 1024;
+
+#ifdef _DEBUG
+#include <stdio.h>
+#define DEBUG(msg...) fprintf(stderr, "%u: ", (int)(pthread_self())); fprintf(stderr, msg)
+#else
+#define DEBUG(mag...)
+#endif
+
+/*
+ * создание нового контекста вместе с очередями
+ */
+static connection_context_t * connection_context_create(connection_pool_t * pool)
+{
+  connection_context_t * context;
+  int node;
+
+  context = calloc(1, sizeof(connection_context_t));
+  if (context == NULL)
+    return NULL;
+
+  // очередь на обработку размещается на узле NUMA ее потребителя
+  node = buffer_pool_get_node();
+  if (pool->process_node >= 0)
+  {
+    buffer_pool_set_node(pool->process_node);
+  }
+  context->to_process_queue = message_queue_create_elastic(pool->to_process_queue_size, pool->queue_budget,
+                                                            pool->queue_backend);
+  buffer_pool_set_node(node);
+  if (context->to_process_queue == NULL)
+  {
+    int error = errno;
+    free(context);
+    errno = error;
+    return NULL;
+  }
+  message_queue_set_name(context->to_process_queue, "to_process");
+
+  context->from_process_queue = message_queue_create_elastic(pool->from_process_queue_size, pool->queue_budget,
+                                                              pool->queue_backend);
+  if (context->from_process_queue == NULL)
+  {
+    int error = errno;
+    message_queue_destroy(context->to_process_queue);
+    free(context);
+    errno = error;
+    return NULL;
+  }
+  message_queue_set_name(context->from_process_queue, "from_process");
+
+  // в обработке одновременно не больше сообщений, чем буферов для результатов
+  context->reorder = calloc(pool->reorder_window, sizeof(message_buffer_t *));
+  if (context->reorder == NULL || pthread_mutex_init(&(context->order_lock), NULL) != 0)
+  {
+    int error = errno;
+    free(context->reorder);
+    message_queue_destroy(context->from_process_queue);
+    message_queue_destroy(context->to_process_queue);
+    free(context);
+    errno = error;
+    return NULL;
+  }
+
+  context->framed = pool->framed;
+  if (context->framed && message_buffer_init(&(context->input), CONNECTION_INPUT_SIZE) != 0)
+  {
+    int error = errno;
+    pthread_mutex_destroy(&(context->order_lock));
+    free(context->reorder);
+    message_queue_destroy(context->from_process_queue);
+    message_queue_destroy(context->to_process_queue);
+    free(context);
+    errno = error;
+    return NULL;
+  }
+
+  context->sock_id = -1;
+  context->pool = pool;
+  return context;
+}
+
+static void connection_context_destroy(connection_context_t * context)
+{
+#ifdef HAVE_IO_URING
+  if (context->uring_ring != NULL)
+  {
+    uring_buf_ring_free(context->uring_ring, CONNECTION_URING_BUFFERS);
+  }
+  for (int i = 0; i < CONNECTION_URING_BUFFERS; ++i)
+  {
+    message_buffer_destroy(context->uring_chunks + i);
+  }
+#endif
+  message_queue_destroy(context->to_process_queue);
+  message_queue_destroy(context->from_process_queue);
+  pthread_mutex_destroy(&(context->order_lock));
+  free(context->reorder);
+  message_buffer_destroy(&(context->input));
+  free(context);
+}
+
+/*
+ * инициализация пула
+ */
+int connection_pool_init(connection_pool_t * pool, size_t to_process_queue_size, size_t from_process_queue_size,
+                         size_t queue_budget, message_queue_backend_t queue_backend, int framed)
+{
+  memset(pool, 0, sizeof(connection_pool_t));
+  if (pthread_mutex_init(&(pool->lock), NULL) != 0)
+    return -1;
+
+  pool->to_process_queue_size   = to_process_queue_size;
+  pool->from_process_queue_size = from_process_queue_size;
+  pool->queue_budget            = queue_budget;
+  pool->reorder_window          = message_queue_capacity(from_process_queue_size, queue_budget);
+  pool->queue_backend           = queue_backend;
+  pool->framed                  = framed;
+  pool->process_node            = -1;
+  return 0;
+}
+
+/*
+ * освободить память всех контекстов пула
+ */
+void connection_pool_destroy(connection_pool_t * pool)
+{
+  connection_context_t * context;
+
+  while ((context = pool->free_contexts) != NULL)
+  {
+    pool->free_contexts = context->next;
+    connection_context_destroy(context);
+  }
+  pthread_mutex_destroy(&(pool->lock));
+}
+
+/*
+ * получить контекст для нового соединения
+ */
+connection_context_t * connection_pool_acquire(connection_pool_t * pool)
+{
+  connection_context_t * context;
+
+  pthread_mutex_lock(&(pool->lock));
+  context = pool->free_contexts;
+  if (context != NULL)
+  {
+    pool->free_contexts = context->next;
+    ++pool->active;
+  }
+  pthread_mutex_unlock(&(pool->lock));
+
+  if (context == NULL)
+  { // свободных контекстов нет - создаем новый
+    context = connection_context_create(pool);
+    if (context == NULL)
+      return NULL;
+
+    pthread_mutex_lock(&(pool->lock));
+    ++pool->allocated;
+    ++pool->active;
+    pthread_mutex_unlock(&(pool->lock));
+  }
+
+  context->next = NULL;
+  context->control_pending = 0;
+  context->send_count = 0;
+  context->process_error = 0;
+  context->read_suspended = 0;
+  context->in_flight = 0;
+  context->inline_ready = 0;
+  context->epoll_fd = -1;
+  context->write_blocked = 0;
+  context->read_hint = CONNECTION_READ_HINT;
+  context->process_sequence = context->emit_sequence = 0;
+  context->tasks = context->stalled_tasks = 0;
+  memset(context->reorder, 0, pool->reorder_window * sizeof(message_buffer_t *));
+  context->input.size = context->input.offset = 0;
+  frame_parser_reset(&(context->parser));
+#ifdef HAVE_IO_URING
+  context->uring = NULL;
+  context->uring_message = NULL;
+  memset(context->uring_buffers, 0, sizeof(context->uring_buffers));
+  context->uring_provided = context->uring_recv = context->uring_sending = 0;
+  context->uring_inflight = context->uring_closing = 0;
+  context->uring_pending_first = context->uring_pending_count = 0;
+  context->uring_offset = 0;
+#endif
+  context->state = CONNECTION_OPEN;
+
+  DEBUG("connection_pool_acquire: context = %p, allocated = %zu\n", context, pool->allocated);
+  return context;
+}
+
+/*
+ * вернуть контекст закрытого соединения в пул
+ */
+void connection_pool_release(connection_pool_t * pool, connection_context_t * context)
+{
+  message_queue_clear(context->to_process_queue);
+  message_queue_clear(context->from_process_queue);
+
+  context->sock_id = -1;
+  context->send_count = 0;
+  context->state = CONNECTION_FREE;
+
+  pthread_mutex_lock(&(pool->lock));
+  context->next = pool->free_contexts;
+  pool->free_contexts = context;
+  --pool->active;
+  pthread_mutex_unlock(&(pool->lock));
+
+  DEBUG("connection_pool_release: context = %p, active = %zu\n", context, pool->active);
+}
+
+/*
+ * поставить контекст в очередь потока обработки
+ */
+int connection_pool_push_control(connection_pool_t * pool, connection_context_t * context)
+{
+  int queued = 0;
+
+  pthread_mutex_lock(&(pool->lock));
+  if (!context->control_pending)
+  {
+    context->control_pending = 1;
+    context->next = NULL;
+    if (pool->control_last == NULL)
+    {
+      pool->control_first = context;
+    }
+    else
+    {
+      pool->control_last->next = context;
+    }
+    pool->control_last = context;
+    queued = 1;
+  }
+  pthread_mutex_unlock(&(pool->lock));
+
+  return queued;
+}
+
+/*
+ * получить очередной контекст, ожидающий потока обработки
+ */
+connection_context_t * connection_pool_pop_control(connection_pool_t * pool, connection_state_t * state)
+{
+  connection_context_t * context;
+
+  pthread_mutex_lock(&(pool->lock));
+  context = pool->control_first;
+  if (context != NULL)
+  {
+    pool->control_first = context->next;
+    if (pool->control_first == NULL)
+    {
+      pool->control_last = NULL;
+    }
+    context->next = NULL;
+    context->control_pending = 0;
+    // состояние, изменившееся после извлечения, приведет к повторной постановке в очередь
+    *state = __atomic_load_n(&(context->state), __ATOMIC_ACQUIRE);
+  }
+  pthread_mutex_unlock(&(pool->lock));
+
+  return context;
+}
@@ -0,0 +1,237 @@
+/*
+ * Соединение с клиентом и пул соединений
+ */
+
+#ifndef __CONNECTION_H__
+#define __CONNECTION_H__
+
+#include <ev.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "message_buffer.h"
+#include "message_queue.h"
+#include "worker_pool.h"
+#include "frame.h"
+#include "uring.h"
+
+/*
+ * Состояние соединения
+ */
+enum connection_state_t
+{
+  CONNECTION_FREE = 0, // контекст находится в пуле
+  CONNECTION_OPEN,     // соединение установлено
+  CONNECTION_CLOSING,  // сокет закрыт, ожидается отключение от потока обработки
+}; // enum connection_state_t
+typedef enum connection_state_t connection_state_t;
+
+/*
+ * Максимальное число буферов в одной записи в сокет
+ */
+#define CONNECTION_SEND_BATCH 64
+
+/*
+ * Максимальное число областей памяти в одной записи в сокет
+ * (сообщение частями занимает область на каждую часть, см. message_buffer.h)
+ */
+#define CONNECTION_SEND_IOV 256
+
+/*
+ * Максимальное число областей памяти при чтении в сообщение частями
+ */
+#define CONNECTION_RECV_IOV 16
+
+/*
+ * Предсказание размера сообщения при чтении через epoll (см. main.c):
+ * начальный и наименьший размер буфера, вес нового сообщения в скользящем
+ * среднем - 1/2^CONNECTION_READ_HINT_SHIFT
+ */
+#define CONNECTION_READ_HINT       (4 * 1024)
+#define CONNECTION_READ_HINT_MIN   512
+#define CONNECTION_READ_HINT_SHIFT 2
+
+/*
+ * Наибольший размер сообщения, читаемого через epoll за один проход:
+ * данные сверх него остаются в сокете до следующего сообщения
+ * (память буфера не учитывается в бюджетах очередей)
+ */
+#define CONNECTION_READ_MAX        (4 * 1024 * 1024)
+
+/*
+ * Буферы приема данных через io_uring: число (степень двойки) и размер
+ */
+#define CONNECTION_URING_BUFFERS     8
+#define CONNECTION_URING_BUFFER_SIZE (16 * 1024)
+
+struct connection_pool_t;
+
+/*
+ * Данные соединения
+ */
+struct connection_context_t
+{
+  int                sock_id;
+  connection_state_t state;
+
+  ev_io    io_watcher;
+
+  ev_async * control_watcher;        // подключение/отключение соединения в потоке обработки
+  ev_async to_process_watcher;
+  ev_async from_process_watcher;
+
+  message_queue_t *   to_process_queue;
+  message_queue_t * from_process_queue;
+
+  struct ev_loop * loop;
+  struct ev_loop * main_loop;
+
+  /*
+   * Результаты, переданные на запись в сокет (отправляются одним вызовом sendmsg)
+   * Между вызовами send_count > 0 только при ожидании готовности сокета к записи
+   */
+  message_buffer_t * send_batch[CONNECTION_SEND_BATCH];
+  int                send_count;
+  int                send_prepared;    // буферов, полностью описанных для записи (send_batch_prepare)
+
+  int process_error;                   // ошибка в потоке обработки, соединение нужно закрыть
+  int read_suspended;                  // чтение остановлено: нет свободных буферов to_process_queue
+
+  /*
+   * Обработка небольших сообщений в потоке работы с сокетами (см. process_inline)
+   * Изменяются только потоком работы с сокетами
+   */
+  unsigned long in_flight;             // сообщений передано на обработку и еще не отправлено
+  int           inline_ready;          // есть результаты, обработанные в потоке работы с сокетами
+
+  /*
+   * Режим кадров (framed != 0)
+   * Данные читаются из сокета в input и разбираются на кадры, каждый
+   * собранный кадр передается на обработку отдельным сообщением
+   */
+  int               framed;
+  message_buffer_t  input;              // прочитанные и не разобранные данные (size - не разобрано)
+  frame_parser_t    parser;
+
+  /*
+   * Работа с сокетом через epoll по фронту (epoll_fd >= 0, см. main.c)
+   * Сообщение читается до опустошения сокета в буфер, заранее выделенный
+   * по размеру недавних сообщений (read_hint)
+   */
+  int    epoll_fd;
+  int    write_blocked;                // сокет занят, запись продолжится по EPOLLOUT
+  size_t read_hint;                    // ожидаемый размер сообщения
+
+#ifdef HAVE_IO_URING
+  /*
+   * Работа с сокетом через io_uring (uring != NULL, см. main.c)
+   * Данные принимаются многократным recv в буферы, предоставленные ядру:
+   * свободные буферы to_process_queue (сообщение принимается на месте)
+   * или, в режиме кадров, блоки чтения uring_chunks, разбираемые на кадры.
+   * Номер буфера (bid) - индекс в uring_buffers
+   */
+  uring_t *                  uring;
+  struct io_uring_buf_ring * uring_ring;                 // кольцо буферов (группа uring_group)
+  unsigned short             uring_group;
+  message_buffer_t *         uring_buffers[CONNECTION_URING_BUFFERS]; // NULL - номер свободен
+  message_buffer_t           uring_chunks[CONNECTION_URING_BUFFERS];
+  int                        uring_provided;             // буферов у ядра
+  int                        uring_recv;                 // многократный recv выполняется
+  int                        uring_sending;              // sendmsg выполняется
+  int                        uring_inflight;             // запросов в ядре
+  int                        uring_closing;              // ожидается завершение запросов
+  message_buffer_t *         uring_message;              // сообщение, данные которого еще в сокете
+
+  // принятые и не разобранные блоки (режим кадров), uring_offset - разобрано в первом
+  unsigned short             uring_pending[CONNECTION_URING_BUFFERS];
+  int                        uring_pending_first;
+  int                        uring_pending_count;
+  size_t                     uring_offset;
+
+  struct msghdr              uring_msg;
+  struct iovec               uring_iov[CONNECTION_SEND_IOV];
+#endif
+
+  /*
+   * Обработка пулом потоков (workers != NULL)
+   * Сообщения нумеруются при взятии на обработку, результаты передаются
+   * на запись строго по порядку номеров
+   */
+  worker_pool_t *     workers;
+  pthread_mutex_t     order_lock;
+  unsigned long       process_sequence;  // номер следующего сообщения, взятого на обработку
+  unsigned long       emit_sequence;     // номер следующего результата для передачи на запись
+  message_buffer_t ** reorder;           // готовые результаты, ожидающие своей очереди
+  int                 tasks;             // задач соединения в пуле потоков
+  int                 stalled_tasks;     // задач, ожидающих свободного буфера для результата
+
+  struct connection_pool_t *    pool;
+  struct connection_context_t * next;  // следующий элемент списка пула
+  int control_pending;                 // контекст ожидает обработки в потоке обработки
+}; // struct connection_context_t
+typedef struct connection_context_t connection_context_t;
+
+/*
+ * Пул контекстов соединений
+ * Контексты закрытых соединений не освобождаются, а используются повторно
+ * вместе с очередями сообщений
+ */
+struct connection_pool_t
+{
+  pthread_mutex_t lock;
+
+  size_t   to_process_queue_size;        // начальная емкость очередей
+  size_t from_process_queue_size;
+  size_t queue_budget;                   // бюджет роста очереди, байт (см. message_queue_create_elastic)
+  size_t reorder_window;                 // наибольшая емкость from_process_queue
+  message_queue_backend_t queue_backend;
+  int framed;                            // соединения используют кадры (см. frame.h)
+  int process_node;                      // узел NUMA потока обработки: память to_process_queue
+                                         // (-1 - узел потока, создающего контекст)
+
+  connection_context_t * free_contexts;  // контексты, готовые к повторному использованию
+  connection_context_t * control_first;  // контексты, ожидающие подключения/отключения
+  connection_context_t * control_last;
+
+  size_t allocated;                      // всего создано контекстов
+  size_t active;                         // контекстов используется
+}; // struct connection_pool_t
+typedef struct connection_pool_t connection_pool_t;
+
+/*
+ * инициализация пула
+ */
+int connection_pool_init(connection_pool_t * pool, size_t to_process_queue_size, size_t from_process_queue_size,
+                         size_t queue_budget, message_queue_backend_t queue_backend, int framed);
+
+/*
+ * освободить память всех контекстов пула
+ * (соединения пула должны быть закрыты)
+ */
+void connection_pool_destroy(connection_pool_t * pool);
+
+/*
+ * получить контекст для нового соединения
+ * если памяти недостаточно, возвращается NULL
+ */
+connection_context_t * connection_pool_acquire(connection_pool_t * pool);
+
+/*
+ * вернуть контекст закрытого соединения в пул
+ */
+void connection_pool_release(connection_pool_t * pool, connection_context_t * context);
+
+/*
+ * поставить контекст в очередь потока обработки
+ * возвращает 0, если контекст уже ожидает обработки
+ */
+int connection_pool_push_control(connection_pool_t * pool, connection_context_t * context);
+
+/*
+ * получить очередной контекст, ожидающий потока обработки
+ * state - состояние соединения на момент извлечения из очереди
+ * если таких нет, возвращается NULL
+ */
+connection_context_t * connection_pool_pop_control(connection_pool_t * pool, connection_state_t * state);
+
+#endif // __CONNECTION_H__
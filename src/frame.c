@@ -0,0 +1,139 @@
+/*
+ * Кадры сообщений (режим --framed)
+ */
+
+#include "frame.h"
+
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef _DEBUG
+#include <stdio.h>
+#include <pthread.h>
+#define DEBUG(msg...) fprintf(stderr, "%u: ", (int)(pthread_self())); fprintf(stderr, msg)
+#else
+#define DEBUG(mag...)
+#endif
+
+/*
+ * Максимальный размер данных кадра
+ */
+static size_t frame_max_size = FRAME_MAX_SIZE;
+
+void frame_set_max_size(size_t size)
+{
+  assert(size <= FRAME_MAX_LIMIT);
+  frame_max_size = size;
+}
+
+/*
+ * сброс разбора (буфер кадра не освобождается)
+ */
+void frame_parser_reset(frame_parser_t * parser)
+{
+  parser->header_size = 0;
+  parser->frame_size  = 0;
+  parser->frame       = NULL;
+}
+
+/*
+ * начать сборку нового кадра в буфере frame
+ */
+void frame_parser_start(frame_parser_t * parser, message_buffer_t * frame)
+{
+  parser->header_size = 0;
+  parser->frame_size  = 0;
+  parser->frame       = frame;
+  frame->size = frame->offset = 0;
+}
+
+/*
+ * заголовок получен: подготовить буфер для всего кадра
+ */
+static int frame_parser_header_done(frame_parser_t * parser)
+{
+  size_t payload_size = ((size_t)(parser->header[0]) << 24) | ((size_t)(parser->header[1]) << 16) |
+                        ((size_t)(parser->header[2]) << 8)  |  (size_t)(parser->header[3]);
+
+  if (payload_size > frame_max_size)
+  {
+    DEBUG("frame size %zu exceeds limit\n", payload_size);
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  // большой кадр собирается частями (см. message_buffer.h)
+  if (message_buffer_resize(parser->frame, FRAME_HEADER_SIZE + payload_size) != 0 ||
+      message_buffer_append(parser->frame, (const char *)(parser->header), FRAME_HEADER_SIZE) != 0)
+    return -1;
+
+  parser->frame_size = FRAME_HEADER_SIZE + payload_size;
+  return 0;
+}
+
+/*
+ * разбор очередной части данных
+ */
+int frame_parser_feed(frame_parser_t * parser, const char * data, size_t size)
+{
+  size_t used = 0;
+  size_t part;
+
+  assert(parser->frame != NULL);
+
+  if (parser->frame_size == 0)
+  {
+    part = FRAME_HEADER_SIZE - parser->header_size;
+    if (part > size)
+      part = size;
+    memcpy(parser->header + parser->header_size, data, part);
+    parser->header_size += part;
+    used += part;
+
+    if (parser->header_size < FRAME_HEADER_SIZE)
+      return used;
+
+    if (frame_parser_header_done(parser) != 0)
+      return -1;
+  }
+
+  part = frame_parser_missing(parser);
+  if (part > size - used)
+    part = size - used;
+  if (message_buffer_append(parser->frame, data + used, part) != 0)
+    return -1;
+  used += part;
+
+  return used;
+}
+
+/*
+ * число байт данных, недостающих до завершения кадра
+ */
+size_t frame_parser_missing(const frame_parser_t * parser)
+{
+  if (parser->frame == NULL || parser->frame_size == 0)
+    return 0;
+
+  return parser->frame_size - parser->frame->offset;
+}
+
+/*
+ * учесть size байт данных, записанных напрямую в конец буфера кадра
+ */
+void frame_parser_commit(frame_parser_t * parser, size_t size)
+{
+  assert(size <= frame_parser_missing(parser));
+  parser->frame->size   += size;
+  parser->frame->offset += size;
+}
+
+/*
+ * кадр собран полностью
+ */
+int frame_parser_ready(const frame_parser_t * parser)
+{
+  return parser->frame != NULL && parser->frame_size != 0 &&
+         parser->frame->offset == parser->frame_size;
+}
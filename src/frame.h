@@ -0,0 +1,85 @@
+/*
+ * Кадры сообщений (режим --framed)
+ *
+ * Кадр: заголовок - длина данных (4 байта, сетевой порядок байт), затем данные.
+ * Ответ передается тем же кадром: заголовок без изменений, данные обработаны.
+ */
+
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include <stdlib.h>
+
+#include "message_buffer.h"
+
+/*
+ * Размер заголовка кадра
+ */
+#define FRAME_HEADER_SIZE 4
+
+/*
+ * Максимальный размер данных кадра по умолчанию
+ * (кадр большего размера считается ошибкой протокола)
+ */
+#define FRAME_MAX_SIZE ((size_t)(64 * 1024 * 1024))
+
+/*
+ * Наибольший размер данных, представимый в заголовке кадра
+ */
+#define FRAME_MAX_LIMIT ((size_t)(0xFFFFFFFF))
+
+/*
+ * Разбор потока данных на кадры
+ * Данные поступают частями произвольного размера, кадр собирается
+ * в буфере frame: заголовок и данные, frame->size - собранный размер
+ */
+struct frame_parser_t
+{
+  unsigned char      header[FRAME_HEADER_SIZE];
+  size_t             header_size; // получено байт заголовка
+  size_t             frame_size;  // полный размер кадра (0 - заголовок не получен)
+  message_buffer_t * frame;       // собираемый кадр (NULL - нет буфера)
+}; // struct frame_parser_t
+typedef struct frame_parser_t frame_parser_t;
+
+/*
+ * максимальный размер данных кадра (не больше FRAME_MAX_LIMIT)
+ * устанавливается до приема соединений
+ */
+void frame_set_max_size(size_t size);
+
+/*
+ * сброс разбора (буфер кадра не освобождается)
+ */
+void frame_parser_reset(frame_parser_t * parser);
+
+/*
+ * начать сборку нового кадра в буфере frame
+ */
+void frame_parser_start(frame_parser_t * parser, message_buffer_t * frame);
+
+/*
+ * разбор очередной части данных
+ * возвращает число использованных байт (не больше одного кадра)
+ * или -1 при ошибке протокола или нехватке памяти (errno)
+ */
+int frame_parser_feed(frame_parser_t * parser, const char * data, size_t size);
+
+/*
+ * число байт данных, недостающих до завершения кадра
+ * (0 - заголовок не получен или кадр собран)
+ */
+size_t frame_parser_missing(const frame_parser_t * parser);
+
+/*
+ * учесть size байт данных, записанных напрямую в конец буфера кадра
+ * (не больше frame_parser_missing)
+ */
+void frame_parser_commit(frame_parser_t * parser, size_t size);
+
+/*
+ * кадр собран полностью
+ */
+int frame_parser_ready(const frame_parser_t * parser);
+
+#endif // __FRAME_H__
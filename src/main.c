@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <ev.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,6 +8,7 @@
 #include <err.h>
 #include <errno.h>
 #include <ctype.h>
+#include <string.h>
 
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -16,9 +19,20 @@
 #include <time.h>
 #include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
 
 #include "message_buffer.h"
 #include "message_queue.h"
+#include "connection.h"
+#include "server_params.h"
+#include "worker_pool.h"
+#include "reverse.h"
+#include "uring.h"
+#include "trace.h"
+#include "metrics.h"
+#include "stage.h"
+#include "affinity.h"
 
 #ifdef _DEBUG
 #define DEBUG(msg...) fprintf(stderr, "%u: ", (int)(pthread_self())); fprintf(stderr, msg)
@@ -28,34 +42,97 @@
 
 
 /*
- * Число буферов для обмена сообщениями между потоками
+ * Начальное число буферов для обмена сообщениями между потоками
+ * (очереди растут в пределах бюджета, см. --queue-budget)
  */
 static const size_t   TO_PROCESS_QUEUE_SIZE = 10; /* Для передачи сообщения на обработку */
 static const size_t FROM_PROCESS_QUEUE_SIZE = 20; /* Для передачи сообщения после обработки */
 
 /*
- * Данные потока
+ * Максимальное число соединений, принимаемых за один вызов обработчика
  */
-struct thread_context_t
-{
-  int      port_number;
-  int      sock_id;
+static const int ACCEPT_BATCH_SIZE = 64;
+
+/*
+ * Максимальное число событий epoll, обрабатываемых за один вызов
+ */
+#define EPOLL_EVENTS 64
+
+/*
+ * Цепочка этапов обработки сообщений (общая для всех потоков, см. --pipeline)
+ */
+static stage_chain_t * stages = NULL;
+
+/*
+ * Сообщения меньше inline_threshold байт обрабатываются в потоке работы
+ * с сокетами (см. process_inline, --inline), 0 - не обрабатываются
+ */
+static size_t inline_threshold = 0;
 
-  ev_io    io_watcher;
+#ifdef HAVE_IO_URING
+/*
+ * Размер кольца запросов io_uring и во сколько раз больше кольцо результатов
+ * (многократные запросы дают несколько результатов)
+ */
+static const unsigned URING_ENTRIES   = 1024;
+static const unsigned URING_CQ_FACTOR = 4;
+
+/*
+ * Тип запроса io_uring - в младших битах user_data (контексты выровнены)
+ */
+enum uring_request_t
+{
+  URING_ACCEPT = 0,
+  URING_RECV,
+  URING_SEND,
+  URING_CANCEL,
+}; // enum uring_request_t
+#define URING_REQUEST_MASK 3UL
+#endif
 
-  ev_async * stop_watcher;
-  ev_async to_process_watcher;
-  ev_async from_process_watcher;
+/*
+ * Данные потока работы с сокетами
+ * В режиме шардов у каждого потока свой экземпляр: собственный сокет
+ * (SO_REUSEPORT), цикл событий, пул соединений и обработка данных
+ */
+struct server_context_t
+{
+  int      port_number;
+  int      backlog;
+  int      reuse_port;         // несколько сокетов на одном порту (режим шардов)
+  int      shard;              // номер шарда (привязка к процессорам, см. affinity.h)
 
-  message_queue_t *   to_process_queue;
-  message_queue_t * from_process_queue;
+  ev_io    accept_watcher;
+  ev_async control_watcher;    // подключение/отключение соединений в потоке обработки
 
   struct ev_loop * loop;
   struct ev_loop * main_loop;
 
-  message_buffer_t * current_send_buffer;
-}; // struct thread_context_t
-typedef struct thread_context_t thread_context_t;
+  connection_pool_t pool;
+  worker_pool_t *   workers;   // пул потоков обработки (NULL - обработка в main_loop)
+
+  /*
+   * Сокеты соединений через epoll по фронту (epoll_fd >= 0)
+   * Готовность дескриптора epoll - событие чтения в цикле libev
+   */
+  int      epoll_fd;
+  ev_io    epoll_watcher;
+
+#ifdef HAVE_IO_URING
+  /*
+   * Работа с сокетами через io_uring (uring != NULL)
+   * Цикл событий libev остается: готовность результатов кольца - событие
+   * чтения его дескриптора, запросы передаются ядру перед ожиданием событий
+   */
+  uring_t *      uring;
+  uring_t        ring;
+  ev_io          uring_watcher;
+  ev_prepare     submit_watcher;
+  int            listen_fd;
+  unsigned short uring_groups; // выдано групп буферов соединений
+#endif
+}; // struct server_context_t
+typedef struct server_context_t server_context_t;
 
 /*
  *  Инициализация сокета
@@ -70,7 +147,7 @@ static void socket_init(struct sockaddr_in * addr, int port_number)
 /*
  *  Создание сокета
  */
-static int socket_create(struct sockaddr_in *addr)
+static int socket_create(struct sockaddr_in *addr, int reuse_port)
 {
   int fd;
   int on = 1;
@@ -85,6 +162,14 @@ static int socket_create(struct sockaddr_in *addr)
 
   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
+  if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+  {
+    fflush(stdout);
+    fprintf(stderr, "Ошибка установки SO_REUSEPORT: %s (%d)\n", strerror(errno), errno);
+    close(fd);
+    return -1;
+  }
+
   if (bind(fd, (const struct sockaddr *)addr, sizeof(struct sockaddr_in)) < 0)
   {
     fflush(stdout);
@@ -109,78 +194,319 @@ static size_t get_bytes_available(int sock_id)
 }
 
 /*
- * Закрыть соединение и освободить память
+ * Закрыть соединение
+ * Вызывается в потоке работы с сокетами. Контекст возвращается в пул
+ * после отключения соединения от потока обработки (см. process_control)
 */
-static void release_context(thread_context_t * context)
+static void release_context(connection_context_t * context)
 {
+  if (__atomic_load_n(&(context->state), __ATOMIC_ACQUIRE) != CONNECTION_OPEN)
+    return;
+
+#ifdef HAVE_IO_URING
+  if (context->uring != NULL)
+  {
+    // ядро не должно обращаться к буферам соединения после его освобождения:
+    // запросы к сокету отменяются, закрытие завершается после их результатов
+    if (!context->uring_closing)
+    {
+      struct io_uring_sqe * sqe = uring_get_sqe(context->uring);
+
+      context->uring_closing = 1;
+      ev_async_stop(context->loop, &(context->from_process_watcher));
+      if (sqe != NULL)
+      {
+        uring_prep_cancel_fd(sqe, context->sock_id);
+        sqe->user_data = (unsigned long)(context) | URING_CANCEL;
+        ++context->uring_inflight;
+      }
+      else
+      {
+        shutdown(context->sock_id, SHUT_RDWR);
+      }
+    }
+    if (context->uring_inflight > 0)
+      return;
+
+    uring_buf_ring_unregister(context->uring, context->uring_group);
+  }
+#endif
+
   fprintf(stderr, "Соединение по сокету %d закрыто!\n", context->sock_id);
 
-  ev_async_send(context->main_loop, context->stop_watcher);
+#ifdef _DEBUG
+  {
+    message_queue_stats_t to_stats, from_stats;
+    message_queue_get_stats(context->to_process_queue, &to_stats);
+    message_queue_get_stats(context->from_process_queue, &from_stats);
+    DEBUG("[%d] to_process: %lu messages, %lu wakeups; from_process: %lu messages, %lu wakeups\n",
+          context->sock_id, to_stats.messages, to_stats.wakeups, from_stats.messages, from_stats.wakeups);
+  }
+#endif
 
   ev_io_stop   (context->loop, &(context->io_watcher));
   ev_async_stop(context->loop, &(context->from_process_watcher));
 
-  ev_async_stop(context->main_loop, &(context->to_process_watcher));
+  if (context->epoll_fd >= 0)
+  {
+    epoll_ctl(context->epoll_fd, EPOLL_CTL_DEL, context->sock_id, NULL);
+  }
+  close(context->sock_id);
+
+  for (int i = 0; i < context->send_count; ++i)
+  {
+    message_queue_release_buffer(context->from_process_queue, context->send_batch[i]);
+  }
+  context->send_count = 0;
 
-  ev_break(context->loop, EVBREAK_ALL);
-//  ev_unloop(context->loop, EVUNLOOP_ALL);
-//  ev_loop_destroy (context->main_loop);
+  if (context->parser.frame != NULL)
+  {
+    message_queue_release_buffer(context->to_process_queue, context->parser.frame);
+    frame_parser_reset(&(context->parser));
+  }
 
-//  ev_break(context->main_loop, EVBREAK_ALL);
-//  ev_unloop(context->main_loop, EVUNLOOP_ALL);
+  __atomic_store_n(&(context->state), CONNECTION_CLOSING, __ATOMIC_RELEASE);
+  if (connection_pool_push_control(context->pool, context))
+  {
+    ev_async_send(context->main_loop, context->control_watcher);
+  }
+}
 
-  close(context->sock_id);
+/*
+ * Ошибка обработки данных соединения
+ * Вызывается в потоке обработки, соединение закрывается потоком работы с сокетами
+ */
+static void fail_context(connection_context_t * context)
+{
+  __atomic_store_n(&(context->process_error), 1, __ATOMIC_RELEASE);
+  ev_async_send(context->loop, &(context->from_process_watcher));
+}
+
+/*
+ * Обработка одного сообщения в пуле потоков
+ */
+static void process_task(void * arg);
+
+/*
+ * Завершение обработки сообщения в потоке этапа
+ */
+static void stage_done(void * owner, message_buffer_t * buffer, unsigned long sequence, int status);
+
+/*
+ * Обработка сообщения цепочкой этапов на месте
+ */
+static int process_message(connection_context_t * context, message_buffer_t * buffer, unsigned long sequence);
+
+/*
+ * Передать новое сообщение на обработку
+ * wakeup - очередь была пуста (результат message_queue_add_ready_buffer):
+ * основной поток уведомляется только в этом случае, иначе он еще не разобрал
+ * очередь и получит сообщение вместе с предыдущими
+ * Вызывается в потоке работы с сокетами
+ */
+static void schedule_processing(connection_context_t * context, int wakeup)
+{
+  if (context->workers == NULL)
+  {
+    if (wakeup)
+    {
+      ev_async_send(context->main_loop, &(context->to_process_watcher));
+    }
+    return;
+  }
+
+  __atomic_add_fetch(&(context->tasks), 1, __ATOMIC_ACQ_REL);
+  if (worker_pool_submit(context->workers, process_task, context) != 0)
+  {
+    __atomic_sub_fetch(&(context->tasks), 1, __ATOMIC_ACQ_REL);
+    fflush(stdout);
+    fprintf(stderr, "Ошибка передачи сообщения в пул потоков обработки\n");
+    release_context(context);
+  }
+}
+
+/*
+ * Возобновить обработку после освобождения буфера для результата
+ * Вызывается в потоке работы с сокетами
+ */
+static void resume_processing(connection_context_t * context)
+{
+  int stalled;
+
+  if (context->workers == NULL)
+  {
+    ev_async_send(context->main_loop, &(context->to_process_watcher));
+    return;
+  }
 
-  message_queue_destroy(context->to_process_queue);
-  message_queue_destroy(context->from_process_queue);
+  // буфер уже освобожден: задачи, не получившие буфер раньше, учтены в stalled_tasks
+  pthread_mutex_lock(&(context->order_lock));
+  stalled = context->stalled_tasks;
+  context->stalled_tasks = 0;
+  pthread_mutex_unlock(&(context->order_lock));
+
+  while (stalled-- > 0 && __atomic_load_n(&(context->state), __ATOMIC_ACQUIRE) == CONNECTION_OPEN)
+  {
+    schedule_processing(context, 1);
+  }
 }
 
 /*
- * 
+ * Добавить в пакет записи готовые буферы from_process_queue (до CONNECTION_SEND_BATCH)
+ * Готовые буферы забираются из очереди одним обращением, пустые - освобождаются
+ * Возвращает число освобожденных буферов
  */
-static void stop_main_loop(struct ev_loop *loop, ev_async *watcher, int revents)
+static int send_batch_fill(connection_context_t * context)
 {
-  ev_break(loop, EVBREAK_ALL);
+  message_buffer_t * buffer;
+  size_t received;
+  int released = 0;
+
+  received = message_queue_get_ready_batch(context->from_process_queue,
+                                           context->send_batch + context->send_count,
+                                           CONNECTION_SEND_BATCH - context->send_count);
+  for (size_t i = 0; i < received; ++i)
+  {
+    buffer = context->send_batch[context->send_count];
+    if (buffer->size == 0)
+    {
+      DEBUG("Пустой буфер для записи в сокет\n");
+      message_queue_release_buffer(context->from_process_queue, buffer);
+      --context->in_flight;
+      ++released;
+      memmove(context->send_batch + context->send_count, context->send_batch + context->send_count + 1,
+              (received - i - 1) * sizeof(message_buffer_t *));
+      continue;
+    }
+    ++context->send_count;
+  }
+  return released;
 }
 
 /*
- * Запись данных в сокет
+ * Описание пакета записи для sendmsg, возвращает флаги записи
+ * Если пакет заполнен, запись выполняется с флагом MSG_MORE: ядро объединит
+ * данные со следующей записью. Последний буфер полного пакета остается
+ * для следующей записи - без нее ядро задержало бы данные до 200 мс
+ * Сообщение частями описывается областью на каждую часть; если области
+ * закончились, остаток сообщения отправляется следующей записью
+ * (context->send_prepared - число буферов, описанных полностью)
  */
-static int send_data(int fd, message_buffer_t *buffer)
+static int send_batch_prepare(connection_context_t * context, struct msghdr * msg, struct iovec * iov)
 {
-  int bytes = 0;
-  int snt = 0;
+  message_buffer_t * buffer;
+  int more = context->send_count == CONNECTION_SEND_BATCH;
+  int count = more ? context->send_count - 1 : context->send_count;
+  size_t used = 0;
+  size_t filled;
+  int i;
+
+  for (i = 0; i < count && used < CONNECTION_SEND_IOV; ++i)
+  {
+    buffer = context->send_batch[i];
+    filled = message_buffer_data_iov(buffer, buffer->offset - buffer->size, buffer->size,
+                                     iov + used, CONNECTION_SEND_IOV - used);
+    used += filled;
+    if (filled < message_buffer_iov_count(buffer, buffer->offset - buffer->size, buffer->size))
+      break;
+  }
+  context->send_prepared = i;
+  if (i < count)
+  {
+    // описаны не все буферы - остаток следующей записью
+    more = 1;
+  }
+  memset(msg, 0, sizeof(struct msghdr));
+  msg->msg_iov    = iov;
+  msg->msg_iovlen = used;
 
-  DEBUG("%s\n", __FUNCTION__);
+  return MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+}
 
-  if (buffer == NULL || buffer->buffer == NULL || fd <= 0)
-    return -1;
+/*
+ * Освободить отправленные буферы пакета (sent байт), недописанный остается первым
+ * Возвращает число освобожденных буферов
+ */
+static int send_batch_commit(connection_context_t * context, size_t sent)
+{
+  message_buffer_t * buffer;
+  unsigned long long now = trace_enabled ? trace_now() : 0;
+  int done = 0;
+
+  while (done < context->send_count && sent >= context->send_batch[done]->size)
+  {
+    buffer = context->send_batch[done++];
+    sent -= buffer->size;
+    trace_complete(buffer, now);
+    message_buffer_reset(buffer);
+    message_queue_release_buffer(context->from_process_queue, buffer);
+    --context->in_flight;
+  }
+  if (done < context->send_count)
+  {
+    context->send_batch[done]->size -= sent;
+  }
+  context->send_count -= done;
+  memmove(context->send_batch, context->send_batch + done, context->send_count * sizeof(message_buffer_t *));
+  return done;
+}
+
+/*
+ * Запись накопленных результатов в сокет
+ * Все готовые буферы from_process_queue (до CONNECTION_SEND_BATCH) передаются
+ * одним вызовом sendmsg, полностью отправленные буферы освобождаются
+ * Возвращает 1 - все данные отправлены, 0 - сокет занят, -1 - ошибка
+ */
+static int send_batch(connection_context_t * context)
+{
+  struct iovec iov[CONNECTION_SEND_IOV];
+  struct msghdr msg;
+  ssize_t sent;
+  int released = 0;
+  int flags;
+  int done;
+
+  DEBUG("%s\n", __FUNCTION__);
 
-  while (buffer->size)
+  while (1)
   {
-    snt = send(fd, buffer->buffer + (buffer->offset - buffer->size), buffer->size, 0);
+    released += send_batch_fill(context);
+    if (context->send_count == 0)
+      break;
 
-    if (snt <= 0)
+    flags = send_batch_prepare(context, &msg, iov);
+    sent = sendmsg(context->sock_id, &msg, flags);
+    if (sent < 0)
     {
+      if (errno == EINTR)
+        continue;
       if (errno != EAGAIN && errno != EWOULDBLOCK)
         return -1;
-
       DEBUG("send would block\n");
+      METRICS_ADD(partial_sends, 1);
       break;
     }
+    DEBUG("sent %zd bytes from %d buffers\n", sent, context->send_count);
+    METRICS_ADD(bytes_sent, sent);
 
-    buffer->size -= snt;
-    bytes        += snt;
+    done = send_batch_commit(context, sent);
+    released += done;
+    if (done < context->send_prepared)
+    {
+      DEBUG("не все данные были отправлены\n");
+      METRICS_ADD(partial_sends, 1);
+      break;
+    }
   }
 
-  if (buffer->size == 0)
+  if (released > 0)
   {
-    DEBUG("buffer is empty\n");
-    buffer->offset = 0;
+    // освободились буферы для результатов - возобновляем обработку
+    resume_processing(context);
   }
 
-  DEBUG("%s done rc = %d\n", __FUNCTION__, bytes);
-  return bytes;
+  DEBUG("%s done. pending = %d\n", __FUNCTION__, context->send_count);
+  return context->send_count == 0 ? 1 : 0;
 }
 
 /*
@@ -188,17 +514,26 @@ static int send_data(int fd, message_buffer_t *buffer)
  */
 int read_data(int fd, message_buffer_t *buffer)
 {
+  struct iovec iov[CONNECTION_RECV_IOV];
   int bytes = 0;
-  int received;
+  ssize_t received;
+  int count;
 
   DEBUG("%s\n", __FUNCTION__);
 
-  if (buffer == NULL || buffer->buffer == NULL || fd <= 0)
+  if (buffer == NULL || (buffer->buffer == NULL && buffer->chunks == NULL) || fd <= 0)
     return -1;
 
-  while (buffer->offset < (int)(buffer->capacity))
+  while (buffer->offset < buffer->capacity)
   {
-    received = recv(fd, buffer->buffer + buffer->offset, buffer->capacity - buffer->offset, 0);
+    // сообщение частями читается сразу в несколько частей
+    count = message_buffer_space_iov(buffer, buffer->capacity - buffer->offset, iov, CONNECTION_RECV_IOV);
+    if (count < 0)
+    {
+      bytes = -1;
+      break;
+    }
+    received = readv(fd, iov, count);
 
     if (received < 0)
     {
@@ -224,265 +559,1533 @@ int read_data(int fd, message_buffer_t *buffer)
     bytes += received;
   }
 
+  if (bytes > 0)
+  {
+    METRICS_ADD(bytes_received, bytes);
+  }
+
   DEBUG("%s done. rc = %d\n", __FUNCTION__, bytes);
   return bytes;
 }
 
 /*
- * Действия при готовности сокета для чтения
- */
-static void on_socket_ready_to_read(struct ev_loop *loop, ev_io *watcher, int revents);
-
-/*
- * Действия при готовности сокета для записи
+ * Приостановить чтение из сокета: нет свободных буферов для сообщений
+ * Данные остаются в буфере приема ядра, окно TCP ограничивает клиента.
+ * Чтение возобновляется после освобождения буфера потоком обработки
+ * (см. send_processed_data)
  */
-static void on_socket_ready_to_write(struct ev_loop *loop, ev_io *watcher, int revents)
+static void suspend_reading(connection_context_t * context)
 {
-  int rc, sock_id = watcher->fd;
-  thread_context_t *context = (thread_context_t *)(watcher->data);
-  message_buffer_t *buffer = context->current_send_buffer;
-
-  DEBUG("%s\n", __FUNCTION__);
-
-  if (revents & EV_ERROR)
+  if (!context->read_suspended)
   {
-    fprintf(stderr, "Внутренняя ошибка libev при вызове обработчика готовности сокета %d к записи\n", sock_id);
-    release_context(context);
-    return;
+    DEBUG("Чтение из сокета %d приостановлено\n", context->sock_id);
+    if (context->epoll_fd < 0)
+    {
+      ev_io_stop(context->loop, &(context->io_watcher));
+    }
+    context->read_suspended = 1;
+    METRICS_ADD(to_process_exhausted, 1);
   }
+}
 
-  if (buffer->size > 0)
+/*
+ * Возобновить чтение из сокета
+ * С epoll события по фронту не повторяются: оставшиеся в сокете данные
+ * читает вызывающий (см. epoll_receive)
+ */
+static void resume_reading(connection_context_t * context)
+{
+  if (context->read_suspended)
   {
-    rc = send_data(sock_id, buffer);
-
-    if (rc < 0)
+    DEBUG("Чтение из сокета %d возобновлено\n", context->sock_id);
+    context->read_suspended = 0;
+    if (context->epoll_fd < 0)
     {
-      release_context(context);
-      return;
+      ev_io_start(context->loop, &(context->io_watcher));
     }
   }
+}
 
-  if (buffer->size > 0)
-  {
-    // не все данные были отправлены
-    DEBUG("не все данные были отправлены\n");
-  }
-  else
+/*
+ * Обработка небольшого сообщения в потоке работы с сокетами (--inline)
+ * Если все предыдущие сообщения соединения уже отправлены, сообщение
+ * обрабатывается сразу после чтения и передается на запись без уведомлений
+ * потока обработки: порядок результатов сохраняется. Результат отправляет
+ * send_processed_data, вызванный в том же потоке (см. send_inline_results)
+ * Возвращает 1 - сообщение обработано, 0 - передается на обработку обычным путем
+ */
+static int process_inline(connection_context_t * context, message_buffer_t * buffer)
+{
+  message_buffer_t * write_buffer;
+
+  if (buffer->size >= inline_threshold || context->in_flight != 0)
+    return 0;
+#ifdef HAVE_IO_URING
+  // запись через io_uring асинхронна: переходов между потоками не становится меньше
+  if (context->uring != NULL)
+    return 0;
+#endif
+
+  write_buffer = message_queue_move_buffer(context->to_process_queue, buffer, context->from_process_queue);
+  if (write_buffer == NULL)
+    return 0;
+
+  if (process_message(context, write_buffer, 0) != 0)
   {
-    DEBUG("В буфере нет данных\n");
-    // возвращаем "обычную" схему работы
-    ev_io_stop(loop, watcher);
-    context->current_send_buffer = NULL;
-    ev_io_init(&(context->io_watcher), on_socket_ready_to_read, sock_id, EV_READ);
-    ev_async_start(context->loop, &(context->from_process_watcher));
-    ev_io_start(loop, &(context->io_watcher));
+    message_queue_release_buffer(context->from_process_queue, write_buffer);
+    fail_context(context);
+    return 1;
   }
+  trace_mark(write_buffer, TRACE_ENQUEUE_SEND);
+  message_queue_add_ready_buffer(context->from_process_queue, write_buffer);
+  context->inline_ready = 1;
+  METRICS_ADD(messages_inline, 1);
+  return 1;
+}
 
-  DEBUG("%s done\n", __FUNCTION__);
+/*
+ * Передать прочитанное сообщение на обработку
+ * Вызывается в потоке работы с сокетами
+ */
+static void submit_message(connection_context_t * context, message_buffer_t * buffer)
+{
+  int inline_done;
+  int wakeup;
+
+  trace_mark(buffer, TRACE_READ);
+  trace_mark(buffer, TRACE_ENQUEUE_PROCESS);
+  inline_done = process_inline(context, buffer);
+  ++context->in_flight;
+  if (inline_done)
+    return;
+
+  wakeup = message_queue_add_ready_buffer(context->to_process_queue, buffer);
+  schedule_processing(context, wakeup);
 }
 
 /*
- * Действия при готовности сокета для чтения
+ * Передать собранный кадр на обработку (режим кадров)
  */
-static void on_socket_ready_to_read(struct ev_loop *loop, ev_io *watcher, int revents)
+static void submit_frame(connection_context_t * context)
 {
-  int rc, sock_id = watcher->fd;
-  thread_context_t *context = (thread_context_t *)(watcher->data);
-  message_buffer_t *buffer = NULL;
+  message_buffer_t * frame = context->parser.frame;
 
-  DEBUG("%s\n", __FUNCTION__);
+  DEBUG("[%d] RECEIVED FRAME: %zu bytes\n", context->sock_id, frame->size);
+  frame_parser_reset(&(context->parser));
+  submit_message(context, frame);
+}
 
-  if (revents & EV_ERROR)
-  {
-    fprintf(stderr, "Внутренняя ошибка libev при вызове обработчика чтения данных из сокета %d\n", sock_id);
-    release_context(context);
-    return;
-  }
+/*
+ * Чтение кадров из сокета (режим кадров)
+ * Данные читаются в context->input и разбираются на кадры, каждый
+ * собранный кадр передается на обработку. Остаток крупного кадра читается
+ * сразу в его буфер. Если свободных буферов нет, разбор продолжится
+ * после обработки очередного сообщения (см. send_processed_data)
+ * Возвращает число переданных на обработку кадров или -1 при ошибке
+ */
+static int receive_frames(connection_context_t * context)
+{
+  message_buffer_t * input = &(context->input);
+  frame_parser_t * parser = &(context->parser);
+  message_buffer_t * buffer;
+  struct iovec iov[CONNECTION_RECV_IOV];
+  int frames = 0;
+  ssize_t received;
+  int direct;
+  int count;
+  int rc;
 
-  if (revents & EV_READ)
+  DEBUG("%s\n", __FUNCTION__);
+
+  while (1)
   {
-    buffer = message_queue_get_free_buffer(context->to_process_queue);
-    if (buffer != NULL)
+    // разбор прочитанных данных
+    while (input->size > 0)
     {
-      int bytes = get_bytes_available(sock_id);
-      if (message_buffer_resize(buffer, bytes) != 0)
+      if (parser->frame == NULL)
+      {
+        buffer = message_queue_get_free_buffer(context->to_process_queue);
+        if (buffer == NULL)
+        {
+          DEBUG("Нет свободного буфера для кадра\n");
+          suspend_reading(context);
+          return frames;
+        }
+        frame_parser_start(parser, buffer);
+      }
+
+      rc = frame_parser_feed(parser, input->buffer + (input->offset - input->size), input->size);
+      if (rc < 0)
       {
         fflush(stdout);
-        fprintf(stderr, "Ошибка выденения памати для размещения данных из сокета: %s (%d)\n", strerror(errno), errno);
-        release_context(context);
-        return;
+        fprintf(stderr, "Ошибка разбора кадра: %s (%d)\n", strerror(errno), errno);
+        return -1;
       }
+      input->size -= rc;
 
-      rc = read_data(sock_id, buffer);
+      if (frame_parser_ready(parser))
+      {
+        submit_frame(context);
+        ++frames;
+      }
+    }
+    input->offset = 0;
 
-      if (rc < 0)
+    direct = frame_parser_missing(parser) >= input->capacity;
+    if (direct)
+    {
+      // остаток кадра частями читается сразу в несколько частей
+      count = message_buffer_space_iov(parser->frame, frame_parser_missing(parser), iov, CONNECTION_RECV_IOV);
+      if (count < 0)
       {
         fflush(stdout);
-        fprintf(stderr, "Ошибка чтения из сокета: %s (%d)\n", strerror(errno), errno);
-        release_context(context);
-        return;
+        fprintf(stderr, "Ошибка выделения памяти для кадра: %s (%d)\n", strerror(errno), errno);
+        return -1;
       }
+      received = readv(context->sock_id, iov, count);
+    }
+    else
+    {
+      received = recv(context->sock_id, input->buffer, input->capacity, 0);
+    }
+
+    if (received < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      fflush(stdout);
+      fprintf(stderr, "Ошибка чтения из сокета: %s (%d)\n", strerror(errno), errno);
+      return -1;
+    }
+    if (received == 0)
+      return -1;
+    METRICS_ADD(bytes_received, received);
 
-      DEBUG("[%d] RECEIVED: %.*s\n", sock_id, buffer->size, buffer->buffer);
-      message_queue_add_ready_buffer(context->to_process_queue, buffer);
+    if (direct)
+    {
+      frame_parser_commit(parser, received);
+      if (frame_parser_ready(parser))
+      {
+        submit_frame(context);
+        ++frames;
+      }
     }
     else
     {
-      DEBUG("Нет свободного буфера\n");
+      input->size = input->offset = received;
     }
   }
 
-  if (buffer != NULL && buffer->size > 0)
+  DEBUG("%s done. frames = %d\n", __FUNCTION__, frames);
+  return frames;
+}
+
+/*
+ * Действия при готовности сокета для чтения
+ */
+static void on_socket_ready_to_read(struct ev_loop *loop, ev_io *watcher, int revents);
+
+/*
+ * Действия при готовности данных для записи в сокет
+ */
+static void send_processed_data(struct ev_loop *loop, ev_async *watcher, int revents);
+
+/*
+ * Отправить результаты, обработанные в потоке работы с сокетами
+ * (без уведомления from_process_watcher)
+ */
+static void send_inline_results(connection_context_t * context)
+{
+  if (context->inline_ready && __atomic_load_n(&(context->state), __ATOMIC_ACQUIRE) == CONNECTION_OPEN)
+  {
+    send_processed_data(context->loop, &(context->from_process_watcher), 0);
+  }
+}
+
+/*
+ * Действия при готовности сокета для записи
+ */
+static void on_socket_ready_to_write(struct ev_loop *loop, ev_io *watcher, int revents)
+{
+  int rc, sock_id = watcher->fd;
+  connection_context_t *context = (connection_context_t *)(watcher->data);
+
+  DEBUG("%s\n", __FUNCTION__);
+
+  if (revents & EV_ERROR)
+  {
+    fprintf(stderr, "Внутренняя ошибка libev при вызове обработчика готовности сокета %d к записи\n", sock_id);
+    release_context(context);
+    return;
+  }
+
+  // вместе с остатком отправляются результаты, накопившиеся пока сокет был занят
+  rc = send_batch(context);
+  if (rc < 0)
+  {
+    release_context(context);
+    return;
+  }
+
+  if (rc == 0)
+  {
+    // не все данные были отправлены
+    DEBUG("не все данные были отправлены\n");
+  }
+  else
+  {
+    DEBUG("В буфере нет данных\n");
+    // возвращаем "обычную" схему работы
+    ev_io_stop(loop, watcher);
+    ev_io_init(&(context->io_watcher), on_socket_ready_to_read, sock_id, EV_READ);
+    ev_async_start(context->loop, &(context->from_process_watcher));
+    // приостановленное чтение (и разбор остатка прочитанных данных)
+    // возобновит send_processed_data
+    if (!context->read_suspended)
+    {
+      ev_io_start(loop, &(context->io_watcher));
+    }
+    // пока сокет был занят, могли накопиться обработанные данные
+    ev_async_send(context->loop, &(context->from_process_watcher));
+  }
+
+  DEBUG("%s done\n", __FUNCTION__);
+}
+
+/*
+ * Действия при готовности сокета для чтения
+ */
+static void on_socket_ready_to_read(struct ev_loop *loop, ev_io *watcher, int revents)
+{
+  int rc, sock_id = watcher->fd;
+  connection_context_t *context = (connection_context_t *)(watcher->data);
+  message_buffer_t *buffer = NULL;
+
+  DEBUG("%s\n", __FUNCTION__);
+
+  if (revents & EV_ERROR)
+  {
+    fprintf(stderr, "Внутренняя ошибка libev при вызове обработчика чтения данных из сокета %d\n", sock_id);
+    release_context(context);
+    return;
+  }
+
+  if (context->framed)
+  {
+    // кадры передаются на обработку по мере сборки
+    if ((revents & EV_READ) && receive_frames(context) < 0)
+    {
+      release_context(context);
+      return;
+    }
+    send_inline_results(context);
+    return;
+  }
+
+  if (revents & EV_READ)
+  {
+    buffer = message_queue_get_free_buffer(context->to_process_queue);
+    if (buffer != NULL)
+    {
+      int bytes = get_bytes_available(sock_id);
+      if (message_buffer_resize(buffer, bytes) != 0)
+      {
+        fflush(stdout);
+        fprintf(stderr, "Ошибка выденения памати для размещения данных из сокета: %s (%d)\n", strerror(errno), errno);
+        release_context(context);
+        return;
+      }
+
+      rc = read_data(sock_id, buffer);
+
+      if (rc < 0)
+      {
+        fflush(stdout);
+        fprintf(stderr, "Ошибка чтения из сокета: %s (%d)\n", strerror(errno), errno);
+        release_context(context);
+        return;
+      }
+
+      DEBUG("[%d] RECEIVED: %zu bytes\n", sock_id, buffer->size);
+      if (buffer->size > 0)
+      {
+        submit_message(context, buffer);
+      }
+      else
+      {
+        DEBUG("Нет данных для передачи на обработку\n");
+        message_queue_release_buffer(context->to_process_queue, buffer);
+      }
+    }
+    else
+    {
+      DEBUG("Нет свободного буфера\n");
+      suspend_reading(context);
+    }
+  }
+
+  send_inline_results(context);
+
+  DEBUG("%s done\n", __FUNCTION__);
+}
+
+/*
+ * Работа с сокетами соединений через epoll по фронту
+ *
+ * Сокет регистрируется один раз на чтение и запись (EPOLLET), событие
+ * приходит только при поступлении новых данных или освобождении места
+ * для записи. Сообщение читается без запроса числа доступных байт
+ * (FIONREAD): буфер заранее получает размер, предсказанный по недавним
+ * сообщениям, и растет вдвое, если данных оказалось больше, но не больше
+ * CONNECTION_READ_MAX: остаток читается следующим сообщением сразу, без
+ * ожидания события
+ */
+
+/*
+ * Чтение сообщения до опустошения сокета, но не больше CONNECTION_READ_MAX
+ * Короткое чтение (меньше свободного места) означает, что данных в сокете
+ * больше нет: новые данные вызовут следующее событие, поэтому повторное
+ * чтение до EAGAIN не выполняется
+ * more - в сокете могут оставаться данные (сообщение достигло предела или
+ * получен конец данных после части сообщения): события о них не будет,
+ * вызывающий читает снова
+ * Возвращает размер сообщения или -1 при ошибке и конце данных
+ */
+static ssize_t epoll_read_message(connection_context_t * context, message_buffer_t * buffer, int * more)
+{
+  struct iovec iov[CONNECTION_RECV_IOV];
+  ssize_t received;
+  size_t space;
+  int count;
+
+  *more = 0;
+  if (message_buffer_resize(buffer, context->read_hint) != 0)
+    return -1;
+
+  while (1)
+  {
+    if (buffer->offset == buffer->capacity)
+    {
+      size_t capacity = buffer->capacity * 2;
+
+      if (buffer->capacity >= CONNECTION_READ_MAX)
+      {
+        *more = 1;
+        break;
+      }
+      if (message_buffer_reserve(buffer, capacity < CONNECTION_READ_MAX ? capacity : CONNECTION_READ_MAX) != 0)
+        return -1;
+    }
+
+    count = message_buffer_space_iov(buffer, buffer->capacity - buffer->offset, iov, CONNECTION_RECV_IOV);
+    if (count < 0)
+      return -1;
+    space = 0;
+    for (int i = 0; i < count; ++i)
+    {
+      space += iov[i].iov_len;
+    }
+
+    received = readv(context->sock_id, iov, count);
+    if (received < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return -1;
+    }
+    if (received == 0)
+    {
+      if (buffer->size == 0)
+        return -1;
+      // прочитанное сообщение передается, конец данных - при следующем чтении
+      *more = 1;
+      break;
+    }
+
+    buffer->size   += received;
+    buffer->offset += received;
+    if ((size_t)(received) < space)
+      break;
+  }
+
+  if (buffer->size > 0)
+  {
+    size_t hint = context->read_hint - (context->read_hint >> CONNECTION_READ_HINT_SHIFT) +
+                  (buffer->size >> CONNECTION_READ_HINT_SHIFT);
+    context->read_hint = hint < CONNECTION_READ_HINT_MIN ? CONNECTION_READ_HINT_MIN : hint;
+    METRICS_ADD(bytes_received, buffer->size);
+  }
+  return buffer->size;
+}
+
+/*
+ * Прием данных соединения
+ * Вызывается по событию чтения и при возобновлении приостановленного чтения
+ * Возвращает -1 при ошибке
+ */
+static int epoll_receive(connection_context_t * context)
+{
+  message_buffer_t * buffer;
+  ssize_t size;
+  int more;
+
+  if (context->framed)
+    return receive_frames(context) < 0 ? -1 : 0;
+
+  // данные, оставшиеся в сокете после чтения, нового события не вызовут
+  do
+  {
+    buffer = message_queue_get_free_buffer(context->to_process_queue);
+    if (buffer == NULL)
+    {
+      // данные остаются в сокете до освобождения буфера (см. send_processed_data)
+      DEBUG("Нет свободного буфера\n");
+      suspend_reading(context);
+      return 0;
+    }
+
+    size = epoll_read_message(context, buffer, &more);
+    if (size <= 0)
+    {
+      int error = errno;
+      message_queue_release_buffer(context->to_process_queue, buffer);
+      if (size < 0)
+      {
+        fflush(stdout);
+        fprintf(stderr, "Ошибка чтения из сокета: %s (%d)\n", strerror(error), error);
+      }
+      return size < 0 ? -1 : 0;
+    }
+
+    DEBUG("[%d] RECEIVED: %zu bytes\n", context->sock_id, buffer->size);
+    submit_message(context, buffer);
+  }
+  while (more && !context->read_suspended &&
+         __atomic_load_n(&(context->state), __ATOMIC_ACQUIRE) == CONNECTION_OPEN);
+  return 0;
+}
+
+/*
+ * Обработка событий сокетов соединений
+ */
+static void epoll_process_events(struct ev_loop *loop, ev_io *watcher, int revents)
+{
+  server_context_t * server = (server_context_t *)(watcher->data);
+  struct epoll_event events[EPOLL_EVENTS];
+  connection_context_t * context;
+  int count;
+
+  count = epoll_wait(server->epoll_fd, events, EPOLL_EVENTS, 0);
+  for (int i = 0; i < count; ++i)
+  {
+    context = (connection_context_t *)(events[i].data.ptr);
+
+    // соединение могло быть закрыто при обработке предыдущих событий
+    if (__atomic_load_n(&(context->state), __ATOMIC_ACQUIRE) != CONNECTION_OPEN)
+      continue;
+
+    // приостановленное чтение продолжит send_processed_data
+    if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !context->read_suspended &&
+        epoll_receive(context) < 0)
+    {
+      release_context(context);
+      continue;
+    }
+    send_inline_results(context);
+
+    if ((events[i].events & EPOLLOUT) && context->write_blocked &&
+        __atomic_load_n(&(context->state), __ATOMIC_ACQUIRE) == CONNECTION_OPEN)
+    {
+      // вместе с остатком отправляются результаты, накопившиеся пока сокет был занят
+      context->write_blocked = 0;
+      send_processed_data(loop, &(context->from_process_watcher), 0);
+    }
+  }
+
+  if (count < 0 && errno != EINTR)
+  {
+    fflush(stdout);
+    fprintf(stderr, "Ошибка ожидания событий epoll: %s (%d)\n", strerror(errno), errno);
+  }
+}
+
+/*
+ * Действия при готовности данных для записи в сокет
+ */
+static void send_processed_data(struct ev_loop *loop, ev_async *watcher, int revents)
+{
+  int rc;
+  connection_context_t *context = (connection_context_t *)(watcher->data);
+  int sock_id = context->sock_id;
+
+  DEBUG("%s\n", __FUNCTION__);
+
+  if (revents & EV_ERROR)
+  {
+    fprintf(stderr, "Внутренняя ошибка libev при вызове обработчика записи данных в сокет %d\n", sock_id);
+    release_context(context);
+    return;
+  }
+
+  if (__atomic_load_n(&(context->process_error), __ATOMIC_ACQUIRE))
+  {
+    release_context(context);
+    return;
+  }
+
+  if (context->write_blocked)
+  {
+    // сокет занят: результаты будут отправлены по EPOLLOUT
+    return;
+  }
+
+  // возобновленное чтение может добавить результаты, обработанные на месте (process_inline)
+  do
+  {
+    context->inline_ready = 0;
+
+    // все накопленные результаты передаются одной записью
+    rc = send_batch(context);
+    if (rc < 0)
+    {
+      release_context(context);
+      return;
+    }
+
+    if (rc == 0 && context->epoll_fd >= 0)
+    {
+      // сокет зарегистрирован и для записи: ждем EPOLLOUT
+      DEBUG("не все данные были отправлены\n");
+      context->write_blocked = 1;
+      return;
+    }
+
+    if (rc == 0)
+    {
+      // не все данные были отправлены
+      DEBUG("не все данные были отправлены\n");
+      // ждем освобождения сокета
+      ev_async_stop(loop, watcher);                      // не принимаем обработанные данные
+      ev_io_stop(context->loop, &(context->io_watcher)); // не принимаем данные из сокета
+      ev_io_init(&(context->io_watcher), on_socket_ready_to_write, sock_id, EV_WRITE);
+      ev_io_start(loop, &(context->io_watcher));         // ждем освобождения сокета для записи
+      return;
+    }
+
+    // поток обработки освобождает буферы сообщений перед передачей результата
+    if (context->read_suspended)
+    {
+      resume_reading(context);
+      // разбор ранее прочитанных данных (при нехватке буферов чтение снова приостановится)
+      if (context->epoll_fd >= 0 && epoll_receive(context) < 0)
+      {
+        release_context(context);
+        return;
+      }
+      if (context->epoll_fd < 0 && context->framed && context->input.size > 0 && receive_frames(context) < 0)
+      {
+        release_context(context);
+        return;
+      }
+    }
+  }
+  while (context->inline_ready);
+
+  DEBUG("Нет готовых данных для записи в сокет\n");
+  DEBUG("%s done\n", __FUNCTION__);
+}
+
+/*
+ * Обработка данных в основном потоке
+ */
+static void process_data(struct ev_loop * loop, ev_async *watcher, int revents);
+
+#ifdef HAVE_IO_URING
+/*
+ * Работа с сокетами через io_uring
+ *
+ * Запросы накапливаются в кольце и передаются ядру одним вызовом перед
+ * ожиданием событий цикла (uring_submit_requests). Данные принимаются
+ * многократным recv: ядро само выбирает буфер из кольца буферов соединения
+ * и возвращает результат на каждую порцию данных без повторных запросов.
+ * Запись - sendmsg пакета результатов, на соединение не больше одной записи
+ */
+
+/*
+ * Очередной запрос; если кольцо заполнено, накопленные запросы передаются ядру
+ */
+static struct io_uring_sqe * uring_sqe(uring_t * ring)
+{
+  struct io_uring_sqe * sqe = uring_get_sqe(ring);
+
+  if (sqe == NULL && uring_submit(ring) >= 0)
+  {
+    sqe = uring_get_sqe(ring);
+  }
+  return sqe;
+}
+
+/*
+ * Вернуть ядру буфер с номером bid после переноса данных
+ */
+static void uring_provide_buffer(connection_context_t * context, unsigned short bid)
+{
+  message_buffer_t * buffer = context->uring_buffers[bid];
+
+  buffer->size = buffer->offset = 0;
+  uring_buf_ring_add(context->uring_ring, CONNECTION_URING_BUFFERS, buffer->buffer, buffer->capacity, bid, 0);
+  uring_buf_ring_advance(context->uring_ring, 1);
+  ++context->uring_provided;
+}
+
+/*
+ * Предоставить ядру свободные буферы и возобновить прием данных
+ * Сообщение принимается на месте в буфер to_process_queue,
+ * в режиме кадров - в блок чтения соединения
+ */
+static int uring_provide(connection_context_t * context)
+{
+  message_buffer_t * buffer;
+  struct io_uring_sqe * sqe;
+  unsigned added = 0;
+
+  for (unsigned short bid = 0; bid < CONNECTION_URING_BUFFERS; ++bid)
+  {
+    if (context->uring_buffers[bid] != NULL)
+      continue;
+
+    if (context->framed)
+    {
+      buffer = context->uring_chunks + bid;
+    }
+    else
+    {
+      buffer = message_queue_get_free_buffer(context->to_process_queue);
+      if (buffer == NULL)
+        break;
+      if (message_buffer_resize(buffer, CONNECTION_URING_BUFFER_SIZE) != 0)
+      {
+        int error = errno;
+        message_queue_release_buffer(context->to_process_queue, buffer);
+        errno = error;
+        return -1;
+      }
+    }
+    context->uring_buffers[bid] = buffer;
+    uring_buf_ring_add(context->uring_ring, CONNECTION_URING_BUFFERS, buffer->buffer, buffer->capacity, bid, added++);
+  }
+  if (added > 0)
+  {
+    uring_buf_ring_advance(context->uring_ring, added);
+    context->uring_provided += added;
+  }
+
+  if (context->uring_recv || context->uring_closing)
+    return 0;
+
+  if (context->uring_provided == 0)
+  {
+    // свободных буферов нет: прием возобновится после обработки сообщений
+    DEBUG("Чтение из сокета %d приостановлено\n", context->sock_id);
+    context->read_suspended = 1;
+    METRICS_ADD(to_process_exhausted, 1);
+    return 0;
+  }
+
+  sqe = uring_sqe(context->uring);
+  if (sqe == NULL)
+    return -1;
+  uring_prep_recv_multishot(sqe, context->sock_id, context->uring_group);
+  sqe->user_data = (unsigned long)(context) | URING_RECV;
+  context->uring_recv = 1;
+  context->read_suspended = 0;
+  ++context->uring_inflight;
+  return 0;
+}
+
+/*
+ * Разбор принятых блоков на кадры (режим кадров)
+ * Разобранный блок возвращается ядру (см. uring_provide). Если буферов
+ * для кадров нет, разбор продолжится после обработки очередного сообщения
+ */
+static int uring_receive_frames(connection_context_t * context)
+{
+  frame_parser_t * parser = &(context->parser);
+  message_buffer_t * chunk;
+  message_buffer_t * buffer;
+  unsigned short bid;
+  int rc;
+
+  while (context->uring_pending_count > 0)
+  {
+    bid = context->uring_pending[context->uring_pending_first];
+    chunk = context->uring_buffers[bid];
+
+    while (chunk->size > 0)
+    {
+      if (parser->frame == NULL)
+      {
+        buffer = message_queue_get_free_buffer(context->to_process_queue);
+        if (buffer == NULL)
+        {
+          DEBUG("Нет свободного буфера для кадра\n");
+          return 0;
+        }
+        frame_parser_start(parser, buffer);
+      }
+
+      rc = frame_parser_feed(parser, chunk->buffer + (chunk->offset - chunk->size), chunk->size);
+      if (rc < 0)
+      {
+        fflush(stdout);
+        fprintf(stderr, "Ошибка разбора кадра: %s (%d)\n", strerror(errno), errno);
+        return -1;
+      }
+      chunk->size -= rc;
+
+      if (frame_parser_ready(parser))
+      {
+        submit_frame(context);
+      }
+    }
+
+    context->uring_buffers[bid] = NULL;
+    context->uring_pending_first = (context->uring_pending_first + 1) % CONNECTION_URING_BUFFERS;
+    --context->uring_pending_count;
+  }
+  return 0;
+}
+
+/*
+ * Продолжить прием после освобождения буферов to_process_queue
+ */
+static int uring_resume_reading(connection_context_t * context)
+{
+  if (context->framed && uring_receive_frames(context) != 0)
+    return -1;
+  return uring_provide(context);
+}
+
+/*
+ * Результат многократного recv
+ */
+static void uring_on_recv(connection_context_t * context, int res, unsigned flags)
+{
+  message_buffer_t * buffer = NULL;
+  unsigned short bid = 0;
+
+  if (flags & IORING_CQE_F_BUFFER)
+  {
+    bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    buffer = context->uring_buffers[bid];
+    --context->uring_provided;
+  }
+  if (!(flags & IORING_CQE_F_MORE))
+  {
+    // запрос завершен: повторный запрос - в uring_provide
+    context->uring_recv = 0;
+    --context->uring_inflight;
+  }
+
+  if (context->uring_closing)
+  {
+    release_context(context);
+    return;
+  }
+
+  if (res == 0)
+  {
+    DEBUG("Соединение %d закрыто клиентом\n", context->sock_id);
+    release_context(context);
+    return;
+  }
+  if (res < 0 && res != -ENOBUFS)
+  {
+    fflush(stdout);
+    fprintf(stderr, "Ошибка чтения из сокета: %s (%d)\n", strerror(-res), -res);
+    release_context(context);
+    return;
+  }
+
+  if (res > 0 && buffer != NULL)
+  {
+    METRICS_ADD(bytes_received, res);
+    buffer->size = buffer->offset = res;
+    if (context->framed)
+    {
+      int index = (context->uring_pending_first + context->uring_pending_count) % CONNECTION_URING_BUFFERS;
+      context->uring_pending[index] = bid;
+      ++context->uring_pending_count;
+    }
+    else
+    {
+      // сообщение - все данные, доступные в сокете (как при чтении до EAGAIN):
+      // пока в сокете остаются данные, следующие порции добавляются к первой
+      if (context->uring_message == NULL)
+      {
+        context->uring_buffers[bid] = NULL;
+        context->uring_message = buffer;
+      }
+      else
+      {
+        if (message_buffer_append(context->uring_message, buffer->buffer, res) != 0)
+        {
+          fflush(stdout);
+          fprintf(stderr, "Ошибка выделения памяти для сообщения: %s (%d)\n", strerror(errno), errno);
+          release_context(context);
+          return;
+        }
+        uring_provide_buffer(context, bid);
+      }
+
+      if (!(flags & IORING_CQE_F_SOCK_NONEMPTY))
+      {
+        DEBUG("[%d] RECEIVED: %zu bytes\n", context->sock_id, context->uring_message->size);
+        buffer = context->uring_message;
+        context->uring_message = NULL;
+        submit_message(context, buffer);
+        if (context->uring_closing)
+          return;
+      }
+    }
+  }
+
+  if (uring_resume_reading(context) != 0)
+  {
+    release_context(context);
+  }
+}
+
+/*
+ * Передать ядру запись накопленных результатов
+ */
+static int uring_send(connection_context_t * context)
+{
+  struct io_uring_sqe * sqe;
+  int flags;
+
+  if (context->uring_sending || context->uring_closing)
+    return 0;
+
+  if (send_batch_fill(context) > 0)
+  {
+    resume_processing(context);
+  }
+  if (context->send_count == 0)
+    return 0;
+
+  sqe = uring_sqe(context->uring);
+  if (sqe == NULL)
+    return -1;
+  flags = send_batch_prepare(context, &(context->uring_msg), context->uring_iov);
+  uring_prep_sendmsg(sqe, context->sock_id, &(context->uring_msg), flags);
+  sqe->user_data = (unsigned long)(context) | URING_SEND;
+  context->uring_sending = 1;
+  ++context->uring_inflight;
+  return 0;
+}
+
+/*
+ * Результат записи
+ */
+static void uring_on_send(connection_context_t * context, int res)
+{
+  int done;
+
+  context->uring_sending = 0;
+  --context->uring_inflight;
+
+  if (context->uring_closing)
+  {
+    release_context(context);
+    return;
+  }
+
+  if (res < 0 && res != -EAGAIN && res != -EINTR)
+  {
+    fflush(stdout);
+    fprintf(stderr, "Ошибка записи в сокет: %s (%d)\n", strerror(-res), -res);
+    release_context(context);
+    return;
+  }
+  DEBUG("sent %d bytes from %d buffers\n", res, context->send_count);
+
+  if (res > 0)
+  {
+    METRICS_ADD(bytes_sent, res);
+  }
+  done = res > 0 ? send_batch_commit(context, res) : 0;
+  if (done > 0)
+  {
+    // освободились буферы для результатов - возобновляем обработку
+    resume_processing(context);
+  }
+  if (done < context->send_prepared)
+  {
+    METRICS_ADD(partial_sends, 1);
+  }
+
+  // вместе с остатком отправляются результаты, накопившиеся за время записи
+  if (uring_send(context) != 0 || uring_resume_reading(context) != 0)
+  {
+    release_context(context);
+  }
+}
+
+/*
+ * Действия при готовности данных для записи в сокет
+ */
+static void uring_send_processed_data(struct ev_loop *loop, ev_async *watcher, int revents)
+{
+  connection_context_t *context = (connection_context_t *)(watcher->data);
+
+  DEBUG("%s\n", __FUNCTION__);
+
+  if (__atomic_load_n(&(context->process_error), __ATOMIC_ACQUIRE))
+  {
+    release_context(context);
+    return;
+  }
+
+  // поток обработки освобождает буферы сообщений перед передачей результата
+  if (uring_send(context) != 0 || uring_resume_reading(context) != 0)
+  {
+    release_context(context);
+  }
+}
+
+/*
+ * Подключение соединения: кольцо буферов регистрируется группой соединения
+ */
+static int uring_open_context(server_context_t * server, connection_context_t * context)
+{
+  context->uring = server->uring;
+  ev_async_init(&(context->from_process_watcher), &uring_send_processed_data);
+
+  if (context->uring_ring == NULL)
+  {
+    if (server->uring_groups == (unsigned short)(-1))
+    {
+      errno = ENOSPC;
+      return -1;
+    }
+    context->uring_ring = uring_buf_ring_create(CONNECTION_URING_BUFFERS);
+    if (context->uring_ring == NULL)
+      return -1;
+    context->uring_group = ++server->uring_groups;
+  }
+
+  for (int i = 0; context->framed && i < CONNECTION_URING_BUFFERS; ++i)
+  {
+    if (context->uring_chunks[i].buffer == NULL &&
+        message_buffer_init(context->uring_chunks + i, CONNECTION_URING_BUFFER_SIZE) != 0)
+      return -1;
+  }
+
+  return uring_buf_ring_register(context->uring, context->uring_ring, CONNECTION_URING_BUFFERS,
+                                 context->uring_group);
+}
+
+/*
+ * Запрос многократного приема соединений
+ */
+static int uring_accept(server_context_t * server)
+{
+  struct io_uring_sqe * sqe = uring_sqe(server->uring);
+
+  if (sqe == NULL)
+    return -1;
+  uring_prep_accept_multishot(sqe, server->listen_fd);
+  sqe->user_data = (unsigned long)(server) | URING_ACCEPT;
+  return 0;
+}
+
+static void open_context(server_context_t * server, connection_context_t * context, int sock_id);
+
+/*
+ * Результат приема соединения
+ */
+static void uring_on_accept(server_context_t * server, int res, unsigned flags)
+{
+  connection_context_t *context;
+
+  if (res >= 0)
+  {
+    DEBUG("Принято новое подключение %d\n", res);
+    context = connection_pool_acquire(&(server->pool));
+    if (context == NULL)
+    {
+      fflush(stdout);
+      fprintf(stderr, "Ошибка выделения памяти для соединения: %s (%d)\n", strerror(errno), errno);
+      close(res);
+    }
+    else
+    {
+      open_context(server, context, res);
+    }
+  }
+  else if (res != -EINTR && res != -ECONNABORTED)
+  {
+    fflush(stdout);
+    fprintf(stderr, "Ошибка приема соединения: %s (%d)\n", strerror(-res), -res);
+  }
+
+  if (!(flags & IORING_CQE_F_MORE) && uring_accept(server) != 0)
+  {
+    error(EXIT_FAILURE, errno, "Ошибка запроса приема соединений");
+  }
+}
+
+/*
+ * Обработка результатов запросов io_uring
+ */
+static void uring_process_completions(struct ev_loop *loop, ev_io *watcher, int revents)
+{
+  server_context_t * server = (server_context_t *)(watcher->data);
+  struct io_uring_cqe * cqe;
+  unsigned long user_data;
+  int res;
+  unsigned flags;
+
+  while ((cqe = uring_peek_cqe(server->uring)) != NULL)
+  {
+    user_data = cqe->user_data;
+    res       = cqe->res;
+    flags     = cqe->flags;
+    uring_cqe_seen(server->uring);
+
+    switch (user_data & URING_REQUEST_MASK)
+    {
+      case URING_ACCEPT:
+        uring_on_accept(server, res, flags);
+        break;
+
+      case URING_RECV:
+        uring_on_recv((connection_context_t *)(user_data & ~URING_REQUEST_MASK), res, flags);
+        break;
+
+      case URING_SEND:
+        uring_on_send((connection_context_t *)(user_data & ~URING_REQUEST_MASK), res);
+        break;
+
+      case URING_CANCEL:
+        {
+          connection_context_t * context = (connection_context_t *)(user_data & ~URING_REQUEST_MASK);
+          --context->uring_inflight;
+          release_context(context);
+        }
+        break;
+    }
+  }
+}
+
+/*
+ * Передача накопленных запросов ядру перед ожиданием событий
+ */
+static void uring_submit_requests(struct ev_loop *loop, ev_prepare *watcher, int revents)
+{
+  server_context_t * server = (server_context_t *)(watcher->data);
+
+  // EBUSY - кольцо результатов переполнено: запросы будут переданы после их обработки
+  if (uring_submit(server->uring) < 0 && errno != EBUSY && errno != EAGAIN)
+  {
+    fflush(stdout);
+    fprintf(stderr, "Ошибка передачи запросов io_uring: %s (%d)\n", strerror(errno), errno);
+  }
+}
+#endif // HAVE_IO_URING
+
+/*
+ * Подключение нового соединения к потоку работы с сокетами
+ */
+static void open_context(server_context_t * server, connection_context_t * context, int sock_id)
+{
+  context->sock_id         = sock_id;
+  context->loop            = server->loop;
+  context->main_loop       = server->main_loop;
+  context->control_watcher = &(server->control_watcher);
+  context->workers         = server->workers;
+  context->epoll_fd        = server->epoll_fd;
+  METRICS_ADD(connections_accepted, 1);
+
+  ev_io_init(&(context->io_watcher), on_socket_ready_to_read, sock_id, EV_READ);
+  ev_async_init(&(context->to_process_watcher),   &process_data);
+  ev_async_init(&(context->from_process_watcher), &send_processed_data);
+  context->io_watcher.data           = context;
+  context->to_process_watcher.data   = context;
+  context->from_process_watcher.data = context;
+
+#ifdef HAVE_IO_URING
+  if (server->uring != NULL)
+  {
+    if (uring_open_context(server, context) != 0)
+    {
+      fflush(stdout);
+      fprintf(stderr, "Ошибка подключения соединения к io_uring: %s (%d)\n", strerror(errno), errno);
+      close(sock_id);
+      connection_pool_release(&(server->pool), context);
+      return;
+    }
+  }
+  else
+#endif
+  if (server->epoll_fd >= 0)
+  {
+    // данные, поступившие до регистрации, дают событие сразу
+    struct epoll_event event = {0};
+
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = context;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, sock_id, &event) != 0)
+    {
+      fflush(stdout);
+      fprintf(stderr, "Ошибка регистрации сокета в epoll: %s (%d)\n", strerror(errno), errno);
+      close(sock_id);
+      connection_pool_release(&(server->pool), context);
+      return;
+    }
+  }
+  else
+  {
+    ev_io_start(server->loop, &(context->io_watcher));
+  }
+  ev_async_start(server->loop, &(context->from_process_watcher));
+
+  // обработчик to_process_watcher запускается в потоке обработки
+  if (connection_pool_push_control(&(server->pool), context))
+  {
+    ev_async_send(server->main_loop, &(server->control_watcher));
+  }
+
+#ifdef HAVE_IO_URING
+  if (server->uring != NULL && uring_provide(context) != 0)
+  {
+    release_context(context);
+  }
+#endif
+}
+
+/*
+ * Действия при появлении новых подключений
+ * За один вызов принимается до ACCEPT_BATCH_SIZE соединений
+ */
+static void accept_connection(struct ev_loop *loop, ev_io *watcher, int revents)
+{
+  server_context_t *server = (server_context_t*)(watcher->data);
+  connection_context_t *context = NULL;
+  struct sockaddr_in sa;
+  socklen_t sa_len;
+  int sock_id;
+
+  for (int i = 0; i < ACCEPT_BATCH_SIZE; ++i)
   {
-    context->to_process_watcher.data = context;
-    ev_async_send(context->main_loop, &(context->to_process_watcher));
+    sa_len = sizeof(sa);
+    sock_id = accept4(watcher->fd, (struct sockaddr *)&sa, &sa_len, SOCK_NONBLOCK);
+    if (sock_id < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        fflush(stdout);
+        fprintf(stderr, "Ошибка приема соединения: %s (%d)\n", strerror(errno), errno);
+      }
+      break;
+    }
+
+    DEBUG("Принято новое подключение %s:%d\n", inet_ntoa(sa.sin_addr), ntohs(sa.sin_port));
+
+    context = connection_pool_acquire(&(server->pool));
+    if (context == NULL)
+    {
+      fflush(stdout);
+      fprintf(stderr, "Ошибка выделения памяти для соединения: %s (%d)\n", strerror(errno), errno);
+      close(sock_id);
+      continue;
+    }
+
+    open_context(server, context, sock_id);
+  }
+}
+
+/*
+ * Поток работы с сокетом
+ * (в режиме шардов - также и обработка данных)
+ * Чтение данных из сокета
+ * Отправка данных на обработку
+ * Получение данных после обработки
+ * Запись данных в сокет
+ */
+static void * socket_routine(void * params)
+{
+  server_context_t  * server;
+  struct sockaddr_in sock = {0};
+  int sock_id;
+
+  DEBUG("%s\n", __FUNCTION__);
+  server = (server_context_t*)(params);
+  metrics_set_role(server->loop == server->main_loop ? "shard" : "socket");
+  // память, выделяемая потоком (соединения, очереди результатов), - на его узле NUMA
+  affinity_bind(server->loop == server->main_loop ? AFFINITY_SHARD : AFFINITY_SOCKET, server->shard);
+
+  socket_init(&sock, server->port_number);
+  sock_id = socket_create(&sock, server->reuse_port);
+  if (sock_id < 0)
+  {
+    error(EXIT_FAILURE, 0, "Ошибка создания сокета");
+  }
+
+  fcntl(sock_id, F_SETFL, O_NONBLOCK);
+
+#ifdef HAVE_IO_URING
+  if (server->uring != NULL)
+  {
+    server->listen_fd = sock_id;
+    ev_io_init(&(server->uring_watcher), uring_process_completions, server->uring->fd, EV_READ);
+    server->uring_watcher.data = server;
+    ev_io_start(server->loop, &(server->uring_watcher));
+    ev_prepare_init(&(server->submit_watcher), uring_submit_requests);
+    server->submit_watcher.data = server;
+    ev_prepare_start(server->loop, &(server->submit_watcher));
   }
   else
+#endif
+  {
+    if (server->epoll_fd >= 0)
+    {
+      ev_io_init(&(server->epoll_watcher), epoll_process_events, server->epoll_fd, EV_READ);
+      server->epoll_watcher.data = server;
+      ev_io_start(server->loop, &(server->epoll_watcher));
+    }
+    ev_io_init(&(server->accept_watcher), accept_connection, sock_id, EV_READ);
+    server->accept_watcher.data = server;
+    ev_io_start(server->loop, &(server->accept_watcher));
+  }
+
+  if (listen(sock_id, server->backlog) < 0)
+  {
+    int err = errno;
+    ev_loop_destroy(server->loop);
+    error(EXIT_FAILURE, err, "Ошибка прослушивания сокета");
+  }
+
+#ifdef HAVE_IO_URING
+  if (server->uring != NULL && uring_accept(server) != 0)
   {
-    DEBUG("Нет данных для передачи на обработку\n");
+    error(EXIT_FAILURE, errno, "Ошибка запроса приема соединений");
   }
+#endif
+
+  DEBUG("Прослушивание по порту %d запущено\n", server->port_number);
+
+  ev_loop(server->loop, 0);
 
   DEBUG("%s done\n", __FUNCTION__);
+
+  return NULL;
 }
 
 /*
- * Действия при готовности данных для записи в сокет
+ * Подключение и отключение соединений в основном потоке
  */
-static void send_processed_data(struct ev_loop *loop, ev_async *watcher, int revents)
+static void process_control(struct ev_loop * loop, ev_async *watcher, int revents)
 {
-  int rc;
-  thread_context_t *context = (thread_context_t *)(watcher->data);
-  int sock_id = context->sock_id;
-  message_buffer_t *buffer = NULL;
+  server_context_t * server = (server_context_t*)(watcher->data);
+  connection_context_t * context;
+  connection_state_t state;
 
   DEBUG("%s\n", __FUNCTION__);
 
-  if (revents & EV_ERROR)
+  while ((context = connection_pool_pop_control(&(server->pool), &state)) != NULL)
   {
-    fprintf(stderr, "Внутренняя ошибка libev при вызове обработчика записи данных в сокет %d\n", sock_id);
-    release_context(context);
-    return;
+    if (state == CONNECTION_CLOSING)
+    {
+      if (__atomic_load_n(&(context->tasks), __ATOMIC_ACQUIRE) != 0)
+      {
+        DEBUG("Соединение будет освобождено после завершения задач пула потоков\n");
+        continue;
+      }
+
+      // поток работы с сокетами больше не использует соединение
+      ev_async_stop(loop, &(context->to_process_watcher));
+      connection_pool_release(&(server->pool), context);
+    }
+    else if (state == CONNECTION_OPEN && context->workers == NULL &&
+             !ev_is_active(&(context->to_process_watcher)))
+    {
+      ev_async_start(loop, &(context->to_process_watcher));
+      // данные могли поступить до запуска обработчика
+      ev_async_send(loop, &(context->to_process_watcher));
+    }
   }
 
-  buffer = message_queue_get_ready_buffer(context->from_process_queue);
-  if (buffer == NULL)
+  DEBUG("%s done\n", __FUNCTION__);
+}
+
+/*
+ * Передать результат на запись в порядке поступления сообщений
+ */
+static void emit_result(connection_context_t * context, unsigned long sequence, message_buffer_t * write_buffer)
+{
+  size_t window = context->pool->reorder_window;
+  message_buffer_t * buffer;
+  int wakeup = 0;
+
+  pthread_mutex_lock(&(context->order_lock));
+  context->reorder[sequence % window] = write_buffer;
+  while ((buffer = context->reorder[context->emit_sequence % window]) != NULL)
   {
-    DEBUG("Нет готовых данных для записи в сокет\n");
-    return;
+    context->reorder[context->emit_sequence % window] = NULL;
+    trace_mark(buffer, TRACE_ENQUEUE_SEND);
+    wakeup |= message_queue_add_ready_buffer(context->from_process_queue, buffer);
+    ++context->emit_sequence;
   }
+  pthread_mutex_unlock(&(context->order_lock));
 
-  if (buffer->size == 0)
+  // поток работы с сокетами уведомляется, только если он разобрал очередь
+  if (wakeup)
   {
-    DEBUG("Пустой буфер для записи в сокет\n");
-    message_queue_release_buffer(context->from_process_queue, buffer);
-    ev_async_start(context->main_loop, &(context->to_process_watcher));
-    return;
+    ev_async_send(context->loop, &(context->from_process_watcher));
   }
+}
 
-  rc = send_data(sock_id, buffer);
-
-  if (rc < 0)
+/*
+ * Завершение задачи пула потоков
+ * Последняя задача закрытого соединения передает его на освобождение
+ */
+static void finish_task(connection_context_t * context)
+{
+  if (__atomic_sub_fetch(&(context->tasks), 1, __ATOMIC_ACQ_REL) == 0 &&
+      __atomic_load_n(&(context->state), __ATOMIC_ACQUIRE) == CONNECTION_CLOSING)
   {
-    release_context(context);
-    return;
+    if (connection_pool_push_control(context->pool, context))
+    {
+      ev_async_send(context->main_loop, context->control_watcher);
+    }
   }
+}
 
-  if (buffer->size > 0)
+/*
+ * Обработка сообщения цепочкой этапов на месте (по умолчанию - обращение
+ * порядка байт), заголовок кадра передается без изменений
+ * sequence - номер сообщения для emit_result, если обработка продолжается
+ * в потоках этапов
+ * Возвращает 0 - сообщение обработано, 1 - передано потокам этапов
+ * (результат передается на запись в stage_done), -1 - ошибка
+ */
+static int process_message(connection_context_t * context, message_buffer_t * buffer, unsigned long sequence)
+{
+  int rc;
+
+  DEBUG("PROCESSOR RECEIVED: %zu bytes\n", buffer->size);
+  trace_mark(buffer, TRACE_PROCESS_START);
+
+  // соединение не освобождается, пока сообщение в потоках этапов
+  if (stage_chain_threaded(stages))
   {
-    // не все данные были отправлены
-    DEBUG("не все данные были отправлены\n");
-    // ждем освобождения сокета
-    ev_async_stop(loop, watcher);                      // не принимаем обработанные данные 
-    ev_io_stop(context->loop, &(context->io_watcher)); // не принимаем данные из сокета
-    context->current_send_buffer = buffer;
-    ev_io_init(&(context->io_watcher), on_socket_ready_to_write, sock_id, EV_WRITE);
-    ev_io_start(loop, &(context->io_watcher));         // ждем освобождения сокета для записи
+    __atomic_add_fetch(&(context->tasks), 1, __ATOMIC_ACQ_REL);
   }
-  else
+  rc = stage_chain_process(stages, context, buffer, context->framed ? FRAME_HEADER_SIZE : 0, sequence);
+  if (rc == 1)
+    return 1;
+  if (stage_chain_threaded(stages))
   {
-    DEBUG("В буфере нет данных\n");
-    message_queue_release_buffer(context->from_process_queue, buffer);
-    if (!ev_is_active(&(context->to_process_watcher)))
-    {
-      ev_async_start(context->main_loop, &(context->to_process_watcher));
-    }
+    finish_task(context);
   }
+  if (rc != 0)
+    return -1;
 
-  DEBUG("%s done\n", __FUNCTION__);
+  buffer->offset = buffer->size;
+  trace_mark(buffer, TRACE_PROCESS_END);
+  METRICS_ADD(messages_processed, 1);
+  DEBUG("PROCESSOR RESULT: %zu bytes\n", buffer->size);
+  return 0;
 }
 
 /*
- * Действия при появлении нового подключения
+ * Завершение обработки сообщения в потоке этапа
  */
-static void accept_connection(struct ev_loop *loop, ev_io *watcher, int revents)
+static void stage_done(void * owner, message_buffer_t * buffer, unsigned long sequence, int status)
 {
-  thread_context_t *context = NULL;
-  struct sockaddr_in sa;
-  socklen_t sa_len = sizeof(sa);
-  int sock_id;
+  connection_context_t * context = (connection_context_t*)(owner);
 
-  sock_id = accept(watcher->fd, (struct sockaddr *)&sa, &sa_len);
-  if (sock_id <= 0)
+  if (status != 0)
   {
-    fflush(stdout);
-    fprintf(stderr, "Ошибка приема соединения: %s (%d)\n", strerror(errno), errno);
-    exit(1);
+    message_queue_release_buffer(context->from_process_queue, buffer);
+    fail_context(context);
+    finish_task(context);
     return;
   }
 
-  fcntl(sock_id, F_SETFL, O_NONBLOCK);
-
-  DEBUG("Принято новое подключение %s:%d\n", inet_ntoa(sa.sin_addr), ntohs(sa.sin_port));
-
-  context = (thread_context_t*)(watcher->data);
-  context->sock_id = sock_id;
-  context->io_watcher.data = context;
-  ev_io_init(&(context->io_watcher), on_socket_ready_to_read, sock_id, EV_READ);
-  ev_io_start(loop, &(context->io_watcher));
+  buffer->offset = buffer->size;
+  trace_mark(buffer, TRACE_PROCESS_END);
+  METRICS_ADD(messages_processed, 1);
+  emit_result(context, sequence, buffer);
+  finish_task(context);
 }
 
 /*
- * Поток работы с сокетом
- * Чтение данных из сокета
- * Отправка данных на обработку
- * Получение данных после обработки
- * Запись данных в сокет
+ * Обработка одного сообщения в пуле потоков
+ * Номер сообщения определяется порядком извлечения из to_process_queue
  */
-static void * socket_routine(void * params)
+static void process_task(void * arg)
 {
-  thread_context_t  * context;
-  struct sockaddr_in sock = {0};
-  int sock_id;
-  ev_io sock_watcher;
+  connection_context_t * context = (connection_context_t*)(arg);
+  message_buffer_t * read_buffer = NULL;
+  message_buffer_t * write_buffer = NULL;
+  unsigned long sequence;
+  int rc;
 
   DEBUG("%s\n", __FUNCTION__);
-  context = (thread_context_t*)(params);
 
-  socket_init(&sock, context->port_number);
-  sock_id = socket_create(&sock);
-  if (sock_id < 0)
+  if (__atomic_load_n(&(context->state), __ATOMIC_ACQUIRE) != CONNECTION_OPEN ||
+      __atomic_load_n(&(context->process_error), __ATOMIC_ACQUIRE))
   {
-    error(EXIT_FAILURE, 0, "Ошибка создания сокета");
+    finish_task(context);
+    return;
   }
 
-  ev_io_init(&sock_watcher, accept_connection, sock_id, EV_READ);
-  sock_watcher.data = context;
-  ev_io_start(context->loop, &sock_watcher);
-
-  if (listen(sock_id, 1) < 0)
+  pthread_mutex_lock(&(context->order_lock));
+  read_buffer = message_queue_get_ready_buffer(context->to_process_queue);
+  if (read_buffer == NULL)
   {
-    int err = errno;
-    ev_loop_destroy(context->loop);
-    error(EXIT_FAILURE, err, "Ошибка прослушивания сокета");
+    DEBUG("Нет готового буфера\n");
+    pthread_mutex_unlock(&(context->order_lock));
+    finish_task(context);
+    return;
   }
 
-  DEBUG("Прослушивание по порту %d запущено\n", context->port_number);
+  // сообщение обрабатывается на месте и передается на запись в том же буфере
+  write_buffer = message_queue_move_buffer(context->to_process_queue, read_buffer, context->from_process_queue);
+  if (write_buffer == NULL)
+  {
+    DEBUG("Нет свободного буфера для записи результа, задача отложена\n");
+    message_queue_put_back_buffer(context->to_process_queue, read_buffer);
+    ++context->stalled_tasks;
+    METRICS_ADD(from_process_exhausted, 1);
+    pthread_mutex_unlock(&(context->order_lock));
+    finish_task(context);
+    return;
+  }
+  sequence = context->process_sequence++;
+  pthread_mutex_unlock(&(context->order_lock));
 
-  ev_loop(context->loop, 0);
+  rc = process_message(context, write_buffer, sequence);
+  if (rc < 0)
+  {
+    message_queue_release_buffer(context->from_process_queue, write_buffer);
+    fail_context(context);
+  }
+  else if (rc == 0)
+  {
+    emit_result(context, sequence, write_buffer);
+  }
+  finish_task(context);
 
   DEBUG("%s done\n", __FUNCTION__);
-
-  return NULL;
 }
 
 /*
@@ -490,95 +2093,251 @@ static void * socket_routine(void * params)
  */
 static void process_data(struct ev_loop * loop, ev_async *watcher, int revents)
 {
-  thread_context_t * context;
+  connection_context_t * context;
   message_buffer_t * read_buffer = NULL;
   message_buffer_t * write_buffer = NULL;
+  unsigned long sequence;
+  int rc;
 
-  context = (thread_context_t*)(watcher->data);
+  context = (connection_context_t*)(watcher->data);
 
   DEBUG("%s\n", __FUNCTION__);
 
-  write_buffer = message_queue_get_free_buffer(context->from_process_queue);
-  if (write_buffer == NULL)
+  // за одно уведомление могло поступить несколько сообщений (режим кадров)
+  while ((read_buffer = message_queue_get_ready_buffer(context->to_process_queue)) != NULL)
   {
-    DEBUG("Нет свободного буфера для записи результа\n");
-    DEBUG("Приостанавливаем обработку данных\n");
+    // сообщение обрабатывается на месте и передается на запись в том же буфере
+    write_buffer = message_queue_move_buffer(context->to_process_queue, read_buffer, context->from_process_queue);
+    if (write_buffer == NULL)
+    {
+      DEBUG("Нет свободного буфера для записи результа\n");
+      DEBUG("Обработка продолжится после отправки данных\n");
+      message_queue_put_back_buffer(context->to_process_queue, read_buffer);
+      METRICS_ADD(from_process_exhausted, 1);
+      return;
+    }
 
-    ev_async_stop(context->main_loop, &(context->to_process_watcher));
-    return;
+    // с потоками этапов порядок результатов восстанавливает emit_result
+    sequence = stage_chain_threaded(stages) ? context->process_sequence++ : 0;
+    rc = process_message(context, write_buffer, sequence);
+    if (rc == 1)
+      continue;
+    if (rc < 0)
+    {
+      message_queue_release_buffer(context->from_process_queue, write_buffer);
+      fail_context(context);
+      return;
+    }
+
+    // поток работы с сокетами уведомляется, только если он разобрал очередь
+    trace_mark(write_buffer, TRACE_ENQUEUE_SEND);
+    if (message_queue_add_ready_buffer(context->from_process_queue, write_buffer))
+    {
+      DEBUG("send from process watcher context=%p\n", context);
+      ev_async_send(context->loop, &(context->from_process_watcher));
+    }
   }
 
-  read_buffer = message_queue_get_ready_buffer(context->to_process_queue);
-  if (read_buffer != NULL)
+  DEBUG("%s done\n", __FUNCTION__);
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * Создание кольца io_uring и проверка поддержки ядром
+ * колец буферов и многократного приема (Linux 6.0+)
+ */
+static int server_init_uring(server_context_t * server)
+{
+  struct io_uring_buf_ring * buffers;
+  int rc;
+
+  server->uring = NULL;
+  server->uring_groups = 0;
+  if (uring_init(&(server->ring), URING_ENTRIES, URING_CQ_FACTOR) != 0)
+    return -1;
+
+  // группа 0 не выдается соединениям
+  buffers = uring_buf_ring_create(CONNECTION_URING_BUFFERS);
+  rc = buffers != NULL ? uring_buf_ring_register(&(server->ring), buffers, CONNECTION_URING_BUFFERS, 0) : -1;
+  if (rc != 0)
   {
-    DEBUG("PROCESSOR RECEIVED: %.*s\n", read_buffer->size, read_buffer->buffer);
-    if (message_buffer_resize(write_buffer, read_buffer->size) != 0)
-    {
-      fflush(stdout);
-      fprintf(stderr, "Ошибка выденения памяти для размещения данных после обработки: %s (%d)\n", strerror(errno), errno);
-      release_context(context);
+    int error = errno;
+    if (buffers != NULL)
+      uring_buf_ring_free(buffers, CONNECTION_URING_BUFFERS);
+    uring_destroy(&(server->ring));
+    errno = error;
+    return -1;
+  }
+  uring_buf_ring_unregister(&(server->ring), 0);
+  uring_buf_ring_free(buffers, CONNECTION_URING_BUFFERS);
+
+  server->uring = &(server->ring);
+  return 0;
+}
+#endif
+
+/*
+ * Инициализация данных потока работы с сокетами
+ * main_loop - цикл событий, в котором выполняется обработка данных
+ */
+static void server_init(server_context_t * server, const ServerParams * params,
+                        struct ev_loop * loop, struct ev_loop * main_loop)
+{
+  server->port_number = params->port_;
+  server->backlog     = params->backlog_;
+  server->reuse_port  = params->shards_ > 0;
+  server->shard       = 0;
+  server->loop        = loop;
+  server->main_loop   = main_loop;
+  server->workers     = NULL;
+  server->epoll_fd    = -1;
+#ifdef HAVE_IO_URING
+  server->uring       = NULL;
+#endif
+
+  if (connection_pool_init(&(server->pool), TO_PROCESS_QUEUE_SIZE, FROM_PROCESS_QUEUE_SIZE, params->queue_budget_,
+                           params->queue_backend_, params->framed_) != 0)
+  {
+    err(EXIT_FAILURE, "Ошибка создания пула соединений");
+  }
+
+  ev_async_init (&(server->control_watcher), &process_control);
+  server->control_watcher.data = server;
+  ev_async_start(main_loop, &(server->control_watcher));
+
+  if (params->reactor_ == SERVER_REACTOR_URING)
+  {
+#ifdef HAVE_IO_URING
+    if (server_init_uring(server) == 0)
       return;
+    fprintf(stderr, "io_uring недоступен: %s (%d), используется libev\n", strerror(errno), errno);
+#else
+    fprintf(stderr, "Сервер собран без поддержки io_uring, используется libev\n");
+#endif
+  }
+  else if (params->reactor_ == SERVER_REACTOR_EPOLL)
+  {
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epoll_fd < 0)
+    {
+      fprintf(stderr, "epoll недоступен: %s (%d), используется libev\n", strerror(errno), errno);
     }
+  }
+}
+
+/*
+ * Вывод гистограмм трассировки по сигналу SIGUSR1 (в цикле loop)
+ */
+static ev_signal trace_watcher;
 
-    for (int i = 0; i < read_buffer->size/2+1; ++i)
+static void dump_trace(struct ev_loop * loop, ev_signal * watcher, int revents)
+{
+  trace_dump(stderr);
+}
+
+static void start_trace_dump(struct ev_loop * loop)
+{
+  ev_signal_init(&trace_watcher, dump_trace, SIGUSR1);
+  ev_signal_start(loop, &trace_watcher);
+}
+
+/*
+ * Режим шардов: каждый поток принимает соединения на своем сокете
+ * и сам обрабатывает данные, общих блокировок между потоками нет
+ */
+static void run_shards(const ServerParams * params)
+{
+  server_context_t * shards;
+  pthread_t        * threads;
+  pthread_attr_t     attr;
+  int                thread_status;
+
+  shards  = calloc(params->shards_, sizeof(server_context_t));
+  threads = calloc(params->shards_, sizeof(pthread_t));
+  if (shards == NULL || threads == NULL)
+  {
+    err(EXIT_FAILURE, "Ошибка выделения памяти для шардов");
+  }
+
+  pthread_attr_init(&attr);
+  for (int i = 0; i < params->shards_; ++i)
+  {
+    struct ev_loop * loop = ev_loop_new(EVFLAG_AUTO);
+    if (loop == NULL)
     {
-      write_buffer->buffer[i] = read_buffer->buffer[read_buffer->size-1 - i];
-      write_buffer->buffer[read_buffer->size-1 - i] = read_buffer->buffer[i];
+      err(EXIT_FAILURE, "Ошибка создания цикла событий для шарда %d", i);
+    }
+
+    server_init(shards + i, params, loop, loop);
+    shards[i].shard = i;
+    if (i == 0)
+    {
+      start_trace_dump(loop);
+    }
+
+    thread_status = pthread_create(threads + i, &attr, socket_routine, (void *)(shards + i));
+    if (thread_status != 0)
+    {
+      error(EXIT_FAILURE, thread_status, "Ошибка создания потока шарда %d", i);
     }
-    write_buffer->size = read_buffer->size;
-    write_buffer->offset = write_buffer->size;
-    DEBUG("PROCESSOR RESULT: %.*s\n", write_buffer->size, write_buffer->buffer);
-    message_queue_add_ready_buffer(context->from_process_queue, write_buffer);
-    message_queue_release_buffer(context->to_process_queue, read_buffer);
-    DEBUG("send from process watcher context=%p\n", context);
-    context->from_process_watcher.data = context;
-    ev_async_send(context->loop, &(context->from_process_watcher));
-    DEBUG("send from process watcher done\n");
   }
-  else
+  pthread_attr_destroy(&attr);
+
+  for (int i = 0; i < params->shards_; ++i)
   {
-    DEBUG("Нет готового буфера\n");
-    message_queue_release_buffer(context->from_process_queue, write_buffer);
+    pthread_join(threads[i], NULL);
   }
-
-  DEBUG("%s done\n", __FUNCTION__);
 }
 
 int main (int argc, const char * argv[])
 {
   struct ev_loop   *main_loop = NULL;
-  int               port_number = -1;
+  struct ev_loop   *loop = NULL;
+  ServerParams      params;
   int               thread_status;
   pthread_t         thread_id;
-  thread_context_t  thread_context;
+  server_context_t  server;
   pthread_attr_t    attr;
-  ev_async          stop_watcher;
 
-  if (argc > 1)
+  if (ProcessCmdLine(&params, argc, argv) != 0)
   {
-    for (int i = 0; argv[1][i] != 0; ++i)
-    {
-      if (!isdigit(argv[1][i]))
-      {
-        error(EXIT_FAILURE, 0, "Недопустимый символ в номера порта: '%s'", argv[1]);
-      }
-    }
-    port_number = atoi(argv[1]);
-    if (port_number <= 0)
+    return 1;
+  }
+
+  reverse_init();
+  DEBUG("reverse kernel: %s\n", reverse_kernel_name());
+  trace_init(params.trace_);
+  metrics_set_role("main");
+  message_queue_set_global_budget(params.memory_budget_);
+  frame_set_max_size(params.max_frame_);
+  for (int i = 0; i < params.affinity_count_; ++i)
+  {
+    if (affinity_set(params.affinity_[i]) != 0)
     {
-      error(EXIT_FAILURE, 0, "Указан недопустимый номер порта: '%s'", argv[1]);
+      error(EXIT_FAILURE, 0, "Некорректная привязка потоков к процессорам: '%s'", params.affinity_[i]);
     }
   }
-  if (port_number <= 0)
+  inline_threshold = params.inline_size_;
+
+  stages = stage_chain_create(params.stages_, stage_done);
+  if (stages == NULL)
+  {
+    err(EXIT_FAILURE, "Ошибка создания цепочки этапов обработки '%s'", params.stages_);
+  }
+
+  if (params.metrics_port_ > 0 && metrics_server_start(params.metrics_port_) != 0)
   {
-    error(EXIT_FAILURE, 0, "Не указан номер порта");
+    err(EXIT_FAILURE, "Ошибка запуска сервера метрик на порту %d", params.metrics_port_);
   }
 
-  thread_context.port_number = port_number;
-  thread_context.loop = ev_loop_new(EVFLAG_AUTO);
-  thread_context.stop_watcher = &stop_watcher;
+  if (params.shards_ > 0)
+  {
+    run_shards(&params);
+    exit(EXIT_SUCCESS);
+  }
 
-  if (thread_context.loop == NULL)
+  loop = ev_loop_new(EVFLAG_AUTO);
+  if (loop == NULL)
   {
     err(EXIT_FAILURE, "Ошибка создания цикла событий для потока чтения");
   }
@@ -588,38 +2347,34 @@ int main (int argc, const char * argv[])
   {
     err(EXIT_FAILURE, "Ошибка создания цикла событий");
   }
-  thread_context.main_loop = main_loop;
 
-  thread_context.to_process_queue = message_queue_create(TO_PROCESS_QUEUE_SIZE);
-  if (thread_context.to_process_queue == NULL)
-  {
-    err(EXIT_FAILURE, "Ошибка выделения памяти для передачи данных на обработку");
-  }
+  server_init(&server, &params, loop, main_loop);
+  start_trace_dump(main_loop);
 
-  thread_context.from_process_queue = message_queue_create(FROM_PROCESS_QUEUE_SIZE);
-  if (thread_context.from_process_queue == NULL)
+  if (params.workers_ > 0)
   {
-    err(EXIT_FAILURE, "Ошибка выделения памяти для передачи данных на после обработки на запт=ись в сокет");
+    server.workers = worker_pool_create(params.workers_);
+    if (server.workers == NULL)
+    {
+      err(EXIT_FAILURE, "Ошибка создания пула потоков обработки");
+    }
   }
 
+  // очереди на обработку размещаются на узле NUMA потока обработки
+  server.pool.process_node = affinity_node(server.workers != NULL ? AFFINITY_WORKER : AFFINITY_MAIN, 0);
+
   pthread_attr_init(&attr);
-  thread_status = pthread_create(&thread_id, &attr, socket_routine, (void *)(&thread_context));
+  thread_status = pthread_create(&thread_id, &attr, socket_routine, (void *)(&server));
   if (thread_status != 0)
   {
     error(EXIT_FAILURE, thread_status, "Ошибка создания потока");
   }
   pthread_attr_destroy(&attr);
 
-  ev_async_init (&(thread_context.to_process_watcher),   &process_data);
-  ev_async_init (&(thread_context.from_process_watcher), &send_processed_data);
-  ev_async_init (&stop_watcher, &stop_main_loop);
-
-  ev_async_start(main_loop, &stop_watcher);
-  ev_async_start(main_loop, &(thread_context.to_process_watcher));
-  ev_async_start(thread_context.loop, &(thread_context.from_process_watcher));
+  // привязка после создания потоков: иначе они унаследовали бы процессоры основного потока
+  affinity_bind(AFFINITY_MAIN, 0);
 
   ev_run(main_loop, 0);
 
   exit(EXIT_SUCCESS);
 }
-
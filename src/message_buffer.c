@@ -1,25 +1,124 @@
-
 #include "message_buffer.h"
+#include "buffer_pool.h"
+#include "metrics.h"
+
+#include <string.h>
 
 /*
  * Буфер сообщения
+ * Память буферов выделяется из пула (см. buffer_pool.h)
+ */
+
+/*
+ * Буфер не меньше MESSAGE_BUFFER_SHRINK_SIZE возвращается в пул, если
+ * для следующего сообщения достаточно в MESSAGE_BUFFER_SHRINK_RATIO раз меньшего
+ */
+static const size_t MESSAGE_BUFFER_SHRINK_SIZE  = 64 * 1024;
+static const size_t MESSAGE_BUFFER_SHRINK_RATIO = 4;
+
+/*
+ * число частей для size байт
+ */
+static size_t message_buffer_chunks_for(size_t size)
+{
+  return (size + MESSAGE_BUFFER_CHUNK_SIZE - 1) / MESSAGE_BUFFER_CHUNK_SIZE;
+}
+
+/*
+ * вернуть части сообщения в пул
+ */
+static void message_buffer_free_chunks(message_buffer_t * buffer, size_t from)
+{
+  for (size_t i = from; i < buffer->chunk_count; ++i)
+  {
+    buffer_pool_chunk_free(buffer->chunks[i]);
+    buffer->chunks[i] = NULL;
+  }
+  if (from == 0)
+  {
+    free(buffer->chunks);
+    buffer->chunks = NULL;
+    buffer->chunk_count = 0;
+    buffer->capacity = 0;
+  }
+}
+
+/*
+ * таблица не меньше count частей (память частей не выделяется)
+ */
+static int message_buffer_rope_table(message_buffer_t * buffer, size_t count)
+{
+  if (count > buffer->chunk_count)
+  {
+    // при дописывании таблица растет вдвое
+    size_t new_count = buffer->chunk_count * 2 > count ? buffer->chunk_count * 2 : count;
+    char ** chunks = realloc(buffer->chunks, new_count * sizeof(char *));
+    if (chunks == NULL)
+      return -1;
+    memset(chunks + buffer->chunk_count, 0, (new_count - buffer->chunk_count) * sizeof(char *));
+    buffer->chunks = chunks;
+    buffer->chunk_count = new_count;
+  }
+  buffer->capacity = buffer->chunk_count * MESSAGE_BUFFER_CHUNK_SIZE;
+  return 0;
+}
+
+/*
+ * память части index (выделяется при первом обращении)
+ */
+static char * message_buffer_chunk(message_buffer_t * buffer, size_t index)
+{
+  if (buffer->chunks[index] == NULL)
+  {
+    buffer->chunks[index] = buffer_pool_chunk_alloc();
+  }
+  return buffer->chunks[index];
+}
+
+/*
+ * запись данных в части сообщения после offset
  */
+static int message_buffer_rope_write(message_buffer_t * buffer, const char * data, size_t size)
+{
+  if (message_buffer_rope_table(buffer, message_buffer_chunks_for(buffer->offset + size)) != 0)
+    return -1;
+
+  while (size > 0)
+  {
+    size_t position = buffer->offset % MESSAGE_BUFFER_CHUNK_SIZE;
+    size_t part = MESSAGE_BUFFER_CHUNK_SIZE - position;
+    char * chunk = message_buffer_chunk(buffer, buffer->offset / MESSAGE_BUFFER_CHUNK_SIZE);
+
+    if (chunk == NULL)
+      return -1;
+    if (part > size)
+      part = size;
+    memcpy(chunk + position, data, part);
+    buffer->size   += part;
+    buffer->offset += part;
+    data += part;
+    size -= part;
+  }
+  return 0;
+}
 
 // инициализация буфера - выделение памяти
 int message_buffer_init(message_buffer_t * buffer, size_t capacity)
 {
   buffer->size = buffer->offset = 0;
-  buffer->capacity = capacity;
+  buffer->capacity = 0;
+  buffer->buffer = NULL;
+  buffer->chunks = NULL;
+  buffer->chunk_count = 0;
+  memset(buffer->trace, 0, sizeof(buffer->trace));
+  if (capacity > MESSAGE_BUFFER_ROPE_THRESHOLD)
+    return message_buffer_rope_table(buffer, message_buffer_chunks_for(capacity));
   if (capacity > 0)
   {
-    buffer->buffer = calloc(capacity, sizeof(char));
+    buffer->buffer = buffer_pool_alloc(capacity, &(buffer->capacity));
     if (buffer->buffer == NULL)
       return -1;
   }
-  else
-  {
-    buffer->buffer = NULL;
-  }
   return 0;
 }
 
@@ -27,7 +126,9 @@ int message_buffer_init(message_buffer_t * buffer, size_t capacity)
 void message_buffer_destroy(message_buffer_t * buffer)
 {
   if (buffer->buffer)
-    free(buffer->buffer);
+    buffer_pool_free(buffer->buffer, buffer->capacity);
+  if (buffer->chunks)
+    message_buffer_free_chunks(buffer, 0);
 
   buffer->buffer = NULL;
   buffer->size = buffer->offset = 0;
@@ -35,16 +136,50 @@ void message_buffer_destroy(message_buffer_t * buffer)
 }
 
 // изменение размера буфера
+// содержимое буфера не сохраняется
 int message_buffer_resize(message_buffer_t * buffer, size_t capacity)
 {
-  if (capacity > buffer->capacity)
+  if (capacity > MESSAGE_BUFFER_ROPE_THRESHOLD)
+  {
+    // большое сообщение - частями, память частей выделяется при записи
+    size_t count = message_buffer_chunks_for(capacity);
+
+    if (buffer->buffer != NULL)
+    {
+      buffer_pool_free(buffer->buffer, buffer->capacity);
+      buffer->buffer = NULL;
+      buffer->capacity = 0;
+    }
+    if (count < buffer->chunk_count)
+    {
+      message_buffer_free_chunks(buffer, count);
+    }
+    if (message_buffer_rope_table(buffer, count) != 0)
+      return -1;
+  }
+  else if (buffer->chunks != NULL)
+  {
+    message_buffer_free_chunks(buffer, 0);
+    if (capacity > 0)
+    {
+      buffer->buffer = buffer_pool_alloc(capacity, &(buffer->capacity));
+      if (buffer->buffer == NULL)
+        return -1;
+      METRICS_ADD(buffer_reallocs, 1);
+    }
+  }
+  else if (capacity > buffer->capacity ||
+           (buffer->capacity >= MESSAGE_BUFFER_SHRINK_SIZE && capacity > 0 &&
+            capacity * MESSAGE_BUFFER_SHRINK_RATIO <= buffer->capacity))
   {
-    char * ptr = NULL;
-    ptr = realloc(buffer->buffer, capacity * sizeof(char));
+    size_t block_size;
+    char * ptr = buffer_pool_alloc(capacity, &block_size);
     if (ptr == NULL)
       return -1;
+    METRICS_ADD(buffer_reallocs, 1);
+    buffer_pool_free(buffer->buffer, buffer->capacity);
     buffer->buffer = ptr;
-    buffer->capacity = capacity;
+    buffer->capacity = block_size;
   }
   else if (capacity == 0)
   {
@@ -53,3 +188,159 @@ int message_buffer_resize(message_buffer_t * buffer, size_t capacity)
   buffer->size = buffer->offset = 0;
   return 0;
 }
+
+// сброс данных после отправки
+// части сообщения возвращаются в пул, буфер обычного размера сохраняется
+void message_buffer_reset(message_buffer_t * buffer)
+{
+  if (buffer->chunks != NULL)
+  {
+    message_buffer_free_chunks(buffer, 0);
+  }
+  buffer->size = buffer->offset = 0;
+}
+
+// обмен памятью и данными двух буферов
+void message_buffer_swap(message_buffer_t * a, message_buffer_t * b)
+{
+  message_buffer_t tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+// увеличение размера буфера до capacity
+// содержимое буфера сохраняется
+int message_buffer_reserve(message_buffer_t * buffer, size_t capacity)
+{
+  size_t block_size;
+  char * block;
+
+  if (capacity <= buffer->capacity)
+    return 0;
+
+  if (buffer->chunks == NULL && capacity > MESSAGE_BUFFER_ROPE_THRESHOLD)
+  {
+    // сообщение стало большим: накопленные данные однократно переносятся в части,
+    // дальше части добавляются без копирования
+    size_t length = buffer->offset;
+
+    block = buffer->buffer;
+    block_size = buffer->capacity;
+    buffer->buffer = NULL;
+    buffer->capacity = 0;
+    buffer->size = buffer->offset = 0;
+    if (message_buffer_rope_write(buffer, block, length) != 0)
+    {
+      message_buffer_free_chunks(buffer, 0);
+      buffer->buffer = block;
+      buffer->capacity = block_size;
+      buffer->size = buffer->offset = length;
+      return -1;
+    }
+    METRICS_ADD(buffer_reallocs, 1);
+    buffer_pool_free(block, block_size);
+  }
+  if (buffer->chunks != NULL)
+    return message_buffer_rope_table(buffer, message_buffer_chunks_for(capacity));
+
+  block = buffer_pool_alloc(capacity, &block_size);
+  if (block == NULL)
+    return -1;
+  METRICS_ADD(buffer_reallocs, 1);
+  memcpy(block, buffer->buffer, buffer->offset);
+  buffer_pool_free(buffer->buffer, buffer->capacity);
+  buffer->buffer = block;
+  buffer->capacity = block_size;
+  return 0;
+}
+
+// добавление данных в конец буфера
+// содержимое буфера сохраняется
+int message_buffer_append(message_buffer_t * buffer, const char * data, size_t size)
+{
+  if (message_buffer_reserve(buffer, buffer->offset + size) != 0)
+    return -1;
+  if (buffer->chunks != NULL)
+    return message_buffer_rope_write(buffer, data, size);
+
+  memcpy(buffer->buffer + buffer->offset, data, size);
+  buffer->size   += size;
+  buffer->offset += size;
+  return 0;
+}
+
+// число областей памяти для size байт данных с позиции from
+size_t message_buffer_iov_count(const message_buffer_t * buffer, size_t from, size_t size)
+{
+  if (size == 0)
+    return 0;
+  if (buffer->chunks == NULL)
+    return 1;
+  return (from + size - 1) / MESSAGE_BUFFER_CHUNK_SIZE - from / MESSAGE_BUFFER_CHUNK_SIZE + 1;
+}
+
+// описание size байт данных с позиции from
+size_t message_buffer_data_iov(const message_buffer_t * buffer, size_t from, size_t size,
+                               struct iovec * iov, size_t count)
+{
+  size_t filled = 0;
+
+  if (buffer->chunks == NULL)
+  {
+    if (size == 0 || count == 0)
+      return 0;
+    iov[0].iov_base = buffer->buffer + from;
+    iov[0].iov_len  = size;
+    return 1;
+  }
+
+  for (; size > 0 && filled < count; ++filled)
+  {
+    size_t position = from % MESSAGE_BUFFER_CHUNK_SIZE;
+    size_t part = MESSAGE_BUFFER_CHUNK_SIZE - position;
+
+    if (part > size)
+      part = size;
+    iov[filled].iov_base = buffer->chunks[from / MESSAGE_BUFFER_CHUNK_SIZE] + position;
+    iov[filled].iov_len  = part;
+    from += part;
+    size -= part;
+  }
+  return filled;
+}
+
+// описание свободного места после offset для записи до size байт
+int message_buffer_space_iov(message_buffer_t * buffer, size_t size, struct iovec * iov, size_t count)
+{
+  size_t from = buffer->offset;
+  int filled = 0;
+
+  if (size > buffer->capacity - buffer->offset)
+    size = buffer->capacity - buffer->offset;
+
+  if (buffer->chunks == NULL)
+  {
+    if (size == 0 || count == 0)
+      return 0;
+    iov[0].iov_base = buffer->buffer + from;
+    iov[0].iov_len  = size;
+    return 1;
+  }
+
+  for (; size > 0 && (size_t)(filled) < count; ++filled)
+  {
+    size_t position = from % MESSAGE_BUFFER_CHUNK_SIZE;
+    size_t part = MESSAGE_BUFFER_CHUNK_SIZE - position;
+    char * chunk = message_buffer_chunk(buffer, from / MESSAGE_BUFFER_CHUNK_SIZE);
+
+    if (chunk == NULL)
+      return -1;
+    if (part > size)
+      part = size;
+    iov[filled].iov_base = chunk + position;
+    iov[filled].iov_len  = part;
+    from += part;
+    size -= part;
+  }
+  return filled;
+}
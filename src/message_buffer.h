@@ -6,13 +6,34 @@
 #define __MESSAGE_BUFFER_H__
 
 #include <stdlib.h>
+#include <sys/uio.h>
+
+#include "buffer_pool.h"
+
+/*
+ * Число отметок времени этапов обработки (см. trace.h)
+ */
+#define MESSAGE_BUFFER_TRACE_POINTS 6
+
+/*
+ * Сообщение больше MESSAGE_BUFFER_ROPE_THRESHOLD хранится частями (rope):
+ * блоками по MESSAGE_BUFFER_CHUNK_SIZE байт из таблицы chunks. Память блока
+ * выделяется при первой записи в него, части не копируются при росте
+ * сообщения. Данные такого сообщения передаются в сокет и читаются из него
+ * списком областей (см. message_buffer_data_iov, message_buffer_space_iov)
+ */
+#define MESSAGE_BUFFER_CHUNK_SIZE     BUFFER_POOL_CHUNK_SIZE
+#define MESSAGE_BUFFER_ROPE_THRESHOLD (4 * MESSAGE_BUFFER_CHUNK_SIZE)
 
 struct message_buffer_t
 {
-    char *buffer;     // Сообщение
-    int size;         // Размер данных в буфере
-    int offset;       // Указатель на начало при записи
+    char *buffer;     // Сообщение (NULL - сообщение из частей)
+    size_t size;      // Размер данных в буфере
+    size_t offset;    // Указатель на начало при записи
     size_t capacity;  // Выделенный размер буфера
+    char **chunks;      // Части сообщения (NULL - сообщение целиком в buffer)
+    size_t chunk_count; // Размер таблицы частей (NULL в таблице - память части не выделена)
+    unsigned long long trace[MESSAGE_BUFFER_TRACE_POINTS]; // Время этапов обработки (см. trace.h)
 }; // struct message_buffer_t
 
 typedef struct message_buffer_t message_buffer_t;
@@ -23,5 +44,23 @@ int message_buffer_init(message_buffer_t * buffer, size_t capacity);
 void message_buffer_destroy(message_buffer_t * buffer);
 // изменение размера буфера
 int message_buffer_resize(message_buffer_t * buffer, size_t capacity);
+// сброс данных после отправки (части сообщения возвращаются в пул)
+void message_buffer_reset(message_buffer_t * buffer);
+// обмен памятью и данными двух буферов
+void message_buffer_swap(message_buffer_t * a, message_buffer_t * b);
+// увеличение размера буфера (содержимое сохраняется)
+int message_buffer_reserve(message_buffer_t * buffer, size_t capacity);
+// добавление данных в конец буфера (содержимое сохраняется)
+int message_buffer_append(message_buffer_t * buffer, const char * data, size_t size);
+// число областей памяти для size байт данных с позиции from
+size_t message_buffer_iov_count(const message_buffer_t * buffer, size_t from, size_t size);
+// описание size байт данных с позиции from (не больше count областей)
+// возвращает число заполненных областей
+size_t message_buffer_data_iov(const message_buffer_t * buffer, size_t from, size_t size,
+                               struct iovec * iov, size_t count);
+// описание свободного места после offset для записи до size байт
+// (не больше count областей, память частей выделяется)
+// возвращает число заполненных областей или -1 при нехватке памяти
+int message_buffer_space_iov(message_buffer_t * buffer, size_t size, struct iovec * iov, size_t count);
 
 #endif // __MESSAGE_BUFFER_H__
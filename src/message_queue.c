@@ -4,9 +4,14 @@
 
 
 #include "message_queue.h"
+#include "message_queue_impl.h"
+#include "buffer_pool.h"
 #include "message_buffer.h"
+#include "metrics.h"
 
 #include <errno.h>
+#include <stddef.h>
+#include <string.h>
 #include <pthread.h>
 #include <assert.h>
 
@@ -35,22 +40,48 @@ struct buffers_list_t
 {
   buffers_list_element_t * first;
   buffers_list_element_t * last;
+  size_t length;
 }; // struct buffers_list_t
 typedef struct buffers_list_t buffers_list_t;
 
 /*
- * Очередь сообщений
+ * Внутренние структуры
+ *
+ * Магазин свободных буферов потока: стек, сверху - последний
+ * освобожденный буфер (данные еще в кэше процессора)
+ * reserved: 1 - очередь выросла на емкость магазина, 0 - еще нет
+ * (после создания или очистки очереди), -1 - очередь не может вырасти
+ * (до очистки очереди поток работает без магазина)
+ */
+struct buffers_magazine_t
+{
+  size_t                   count;
+  int                      reserved;
+  buffers_list_element_t * elements[MESSAGE_QUEUE_MAGAZINE_SIZE];
+}; // struct buffers_magazine_t
+typedef struct buffers_magazine_t buffers_magazine_t;
+
+/*
+ * Очередь сообщений с блокировкой (MESSAGE_QUEUE_LOCKED)
+ * Выданные буферы (производителю или потребителю) и буферы в магазинах
+ * потоков не входят в списки
  */
-struct message_queue_t
+struct locked_queue_t
 {
+  message_queue_t base;
+
   pthread_mutex_t lock;
-  buffers_list_element_t * buffers;
-  size_t size;
+  buffers_list_element_t * buffers;        // начальные буферы (base.min_size)
+  buffers_list_element_t * extra_buffers;  // добавленные при росте (выделены отдельно)
 
   buffers_list_t free_buffers;
   buffers_list_t ready_buffers;
-  buffers_list_t busy_buffers;
-}; // struct message_buffers_set_t
+  buffers_list_t retired_buffers;    // выведенные из очереди: без памяти данных
+
+  size_t magazine_reserved;          // емкость, занятая магазинами (не выводится)
+  buffers_magazine_t * magazines[MESSAGE_QUEUE_MAGAZINE_THREADS];
+}; // struct locked_queue_t
+typedef struct locked_queue_t locked_queue_t;
 
 /*
  * Внутренние структуры
@@ -60,17 +91,23 @@ struct message_queue_t
 struct buffers_list_element_t
 {
   buffers_list_t * list;
+  locked_queue_t * owner;               // очередь, которой принадлежит буфер
+  int              busy;                // выдан производителю или потребителю
+                                        // (без списка и не выдан - в магазине)
   message_buffer_t buffer;
   buffers_list_element_t * next;
   buffers_list_element_t * prev;
+  buffers_list_element_t * extra_next;  // список добавленных при росте
 }; // struct buffers_list_element_t
 typedef struct buffers_list_element_t buffers_list_element_t;
 
-static int buffers_list_element_init(buffers_list_element_t * element)
+static int buffers_list_element_init(buffers_list_element_t * element, locked_queue_t * owner)
 {
-  if (message_buffer_init(&(element->buffer), 0) != 0)
+  if (message_buffer_init(&(element->buffer), MESSAGE_QUEUE_BUFFER_SIZE) != 0)
     return -1;
   element->list = NULL;
+  element->owner = owner;
+  element->busy = 0;
   element->next = element->prev = NULL;
   return 0;
 }
@@ -83,6 +120,7 @@ static void buffers_list_element_destroy(buffers_list_element_t * element)
 static void buffers_list_init(buffers_list_t * list)
 {
   list->first = list->last = NULL;
+  list->length = 0;
 }
 
 static void buffers_list_push_back(buffers_list_t * list, buffers_list_element_t * element)
@@ -101,6 +139,7 @@ static void buffers_list_push_back(buffers_list_t * list, buffers_list_element_t
     element->next = NULL;
     list->last = element;
   }
+  ++list->length;
 }
 
 static void buffers_list_push_front(buffers_list_t * list, buffers_list_element_t * element)
@@ -119,6 +158,7 @@ static void buffers_list_push_front(buffers_list_t * list, buffers_list_element_
     element->next = list->first;
     list->first = element;
   }
+  ++list->length;
 }
 
 static void buffers_list_remove_element(buffers_list_t * list, buffers_list_element_t * element)
@@ -126,40 +166,205 @@ static void buffers_list_remove_element(buffers_list_t * list, buffers_list_elem
   DEBUG("buffers_list_remove_element(buffers_list_t * list = %p, buffers_list_element_t * element = %p)\n", list, element);
   assert(element->list == list);
 
-  if (element == list->first || element == list->last)
+  if (element == list->first)
   {
-    if (element == list->first)
-    {
-      DEBUG("remove first\n");
-      list->first = element->next;
-    }
-    if (element == list->last)
-    {
-      DEBUG("remove last\n");
-      list->last = element->prev;
-    }
+    DEBUG("remove first\n");
+    list->first = element->next;
   }
   else
   {
     element->prev->next = element->next;
+  }
+
+  if (element == list->last)
+  {
+    DEBUG("remove last\n");
+    list->last = element->prev;
+  }
+  else
+  {
     element->next->prev = element->prev;
   }
   element->prev = element->next = NULL;
   element->list = NULL;
+  --list->length;
   DEBUG("buffers_list_remove_element(buffers_list_t * list = %p, buffers_list_element_t * element = %p) done\n", list, element);
 }
 
+/*
+ * Элемент списка, содержащий выданный буфер (отметка выдачи снимается:
+ * буфер возвращается в очередь)
+ * Вычисляется по адресу буфера без поиска по списку. Выданный буфер
+ * не входит ни в один список и не лежит в магазине
+ */
+static buffers_list_element_t * locked_queue_busy_element(locked_queue_t * queue, message_buffer_t * buffer)
+{
+  buffers_list_element_t * element;
+
+  element = (buffers_list_element_t *)((char *)(buffer) - offsetof(buffers_list_element_t, buffer));
+  assert(element->owner == queue);
+  assert(element->busy && element->list == NULL);
+  element->busy = 0;
+  return element;
+}
+
+/*
+ * захват общей блокировки очереди (с учетом в счетчике)
+ */
+static void locked_queue_lock(locked_queue_t * queue)
+{
+  pthread_mutex_lock(&(queue->lock));
+  __atomic_store_n(&(queue->base.locks), queue->base.locks + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Номер потока для магазинов (назначается при первом обращении к очереди)
+ * Номер завершившегося потока освобождается и вместе с магазинами
+ * (и буферами в них) переходит к следующему новому потоку
+ */
+static pthread_mutex_t  magazine_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t   magazine_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t    magazine_key;
+static size_t           magazine_threads = 0;
+static size_t           magazine_free_threads[MESSAGE_QUEUE_MAGAZINE_THREADS];
+static size_t           magazine_free_count = 0;
+static __thread size_t  magazine_thread = (size_t)(-1);
+
+static void magazine_thread_exit(void * value)
+{
+  pthread_mutex_lock(&magazine_threads_lock);
+  magazine_free_threads[magazine_free_count++] = (size_t)(value) - 1;
+  pthread_mutex_unlock(&magazine_threads_lock);
+}
+
+static void magazine_key_init(void)
+{
+  pthread_key_create(&magazine_key, magazine_thread_exit);
+}
+
+/*
+ * номер текущего потока (MESSAGE_QUEUE_MAGAZINE_THREADS - номера заняты)
+ */
+static size_t magazine_thread_acquire(void)
+{
+  size_t thread = MESSAGE_QUEUE_MAGAZINE_THREADS;
+
+  pthread_once(&magazine_key_once, magazine_key_init);
+  pthread_mutex_lock(&magazine_threads_lock);
+  if (magazine_free_count > 0)
+  {
+    thread = magazine_free_threads[--magazine_free_count];
+  }
+  else if (magazine_threads < MESSAGE_QUEUE_MAGAZINE_THREADS)
+  {
+    thread = magazine_threads++;
+  }
+  pthread_mutex_unlock(&magazine_threads_lock);
+
+  if (thread < MESSAGE_QUEUE_MAGAZINE_THREADS && pthread_setspecific(magazine_key, (void *)(thread + 1)) != 0)
+  {
+    magazine_thread_exit((void *)(thread + 1));
+    thread = MESSAGE_QUEUE_MAGAZINE_THREADS;
+  }
+  return thread;
+}
+
+/*
+ * Поток без магазина в очереди (не удалось выделить память магазина)
+ */
+static buffers_magazine_t no_magazine = { 0, -1 };
+
+static buffers_list_element_t * locked_queue_grow(locked_queue_t * queue);
+
+/*
+ * емкость очереди - не меньше начальной и магазинов: буферы в магазинах
+ * не уменьшают число буферов, доступных другим потокам
+ * для магазина используются буферы, на которые очередь уже выросла,
+ * недостающие добавляются
+ * возвращает NULL, если емкость или бюджет очереди исчерпаны
+ */
+static buffers_magazine_t * locked_queue_magazine_reserve(locked_queue_t * queue, buffers_magazine_t * magazine)
+{
+  size_t needed;
+
+  locked_queue_lock(queue);
+  needed = queue->base.min_size + queue->magazine_reserved + MESSAGE_QUEUE_MAGAZINE_SIZE;
+  if (magazine == NULL)
+  {
+    if (posix_memalign((void **)(&magazine), MESSAGE_QUEUE_CACHE_LINE, sizeof(buffers_magazine_t)) != 0)
+    {
+      magazine = &no_magazine;
+    }
+    else
+    {
+      magazine->count = 0;
+      magazine->reserved = 0;
+    }
+    __atomic_store_n(&(queue->magazines[magazine_thread]), magazine, __ATOMIC_RELEASE);
+  }
+
+  while (magazine->reserved == 0 && queue->base.size < needed)
+  {
+    buffers_list_element_t * element = locked_queue_grow(queue);
+
+    if (element == NULL)
+      break;
+    buffers_list_push_front(&(queue->free_buffers), element);
+  }
+  if (magazine->reserved == 0)
+  {
+    // добавленные буферы без магазина - обычный рост очереди (могут быть выведены)
+    magazine->reserved = queue->base.size >= needed ? 1 : -1;
+    if (magazine->reserved > 0)
+      queue->magazine_reserved += MESSAGE_QUEUE_MAGAZINE_SIZE;
+  }
+  pthread_mutex_unlock(&(queue->lock));
+  return magazine->reserved > 0 ? magazine : NULL;
+}
+
+/*
+ * магазин текущего потока, NULL - без магазина
+ * создается при первом обращении потока к очереди переменной емкости
+ */
+static buffers_magazine_t * locked_queue_magazine(locked_queue_t * queue)
+{
+  buffers_magazine_t * magazine;
+
+  if (queue->base.max_size - queue->base.min_size < MESSAGE_QUEUE_MAGAZINE_SIZE)
+    return NULL;
+
+  if (magazine_thread == (size_t)(-1))
+  {
+    magazine_thread = magazine_thread_acquire();
+  }
+  if (magazine_thread >= MESSAGE_QUEUE_MAGAZINE_THREADS)
+    return NULL;
+
+  magazine = queue->magazines[magazine_thread];
+  if (magazine != NULL && magazine->reserved > 0)
+    return magazine;
+  if (magazine != NULL && magazine->reserved < 0)
+    return NULL;
+  return locked_queue_magazine_reserve(queue, magazine);
+}
+
+static const message_queue_ops_t locked_queue_ops;
+
+static void locked_queue_release_buffer(message_queue_t * base, message_buffer_t * buffer);
+static void locked_queue_destroy(message_queue_t * base);
+
 /*
  * инициализация очереди сообщений
  */
-message_queue_t * message_queue_create(size_t size)
+static message_queue_t * locked_queue_create(size_t size, size_t max_size)
 {
-  message_queue_t * queue;
+  locked_queue_t * queue;
   pthread_mutexattr_t lock_attr;
 
-  queue = calloc(1, sizeof(message_queue_t));
-  if (queue == 0)
+  if (posix_memalign((void **)(&queue), MESSAGE_QUEUE_CACHE_LINE, sizeof(locked_queue_t)) != 0)
     return NULL;
+  memset(queue, 0, sizeof(locked_queue_t));
+  message_queue_init_base(&(queue->base), &locked_queue_ops, size, max_size);
 
   if (pthread_mutexattr_init(&lock_attr) != 0)
   {
@@ -177,7 +382,7 @@ message_queue_t * message_queue_create(size_t size)
   }
   pthread_mutexattr_destroy(&lock_attr);
 
-  queue->buffers = calloc(size, sizeof(buffers_list_element_t));
+  queue->buffers = message_queue_alloc(size * sizeof(buffers_list_element_t));
   if (queue->buffers == NULL)
   {
     int error = errno;
@@ -189,57 +394,187 @@ message_queue_t * message_queue_create(size_t size)
 
   buffers_list_init(&(queue->free_buffers));
   buffers_list_init(&(queue->ready_buffers));
-  buffers_list_init(&(queue->busy_buffers));
+  buffers_list_init(&(queue->retired_buffers));
+
+  // память начальных буферов очереди выделяется и заполняется сразу
+  if (buffer_pool_reserve(MESSAGE_QUEUE_BUFFER_SIZE, size) != 0)
+  {
+    int error = errno;
+    message_queue_free(queue->buffers, size * sizeof(buffers_list_element_t));
+    pthread_mutex_destroy(&(queue->lock));
+    free(queue);
+    errno = error;
+    return NULL;
+  }
 
-  queue->size = size;
   for (int i = 0; i < size; ++i)
   {
     buffers_list_element_t * buffer = queue->buffers + i;
-    if (buffers_list_element_init(buffer) != 0)
+    if (buffers_list_element_init(buffer, queue) != 0)
     {
       int error = errno;
-      pthread_mutex_destroy(&(queue->lock));
-      free(queue);
+      locked_queue_destroy(&(queue->base));
       errno = error;
       return NULL;
     }
     buffers_list_push_back(&(queue->free_buffers), buffer);
   }
 
-  return queue;
+  return &(queue->base);
 }
 
 /*
  * освободить память, выделенную для очереди сообщений
+ * элементы перебираются без списков: выданные буферы и буферы
+ * в магазинах в списки не входят
  */
-void message_queue_destroy(message_queue_t * queue)
+static void locked_queue_destroy(message_queue_t * base)
 {
-  if (queue->buffers != NULL)
+  locked_queue_t * queue = (locked_queue_t *)(base);
+  buffers_list_element_t * element;
+
+  for (size_t i = 0; i < queue->base.min_size; ++i)
+  {
+    buffers_list_element_destroy(queue->buffers + i);
+  }
+  while ((element = queue->extra_buffers) != NULL)
   {
-    for (int i = 0; i < queue->size; ++i)
+    queue->extra_buffers = element->extra_next;
+    buffers_list_element_destroy(element);
+    free(element);
+  }
+  for (size_t i = 0; i < MESSAGE_QUEUE_MAGAZINE_THREADS; ++i)
+  {
+    if (queue->magazines[i] != &no_magazine)
     {
-      buffers_list_element_destroy(queue->buffers + i);
+      free(queue->magazines[i]);
     }
-    free(queue->buffers);
   }
+  message_queue_free(queue->buffers, queue->base.min_size * sizeof(buffers_list_element_t));
   pthread_mutex_destroy(&(queue->lock));
   free(queue);
 }
 
+/*
+ * добавить в очередь буфер (вызывается под блокировкой очереди)
+ * используется элемент, выведенный из очереди ранее, или новый
+ * если емкость или бюджет исчерпаны, возвращается NULL
+ */
+static buffers_list_element_t * locked_queue_grow(locked_queue_t * queue)
+{
+  buffers_list_element_t * element;
+
+  if (message_queue_grow_begin(&(queue->base)) != 0)
+    return NULL;
+
+  element = queue->retired_buffers.first;
+  if (element != NULL)
+  {
+    if (message_buffer_init(&(element->buffer), MESSAGE_QUEUE_BUFFER_SIZE) != 0)
+    {
+      message_queue_grow_end(&(queue->base), 0);
+      return NULL;
+    }
+    buffers_list_remove_element(&(queue->retired_buffers), element);
+  }
+  else
+  {
+    element = malloc(sizeof(buffers_list_element_t));
+    if (element == NULL || buffers_list_element_init(element, queue) != 0)
+    {
+      free(element);
+      message_queue_grow_end(&(queue->base), 0);
+      return NULL;
+    }
+    element->extra_next = queue->extra_buffers;
+    queue->extra_buffers = element;
+  }
+
+  DEBUG("locked_queue_grow(queue = %p) size = %zu\n", queue, queue->base.size + 1);
+  message_queue_grow_end(&(queue->base), 1);
+  return element;
+}
+
+/*
+ * вывести из очереди count свободных буферов (вызывается под блокировкой очереди)
+ * выводятся буферы из конца списка свободных - дольше всего не использовавшиеся
+ */
+static void locked_queue_trim(locked_queue_t * queue, size_t count)
+{
+  for (size_t i = 0; i < count; ++i)
+  {
+    buffers_list_element_t * element = queue->free_buffers.last;
+
+    buffers_list_remove_element(&(queue->free_buffers), element);
+    message_buffer_destroy(&(element->buffer));
+    buffers_list_push_front(&(queue->retired_buffers), element);
+  }
+
+  DEBUG("locked_queue_trim(queue = %p) size = %zu\n", queue, queue->base.size - count);
+  message_queue_shrunk(&(queue->base), count);
+}
+
 /*
  * получить свободный буфер из очереди сообщений
- * если свободных буферов нет, возвращается NULL
+ * сначала - из магазина потока без блокировки; магазин пополняется
+ * из списка свободных пачкой (половина магазина)
+ * если свободных буферов нет, очередь растет в пределах бюджета,
+ * иначе возвращается NULL
+ * буферы, добавленные для магазинов, из очереди не выводятся
  */
-message_buffer_t * message_queue_get_free_buffer(message_queue_t * queue)
+static message_buffer_t * locked_queue_get_free_buffer(message_queue_t * base)
 {
+  locked_queue_t * queue = (locked_queue_t *)(base);
+  buffers_magazine_t * magazine = locked_queue_magazine(queue);
   buffers_list_element_t * element = NULL;
+  size_t surplus;
 
-  pthread_mutex_lock(&(queue->lock));
+  if (magazine != NULL && magazine->count > 0)
+  {
+    element = magazine->elements[magazine->count - 1];
+    __atomic_store_n(&(magazine->count), magazine->count - 1, __ATOMIC_RELAXED);
+    element->busy = 1;
+    return &(element->buffer);
+  }
+
+  locked_queue_lock(queue);
   element = queue->free_buffers.first;
   if (element != NULL)
   {
     buffers_list_remove_element(&(queue->free_buffers), element);
-    buffers_list_push_back(&(queue->busy_buffers), element);
+
+    if (magazine != NULL)
+    {
+      // следующие по порядку буферы - сверху магазина
+      size_t count = MESSAGE_QUEUE_MAGAZINE_SIZE / 2;
+
+      if (count > queue->free_buffers.length)
+        count = queue->free_buffers.length;
+      for (size_t i = count; i > 0; --i)
+      {
+        buffers_list_element_t * cached = queue->free_buffers.first;
+
+        buffers_list_remove_element(&(queue->free_buffers), cached);
+        magazine->elements[i - 1] = cached;
+      }
+      __atomic_store_n(&(magazine->count), count, __ATOMIC_RELAXED);
+    }
+
+    surplus = message_queue_trim_check(base, queue->free_buffers.length);
+    if (surplus > base->size - base->min_size - queue->magazine_reserved)
+      surplus = base->size - base->min_size - queue->magazine_reserved;
+    if (surplus > 0)
+    {
+      locked_queue_trim(queue, surplus);
+    }
+  }
+  else
+  {
+    element = locked_queue_grow(queue);
+  }
+  if (element != NULL)
+  {
+    element->busy = 1;
   }
   pthread_mutex_unlock(&(queue->lock));
   return element != NULL ? &(element->buffer) : NULL;
@@ -249,17 +584,18 @@ message_buffer_t * message_queue_get_free_buffer(message_queue_t * queue)
  * получить заполненный буфер из очереди сообщений
  * если буферов нет, возвращается NULL
  */
-message_buffer_t * message_queue_get_ready_buffer(message_queue_t * queue)
+static message_buffer_t * locked_queue_get_ready_buffer(message_queue_t * base)
 {
+  locked_queue_t * queue = (locked_queue_t *)(base);
   buffers_list_element_t * element = NULL;
 
-  pthread_mutex_lock(&(queue->lock));
+  locked_queue_lock(queue);
   DEBUG("message_queue_get_ready_buffer(message_queue_t * queue = %p)\n", queue);
   element = queue->ready_buffers.first;
   if (element != NULL)
   {
     buffers_list_remove_element(&(queue->ready_buffers), element);
-    buffers_list_push_back(&(queue->busy_buffers), element);
+    element->busy = 1;
   }
   else
   {
@@ -271,75 +607,537 @@ message_buffer_t * message_queue_get_ready_buffer(message_queue_t * queue)
 }
 
 /*
- * пометить буфер как "заполненный"
+ * получить до count заполненных буферов
  */
-void message_queue_add_ready_buffer(message_queue_t * queue, message_buffer_t * buffer)
+static size_t locked_queue_get_ready_batch(message_queue_t * base, message_buffer_t ** buffers, size_t count)
 {
+  locked_queue_t * queue = (locked_queue_t *)(base);
   buffers_list_element_t * element = NULL;
+  size_t received = 0;
 
-  pthread_mutex_lock(&(queue->lock));
-  DEBUG("message_queue_add_ready_buffer(message_queue_t * queue = %p, message_buffer_t * buffer = %p)\n", queue, buffer);
-  element = queue->busy_buffers.last;
-  while (element)
+  locked_queue_lock(queue);
+  while (received < count && (element = queue->ready_buffers.first) != NULL)
   {
-    if (buffer == &(element->buffer))
-      break;
-    element = element->prev;
+    buffers_list_remove_element(&(queue->ready_buffers), element);
+    element->busy = 1;
+    buffers[received++] = &(element->buffer);
   }
-  assert(element);
+  pthread_mutex_unlock(&(queue->lock));
+
+  return received;
+}
 
-  buffers_list_remove_element(&(queue->busy_buffers), element);
+/*
+ * пометить буфер как "заполненный"
+ */
+static int locked_queue_add_ready_buffer(message_queue_t * base, message_buffer_t * buffer)
+{
+  locked_queue_t * queue = (locked_queue_t *)(base);
+  buffers_list_element_t * element = NULL;
+  int wakeup;
+
+  locked_queue_lock(queue);
+  DEBUG("message_queue_add_ready_buffer(message_queue_t * queue = %p, message_buffer_t * buffer = %p)\n", queue, buffer);
+  element = locked_queue_busy_element(queue, buffer);
+
+  wakeup = queue->ready_buffers.first == NULL;
   buffers_list_push_back(&(queue->ready_buffers), element);
   DEBUG("message_queue_add_ready_buffer(message_queue_t * queue = %p, message_buffer_t * buffer = %p) ready.first = %p done\n",
         queue, buffer, queue->ready_buffers.first);
   pthread_mutex_unlock(&(queue->lock));
+  return wakeup;
 }
 
 /*
  * 
  */
-void message_queue_put_back_buffer(message_queue_t * queue, message_buffer_t * buffer)
+static void locked_queue_put_back_buffer(message_queue_t * base, message_buffer_t * buffer)
 {
+  locked_queue_t * queue = (locked_queue_t *)(base);
   buffers_list_element_t * element = NULL;
 
   if (buffer->size == 0)
-    message_queue_release_buffer(queue, buffer);
-
-  pthread_mutex_lock(&(queue->lock));
-  element = queue->busy_buffers.last;
-  while (element)
   {
-    if (buffer == &(element->buffer))
-      break;
-    element = element->prev;
+    locked_queue_release_buffer(base, buffer);
+    return;
   }
-  assert(element);
 
-  buffers_list_remove_element(&(queue->busy_buffers), element);
+  locked_queue_lock(queue);
+  element = locked_queue_busy_element(queue, buffer);
+
   buffers_list_push_front(&(queue->ready_buffers), element);
   pthread_mutex_unlock(&(queue->lock));
 }
 
 /*
  * пометить буфер как "свободный"
+ * буфер кладется в магазин потока без блокировки; из заполненного
+ * магазина в список свободных переносится пачка дольше всего лежавших
  */
-void message_queue_release_buffer(message_queue_t * queue, message_buffer_t * buffer)
+static void locked_queue_release_buffer(message_queue_t * base, message_buffer_t * buffer)
 {
+  locked_queue_t * queue = (locked_queue_t *)(base);
+  buffers_magazine_t * magazine = locked_queue_magazine(queue);
   buffers_list_element_t * element = NULL;
 
-  pthread_mutex_lock(&(queue->lock));
   DEBUG("message_queue_release_buffer(message_queue_t * queue = %p, message_buffer_t * buffer = %p)\n", queue, buffer);
-  element = queue->busy_buffers.last;
-  while (element)
+  element = locked_queue_busy_element(queue, buffer);
+
+  if (magazine != NULL)
   {
-    if (buffer == &(element->buffer))
-      break;
-    element = element->prev;
+    size_t count = magazine->count;
+
+    if (count == MESSAGE_QUEUE_MAGAZINE_SIZE)
+    {
+      size_t spill = MESSAGE_QUEUE_MAGAZINE_SIZE / 2;
+
+      locked_queue_lock(queue);
+      for (size_t i = 0; i < spill; ++i)
+      {
+        buffers_list_push_front(&(queue->free_buffers), magazine->elements[i]);
+      }
+      pthread_mutex_unlock(&(queue->lock));
+      count -= spill;
+      memmove(magazine->elements, magazine->elements + spill, count * sizeof(buffers_list_element_t *));
+    }
+    magazine->elements[count] = element;
+    __atomic_store_n(&(magazine->count), count + 1, __ATOMIC_RELAXED);
+    return;
   }
-  assert(element);
 
-  buffers_list_remove_element(&(queue->busy_buffers), element);
+  locked_queue_lock(queue);
   buffers_list_push_front(&(queue->free_buffers), element);
   DEBUG("message_queue_release_buffer(message_queue_t * queue = %p, message_buffer_t * buffer = %p) done\n", queue, buffer);
   pthread_mutex_unlock(&(queue->lock));
 }
+
+/*
+ * вернуть буфер в список свободных, пока их меньше начальной емкости,
+ * остальные буферы вывести из очереди (выведенные ранее остаются выведенными)
+ */
+static void locked_queue_clear_element(locked_queue_t * queue, buffers_list_element_t * element, int retired)
+{
+  element->list = NULL;
+  element->busy = 0;
+  if (retired)
+  {
+    buffers_list_push_front(&(queue->retired_buffers), element);
+  }
+  else if (queue->free_buffers.length < queue->base.min_size)
+  {
+    message_buffer_resize(&(element->buffer), MESSAGE_QUEUE_BUFFER_SIZE);
+    buffers_list_push_back(&(queue->free_buffers), element);
+  }
+  else
+  {
+    message_buffer_destroy(&(element->buffer));
+    buffers_list_push_front(&(queue->retired_buffers), element);
+  }
+}
+
+/*
+ * вернуть все буферы очереди в список свободных, магазины опустошаются
+ * буферы сверх начальной емкости выводятся из очереди (и буферы магазинов:
+ * при следующем обращении потока очередь снова вырастет для его магазина)
+ */
+static void locked_queue_clear(message_queue_t * base)
+{
+  locked_queue_t * queue = (locked_queue_t *)(base);
+  buffers_list_t * retired = &(queue->retired_buffers);
+
+  locked_queue_lock(queue);
+  buffers_list_init(&(queue->free_buffers));
+  buffers_list_init(&(queue->ready_buffers));
+  buffers_list_init(&(queue->retired_buffers));
+
+  for (size_t i = 0; i < base->min_size; ++i)
+  {
+    buffers_list_element_t * element = queue->buffers + i;
+    locked_queue_clear_element(queue, element, element->list == retired);
+  }
+  for (buffers_list_element_t * element = queue->extra_buffers; element != NULL; element = element->extra_next)
+  {
+    locked_queue_clear_element(queue, element, element->list == retired);
+  }
+  for (size_t i = 0; i < MESSAGE_QUEUE_MAGAZINE_THREADS; ++i)
+  {
+    if (queue->magazines[i] == &no_magazine)
+    {
+      queue->magazines[i] = NULL;
+    }
+    else if (queue->magazines[i] != NULL)
+    {
+      queue->magazines[i]->count = 0;
+      queue->magazines[i]->reserved = 0;
+    }
+  }
+  queue->magazine_reserved = 0;
+  pthread_mutex_unlock(&(queue->lock));
+}
+
+/*
+ * число буферов по состояниям
+ * буферы в магазинах - свободные (счетчики магазинов читаются без
+ * синхронизации с потоками - снимок приблизительный)
+ */
+static void locked_queue_get_occupancy(message_queue_t * base, message_queue_occupancy_t * occupancy)
+{
+  locked_queue_t * queue = (locked_queue_t *)(base);
+  size_t size = __atomic_load_n(&(base->size), __ATOMIC_RELAXED);
+  size_t cached = 0;
+
+  for (size_t i = 0; i < MESSAGE_QUEUE_MAGAZINE_THREADS; ++i)
+  {
+    buffers_magazine_t * magazine = __atomic_load_n(&(queue->magazines[i]), __ATOMIC_ACQUIRE);
+    if (magazine != NULL)
+    {
+      cached += __atomic_load_n(&(magazine->count), __ATOMIC_RELAXED);
+    }
+  }
+
+  locked_queue_lock(queue);
+  occupancy->free  = queue->free_buffers.length + cached;
+  occupancy->ready = queue->ready_buffers.length;
+  pthread_mutex_unlock(&(queue->lock));
+  if (occupancy->free > size)
+    occupancy->free = size;
+  if (occupancy->ready > size - occupancy->free)
+    occupancy->ready = size - occupancy->free;
+  occupancy->busy = size - occupancy->free - occupancy->ready;
+}
+
+static const message_queue_ops_t locked_queue_ops =
+{
+  locked_queue_destroy,
+  locked_queue_get_free_buffer,
+  locked_queue_get_ready_buffer,
+  locked_queue_get_ready_batch,
+  locked_queue_add_ready_buffer,
+  locked_queue_put_back_buffer,
+  locked_queue_release_buffer,
+  locked_queue_clear,
+  locked_queue_get_occupancy,
+};
+
+/*
+ * Общий интерфейс очереди сообщений
+ */
+
+/*
+ * Список всех созданных очередей (изменяется только при создании и удалении)
+ */
+static pthread_mutex_t   registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static message_queue_t * registry_first = NULL;
+
+static message_queue_t * registry_add(message_queue_t * queue)
+{
+  if (queue == NULL)
+    return NULL;
+
+  queue->name = "queue";
+  queue->registry_prev = NULL;
+  pthread_mutex_lock(&registry_lock);
+  queue->registry_next = registry_first;
+  if (registry_first != NULL)
+    registry_first->registry_prev = queue;
+  registry_first = queue;
+  pthread_mutex_unlock(&registry_lock);
+  return queue;
+}
+
+static void registry_remove(message_queue_t * queue)
+{
+  pthread_mutex_lock(&registry_lock);
+  if (queue->registry_prev != NULL)
+    queue->registry_prev->registry_next = queue->registry_next;
+  else
+    registry_first = queue->registry_next;
+  if (queue->registry_next != NULL)
+    queue->registry_next->registry_prev = queue->registry_prev;
+  pthread_mutex_unlock(&registry_lock);
+}
+
+/*
+ * Общий бюджет дополнительных буферов (0 - без ограничения) и занятый объем
+ */
+static size_t global_budget = 0;
+static size_t global_used   = 0;
+
+void message_queue_set_global_budget(size_t budget)
+{
+  global_budget = budget;
+}
+
+/*
+ * инициализация общей части
+ */
+void message_queue_init_base(message_queue_t * queue, const message_queue_ops_t * ops, size_t size, size_t max_size)
+{
+  queue->ops        = ops;
+  queue->min_size   = size;
+  queue->max_size   = max_size > size ? max_size : size;
+  queue->shared_producers = 0;
+  queue->size       = size;
+  queue->trim_count = 0;
+  queue->trim_low   = (size_t)(-1);
+}
+
+/*
+ * зарезервировать место для буфера
+ */
+int message_queue_grow_begin(message_queue_t * queue)
+{
+  size_t used;
+
+  if (queue->size >= queue->max_size)
+    return -1;
+
+  used = __atomic_load_n(&global_used, __ATOMIC_RELAXED);
+  do
+  {
+    if (global_budget != 0 && used + MESSAGE_QUEUE_BUFFER_SIZE > global_budget)
+      return -1;
+  }
+  while (!__atomic_compare_exchange_n(&global_used, &used, used + MESSAGE_QUEUE_BUFFER_SIZE, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 0;
+}
+
+void message_queue_grow_end(message_queue_t * queue, int success)
+{
+  if (!success)
+  {
+    __atomic_sub_fetch(&global_used, MESSAGE_QUEUE_BUFFER_SIZE, __ATOMIC_RELAXED);
+    return;
+  }
+  __atomic_store_n(&(queue->size), queue->size + 1, __ATOMIC_RELAXED);
+  METRICS_ADD(queue_grows, 1);
+}
+
+/*
+ * учет выведенных из очереди буферов
+ */
+void message_queue_shrunk(message_queue_t * queue, size_t count)
+{
+  if (count == 0)
+    return;
+  __atomic_store_n(&(queue->size), queue->size - count, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&global_used, count * MESSAGE_QUEUE_BUFFER_SIZE, __ATOMIC_RELAXED);
+  METRICS_ADD(queue_shrinks, count);
+}
+
+/*
+ * наибольшее число буферов очереди
+ */
+size_t message_queue_capacity(size_t size, size_t budget)
+{
+  size_t capacity = budget / MESSAGE_QUEUE_BUFFER_SIZE;
+  return capacity > size ? capacity : size;
+}
+
+/*
+ * инициализация очереди сообщений
+ */
+message_queue_t * message_queue_create(size_t size)
+{
+  return message_queue_create_backend(size, MESSAGE_QUEUE_LOCKED);
+}
+
+/*
+ * инициализация очереди сообщений с заданной реализацией
+ */
+message_queue_t * message_queue_create_backend(size_t size, message_queue_backend_t backend)
+{
+  return message_queue_create_elastic(size, 0, backend);
+}
+
+/*
+ * инициализация очереди сообщений переменной емкости
+ */
+message_queue_t * message_queue_create_elastic(size_t size, size_t budget, message_queue_backend_t backend)
+{
+  size_t max_size = message_queue_capacity(size, budget);
+
+  switch (backend)
+  {
+    case MESSAGE_QUEUE_LOCKED:
+      return registry_add(locked_queue_create(size, max_size));
+
+    case MESSAGE_QUEUE_SPSC:
+      return registry_add(spsc_queue_create(size, max_size));
+
+    case MESSAGE_QUEUE_MPMC:
+      return registry_add(mpmc_queue_create(size, max_size));
+  }
+
+  errno = EINVAL;
+  return NULL;
+}
+
+/*
+ * освободить память, выделенную для очереди сообщений
+ */
+void message_queue_destroy(message_queue_t * queue)
+{
+  registry_remove(queue);
+  message_queue_shrunk(queue, queue->size - queue->min_size);
+  queue->ops->destroy(queue);
+}
+
+/*
+ * получить свободный буфер из очереди сообщений
+ */
+message_buffer_t * message_queue_get_free_buffer(message_queue_t * queue)
+{
+  return queue->ops->get_free_buffer(queue);
+}
+
+/*
+ * получить заполненный буфер из очереди сообщений
+ */
+message_buffer_t * message_queue_get_ready_buffer(message_queue_t * queue)
+{
+  return queue->ops->get_ready_buffer(queue);
+}
+
+/*
+ * получить до count заполненных буферов за одно обращение к очереди
+ */
+size_t message_queue_get_ready_batch(message_queue_t * queue, message_buffer_t ** buffers, size_t count)
+{
+  return queue->ops->get_ready_batch(queue, buffers, count);
+}
+
+/*
+ * пометить буфер как "заполненный"
+ * счетчики изменяет только производитель (или производители под общей блокировкой),
+ * при нескольких производителях без блокировки - атомарно
+ */
+int message_queue_add_ready_buffer(message_queue_t * queue, message_buffer_t * buffer)
+{
+  int wakeup = queue->ops->add_ready_buffer(queue, buffer);
+
+  if (queue->shared_producers)
+  {
+    __atomic_add_fetch(&(queue->messages), 1, __ATOMIC_RELAXED);
+    if (wakeup)
+    {
+      __atomic_add_fetch(&(queue->wakeups), 1, __ATOMIC_RELAXED);
+    }
+    return wakeup;
+  }
+
+  __atomic_store_n(&(queue->messages), queue->messages + 1, __ATOMIC_RELAXED);
+  if (wakeup)
+  {
+    __atomic_store_n(&(queue->wakeups), queue->wakeups + 1, __ATOMIC_RELAXED);
+  }
+  return wakeup;
+}
+
+/*
+ * Вернуть неиспользуемый буфер в очередь
+ */
+void message_queue_put_back_buffer(message_queue_t * queue, message_buffer_t * buffer)
+{
+  queue->ops->put_back_buffer(queue, buffer);
+}
+
+/*
+ * пометить буфер как "свободный"
+ */
+void message_queue_release_buffer(message_queue_t * queue, message_buffer_t * buffer)
+{
+  queue->ops->release_buffer(queue, buffer);
+}
+
+/*
+ * передать заполненный буфер в другую очередь без копирования
+ */
+message_buffer_t * message_queue_move_buffer(message_queue_t * from, message_buffer_t * buffer, message_queue_t * to)
+{
+  message_buffer_t * target;
+
+  target = message_queue_get_free_buffer(to);
+  if (target == NULL)
+    return NULL;
+
+  message_buffer_swap(buffer, target);
+  message_queue_release_buffer(from, buffer);
+  return target;
+}
+
+/*
+ * память элементов очереди из пула буферов
+ */
+void * message_queue_alloc(size_t size)
+{
+  size_t capacity;
+  void * ptr = buffer_pool_alloc(size, &capacity);
+
+  if (ptr != NULL)
+  {
+    memset(ptr, 0, size);
+  }
+  return ptr;
+}
+
+void message_queue_free(void * ptr, size_t size)
+{
+  buffer_pool_free(ptr, size);
+}
+
+/*
+ * вернуть все буферы очереди в список свободных
+ */
+void message_queue_clear(message_queue_t * queue)
+{
+  queue->ops->clear(queue);
+  message_queue_shrunk(queue, queue->size - queue->min_size);
+  queue->messages = queue->wakeups = queue->locks = 0;
+  queue->trim_count = 0;
+  queue->trim_low = (size_t)(-1);
+}
+
+/*
+ * Счетчики очереди
+ */
+void message_queue_get_stats(message_queue_t * queue, message_queue_stats_t * stats)
+{
+  stats->messages = __atomic_load_n(&(queue->messages), __ATOMIC_RELAXED);
+  stats->wakeups  = __atomic_load_n(&(queue->wakeups),  __ATOMIC_RELAXED);
+  stats->locks    = __atomic_load_n(&(queue->locks),    __ATOMIC_RELAXED);
+}
+
+/*
+ * Состояние буферов очереди
+ */
+void message_queue_get_occupancy(message_queue_t * queue, message_queue_occupancy_t * occupancy)
+{
+  queue->ops->get_occupancy(queue, occupancy);
+  occupancy->size     = __atomic_load_n(&(queue->size), __ATOMIC_RELAXED);
+  occupancy->max_size = queue->max_size;
+}
+
+void message_queue_set_name(message_queue_t * queue, const char * name)
+{
+  queue->name = name;
+}
+
+const char * message_queue_get_name(const message_queue_t * queue)
+{
+  return queue->name;
+}
+
+/*
+ * Обход всех очередей
+ */
+void message_queue_foreach(void (*callback)(message_queue_t * queue, void * arg), void * arg)
+{
+  pthread_mutex_lock(&registry_lock);
+  for (message_queue_t * queue = registry_first; queue != NULL; queue = queue->registry_next)
+  {
+    callback(queue, arg);
+  }
+  pthread_mutex_unlock(&registry_lock);
+}
@@ -16,10 +16,52 @@ struct message_queue_t;
 typedef struct message_queue_t message_queue_t;
 
 /*
- * инициализация очереди сообщений
+ * Реализация очереди сообщений
+ */
+enum message_queue_backend_t
+{
+  MESSAGE_QUEUE_LOCKED = 0, // списки буферов под общей блокировкой, любое число потоков
+  MESSAGE_QUEUE_SPSC,       // кольцевые буферы без блокировок: один поток-производитель
+                            // (get_free/add_ready) и один поток-потребитель
+                            // (get_ready/put_back/release)
+  MESSAGE_QUEUE_MPMC,       // кольцевые буферы с номером последовательности в ячейке,
+                            // любое число производителей и потребителей без общей
+                            // блокировки (блокировка - только при росте и уменьшении)
+}; // enum message_queue_backend_t
+typedef enum message_queue_backend_t message_queue_backend_t;
+
+/*
+ * инициализация очереди сообщений (MESSAGE_QUEUE_LOCKED)
  */
 message_queue_t * message_queue_create(size_t size);
 
+/*
+ * инициализация очереди сообщений с заданной реализацией
+ */
+message_queue_t * message_queue_create_backend(size_t size, message_queue_backend_t backend);
+
+/*
+ * инициализация очереди сообщений переменной емкости
+ * Очередь создается из size буферов и растет, пока буферов не хватает,
+ * но не больше, чем на budget байт (см. message_queue_capacity).
+ * Буферы, остававшиеся свободными в течение периода обращений, выводятся
+ * из очереди (память данных возвращается в пул), но очередь не становится
+ * меньше size буферов. Рост и уменьшение выполняются при получении
+ * свободного буфера - в потоке-производителе, без остановки очереди
+ */
+message_queue_t * message_queue_create_elastic(size_t size, size_t budget, message_queue_backend_t backend);
+
+/*
+ * наибольшее число буферов очереди из size буферов с бюджетом budget байт
+ */
+size_t message_queue_capacity(size_t size, size_t budget);
+
+/*
+ * общий бюджет дополнительных буферов всех очередей, байт (0 - без ограничения)
+ * устанавливается до создания очередей
+ */
+void message_queue_set_global_budget(size_t budget);
+
 /*
  * освободить память, выделенную для очереди сообщений
  */
@@ -37,10 +79,19 @@ message_buffer_t * message_queue_get_free_buffer(message_queue_t * queue);
  */
 message_buffer_t * message_queue_get_ready_buffer(message_queue_t * queue);
 
+/*
+ * получить до count заполненных буферов за одно обращение к очереди
+ * возвращает число полученных буферов
+ */
+size_t message_queue_get_ready_batch(message_queue_t * queue, message_buffer_t ** buffers, size_t count);
+
 /*
  * пометить буфер как "заполненный"
+ * возвращает 1, если заполненных буферов не было: потребитель, разобравший
+ * очередь до конца, ожидает уведомления (переход "пусто - не пусто").
+ * Пока очередь не пуста, уведомление не требуется
  */
-void message_queue_add_ready_buffer(message_queue_t * queue, message_buffer_t * buffer);
+int message_queue_add_ready_buffer(message_queue_t * queue, message_buffer_t * buffer);
 
 /*
  * Вернуть неиспользуемый буфер в очередь
@@ -52,4 +103,63 @@ void message_queue_put_back_buffer(message_queue_t * queue, message_buffer_t * b
  */
 void message_queue_release_buffer(message_queue_t * queue, message_buffer_t * buffer);
 
+/*
+ * передать заполненный буфер buffer очереди from в очередь to без копирования:
+ * данные переносятся в свободный буфер очереди to (обмен памятью буферов),
+ * буфер buffer возвращается в from как "свободный"
+ * возвращает буфер очереди to, который нужно пометить как "заполненный";
+ * если в очереди to нет свободных буферов, возвращается NULL, buffer не изменяется
+ */
+message_buffer_t * message_queue_move_buffer(message_queue_t * from, message_buffer_t * buffer, message_queue_t * to);
+
+/*
+ * Счетчики очереди (с момента создания или очистки)
+ */
+struct message_queue_stats_t
+{
+  unsigned long messages; // заполненных буферов
+  unsigned long wakeups;  // из них с уведомлением потребителя
+  unsigned long locks;    // захватов общей блокировки очереди (MESSAGE_QUEUE_LOCKED)
+}; // struct message_queue_stats_t
+typedef struct message_queue_stats_t message_queue_stats_t;
+
+void message_queue_get_stats(message_queue_t * queue, message_queue_stats_t * stats);
+
+/*
+ * Число буферов очереди по состояниям
+ */
+struct message_queue_occupancy_t
+{
+  size_t free;     // свободных
+  size_t ready;    // заполненных, ожидающих потребителя
+  size_t busy;     // выданных производителю или потребителю
+  size_t size;     // всего буферов (текущая емкость очереди)
+  size_t max_size; // наибольшая емкость очереди
+}; // struct message_queue_occupancy_t
+typedef struct message_queue_occupancy_t message_queue_occupancy_t;
+
+/*
+ * снимок состояния очереди из любого потока
+ * (для очереди без блокировок - приблизительный)
+ */
+void message_queue_get_occupancy(message_queue_t * queue, message_queue_occupancy_t * occupancy);
+
+/*
+ * имя очереди для отчетов (строка не копируется), по умолчанию "queue"
+ */
+void message_queue_set_name(message_queue_t * queue, const char * name);
+const char * message_queue_get_name(const message_queue_t * queue);
+
+/*
+ * вызвать callback для каждой созданной очереди
+ * (под общей блокировкой: callback не должен создавать и удалять очереди)
+ */
+void message_queue_foreach(void (*callback)(message_queue_t * queue, void * arg), void * arg);
+
+/*
+ * вернуть все буферы очереди в список свободных, емкость очереди
+ * возвращается к начальной (очередь не должна использоваться другими потоками)
+ */
+void message_queue_clear(message_queue_t * queue);
+
 #endif // __MESSAGE_QUEUE_H__
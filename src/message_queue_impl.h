@@ -0,0 +1,150 @@
+/*
+ * Очередь сообщений
+ * Внутренний интерфейс реализаций очереди
+ */
+
+#ifndef __MESSAGE_QUEUE_IMPL_H__
+#define __MESSAGE_QUEUE_IMPL_H__
+
+#include "message_queue.h"
+
+/*
+ * Размер строки кэша для разнесения данных разных потоков
+ */
+#define MESSAGE_QUEUE_CACHE_LINE 64
+
+/*
+ * Начальный размер буфера сообщения
+ * Память буферов выделяется из пула при создании очереди, при очистке
+ * очереди буферы, выросшие под крупные сообщения, уменьшаются до этого размера
+ */
+#define MESSAGE_QUEUE_BUFFER_SIZE 512
+
+/*
+ * Переменная емкость очереди
+ * Дополнительный буфер учитывается в бюджете по начальному размеру
+ * (MESSAGE_QUEUE_BUFFER_SIZE). Раз в MESSAGE_QUEUE_TRIM_PERIOD получений
+ * свободного буфера из очереди выводятся буферы, которые весь период
+ * оставались свободными (наименьшее число свободных буферов за период)
+ */
+#define MESSAGE_QUEUE_TRIM_PERIOD 256
+
+/*
+ * Магазины буферов (MESSAGE_QUEUE_LOCKED)
+ * Поток держит до MESSAGE_QUEUE_MAGAZINE_SIZE свободных буферов очереди
+ * без блокировки и обменивается ими со списком свободных пачками по
+ * половине магазина: общая блокировка захватывается раз в пачку, в том
+ * числе когда буферы получает один поток, а освобождает другой.
+ * Магазины есть только у очередей переменной емкости: при создании магазина
+ * очередь растет на его емкость (в пределах бюджета), поэтому буферы
+ * в магазинах не уменьшают число буферов, доступных другим потокам.
+ * Если очередь вырасти не может, поток работает без магазина.
+ * Магазины получают до MESSAGE_QUEUE_MAGAZINE_THREADS одновременно
+ * работающих потоков
+ */
+#define MESSAGE_QUEUE_MAGAZINE_SIZE    16
+#define MESSAGE_QUEUE_MAGAZINE_THREADS 64
+
+/*
+ * Операции реализации очереди
+ */
+struct message_queue_ops_t
+{
+  void               (*destroy)         (message_queue_t * queue);
+  message_buffer_t * (*get_free_buffer) (message_queue_t * queue);
+  message_buffer_t * (*get_ready_buffer)(message_queue_t * queue);
+  size_t             (*get_ready_batch) (message_queue_t * queue, message_buffer_t ** buffers, size_t count);
+  int                (*add_ready_buffer)(message_queue_t * queue, message_buffer_t * buffer);
+  void               (*put_back_buffer) (message_queue_t * queue, message_buffer_t * buffer);
+  void               (*release_buffer)  (message_queue_t * queue, message_buffer_t * buffer);
+  void               (*clear)           (message_queue_t * queue);
+  void               (*get_occupancy)   (message_queue_t * queue, message_queue_occupancy_t * occupancy);
+}; // struct message_queue_ops_t
+typedef struct message_queue_ops_t message_queue_ops_t;
+
+/*
+ * Общая часть всех реализаций (первое поле структуры реализации)
+ * Счетчики и емкость изменяет производитель, они вынесены в отдельную
+ * строку кэша
+ * Все созданные очереди входят в общий список (см. message_queue_foreach)
+ */
+struct message_queue_t
+{
+  const message_queue_ops_t * ops;
+  const char *                name;
+  struct message_queue_t *    registry_next;
+  struct message_queue_t *    registry_prev;
+  size_t                      min_size;  // начальная емкость
+  size_t                      max_size;  // наибольшая емкость
+  int                         shared_producers; // производителей несколько без общей
+                                                // блокировки: счетчики изменяются атомарно
+
+  unsigned long messages __attribute__((aligned(MESSAGE_QUEUE_CACHE_LINE)));
+  unsigned long wakeups;
+  unsigned long locks;       // захватов общей блокировки (изменяется под ней)
+  size_t        size;        // текущая емкость (буферов с памятью данных)
+  size_t        trim_count;  // получений свободного буфера за период
+  size_t        trim_low;    // наименьшее число свободных буферов за период
+}; // struct message_queue_t
+
+/*
+ * инициализация общей части: емкость от size до max_size буферов
+ */
+void message_queue_init_base(message_queue_t * queue, const message_queue_ops_t * ops, size_t size, size_t max_size);
+
+/*
+ * добавление буфера в очередь
+ * grow_begin проверяет, что емкость меньше наибольшей, и резервирует место
+ * в общем бюджете (0 - буфер можно добавить); grow_end завершает добавление:
+ * при успехе увеличивает емкость, при ошибке освобождает место в бюджете
+ */
+int message_queue_grow_begin(message_queue_t * queue);
+void message_queue_grow_end(message_queue_t * queue, int success);
+
+/*
+ * учет получения свободного буфера, free - свободных буферов после получения
+ * возвращает число буферов, которые нужно вывести из очереди (0 - почти всегда)
+ */
+static inline size_t message_queue_trim_check(message_queue_t * queue, size_t free)
+{
+  size_t surplus;
+
+  if (queue->max_size == queue->min_size)
+    return 0;
+
+  if (free < queue->trim_low)
+    queue->trim_low = free;
+  if (++queue->trim_count < MESSAGE_QUEUE_TRIM_PERIOD)
+    return 0;
+
+  surplus = queue->trim_low;
+  queue->trim_count = 0;
+  queue->trim_low = (size_t)(-1);
+  if (surplus > queue->size - queue->min_size)
+    surplus = queue->size - queue->min_size;
+  return surplus;
+}
+
+/*
+ * учет выведенных из очереди буферов (место в общем бюджете освобождается)
+ */
+void message_queue_shrunk(message_queue_t * queue, size_t count);
+
+/*
+ * память элементов очереди (заполнена нулями) из пула буферов: на узле NUMA,
+ * выбранном потоком, создающим очередь (см. buffer_pool_set_node)
+ */
+void * message_queue_alloc(size_t size);
+void message_queue_free(void * ptr, size_t size);
+
+/*
+ * создание очереди MESSAGE_QUEUE_SPSC
+ */
+message_queue_t * spsc_queue_create(size_t size, size_t max_size);
+
+/*
+ * создание очереди MESSAGE_QUEUE_MPMC
+ */
+message_queue_t * mpmc_queue_create(size_t size, size_t max_size);
+
+#endif // __MESSAGE_QUEUE_IMPL_H__
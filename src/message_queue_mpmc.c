@@ -0,0 +1,612 @@
+/*
+ * Очередь сообщений без общей блокировки (MESSAGE_QUEUE_MPMC)
+ *
+ * Для любого числа производителей и потребителей. Свободные и заполненные
+ * буферы передаются через два ограниченных кольцевых буфера с номером
+ * последовательности в каждой ячейке: поток занимает позицию кольца
+ * атомарным сравнением с обменом и по номеру ячейки определяет, записана
+ * ли она (для чтения) или уже прочитана (для записи).
+ * Кольца рассчитаны на наибольшую емкость очереди. Рост и уменьшение
+ * очереди (редкие) выполняются под блокировкой роста.
+ */
+
+#include "message_queue_impl.h"
+#include "message_buffer.h"
+#include "buffer_pool.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+
+#ifdef _DEBUG
+#include <stdio.h>
+#define DEBUG(msg...) fprintf(stderr, "%u: ", (int)(pthread_self())); fprintf(stderr, msg)
+#else
+#define DEBUG(mag...)
+#endif
+
+#define CACHE_ALIGNED __attribute__((aligned(MESSAGE_QUEUE_CACHE_LINE)))
+
+/*
+ * Учет периода уменьшения очереди ведется по каждому MPMC_TRIM_SAMPLE-му
+ * получению свободного буфера (период соответственно длиннее)
+ */
+#define MPMC_TRIM_SAMPLE 16
+
+/*
+ * Внутренние структуры
+ *
+ * Состояние буфера
+ */
+enum mpmc_buffer_state_t
+{
+  MPMC_BUFFER_FREE = 0,  // в кольце свободных буферов
+  MPMC_BUFFER_PRODUCING, // заполняется производителем
+  MPMC_BUFFER_READY,     // в кольце заполненных буферов или отложен потребителем
+  MPMC_BUFFER_CONSUMING, // обрабатывается потребителем
+  MPMC_BUFFER_RETIRED,   // выведен из очереди, без памяти данных
+}; // enum mpmc_buffer_state_t
+
+/*
+ * Внутренние структуры
+ *
+ * Буфер очереди с состоянием
+ */
+struct mpmc_slot_t
+{
+  message_buffer_t     buffer;
+  unsigned char        state;
+  struct mpmc_slot_t * retired_next;  // список выведенных из очереди
+  struct mpmc_slot_t * extra_next;    // список добавленных при росте
+  struct mpmc_slot_t * stash_next;    // список отложенных потребителями
+}; // struct mpmc_slot_t
+typedef struct mpmc_slot_t mpmc_slot_t;
+
+/*
+ * Внутренние структуры
+ *
+ * Ячейка кольца: номер последовательности равен позиции записи, если
+ * ячейка свободна, и позиции записи + 1, если записана
+ */
+struct mpmc_cell_t
+{
+  size_t             sequence;
+  message_buffer_t * buffer;
+}; // struct mpmc_cell_t
+typedef struct mpmc_cell_t mpmc_cell_t;
+
+/*
+ * Внутренние структуры
+ *
+ * Кольцевой буфер указателей для любого числа писателей и читателей
+ * Позиции записи и чтения находятся в разных строках кэша
+ */
+struct mpmc_ring_t
+{
+  size_t tail CACHE_ALIGNED;  // позиция записи
+  size_t head CACHE_ALIGNED;  // позиция чтения
+
+  mpmc_cell_t * cells CACHE_ALIGNED;
+  size_t mask;
+}; // struct mpmc_ring_t
+typedef struct mpmc_ring_t mpmc_ring_t;
+
+/*
+ * Очередь сообщений
+ */
+struct mpmc_queue_t
+{
+  message_queue_t base;
+
+  mpmc_slot_t * slots;     // начальные буферы (base.min_size)
+
+  mpmc_ring_t free_ring;   // потребители -> производители
+  mpmc_ring_t ready_ring;  // производители -> потребители
+
+  pthread_mutex_t grow_lock CACHE_ALIGNED; // рост и уменьшение очереди
+  mpmc_slot_t *   extra_slots;             // добавленные при росте (выделены отдельно)
+  mpmc_slot_t *   retired_slots;           // выведенные из очереди
+
+  pthread_mutex_t stash_lock CACHE_ALIGNED; // буферы, возвращенные потребителями (put_back)
+  mpmc_slot_t *   stash;
+  size_t          stashed;
+}; // struct mpmc_queue_t
+typedef struct mpmc_queue_t mpmc_queue_t;
+
+static int mpmc_ring_init(mpmc_ring_t * ring, size_t size)
+{
+  size_t capacity = 1;
+
+  while (capacity < size)
+    capacity <<= 1;
+
+  ring->cells = message_queue_alloc(capacity * sizeof(mpmc_cell_t));
+  if (ring->cells == NULL)
+    return -1;
+
+  ring->mask = capacity - 1;
+  return 0;
+}
+
+static void mpmc_ring_reset(mpmc_ring_t * ring)
+{
+  for (size_t i = 0; i <= ring->mask; ++i)
+  {
+    ring->cells[i].sequence = i;
+    ring->cells[i].buffer = NULL;
+  }
+  ring->head = ring->tail = 0;
+}
+
+static void mpmc_ring_destroy(mpmc_ring_t * ring)
+{
+  message_queue_free(ring->cells, (ring->mask + 1) * sizeof(mpmc_cell_t));
+}
+
+/*
+ * добавить буфер, position - занятая позиция записи
+ * В кольце есть место для всех буферов очереди, но ячейка может быть
+ * еще не освобождена читателем, который занял ее позицию и был прерван
+ * до записи номера: писатель ждет освобождения ячейки
+ */
+static void mpmc_ring_push(mpmc_ring_t * ring, message_buffer_t * buffer, size_t * position)
+{
+  size_t tail = __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED);
+  mpmc_cell_t * cell;
+
+  for (;;)
+  {
+    intptr_t difference;
+
+    cell = ring->cells + (tail & ring->mask);
+    difference = (intptr_t)(__atomic_load_n(&(cell->sequence), __ATOMIC_ACQUIRE)) - (intptr_t)(tail);
+    if (difference == 0)
+    {
+      if (__atomic_compare_exchange_n(&(ring->tail), &tail, tail + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (difference < 0)
+    {
+      sched_yield();
+      tail = __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED);
+    }
+    else
+    {
+      tail = __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->buffer = buffer;
+  __atomic_store_n(&(cell->sequence), tail + 1, __ATOMIC_RELEASE);
+  if (position != NULL)
+    *position = tail;
+}
+
+/*
+ * извлечь буфер
+ * если кольцо пусто (или ячейка еще не записана писателем, занявшим ее
+ * позицию), возвращается NULL
+ */
+static message_buffer_t * mpmc_ring_pop(mpmc_ring_t * ring, size_t * position)
+{
+  size_t head = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+  message_buffer_t * buffer;
+  mpmc_cell_t * cell;
+
+  for (;;)
+  {
+    intptr_t difference;
+
+    cell = ring->cells + (head & ring->mask);
+    difference = (intptr_t)(__atomic_load_n(&(cell->sequence), __ATOMIC_ACQUIRE)) - (intptr_t)(head + 1);
+    if (difference == 0)
+    {
+      if (__atomic_compare_exchange_n(&(ring->head), &head, head + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (difference < 0)
+    {
+      // парный барьер - в mpmc_queue_add_ready_buffer: либо читатель увидит
+      // новый буфер, либо писатель увидит пустое кольцо и уведомит читателя
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      difference = (intptr_t)(__atomic_load_n(&(cell->sequence), __ATOMIC_ACQUIRE)) - (intptr_t)(head + 1);
+      if (difference < 0)
+        return NULL;
+      head = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+    }
+    else
+    {
+      head = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+    }
+  }
+
+  buffer = cell->buffer;
+  __atomic_store_n(&(cell->sequence), head + ring->mask + 1, __ATOMIC_RELEASE);
+  if (position != NULL)
+    *position = head;
+  return buffer;
+}
+
+/*
+ * число буферов в кольце (приблизительно)
+ */
+static size_t mpmc_ring_count(mpmc_ring_t * ring)
+{
+  size_t head = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+  size_t tail = __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED);
+
+  return tail > head ? tail - head : 0;
+}
+
+static mpmc_slot_t * mpmc_queue_slot(message_buffer_t * buffer)
+{
+  return (mpmc_slot_t *)((char *)(buffer) - offsetof(mpmc_slot_t, buffer));
+}
+
+static void mpmc_queue_destroy(message_queue_t * base)
+{
+  mpmc_queue_t * queue = (mpmc_queue_t *)(base);
+  mpmc_slot_t * slot;
+
+  if (queue->slots != NULL)
+  {
+    for (size_t i = 0; i < queue->base.min_size; ++i)
+    {
+      message_buffer_destroy(&(queue->slots[i].buffer));
+    }
+    message_queue_free(queue->slots, queue->base.min_size * sizeof(mpmc_slot_t));
+  }
+  while ((slot = queue->extra_slots) != NULL)
+  {
+    queue->extra_slots = slot->extra_next;
+    message_buffer_destroy(&(slot->buffer));
+    free(slot);
+  }
+  mpmc_ring_destroy(&(queue->free_ring));
+  mpmc_ring_destroy(&(queue->ready_ring));
+  pthread_mutex_destroy(&(queue->grow_lock));
+  pthread_mutex_destroy(&(queue->stash_lock));
+  free(queue);
+}
+
+/*
+ * вернуть буфер в кольцо свободных, пока их меньше начальной емкости,
+ * остальные буферы вывести из очереди
+ */
+static void mpmc_queue_clear_slot(mpmc_queue_t * queue, mpmc_slot_t * slot, size_t * count)
+{
+  if (*count < queue->base.min_size)
+  {
+    if (slot->state == MPMC_BUFFER_RETIRED)
+    {
+      message_buffer_init(&(slot->buffer), MESSAGE_QUEUE_BUFFER_SIZE);
+    }
+    else
+    {
+      message_buffer_resize(&(slot->buffer), MESSAGE_QUEUE_BUFFER_SIZE);
+    }
+    slot->state = MPMC_BUFFER_FREE;
+    mpmc_ring_push(&(queue->free_ring), &(slot->buffer), NULL);
+    ++*count;
+  }
+  else
+  {
+    message_buffer_destroy(&(slot->buffer));
+    slot->state = MPMC_BUFFER_RETIRED;
+    slot->retired_next = queue->retired_slots;
+    queue->retired_slots = slot;
+  }
+}
+
+/*
+ * вернуть все буферы в кольцо свободных
+ * буферы сверх начальной емкости выводятся из очереди
+ */
+static void mpmc_queue_clear(message_queue_t * base)
+{
+  mpmc_queue_t * queue = (mpmc_queue_t *)(base);
+  size_t count = 0;
+
+  mpmc_ring_reset(&(queue->free_ring));
+  mpmc_ring_reset(&(queue->ready_ring));
+  queue->stash = NULL;
+  queue->stashed = 0;
+  queue->retired_slots = NULL;
+
+  for (size_t i = 0; i < queue->base.min_size; ++i)
+  {
+    mpmc_queue_clear_slot(queue, queue->slots + i, &count);
+  }
+  for (mpmc_slot_t * slot = queue->extra_slots; slot != NULL; slot = slot->extra_next)
+  {
+    mpmc_queue_clear_slot(queue, slot, &count);
+  }
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * добавить в очередь буфер (под блокировкой роста)
+ * используется буфер, выведенный из очереди ранее, или новый
+ * если емкость или бюджет исчерпаны, возвращается NULL
+ */
+static message_buffer_t * mpmc_queue_grow(mpmc_queue_t * queue)
+{
+  mpmc_slot_t * slot;
+
+  if (message_queue_grow_begin(&(queue->base)) != 0)
+    return NULL;
+
+  slot = queue->retired_slots;
+  if (slot != NULL)
+  {
+    if (message_buffer_init(&(slot->buffer), MESSAGE_QUEUE_BUFFER_SIZE) != 0)
+    {
+      message_queue_grow_end(&(queue->base), 0);
+      return NULL;
+    }
+    queue->retired_slots = slot->retired_next;
+  }
+  else
+  {
+    slot = calloc(1, sizeof(mpmc_slot_t));
+    if (slot == NULL || message_buffer_init(&(slot->buffer), MESSAGE_QUEUE_BUFFER_SIZE) != 0)
+    {
+      free(slot);
+      message_queue_grow_end(&(queue->base), 0);
+      return NULL;
+    }
+    slot->extra_next = queue->extra_slots;
+    queue->extra_slots = slot;
+  }
+
+  DEBUG("mpmc_queue_grow(queue = %p) size = %zu\n", queue, queue->base.size + 1);
+  message_queue_grow_end(&(queue->base), 1);
+  return &(slot->buffer);
+}
+
+/*
+ * вывести из очереди до count свободных буферов (под блокировкой роста)
+ */
+static void mpmc_queue_trim(mpmc_queue_t * queue, size_t count)
+{
+  message_buffer_t * buffer;
+  size_t trimmed = 0;
+
+  while (trimmed < count && (buffer = mpmc_ring_pop(&(queue->free_ring), NULL)) != NULL)
+  {
+    mpmc_slot_t * slot = mpmc_queue_slot(buffer);
+
+    message_buffer_destroy(buffer);
+    slot->state = MPMC_BUFFER_RETIRED;
+    slot->retired_next = queue->retired_slots;
+    queue->retired_slots = slot;
+    ++trimmed;
+  }
+
+  DEBUG("mpmc_queue_trim(queue = %p) size = %zu\n", queue, queue->base.size - trimmed);
+  message_queue_shrunk(&(queue->base), trimmed);
+}
+
+/*
+ * получить свободный буфер
+ * если свободных буферов нет, очередь растет в пределах бюджета,
+ * иначе возвращается NULL
+ */
+static message_buffer_t * mpmc_queue_get_free_buffer(message_queue_t * base)
+{
+  mpmc_queue_t * queue = (mpmc_queue_t *)(base);
+  message_buffer_t * buffer;
+  size_t position;
+
+  buffer = mpmc_ring_pop(&(queue->free_ring), &position);
+  if (buffer == NULL)
+  {
+    pthread_mutex_lock(&(queue->grow_lock));
+    buffer = mpmc_queue_grow(queue);
+    pthread_mutex_unlock(&(queue->grow_lock));
+    if (buffer == NULL)
+      return NULL;
+  }
+  else if (base->max_size != base->min_size && position % MPMC_TRIM_SAMPLE == 0 &&
+           pthread_mutex_trylock(&(queue->grow_lock)) == 0)
+  {
+    size_t surplus = message_queue_trim_check(base, mpmc_ring_count(&(queue->free_ring)));
+    if (surplus > 0)
+    {
+      mpmc_queue_trim(queue, surplus);
+    }
+    pthread_mutex_unlock(&(queue->grow_lock));
+  }
+
+  mpmc_queue_slot(buffer)->state = MPMC_BUFFER_PRODUCING;
+  return buffer;
+}
+
+/*
+ * пометить буфер как "заполненный"
+ */
+static int mpmc_queue_add_ready_buffer(message_queue_t * base, message_buffer_t * buffer)
+{
+  mpmc_queue_t * queue = (mpmc_queue_t *)(base);
+  mpmc_slot_t * slot = mpmc_queue_slot(buffer);
+  size_t position;
+
+  DEBUG("mpmc_queue_add_ready_buffer(queue = %p, buffer = %p)\n", queue, buffer);
+  assert(slot->state == MPMC_BUFFER_PRODUCING);
+  slot->state = MPMC_BUFFER_READY;
+  mpmc_ring_push(&(queue->ready_ring), buffer, &position);
+
+  // кольцо было пусто, если читатели уже забрали все буферы до добавленного
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_load_n(&(queue->ready_ring.head), __ATOMIC_RELAXED) == position;
+}
+
+/*
+ * получить заполненный буфер
+ * сначала - отложенные потребителями (put_back)
+ */
+static message_buffer_t * mpmc_queue_get_ready_buffer(message_queue_t * base)
+{
+  mpmc_queue_t * queue = (mpmc_queue_t *)(base);
+  message_buffer_t * buffer = NULL;
+
+  if (__atomic_load_n(&(queue->stashed), __ATOMIC_ACQUIRE) != 0)
+  {
+    pthread_mutex_lock(&(queue->stash_lock));
+    if (queue->stash != NULL)
+    {
+      buffer = &(queue->stash->buffer);
+      queue->stash = queue->stash->stash_next;
+      __atomic_store_n(&(queue->stashed), queue->stashed - 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&(queue->stash_lock));
+  }
+  if (buffer == NULL)
+  {
+    buffer = mpmc_ring_pop(&(queue->ready_ring), NULL);
+    if (buffer == NULL)
+      return NULL;
+  }
+
+  mpmc_queue_slot(buffer)->state = MPMC_BUFFER_CONSUMING;
+  return buffer;
+}
+
+/*
+ * получить до count заполненных буферов
+ */
+static size_t mpmc_queue_get_ready_batch(message_queue_t * base, message_buffer_t ** buffers, size_t count)
+{
+  size_t received = 0;
+
+  while (received < count && (buffers[received] = mpmc_queue_get_ready_buffer(base)) != NULL)
+  {
+    ++received;
+  }
+  return received;
+}
+
+/*
+ * пометить буфер как "свободный"
+ * буфер, полученный производителем и не заполненный, тоже возвращается
+ * в кольцо свободных
+ */
+static void mpmc_queue_release_buffer(message_queue_t * base, message_buffer_t * buffer)
+{
+  mpmc_queue_t * queue = (mpmc_queue_t *)(base);
+  mpmc_slot_t * slot = mpmc_queue_slot(buffer);
+
+  DEBUG("mpmc_queue_release_buffer(queue = %p, buffer = %p)\n", queue, buffer);
+  assert(slot->state == MPMC_BUFFER_PRODUCING || slot->state == MPMC_BUFFER_CONSUMING);
+  slot->state = MPMC_BUFFER_FREE;
+  mpmc_ring_push(&(queue->free_ring), buffer, NULL);
+}
+
+/*
+ * вернуть неиспользованный заполненный буфер в начало очереди
+ */
+static void mpmc_queue_put_back_buffer(message_queue_t * base, message_buffer_t * buffer)
+{
+  mpmc_queue_t * queue = (mpmc_queue_t *)(base);
+  mpmc_slot_t * slot = mpmc_queue_slot(buffer);
+
+  if (buffer->size == 0)
+  {
+    mpmc_queue_release_buffer(base, buffer);
+    return;
+  }
+
+  assert(slot->state == MPMC_BUFFER_CONSUMING);
+  slot->state = MPMC_BUFFER_READY;
+  pthread_mutex_lock(&(queue->stash_lock));
+  slot->stash_next = queue->stash;
+  queue->stash = slot;
+  __atomic_store_n(&(queue->stashed), queue->stashed + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&(queue->stash_lock));
+}
+
+/*
+ * состояние буферов по позициям колец (снимок приблизительный)
+ */
+static void mpmc_queue_get_occupancy(message_queue_t * base, message_queue_occupancy_t * occupancy)
+{
+  mpmc_queue_t * queue = (mpmc_queue_t *)(base);
+  size_t size = __atomic_load_n(&(base->size), __ATOMIC_RELAXED);
+
+  occupancy->free  = mpmc_ring_count(&(queue->free_ring));
+  occupancy->ready = mpmc_ring_count(&(queue->ready_ring)) + __atomic_load_n(&(queue->stashed), __ATOMIC_RELAXED);
+  if (occupancy->free > size)
+    occupancy->free = size;
+  if (occupancy->ready > size - occupancy->free)
+    occupancy->ready = size - occupancy->free;
+  occupancy->busy = size - occupancy->free - occupancy->ready;
+}
+
+static const message_queue_ops_t mpmc_queue_ops =
+{
+  mpmc_queue_destroy,
+  mpmc_queue_get_free_buffer,
+  mpmc_queue_get_ready_buffer,
+  mpmc_queue_get_ready_batch,
+  mpmc_queue_add_ready_buffer,
+  mpmc_queue_put_back_buffer,
+  mpmc_queue_release_buffer,
+  mpmc_queue_clear,
+  mpmc_queue_get_occupancy,
+};
+
+/*
+ * создание очереди MESSAGE_QUEUE_MPMC
+ */
+message_queue_t * mpmc_queue_create(size_t size, size_t max_size)
+{
+  mpmc_queue_t * queue = NULL;
+  int error;
+
+  if (posix_memalign((void **)(&queue), MESSAGE_QUEUE_CACHE_LINE, sizeof(mpmc_queue_t)) != 0)
+    return NULL;
+  memset(queue, 0, sizeof(mpmc_queue_t));
+  message_queue_init_base(&(queue->base), &mpmc_queue_ops, size, max_size);
+  queue->base.shared_producers = 1;
+  pthread_mutex_init(&(queue->grow_lock), NULL);
+  pthread_mutex_init(&(queue->stash_lock), NULL);
+
+  // в кольцах есть место для всех буферов наибольшей емкости
+  queue->slots = message_queue_alloc(size * sizeof(mpmc_slot_t));
+  if (queue->slots == NULL ||
+      mpmc_ring_init(&(queue->free_ring), queue->base.max_size) != 0 ||
+      mpmc_ring_init(&(queue->ready_ring), queue->base.max_size) != 0)
+  {
+    error = errno;
+    mpmc_queue_destroy(&(queue->base));
+    errno = error;
+    return NULL;
+  }
+
+  // память начальных буферов очереди выделяется и заполняется сразу
+  if (buffer_pool_reserve(MESSAGE_QUEUE_BUFFER_SIZE, size) != 0)
+  {
+    error = errno;
+    mpmc_queue_destroy(&(queue->base));
+    errno = error;
+    return NULL;
+  }
+
+  for (size_t i = 0; i < size; ++i)
+  {
+    if (message_buffer_init(&(queue->slots[i].buffer), MESSAGE_QUEUE_BUFFER_SIZE) != 0)
+    {
+      error = errno;
+      mpmc_queue_destroy(&(queue->base));
+      errno = error;
+      return NULL;
+    }
+  }
+
+  mpmc_queue_clear(&(queue->base));
+  return &(queue->base);
+}
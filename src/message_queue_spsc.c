@@ -0,0 +1,530 @@
+/*
+ * Очередь сообщений без блокировок (MESSAGE_QUEUE_SPSC)
+ *
+ * Для одного потока-производителя (get_free/add_ready) и одного
+ * потока-потребителя (get_ready/put_back/release). Свободные и заполненные
+ * буферы передаются между потоками через два кольцевых буфера:
+ * заполненные - от производителя к потребителю, свободные - обратно.
+ * Кольца рассчитаны на наибольшую емкость очереди; буферы добавляет
+ * и выводит из очереди только производитель.
+ */
+
+#include "message_queue_impl.h"
+#include "message_buffer.h"
+#include "buffer_pool.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef _DEBUG
+#include <stdio.h>
+#include <pthread.h>
+#define DEBUG(msg...) fprintf(stderr, "%u: ", (int)(pthread_self())); fprintf(stderr, msg)
+#else
+#define DEBUG(mag...)
+#endif
+
+#define CACHE_ALIGNED __attribute__((aligned(MESSAGE_QUEUE_CACHE_LINE)))
+
+/*
+ * Внутренние структуры
+ *
+ * Состояние буфера
+ */
+enum spsc_buffer_state_t
+{
+  SPSC_BUFFER_FREE = 0,  // в кольце свободных буферов
+  SPSC_BUFFER_PRODUCING, // заполняется производителем
+  SPSC_BUFFER_READY,     // в кольце заполненных буферов или отложен потребителем
+  SPSC_BUFFER_CONSUMING, // обрабатывается потребителем
+  SPSC_BUFFER_RETIRED,   // выведен из очереди производителем, без памяти данных
+}; // enum spsc_buffer_state_t
+
+/*
+ * Внутренние структуры
+ *
+ * Буфер очереди с состоянием
+ */
+struct spsc_slot_t
+{
+  message_buffer_t     buffer;
+  unsigned char        state;
+  struct spsc_slot_t * retired_next;  // список выведенных из очереди
+  struct spsc_slot_t * extra_next;    // список добавленных при росте
+}; // struct spsc_slot_t
+typedef struct spsc_slot_t spsc_slot_t;
+
+/*
+ * Внутренние структуры
+ *
+ * Кольцевой буфер указателей для одного писателя и одного читателя
+ * Индексы писателя и читателя находятся в разных строках кэша,
+ * каждая сторона хранит копию последнего прочитанного индекса другой стороны
+ */
+struct spsc_ring_t
+{
+  size_t head CACHE_ALIGNED;  // позиция чтения (изменяет читатель)
+  size_t cached_tail;         // копия tail у читателя
+
+  size_t tail CACHE_ALIGNED;  // позиция записи (изменяет писатель)
+  size_t cached_head;         // копия head у писателя
+
+  message_buffer_t ** slots CACHE_ALIGNED;
+  size_t mask;
+}; // struct spsc_ring_t
+typedef struct spsc_ring_t spsc_ring_t;
+
+/*
+ * Очередь сообщений
+ */
+struct spsc_queue_t
+{
+  message_queue_t base;
+
+  spsc_slot_t * slots;     // начальные буферы (base.min_size)
+
+  spsc_ring_t free_ring;   // потребитель -> производитель
+  spsc_ring_t ready_ring;  // производитель -> потребитель
+
+  message_buffer_t * producer_stash CACHE_ALIGNED; // буфер, освобожденный производителем без заполнения
+  spsc_slot_t *      extra_slots;                  // добавленные при росте (выделены отдельно)
+  spsc_slot_t *      retired_slots;                // выведенные из очереди
+  message_buffer_t * consumer_stash CACHE_ALIGNED; // буфер, возвращенный потребителем (put_back)
+}; // struct spsc_queue_t
+typedef struct spsc_queue_t spsc_queue_t;
+
+static int spsc_ring_init(spsc_ring_t * ring, size_t size)
+{
+  size_t capacity = 1;
+
+  while (capacity < size)
+    capacity <<= 1;
+
+  ring->slots = message_queue_alloc(capacity * sizeof(message_buffer_t *));
+  if (ring->slots == NULL)
+    return -1;
+
+  ring->mask = capacity - 1;
+  ring->head = ring->tail = 0;
+  ring->cached_head = ring->cached_tail = 0;
+  return 0;
+}
+
+static void spsc_ring_reset(spsc_ring_t * ring)
+{
+  ring->head = ring->tail = 0;
+  ring->cached_head = ring->cached_tail = 0;
+}
+
+/*
+ * добавить буфер (поток-писатель)
+ */
+static int spsc_ring_push(spsc_ring_t * ring, message_buffer_t * buffer)
+{
+  size_t tail = ring->tail;
+
+  if (tail - ring->cached_head > ring->mask)
+  {
+    ring->cached_head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+    if (tail - ring->cached_head > ring->mask)
+      return -1;
+  }
+
+  ring->slots[tail & ring->mask] = buffer;
+  __atomic_store_n(&(ring->tail), tail + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/*
+ * извлечь буфер (поток-читатель)
+ */
+static message_buffer_t * spsc_ring_pop(spsc_ring_t * ring)
+{
+  size_t head = ring->head;
+  message_buffer_t * buffer;
+
+  if (head == ring->cached_tail)
+  {
+    // парный барьер - в spsc_queue_add_ready_buffer: либо читатель увидит
+    // новый буфер, либо писатель увидит пустое кольцо и уведомит читателя
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    ring->cached_tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+    if (head == ring->cached_tail)
+      return NULL;
+  }
+
+  buffer = ring->slots[head & ring->mask];
+  __atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+  return buffer;
+}
+
+static spsc_slot_t * spsc_queue_slot(message_buffer_t * buffer)
+{
+  return (spsc_slot_t *)((char *)(buffer) - offsetof(spsc_slot_t, buffer));
+}
+
+static void spsc_queue_destroy(message_queue_t * base)
+{
+  spsc_queue_t * queue = (spsc_queue_t *)(base);
+  spsc_slot_t * slot;
+
+  if (queue->slots != NULL)
+  {
+    for (size_t i = 0; i < queue->base.min_size; ++i)
+    {
+      message_buffer_destroy(&(queue->slots[i].buffer));
+    }
+    message_queue_free(queue->slots, queue->base.min_size * sizeof(spsc_slot_t));
+  }
+  while ((slot = queue->extra_slots) != NULL)
+  {
+    queue->extra_slots = slot->extra_next;
+    message_buffer_destroy(&(slot->buffer));
+    free(slot);
+  }
+  message_queue_free(queue->free_ring.slots, (queue->free_ring.mask + 1) * sizeof(message_buffer_t *));
+  message_queue_free(queue->ready_ring.slots, (queue->ready_ring.mask + 1) * sizeof(message_buffer_t *));
+  free(queue);
+}
+
+/*
+ * вернуть буфер в кольцо свободных, пока их меньше начальной емкости,
+ * остальные буферы вывести из очереди
+ */
+static void spsc_queue_clear_slot(spsc_queue_t * queue, spsc_slot_t * slot, size_t * count)
+{
+  if (*count < queue->base.min_size)
+  {
+    if (slot->state == SPSC_BUFFER_RETIRED)
+    {
+      message_buffer_init(&(slot->buffer), MESSAGE_QUEUE_BUFFER_SIZE);
+    }
+    else
+    {
+      message_buffer_resize(&(slot->buffer), MESSAGE_QUEUE_BUFFER_SIZE);
+    }
+    slot->state = SPSC_BUFFER_FREE;
+    spsc_ring_push(&(queue->free_ring), &(slot->buffer));
+    ++*count;
+  }
+  else
+  {
+    message_buffer_destroy(&(slot->buffer));
+    slot->state = SPSC_BUFFER_RETIRED;
+    slot->retired_next = queue->retired_slots;
+    queue->retired_slots = slot;
+  }
+}
+
+/*
+ * вернуть все буферы в кольцо свободных
+ * буферы сверх начальной емкости выводятся из очереди
+ */
+static void spsc_queue_clear(message_queue_t * base)
+{
+  spsc_queue_t * queue = (spsc_queue_t *)(base);
+  size_t count = 0;
+
+  spsc_ring_reset(&(queue->free_ring));
+  spsc_ring_reset(&(queue->ready_ring));
+  queue->producer_stash = queue->consumer_stash = NULL;
+  queue->retired_slots = NULL;
+
+  for (size_t i = 0; i < queue->base.min_size; ++i)
+  {
+    spsc_queue_clear_slot(queue, queue->slots + i, &count);
+  }
+  for (spsc_slot_t * slot = queue->extra_slots; slot != NULL; slot = slot->extra_next)
+  {
+    spsc_queue_clear_slot(queue, slot, &count);
+  }
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * добавить в очередь буфер (поток-производитель)
+ * используется буфер, выведенный из очереди ранее, или новый
+ * если емкость или бюджет исчерпаны, возвращается NULL
+ */
+static message_buffer_t * spsc_queue_grow(spsc_queue_t * queue)
+{
+  spsc_slot_t * slot;
+
+  if (message_queue_grow_begin(&(queue->base)) != 0)
+    return NULL;
+
+  slot = queue->retired_slots;
+  if (slot != NULL)
+  {
+    if (message_buffer_init(&(slot->buffer), MESSAGE_QUEUE_BUFFER_SIZE) != 0)
+    {
+      message_queue_grow_end(&(queue->base), 0);
+      return NULL;
+    }
+    queue->retired_slots = slot->retired_next;
+  }
+  else
+  {
+    slot = calloc(1, sizeof(spsc_slot_t));
+    if (slot == NULL || message_buffer_init(&(slot->buffer), MESSAGE_QUEUE_BUFFER_SIZE) != 0)
+    {
+      free(slot);
+      message_queue_grow_end(&(queue->base), 0);
+      return NULL;
+    }
+    slot->extra_next = queue->extra_slots;
+    queue->extra_slots = slot;
+  }
+
+  DEBUG("spsc_queue_grow(queue = %p) size = %zu\n", queue, queue->base.size + 1);
+  message_queue_grow_end(&(queue->base), 1);
+  return &(slot->buffer);
+}
+
+/*
+ * вывести из очереди до count свободных буферов (поток-производитель)
+ */
+static void spsc_queue_trim(spsc_queue_t * queue, size_t count)
+{
+  message_buffer_t * buffer;
+  size_t trimmed = 0;
+
+  while (trimmed < count && (buffer = spsc_ring_pop(&(queue->free_ring))) != NULL)
+  {
+    spsc_slot_t * slot = spsc_queue_slot(buffer);
+
+    message_buffer_destroy(buffer);
+    slot->state = SPSC_BUFFER_RETIRED;
+    slot->retired_next = queue->retired_slots;
+    queue->retired_slots = slot;
+    ++trimmed;
+  }
+
+  DEBUG("spsc_queue_trim(queue = %p) size = %zu\n", queue, queue->base.size - trimmed);
+  message_queue_shrunk(&(queue->base), trimmed);
+}
+
+/*
+ * получить свободный буфер (поток-производитель)
+ * если свободных буферов нет, очередь растет в пределах бюджета,
+ * иначе возвращается NULL
+ */
+static message_buffer_t * spsc_queue_get_free_buffer(message_queue_t * base)
+{
+  spsc_queue_t * queue = (spsc_queue_t *)(base);
+  message_buffer_t * buffer = queue->producer_stash;
+
+  if (buffer != NULL)
+  {
+    queue->producer_stash = NULL;
+  }
+  else
+  {
+    buffer = spsc_ring_pop(&(queue->free_ring));
+    if (buffer == NULL)
+    {
+      buffer = spsc_queue_grow(queue);
+      if (buffer == NULL)
+        return NULL;
+    }
+    else if (base->max_size != base->min_size)
+    {
+      // свободных буферов после получения (индекс потребителя читается
+      // только для очереди переменной емкости)
+      size_t free = __atomic_load_n(&(queue->free_ring.tail), __ATOMIC_RELAXED) - queue->free_ring.head;
+      size_t surplus = message_queue_trim_check(base, free);
+      if (surplus > 0)
+      {
+        spsc_queue_trim(queue, surplus);
+      }
+    }
+  }
+
+  spsc_queue_slot(buffer)->state = SPSC_BUFFER_PRODUCING;
+  return buffer;
+}
+
+/*
+ * пометить буфер как "заполненный" (поток-производитель)
+ */
+static int spsc_queue_add_ready_buffer(message_queue_t * base, message_buffer_t * buffer)
+{
+  spsc_queue_t * queue = (spsc_queue_t *)(base);
+  spsc_slot_t * slot = spsc_queue_slot(buffer);
+  size_t tail = queue->ready_ring.tail;
+
+  DEBUG("spsc_queue_add_ready_buffer(queue = %p, buffer = %p)\n", queue, buffer);
+  assert(slot->state == SPSC_BUFFER_PRODUCING);
+  slot->state = SPSC_BUFFER_READY;
+  // буферов не больше, чем мест в кольце - добавление всегда успешно
+  spsc_ring_push(&(queue->ready_ring), buffer);
+
+  // кольцо было пусто, если читатель уже забрал все буферы до добавленного
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_load_n(&(queue->ready_ring.head), __ATOMIC_RELAXED) == tail;
+}
+
+/*
+ * получить заполненный буфер (поток-потребитель)
+ */
+static message_buffer_t * spsc_queue_get_ready_buffer(message_queue_t * base)
+{
+  spsc_queue_t * queue = (spsc_queue_t *)(base);
+  message_buffer_t * buffer = queue->consumer_stash;
+
+  if (buffer != NULL)
+  {
+    queue->consumer_stash = NULL;
+  }
+  else
+  {
+    buffer = spsc_ring_pop(&(queue->ready_ring));
+    if (buffer == NULL)
+      return NULL;
+  }
+
+  spsc_queue_slot(buffer)->state = SPSC_BUFFER_CONSUMING;
+  return buffer;
+}
+
+/*
+ * получить до count заполненных буферов (поток-потребитель)
+ */
+static size_t spsc_queue_get_ready_batch(message_queue_t * base, message_buffer_t ** buffers, size_t count)
+{
+  size_t received = 0;
+
+  while (received < count && (buffers[received] = spsc_queue_get_ready_buffer(base)) != NULL)
+  {
+    ++received;
+  }
+  return received;
+}
+
+/*
+ * пометить буфер как "свободный"
+ * буфер, полученный производителем и не заполненный, остается у производителя
+ */
+static void spsc_queue_release_buffer(message_queue_t * base, message_buffer_t * buffer)
+{
+  spsc_queue_t * queue = (spsc_queue_t *)(base);
+  spsc_slot_t * slot = spsc_queue_slot(buffer);
+
+  DEBUG("spsc_queue_release_buffer(queue = %p, buffer = %p)\n", queue, buffer);
+  if (slot->state == SPSC_BUFFER_PRODUCING)
+  {
+    assert(queue->producer_stash == NULL);
+    queue->producer_stash = buffer;
+    return;
+  }
+
+  assert(slot->state == SPSC_BUFFER_CONSUMING);
+  slot->state = SPSC_BUFFER_FREE;
+  spsc_ring_push(&(queue->free_ring), buffer);
+}
+
+/*
+ * вернуть неиспользованный заполненный буфер в начало очереди (поток-потребитель)
+ * одновременно может быть возвращен только один буфер
+ */
+static void spsc_queue_put_back_buffer(message_queue_t * base, message_buffer_t * buffer)
+{
+  spsc_queue_t * queue = (spsc_queue_t *)(base);
+  spsc_slot_t * slot = spsc_queue_slot(buffer);
+
+  if (buffer->size == 0)
+  {
+    spsc_queue_release_buffer(base, buffer);
+    return;
+  }
+
+  assert(slot->state == SPSC_BUFFER_CONSUMING);
+  assert(queue->consumer_stash == NULL);
+  slot->state = SPSC_BUFFER_READY;
+  queue->consumer_stash = buffer;
+}
+
+/*
+ * состояние буферов по индексам колец (читаются без синхронизации
+ * с производителем и потребителем - снимок приблизительный)
+ */
+static void spsc_queue_get_occupancy(message_queue_t * base, message_queue_occupancy_t * occupancy)
+{
+  spsc_queue_t * queue = (spsc_queue_t *)(base);
+  size_t size = __atomic_load_n(&(base->size), __ATOMIC_RELAXED);
+
+  occupancy->free  = __atomic_load_n(&(queue->free_ring.tail), __ATOMIC_RELAXED) -
+                     __atomic_load_n(&(queue->free_ring.head), __ATOMIC_RELAXED);
+  occupancy->ready = __atomic_load_n(&(queue->ready_ring.tail), __ATOMIC_RELAXED) -
+                     __atomic_load_n(&(queue->ready_ring.head), __ATOMIC_RELAXED) +
+                     (__atomic_load_n(&(queue->consumer_stash), __ATOMIC_RELAXED) != NULL);
+  if (occupancy->free > size)
+    occupancy->free = size;
+  if (occupancy->ready > size - occupancy->free)
+    occupancy->ready = size - occupancy->free;
+  occupancy->busy = size - occupancy->free - occupancy->ready;
+}
+
+static const message_queue_ops_t spsc_queue_ops =
+{
+  spsc_queue_destroy,
+  spsc_queue_get_free_buffer,
+  spsc_queue_get_ready_buffer,
+  spsc_queue_get_ready_batch,
+  spsc_queue_add_ready_buffer,
+  spsc_queue_put_back_buffer,
+  spsc_queue_release_buffer,
+  spsc_queue_clear,
+  spsc_queue_get_occupancy,
+};
+
+/*
+ * создание очереди MESSAGE_QUEUE_SPSC
+ */
+message_queue_t * spsc_queue_create(size_t size, size_t max_size)
+{
+  spsc_queue_t * queue = NULL;
+  int error;
+
+  if (posix_memalign((void **)(&queue), MESSAGE_QUEUE_CACHE_LINE, sizeof(spsc_queue_t)) != 0)
+    return NULL;
+  memset(queue, 0, sizeof(spsc_queue_t));
+  message_queue_init_base(&(queue->base), &spsc_queue_ops, size, max_size);
+
+  // в кольцах есть место для всех буферов наибольшей емкости
+  queue->slots = message_queue_alloc(size * sizeof(spsc_slot_t));
+  if (queue->slots == NULL ||
+      spsc_ring_init(&(queue->free_ring), queue->base.max_size) != 0 ||
+      spsc_ring_init(&(queue->ready_ring), queue->base.max_size) != 0)
+  {
+    error = errno;
+    spsc_queue_destroy(&(queue->base));
+    errno = error;
+    return NULL;
+  }
+
+  // память начальных буферов очереди выделяется и заполняется сразу
+  if (buffer_pool_reserve(MESSAGE_QUEUE_BUFFER_SIZE, size) != 0)
+  {
+    error = errno;
+    spsc_queue_destroy(&(queue->base));
+    errno = error;
+    return NULL;
+  }
+
+  for (size_t i = 0; i < size; ++i)
+  {
+    if (message_buffer_init(&(queue->slots[i].buffer), MESSAGE_QUEUE_BUFFER_SIZE) != 0)
+    {
+      error = errno;
+      spsc_queue_destroy(&(queue->base));
+      errno = error;
+      return NULL;
+    }
+  }
+
+  spsc_queue_clear(&(queue->base));
+  return &(queue->base);
+}
@@ -0,0 +1,351 @@
+/*
+ * Счетчики сервера
+ */
+
+#include "metrics.h"
+#include "message_queue.h"
+#include "buffer_pool.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifdef _DEBUG
+#define DEBUG(msg...) fprintf(stderr, "%u: ", (int)(pthread_self())); fprintf(stderr, msg)
+#else
+#define DEBUG(mag...)
+#endif
+
+/*
+ * Наибольший размер запроса к серверу метрик и время его ожидания
+ */
+#define METRICS_REQUEST_SIZE 4096
+static const int METRICS_REQUEST_TIMEOUT = 1; // секунд
+
+/*
+ * Число различных имен очередей в снимке
+ */
+#define METRICS_QUEUE_NAMES 8
+
+__thread metrics_t * metrics_local = NULL;
+
+/*
+ * Наборы счетчиков всех потоков (добавляются в начало, не удаляются)
+ */
+static pthread_mutex_t metrics_lock  = PTHREAD_MUTEX_INITIALIZER;
+static metrics_t *     metrics_first = NULL;
+static int             metrics_count = 0;
+
+metrics_t * metrics_register(void)
+{
+  metrics_t * metrics;
+
+  if (posix_memalign((void **)(&metrics), 64, sizeof(metrics_t)) != 0)
+  {
+    // без памяти счетчики потока не учитываются
+    static __thread metrics_t lost;
+    metrics_local = &lost;
+    return metrics_local;
+  }
+  memset(metrics, 0, sizeof(metrics_t));
+  metrics->role = "other";
+
+  pthread_mutex_lock(&metrics_lock);
+  metrics->index = metrics_count++;
+  metrics->next  = metrics_first;
+  __atomic_store_n(&metrics_first, metrics, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&metrics_lock);
+
+  metrics_local = metrics;
+  return metrics;
+}
+
+void metrics_set_role(const char * role)
+{
+  __atomic_store_n(&(metrics_thread()->role), role, __ATOMIC_RELAXED);
+}
+
+/*
+ * Счетчики потоков
+ */
+struct metrics_counter_t
+{
+  const char * name;
+  const char * help;
+  size_t       offset;
+  const char * queue;   // метка queue (NULL - без метки)
+}; // struct metrics_counter_t
+typedef struct metrics_counter_t metrics_counter_t;
+
+static const metrics_counter_t METRICS_COUNTERS[] =
+{
+  { "server_bytes_received_total", "Bytes read from client sockets",
+    offsetof(metrics_t, bytes_received), NULL },
+  { "server_bytes_sent_total", "Bytes written to client sockets",
+    offsetof(metrics_t, bytes_sent), NULL },
+  { "server_messages_processed_total", "Messages processed",
+    offsetof(metrics_t, messages_processed), NULL },
+  { "server_connections_accepted_total", "Accepted connections",
+    offsetof(metrics_t, connections_accepted), NULL },
+  { "server_buffer_exhausted_total", "Times a queue had no free buffer",
+    offsetof(metrics_t, to_process_exhausted), "to_process" },
+  { "server_buffer_exhausted_total", NULL,
+    offsetof(metrics_t, from_process_exhausted), "from_process" },
+  { "server_buffer_reallocs_total", "Memory allocations on message buffer resize",
+    offsetof(metrics_t, buffer_reallocs), NULL },
+  { "server_partial_sends_total", "Socket writes that did not take all pending data",
+    offsetof(metrics_t, partial_sends), NULL },
+  { "server_queue_grows_total", "Buffers added to message queues that ran out of free buffers",
+    offsetof(metrics_t, queue_grows), NULL },
+  { "server_queue_shrinks_total", "Buffers removed from message queues after staying free",
+    offsetof(metrics_t, queue_shrinks), NULL },
+  { "server_messages_inline_total", "Small messages processed and sent on the socket thread",
+    offsetof(metrics_t, messages_inline), NULL },
+};
+
+/*
+ * Заполнение очередей, сгруппированное по имени
+ */
+struct metrics_queues_t
+{
+  size_t                    count;
+  const char *              names[METRICS_QUEUE_NAMES];
+  size_t                    queues[METRICS_QUEUE_NAMES];
+  message_queue_occupancy_t occupancy[METRICS_QUEUE_NAMES];
+}; // struct metrics_queues_t
+typedef struct metrics_queues_t metrics_queues_t;
+
+static void metrics_add_queue(message_queue_t * queue, void * arg)
+{
+  metrics_queues_t * queues = (metrics_queues_t *)(arg);
+  const char * name = message_queue_get_name(queue);
+  message_queue_occupancy_t occupancy;
+  size_t i;
+
+  for (i = 0; i < queues->count && strcmp(queues->names[i], name) != 0; ++i)
+  {
+  }
+  if (i == queues->count)
+  {
+    if (queues->count == METRICS_QUEUE_NAMES)
+      return;
+    queues->names[queues->count++] = name;
+  }
+
+  message_queue_get_occupancy(queue, &occupancy);
+  ++queues->queues[i];
+  queues->occupancy[i].free  += occupancy.free;
+  queues->occupancy[i].ready += occupancy.ready;
+  queues->occupancy[i].busy  += occupancy.busy;
+  queues->occupancy[i].size  += occupancy.size;
+}
+
+void metrics_write(FILE * stream)
+{
+  metrics_t * first = __atomic_load_n(&metrics_first, __ATOMIC_ACQUIRE);
+  metrics_queues_t queues;
+  buffer_pool_node_stats_t nodes[BUFFER_POOL_NODES];
+  size_t node_count;
+
+  for (size_t c = 0; c < sizeof(METRICS_COUNTERS) / sizeof(METRICS_COUNTERS[0]); ++c)
+  {
+    const metrics_counter_t * counter = METRICS_COUNTERS + c;
+
+    if (counter->help != NULL)
+    {
+      fprintf(stream, "# HELP %s %s\n# TYPE %s counter\n", counter->name, counter->help, counter->name);
+    }
+    for (metrics_t * metrics = first; metrics != NULL; metrics = metrics->next)
+    {
+      unsigned long value = __atomic_load_n((unsigned long *)((char *)(metrics) + counter->offset), __ATOMIC_RELAXED);
+
+      fprintf(stream, "%s{thread=\"%d\",role=\"%s\"", counter->name, metrics->index,
+              __atomic_load_n(&(metrics->role), __ATOMIC_RELAXED));
+      if (counter->queue != NULL)
+      {
+        fprintf(stream, ",queue=\"%s\"", counter->queue);
+      }
+      fprintf(stream, "} %lu\n", value);
+    }
+  }
+
+  memset(&queues, 0, sizeof(queues));
+  message_queue_foreach(metrics_add_queue, &queues);
+
+  fprintf(stream, "# HELP server_queues Message queues allocated (connection contexts are reused)\n"
+                  "# TYPE server_queues gauge\n");
+  for (size_t i = 0; i < queues.count; ++i)
+  {
+    fprintf(stream, "server_queues{queue=\"%s\"} %zu\n", queues.names[i], queues.queues[i]);
+  }
+  fprintf(stream, "# HELP server_queue_capacity Message queue buffers (elastic queues grow and shrink)\n"
+                  "# TYPE server_queue_capacity gauge\n");
+  for (size_t i = 0; i < queues.count; ++i)
+  {
+    fprintf(stream, "server_queue_capacity{queue=\"%s\"} %zu\n", queues.names[i], queues.occupancy[i].size);
+  }
+  fprintf(stream, "# HELP server_queue_buffers Message queue buffers by list\n"
+                  "# TYPE server_queue_buffers gauge\n");
+  for (size_t i = 0; i < queues.count; ++i)
+  {
+    fprintf(stream, "server_queue_buffers{queue=\"%s\",list=\"free\"} %zu\n", queues.names[i], queues.occupancy[i].free);
+    fprintf(stream, "server_queue_buffers{queue=\"%s\",list=\"ready\"} %zu\n", queues.names[i], queues.occupancy[i].ready);
+    fprintf(stream, "server_queue_buffers{queue=\"%s\",list=\"busy\"} %zu\n", queues.names[i], queues.occupancy[i].busy);
+  }
+
+  node_count = buffer_pool_get_node_stats(nodes, BUFFER_POOL_NODES);
+  fprintf(stream, "# HELP server_buffer_pool_bytes Buffer pool memory by NUMA node (approximate)\n"
+                  "# TYPE server_buffer_pool_bytes gauge\n");
+  for (size_t i = 0; i < node_count; ++i)
+  {
+    if (i > 0 && nodes[i].allocated == 0)
+      continue;
+    fprintf(stream, "server_buffer_pool_bytes{node=\"%zu\",state=\"allocated\"} %zu\n", i, nodes[i].allocated);
+    fprintf(stream, "server_buffer_pool_bytes{node=\"%zu\",state=\"free\"} %zu\n", i, nodes[i].free);
+  }
+}
+
+/*
+ * Запись всех данных в сокет
+ */
+static int metrics_send(int fd, const char * data, size_t size)
+{
+  while (size > 0)
+  {
+    ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += sent;
+    size -= sent;
+  }
+  return 0;
+}
+
+/*
+ * Ответ на один запрос HTTP (соединение закрывается после ответа)
+ */
+static void metrics_serve(int fd)
+{
+  char request[METRICS_REQUEST_SIZE];
+  size_t received = 0;
+  char header[256];
+  char * body = NULL;
+  size_t body_size = 0;
+  FILE * stream;
+  int found = 0;
+
+  while (received < sizeof(request) - 1)
+  {
+    ssize_t rc = recv(fd, request + received, sizeof(request) - 1 - received, 0);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc <= 0)
+      return;
+    received += rc;
+    request[received] = 0;
+    if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+      break;
+  }
+  request[received] = 0;
+
+  if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0)
+  {
+    stream = open_memstream(&body, &body_size);
+    if (stream == NULL)
+      return;
+    metrics_write(stream);
+    fclose(stream);
+    found = 1;
+  }
+
+  snprintf(header, sizeof(header), "HTTP/1.1 %s\r\n"
+                                   "Content-Type: text/plain; version=0.0.4\r\n"
+                                   "Content-Length: %zu\r\n"
+                                   "Connection: close\r\n\r\n",
+           found ? "200 OK" : "404 Not Found", body_size);
+  if (metrics_send(fd, header, strlen(header)) == 0 && body_size > 0)
+  {
+    metrics_send(fd, body, body_size);
+  }
+  free(body);
+}
+
+static void * metrics_routine(void * params)
+{
+  int sock_id = (int)(long)(params);
+  struct timeval timeout = { METRICS_REQUEST_TIMEOUT, 0 };
+
+  metrics_set_role("metrics");
+
+  while (1)
+  {
+    int fd = accept(sock_id, NULL, NULL);
+    if (fd < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+        continue;
+      fprintf(stderr, "Ошибка приема соединения сервера метрик: %s (%d)\n", strerror(errno), errno);
+      break;
+    }
+
+    // медленный клиент не задерживает следующие запросы дольше таймаута
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    metrics_serve(fd);
+    close(fd);
+  }
+
+  close(sock_id);
+  return NULL;
+}
+
+int metrics_server_start(int port)
+{
+  struct sockaddr_in addr;
+  pthread_t thread_id;
+  int sock_id;
+  int on = 1;
+  int rc;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  sock_id = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock_id < 0)
+    return -1;
+
+  setsockopt(sock_id, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (bind(sock_id, (struct sockaddr *)(&addr), sizeof(addr)) < 0 || listen(sock_id, 16) < 0)
+  {
+    int error = errno;
+    close(sock_id);
+    errno = error;
+    return -1;
+  }
+
+  rc = pthread_create(&thread_id, NULL, metrics_routine, (void *)(long)(sock_id));
+  if (rc != 0)
+  {
+    close(sock_id);
+    errno = rc;
+    return -1;
+  }
+  pthread_detach(thread_id);
+
+  DEBUG("Сервер метрик: 127.0.0.1:%d\n", port);
+  return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * Счетчики сервера
+ *
+ * У каждого потока свой набор счетчиков (регистрируется при первом
+ * обращении), поток изменяет только свои счетчики обычной записью без
+ * блокировок и атомарных операций чтения-записи. Снимок суммирует наборы
+ * всех потоков; наборы завершившихся потоков сохраняются.
+ * Снимок в текстовом формате Prometheus отдается по HTTP на отдельном
+ * локальном порту (metrics_server_start).
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdio.h>
+
+/*
+ * Счетчики одного потока
+ */
+struct metrics_t
+{
+  unsigned long bytes_received;
+  unsigned long bytes_sent;
+  unsigned long messages_processed;
+  unsigned long connections_accepted;
+  unsigned long to_process_exhausted;   // нет свободного буфера to_process_queue (чтение приостановлено)
+  unsigned long from_process_exhausted; // нет свободного буфера from_process_queue (обработка отложена)
+  unsigned long buffer_reallocs;        // выделений памяти при изменении размера буфера
+  unsigned long partial_sends;          // записей, не принявших все данные
+  unsigned long queue_grows;            // буферов добавлено в очереди при нехватке
+  unsigned long queue_shrinks;          // буферов выведено из очередей
+  unsigned long messages_inline;        // сообщений обработано в потоке работы с сокетами
+
+  const char *  role;                   // назначение потока
+  int           index;                  // номер набора
+  struct metrics_t * next;
+} __attribute__((aligned(64))); // struct metrics_t
+typedef struct metrics_t metrics_t;
+
+/*
+ * Набор счетчиков текущего потока
+ */
+extern __thread metrics_t * metrics_local;
+
+metrics_t * metrics_register(void);
+
+static inline metrics_t * metrics_thread(void)
+{
+  metrics_t * metrics = metrics_local;
+
+  if (__builtin_expect(metrics == NULL, 0))
+    metrics = metrics_register();
+  return metrics;
+}
+
+/*
+ * увеличить счетчик field текущего потока на value
+ * (запись атомарна для потока, формирующего снимок)
+ */
+#define METRICS_ADD(field, value) \
+  do \
+  { \
+    metrics_t * metrics_ = metrics_thread(); \
+    __atomic_store_n(&(metrics_->field), metrics_->field + (value), __ATOMIC_RELAXED); \
+  } \
+  while (0)
+
+/*
+ * назначение текущего потока (метка role), строка не копируется
+ */
+void metrics_set_role(const char * role);
+
+/*
+ * снимок в текстовом формате Prometheus
+ */
+void metrics_write(FILE * stream);
+
+/*
+ * запуск потока, отдающего снимок по HTTP на 127.0.0.1:port
+ * возвращает -1 при ошибке (errno)
+ */
+int metrics_server_start(int port);
+
+#endif // __METRICS_H__
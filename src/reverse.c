@@ -0,0 +1,327 @@
+/*
+ * Обращение порядка байт сообщения
+ *
+ * Векторные реализации переставляют байты блока командой pshufb
+ * (SSSE3 - 16 байт, AVX2 - 32 байта): блок с конца исходных данных
+ * записывается в начало результата, остаток обрабатывается следующей
+ * по ширине реализацией. При обращении на месте блоки с начала и с конца
+ * данных меняются местами. Реализация выбирается при запуске по CPUID.
+ */
+
+#include "reverse.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Размер блока при обмене данными областей (reverse_bytes_iov)
+ */
+#define REVERSE_IOV_BLOCK 4096
+
+#if defined(__x86_64__) || defined(__i386__)
+#define REVERSE_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * по 8 байт с перестановкой в регистре
+ */
+static void reverse_scalar(char * dst, const char * src, size_t size)
+{
+  uint64_t word;
+  size_t i = 0;
+
+  for (; i + sizeof(word) <= size; i += sizeof(word))
+  {
+    memcpy(&word, src + size - i - sizeof(word), sizeof(word));
+    word = __builtin_bswap64(word);
+    memcpy(dst + i, &word, sizeof(word));
+  }
+  for (; i < size; ++i)
+  {
+    dst[i] = src[size-1 - i];
+  }
+}
+
+static void reverse_scalar_inplace(char * data, size_t size)
+{
+  uint64_t head, tail;
+  size_t i = 0;
+  size_t j = size;
+  char byte;
+
+  for (; j - i >= 2 * sizeof(head); i += sizeof(head), j -= sizeof(head))
+  {
+    memcpy(&head, data + i, sizeof(head));
+    memcpy(&tail, data + j - sizeof(tail), sizeof(tail));
+    head = __builtin_bswap64(head);
+    tail = __builtin_bswap64(tail);
+    memcpy(data + i, &tail, sizeof(tail));
+    memcpy(data + j - sizeof(head), &head, sizeof(head));
+  }
+  for (; j - i >= 2; ++i, --j)
+  {
+    byte = data[i];
+    data[i] = data[j-1];
+    data[j-1] = byte;
+  }
+}
+
+#ifdef REVERSE_X86
+
+__attribute__((target("ssse3")))
+static void reverse_ssse3_inplace(char * data, size_t size)
+{
+  const __m128i mask = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  size_t i = 0;
+  size_t j = size;
+
+  for (; j - i >= 32; i += 16, j -= 16)
+  {
+    __m128i head = _mm_loadu_si128((const __m128i *)(data + i));
+    __m128i tail = _mm_loadu_si128((const __m128i *)(data + j - 16));
+    _mm_storeu_si128((__m128i *)(data + i),      _mm_shuffle_epi8(tail, mask));
+    _mm_storeu_si128((__m128i *)(data + j - 16), _mm_shuffle_epi8(head, mask));
+  }
+  // середина данных
+  reverse_scalar_inplace(data + i, j - i);
+}
+
+__attribute__((target("ssse3")))
+static void reverse_ssse3(char * dst, const char * src, size_t size)
+{
+  const __m128i mask = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  size_t i = 0;
+
+  for (; i + 16 <= size; i += 16)
+  {
+    __m128i block = _mm_loadu_si128((const __m128i *)(src + size - i - 16));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(block, mask));
+  }
+  // остаток результата - обращение начала исходных данных
+  reverse_scalar(dst + i, src, size - i);
+}
+
+/*
+ * запись результата минуя кэш: до выравнивания результата на 16 байт
+ * и остаток - обычная запись
+ */
+__attribute__((target("ssse3")))
+static void reverse_ssse3_nt(char * dst, const char * src, size_t size)
+{
+  const __m128i mask = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  size_t head = (16 - ((uintptr_t)(dst) & 15)) & 15;
+  size_t i = 0;
+
+  if (head > size)
+    head = size;
+  reverse_scalar(dst, src + size - head, head);
+  dst  += head;
+  size -= head;
+
+  for (; i + 16 <= size; i += 16)
+  {
+    __m128i block = _mm_loadu_si128((const __m128i *)(src + size - i - 16));
+    _mm_stream_si128((__m128i *)(dst + i), _mm_shuffle_epi8(block, mask));
+  }
+  _mm_sfence();
+  reverse_scalar(dst + i, src, size - i);
+}
+
+/*
+ * pshufb переставляет байты внутри 128-битных половин,
+ * затем половины меняются местами
+ */
+__attribute__((target("avx2")))
+static void reverse_avx2(char * dst, const char * src, size_t size)
+{
+  const __m256i mask = _mm256_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                       0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  size_t i = 0;
+
+  for (; i + 32 <= size; i += 32)
+  {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(src + size - i - 32));
+    block = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(block, mask), 0x4E);
+    _mm256_storeu_si256((__m256i *)(dst + i), block);
+  }
+  reverse_ssse3(dst + i, src, size - i);
+}
+
+__attribute__((target("avx2")))
+static void reverse_avx2_inplace(char * data, size_t size)
+{
+  const __m256i mask = _mm256_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                       0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  size_t i = 0;
+  size_t j = size;
+
+  for (; j - i >= 64; i += 32, j -= 32)
+  {
+    __m256i head = _mm256_loadu_si256((const __m256i *)(data + i));
+    __m256i tail = _mm256_loadu_si256((const __m256i *)(data + j - 32));
+    head = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(head, mask), 0x4E);
+    tail = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(tail, mask), 0x4E);
+    _mm256_storeu_si256((__m256i *)(data + i),      tail);
+    _mm256_storeu_si256((__m256i *)(data + j - 32), head);
+  }
+  reverse_ssse3_inplace(data + i, j - i);
+}
+
+__attribute__((target("avx2")))
+static void reverse_avx2_nt(char * dst, const char * src, size_t size)
+{
+  const __m256i mask = _mm256_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                       0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  size_t head = (32 - ((uintptr_t)(dst) & 31)) & 31;
+  size_t i = 0;
+
+  if (head > size)
+    head = size;
+  reverse_ssse3(dst, src + size - head, head);
+  dst  += head;
+  size -= head;
+
+  for (; i + 32 <= size; i += 32)
+  {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(src + size - i - 32));
+    block = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(block, mask), 0x4E);
+    _mm256_stream_si256((__m256i *)(dst + i), block);
+  }
+  _mm_sfence();
+  reverse_ssse3(dst + i, src, size - i);
+}
+
+#endif // REVERSE_X86
+
+/*
+ * Реализации в порядке предпочтения (после проверки поддержки)
+ */
+enum reverse_kernel_index_t
+{
+  REVERSE_SCALAR = 0,
+#ifdef REVERSE_X86
+  REVERSE_SSSE3,
+  REVERSE_SSSE3_NT,
+  REVERSE_AVX2,
+  REVERSE_AVX2_NT,
+#endif
+  REVERSE_KERNELS_COUNT
+}; // enum reverse_kernel_index_t
+
+static reverse_kernel_t kernels[REVERSE_KERNELS_COUNT] =
+{
+  { "scalar",   reverse_scalar,   reverse_scalar_inplace, 1 },
+#ifdef REVERSE_X86
+  { "ssse3",    reverse_ssse3,    reverse_ssse3_inplace,  0 },
+  { "ssse3-nt", reverse_ssse3_nt, NULL,                   0 },
+  { "avx2",     reverse_avx2,     reverse_avx2_inplace,   0 },
+  { "avx2-nt",  reverse_avx2_nt,  NULL,                   0 },
+#endif
+};
+
+static const reverse_kernel_t * current    = kernels + REVERSE_SCALAR;
+static const reverse_kernel_t * current_nt = kernels + REVERSE_SCALAR;
+
+/*
+ * выбор реализации по возможностям процессора (CPUID)
+ */
+void reverse_init(void)
+{
+#ifdef REVERSE_X86
+  __builtin_cpu_init();
+  kernels[REVERSE_SSSE3].supported    = __builtin_cpu_supports("ssse3");
+  kernels[REVERSE_SSSE3_NT].supported = kernels[REVERSE_SSSE3].supported;
+  kernels[REVERSE_AVX2].supported     = __builtin_cpu_supports("avx2");
+  kernels[REVERSE_AVX2_NT].supported  = kernels[REVERSE_AVX2].supported;
+
+  if (kernels[REVERSE_AVX2].supported)
+  {
+    current    = kernels + REVERSE_AVX2;
+    current_nt = kernels + REVERSE_AVX2_NT;
+  }
+  else if (kernels[REVERSE_SSSE3].supported)
+  {
+    current    = kernels + REVERSE_SSSE3;
+    current_nt = kernels + REVERSE_SSSE3_NT;
+  }
+#endif
+}
+
+const reverse_kernel_t * reverse_kernels(size_t * count)
+{
+  *count = REVERSE_KERNELS_COUNT;
+  return kernels;
+}
+
+const char * reverse_kernel_name(void)
+{
+  return current->name;
+}
+
+void reverse_bytes(char * dst, const char * src, size_t size)
+{
+  if (size >= REVERSE_NT_THRESHOLD)
+  {
+    current_nt->reverse(dst, src, size);
+  }
+  else
+  {
+    current->reverse(dst, src, size);
+  }
+}
+
+void reverse_bytes_inplace(char * data, size_t size)
+{
+  current->reverse_inplace(data, size);
+}
+
+/*
+ * Области с начала и с конца данных меняются местами блоками через
+ * промежуточный буфер, середина в одной области обращается на месте
+ */
+void reverse_bytes_iov(const struct iovec * iov, size_t count)
+{
+  char block[REVERSE_IOV_BLOCK];
+  size_t first = 0, last = count;
+  size_t head = 0;                  // обработано байт в начале области first
+  size_t tail = 0;                  // обработано байт в конце области last-1
+
+  while (first < last)
+  {
+    char * front = (char *)(iov[first].iov_base) + head;
+    size_t front_size = iov[first].iov_len - head;
+    char * back;
+    size_t back_size;
+    size_t part;
+
+    if (first == last - 1)
+    {
+      reverse_bytes_inplace(front, front_size - tail);
+      break;
+    }
+
+    back_size = iov[last - 1].iov_len - tail;
+    part = front_size < back_size ? front_size : back_size;
+    if (part > sizeof(block))
+      part = sizeof(block);
+    back = (char *)(iov[last - 1].iov_base) + back_size - part;
+
+    reverse_bytes(block, front, part);
+    reverse_bytes(front, back, part);
+    memcpy(back, block, part);
+
+    head += part;
+    tail += part;
+    if (head == iov[first].iov_len)
+    {
+      ++first;
+      head = 0;
+    }
+    if (tail == iov[last - 1].iov_len)
+    {
+      --last;
+      tail = 0;
+    }
+  }
+}
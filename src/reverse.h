@@ -0,0 +1,74 @@
+/*
+ * Обращение порядка байт сообщения
+ */
+
+#ifndef __REVERSE_H__
+#define __REVERSE_H__
+
+#include <stdlib.h>
+#include <sys/uio.h>
+
+/*
+ * Размер данных, начиная с которого результат записывается в память
+ * минуя кэш (non-temporal store): такие данные не будут прочитаны из
+ * кэша до отправки, а вытеснят из него данные других соединений
+ */
+#define REVERSE_NT_THRESHOLD (4 * 1024 * 1024)
+
+/*
+ * Реализация обращения: dst[i] = src[size-1 - i]
+ * Области dst и src не должны пересекаться
+ */
+typedef void (*reverse_fn)(char * dst, const char * src, size_t size);
+
+/*
+ * Обращение на месте: блоки с начала и с конца данных меняются местами
+ */
+typedef void (*reverse_inplace_fn)(char * data, size_t size);
+
+/*
+ * Описание реализации (для выбора и сравнения)
+ */
+struct reverse_kernel_t
+{
+  const char *       name;
+  reverse_fn         reverse;
+  reverse_inplace_fn reverse_inplace; // NULL - только с записью в другую область
+  int                supported;       // поддерживается процессором
+}; // struct reverse_kernel_t
+typedef struct reverse_kernel_t reverse_kernel_t;
+
+/*
+ * выбор реализации по возможностям процессора (CPUID)
+ * вызывается один раз при запуске до создания потоков
+ */
+void reverse_init(void);
+
+/*
+ * список всех реализаций, count - число элементов
+ */
+const reverse_kernel_t * reverse_kernels(size_t * count);
+
+/*
+ * имя выбранной реализации
+ */
+const char * reverse_kernel_name(void);
+
+/*
+ * обращение порядка байт выбранной реализацией
+ * для данных от REVERSE_NT_THRESHOLD используется запись минуя кэш
+ */
+void reverse_bytes(char * dst, const char * src, size_t size);
+
+/*
+ * обращение порядка байт на месте выбранной реализацией
+ */
+void reverse_bytes_inplace(char * data, size_t size);
+
+/*
+ * обращение на месте данных из нескольких областей (сообщение частями):
+ * результат - обращение всех данных, размеры областей сохраняются
+ */
+void reverse_bytes_iov(const struct iovec * iov, size_t count);
+
+#endif // __REVERSE_H__
@@ -0,0 +1,320 @@
+#include "server_params.h"
+#include "frame.h"
+
+#include <stdio.h>
+#include <getopt.h>
+#include <error.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <sys/socket.h>
+
+
+static void print_help(const char * programName)
+{
+  fprintf(stdout, "Использование: %s [опции] [порт [число шардов]]\n"
+                  "опции:\n"
+                  "	-?	--help		эта справка\n"
+                  "	-p	--port		порт сервера\n"
+                  "	-s	--shards	число шардов: потоков со своим сокетом (SO_REUSEPORT),\n"
+                  "			циклом событий и обработкой данных (0 - без шардов)\n"
+                  "	-w	--workers	число потоков обработки данных (0 - обработка в основном потоке)\n"
+                  "	-q	--queue		реализация очередей сообщений: locked, spsc, mpmc (locked)\n"
+                  "			spsc - без блокировок, не используется с пулом потоков и потоками этапов\n"
+                  "			mpmc - без общей блокировки, любое число потоков\n"
+                  "	-Q	--queue-budget	на сколько байт может вырасти очередь сообщений при нехватке\n"
+                  "			буферов (%zuK), 0 - очереди постоянной емкости; суффиксы K, M, G\n"
+                  "	-M	--memory-budget	общий объем роста всех очередей (%zuM), 0 - без ограничения\n"
+                  "	-P	--pipeline	цепочка этапов обработки (%s): этапы через ',' выполняются\n"
+                  "			в одном потоке, '|' перед этапом - в своем потоке (конвейер);\n"
+                  "			этап - имя или путь к библиотеке[:функция], например\n"
+                  "			\"reverse|reverse\", \"|./libstage.so:encode\"\n"
+                  "	-i	--inline	сообщения меньше заданного размера обрабатываются и отправляются\n"
+                  "			сразу в потоке работы с сокетами (0 - не обрабатываются);\n"
+                  "			суффиксы K, M, G; не используется с spsc и потоками этапов\n"
+                  "	-f	--framed	сообщения передаются кадрами: длина (4 байта, сетевой порядок)\n"
+                  "			и данные; ответ - кадр той же длины\n"
+                  "	-F	--max-frame	максимальный размер данных кадра (%zuM), кадр большего\n"
+                  "			размера закрывает соединение; суффиксы K, M, G, не больше 4G-1\n"
+                  "	-r	--reactor	работа с сокетами: libev, uring, epoll (libev)\n"
+                  "			uring - io_uring (Linux 6.0+), при недоступности - libev\n"
+                  "			epoll - epoll по фронту: чтение до опустошения сокета\n"
+                  "			без запроса числа доступных байт\n"
+                  "	-m	--metrics	порт сервера метрик на 127.0.0.1 (формат Prometheus, GET /metrics)\n"
+                  "	-t	--trace		трассировка этапов обработки сообщений:\n"
+                  "			гистограммы задержек выводятся в stderr по сигналу SIGUSR1\n"
+                  "	-a	--affinity	привязка потоков к процессорам: роль=список, например\n"
+                  "			\"socket=0\", \"workers=2-5,8\"; роли: socket, main, workers,\n"
+                  "			stages, shards; потоки пулов и шарды - по одному процессору\n"
+                  "			списка; память очередей и буферов - на узле NUMA потребителя\n"
+                  "	-b	--backlog	длина очереди ожидающих подключений (%d)\n", programName,
+          SERVER_QUEUE_BUDGET / 1024, SERVER_MEMORY_BUDGET / (1024 * 1024),
+          STAGE_DEFAULT_CHAIN, FRAME_MAX_SIZE / (1024 * 1024), SOMAXCONN);
+}
+
+/*
+ * Разбор целого числа не меньше minimum
+ */
+static int parse_integer(const char * value, const char * name, int minimum)
+{
+  int number;
+
+  for (int i = 0; value[i] != 0; ++i)
+  {
+    if (!isdigit(value[i]))
+    {
+      error(EXIT_FAILURE, 0, "Недопустимый символ в параметре '%s': '%s'", name, value);
+    }
+  }
+  if (value[0] == 0 || (number = atoi(value)) < minimum)
+  {
+    error(EXIT_FAILURE, 0, "Некорректное значение параметра '%s': '%s'", name, value);
+  }
+  return number;
+}
+
+/*
+ * Разбор целого положительного числа
+ */
+static int parse_number(const char * value, const char * name)
+{
+  return parse_integer(value, name, 1);
+}
+
+/*
+ * Разбор числа потоков: 0 допустим (без потоков)
+ */
+static int parse_count(const char * value, const char * name)
+{
+  return parse_integer(value, name, 0);
+}
+
+/*
+ * Разбор объема памяти: число байт с необязательным суффиксом K, M, G
+ */
+static size_t parse_size(const char * value, const char * name)
+{
+  char * end;
+  unsigned long long size;
+
+  if (!isdigit(value[0]))
+  {
+    error(EXIT_FAILURE, 0, "Некорректное значение параметра '%s': '%s'", name, value);
+  }
+  size = strtoull(value, &end, 10);
+  switch (toupper(*end)) // множители суффиксов накапливаются (без break)
+  {
+    case 'G':
+      size *= 1024;
+    case 'M':
+      size *= 1024;
+    case 'K':
+      size *= 1024;
+      ++end;
+      break;
+  }
+  if (*end != 0)
+  {
+    error(EXIT_FAILURE, 0, "Недопустимый символ в параметре '%s': '%s'", name, value);
+  }
+  return size;
+}
+
+int ProcessCmdLine(ServerParams * serverParams, int argc, const char * argv[])
+{
+  int c;
+  int ret = 0;
+
+  serverParams->port_    = -1;
+  serverParams->backlog_ = SOMAXCONN;
+  serverParams->shards_  = 0;
+  serverParams->workers_ = 0;
+  serverParams->queue_backend_ = MESSAGE_QUEUE_LOCKED;
+  serverParams->queue_budget_  = SERVER_QUEUE_BUDGET;
+  serverParams->memory_budget_ = SERVER_MEMORY_BUDGET;
+  serverParams->stages_  = STAGE_DEFAULT_CHAIN;
+  serverParams->inline_size_ = 0;
+  serverParams->framed_  = 0;
+  serverParams->max_frame_ = FRAME_MAX_SIZE;
+  serverParams->reactor_ = SERVER_REACTOR_LIBEV;
+  serverParams->trace_   = 0;
+  serverParams->metrics_port_ = 0;
+  serverParams->affinity_count_ = 0;
+
+  while (1)
+  {
+    int option_index = 0;
+    static struct option long_options[] =
+                     {
+                         {"help",    no_argument,       0, '?'},
+                         {"port",    required_argument, 0, 'p'},
+                         {"backlog", required_argument, 0, 'b'},
+                         {"shards",  required_argument, 0, 's'},
+                         {"workers", required_argument, 0, 'w'},
+                         {"queue",   required_argument, 0, 'q'},
+                         {"queue-budget",  required_argument, 0, 'Q'},
+                         {"memory-budget", required_argument, 0, 'M'},
+                         {"pipeline", required_argument, 0, 'P'},
+                         {"inline",  required_argument, 0, 'i'},
+                         {"framed",  no_argument,       0, 'f'},
+                         {"max-frame", required_argument, 0, 'F'},
+                         {"reactor", required_argument, 0, 'r'},
+                         {"trace",   no_argument,       0, 't'},
+                         {"metrics", required_argument, 0, 'm'},
+                         {"affinity", required_argument, 0, 'a'},
+                         {0, 0, 0, 0},
+                     };
+
+    c = getopt_long (argc, (char * const *)(argv), "?p:b:s:w:q:Q:M:P:i:fF:r:tm:a:", long_options, &option_index);
+    if (c == -1)
+    {
+      break;
+    }
+    switch (c)
+    {
+      case '?':
+        print_help(argv[0]);
+        ret = 1;
+        break;
+
+      case 'p':
+        serverParams->port_ = parse_number(optarg, "порт");
+        break;
+
+      case 'b':
+        serverParams->backlog_ = parse_number(optarg, "backlog");
+        break;
+
+      case 's':
+        serverParams->shards_ = parse_count(optarg, "шарды");
+        break;
+
+      case 'w':
+        serverParams->workers_ = parse_count(optarg, "потоки обработки");
+        break;
+
+      case 'q':
+        if (strcmp(optarg, "locked") == 0)
+        {
+          serverParams->queue_backend_ = MESSAGE_QUEUE_LOCKED;
+        }
+        else if (strcmp(optarg, "spsc") == 0)
+        {
+          serverParams->queue_backend_ = MESSAGE_QUEUE_SPSC;
+        }
+        else if (strcmp(optarg, "mpmc") == 0)
+        {
+          serverParams->queue_backend_ = MESSAGE_QUEUE_MPMC;
+        }
+        else
+        {
+          error(EXIT_FAILURE, 0, "Неизвестная реализация очереди сообщений: '%s'", optarg);
+        }
+        break;
+
+      case 'Q':
+        serverParams->queue_budget_ = parse_size(optarg, "бюджет очереди");
+        break;
+
+      case 'M':
+        serverParams->memory_budget_ = parse_size(optarg, "бюджет очередей");
+        break;
+
+      case 'P':
+        serverParams->stages_ = optarg;
+        break;
+
+      case 'i':
+        serverParams->inline_size_ = parse_size(optarg, "размер сообщений для обработки в потоке сокетов");
+        break;
+
+      case 'f':
+        serverParams->framed_ = 1;
+        break;
+
+      case 'F':
+        serverParams->max_frame_ = parse_size(optarg, "размер кадра");
+        if (serverParams->max_frame_ == 0 || serverParams->max_frame_ > FRAME_MAX_LIMIT)
+        {
+          error(EXIT_FAILURE, 0, "Некорректное значение параметра '%s': '%s'", "размер кадра", optarg);
+        }
+        break;
+
+      case 'm':
+        serverParams->metrics_port_ = parse_number(optarg, "порт сервера метрик");
+        break;
+
+      case 't':
+        serverParams->trace_ = 1;
+        break;
+
+      case 'a':
+        if (serverParams->affinity_count_ == AFFINITY_ROLES)
+        {
+          error(EXIT_FAILURE, 0, "Слишком много параметров привязки потоков: '%s'", optarg);
+        }
+        serverParams->affinity_[serverParams->affinity_count_++] = optarg;
+        break;
+
+      case 'r':
+        if (strcmp(optarg, "libev") == 0)
+        {
+          serverParams->reactor_ = SERVER_REACTOR_LIBEV;
+        }
+        else if (strcmp(optarg, "uring") == 0)
+        {
+          serverParams->reactor_ = SERVER_REACTOR_URING;
+        }
+        else if (strcmp(optarg, "epoll") == 0)
+        {
+          serverParams->reactor_ = SERVER_REACTOR_EPOLL;
+        }
+        else
+        {
+          error(EXIT_FAILURE, 0, "Неизвестный механизм работы с сокетами: '%s'", optarg);
+        }
+        break;
+
+      default:
+        error(EXIT_FAILURE, 0, "Неверный параметр командной строки:\n"
+                               "\t\tиспользуйте параметр --help для справки\n");
+        break;
+    }
+  }
+
+  // номер порта и число шардов могут быть указаны без ключей
+  if (optind < argc)
+  {
+    serverParams->port_ = parse_number(argv[optind++], "порт");
+  }
+  if (optind < argc)
+  {
+    serverParams->shards_ = parse_count(argv[optind++], "шарды");
+  }
+
+  if (ret == 0 && serverParams->port_ <= 0)
+  {
+    error(EXIT_FAILURE, 0, "Не указан номер порта");
+  }
+  if (ret == 0 && serverParams->shards_ > 0 && serverParams->workers_ > 0)
+  {
+    error(EXIT_FAILURE, 0, "Пул потоков обработки не используется в режиме шардов");
+  }
+  if (ret == 0 && serverParams->workers_ > 0 && serverParams->queue_backend_ == MESSAGE_QUEUE_SPSC)
+  {
+    error(EXIT_FAILURE, 0, "Очереди spsc не используются с пулом потоков обработки");
+  }
+  if (ret == 0 && strchr(serverParams->stages_, '|') != NULL && serverParams->queue_backend_ == MESSAGE_QUEUE_SPSC)
+  {
+    error(EXIT_FAILURE, 0, "Очереди spsc не используются с потоками этапов обработки");
+  }
+  if (ret == 0 && serverParams->inline_size_ > 0 && serverParams->queue_backend_ == MESSAGE_QUEUE_SPSC)
+  {
+    error(EXIT_FAILURE, 0, "Очереди spsc не используются с обработкой в потоке сокетов");
+  }
+  if (ret == 0 && serverParams->inline_size_ > 0 && strchr(serverParams->stages_, '|') != NULL)
+  {
+    error(EXIT_FAILURE, 0, "Обработка в потоке сокетов не используется с потоками этапов обработки");
+  }
+  return ret;
+}
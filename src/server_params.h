@@ -0,0 +1,52 @@
+/*
+ * Параметры запуска сервера
+ */
+
+#ifndef __SERVER_PARAMS_H__
+#define __SERVER_PARAMS_H__
+
+#include "message_queue.h"
+#include "stage.h"
+#include "affinity.h"
+
+/*
+ * Механизм работы с сокетами
+ */
+enum server_reactor_t
+{
+  SERVER_REACTOR_LIBEV = 0, // уведомления о готовности (libev)
+  SERVER_REACTOR_URING,     // io_uring; при недоступности - libev
+  SERVER_REACTOR_EPOLL,     // epoll по фронту для сокетов соединений
+}; // enum server_reactor_t
+typedef enum server_reactor_t server_reactor_t;
+
+/*
+ * Бюджет роста очередей сообщений по умолчанию, байт
+ */
+#define SERVER_QUEUE_BUDGET  ((size_t)(64 * 1024))
+#define SERVER_MEMORY_BUDGET ((size_t)(64 * 1024 * 1024))
+
+struct ServerParams
+{
+  int port_;     // порт для приема подключений
+  int backlog_;  // длина очереди ожидающих подключений
+  int shards_;   // число шардов (0 - поток сокетов и поток обработки)
+  int workers_;  // число потоков обработки (0 - обработка в основном потоке)
+  message_queue_backend_t queue_backend_; // реализация очередей сообщений
+  size_t queue_budget_;  // бюджет роста одной очереди, байт (0 - постоянная емкость)
+  size_t memory_budget_; // общий бюджет роста очередей, байт (0 - без ограничения)
+  const char * stages_;  // цепочка этапов обработки (см. stage.h)
+  size_t inline_size_;   // сообщения меньше - обрабатываются в потоке сокетов (0 - не обрабатываются)
+  int framed_;   // сообщения передаются кадрами с заголовком длины (см. frame.h)
+  size_t max_frame_;     // максимальный размер данных кадра, байт
+  server_reactor_t reactor_;              // механизм работы с сокетами
+  int metrics_port_; // локальный порт сервера метрик (0 - не запускается)
+  int trace_;    // трассировка этапов обработки сообщений (см. trace.h)
+  const char * affinity_[AFFINITY_ROLES]; // процессоры назначений потоков (см. affinity.h)
+  int affinity_count_;
+}; // struct ServerParams
+typedef struct ServerParams ServerParams;
+
+int ProcessCmdLine(ServerParams * serverParams, int argc, const char * argv[]);
+
+#endif // __SERVER_PARAMS_H__
@@ -0,0 +1,496 @@
+/*
+ * Этапы обработки сообщений
+ */
+
+#include "stage.h"
+#include "reverse.h"
+#include "metrics.h"
+#include "affinity.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef _DEBUG
+#define DEBUG(msg...) fprintf(stderr, "%u: ", (int)(pthread_self())); fprintf(stderr, msg)
+#else
+#define DEBUG(mag...)
+#endif
+
+/*
+ * Наибольшее число зарегистрированных этапов и этапов в цепочке
+ */
+#define STAGE_MAX_REGISTERED 32
+#define STAGE_MAX_CHAIN      32
+
+/*
+ * Начальный размер очереди потока этапа
+ */
+static const size_t STAGE_QUEUE_INITIAL_SIZE = 64;
+
+/*
+ * Внутренние структуры
+ *
+ * Этап
+ */
+struct stage_t
+{
+  const char * name;
+  stage_fn     process;
+  stage_iov_fn process_iov; // NULL - сообщения частями не обрабатываются
+  void *       arg;
+}; // struct stage_t
+typedef struct stage_t stage_t;
+
+/*
+ * Внутренние структуры
+ *
+ * Сообщение в очереди потока этапа
+ */
+struct stage_job_t
+{
+  void *             owner;
+  message_buffer_t * buffer;
+  size_t             header_size;
+  unsigned long      sequence;
+}; // struct stage_job_t
+typedef struct stage_job_t stage_job_t;
+
+/*
+ * Внутренние структуры
+ *
+ * Этапы, выполняемые в одном потоке (кроме первого участка - со своим
+ * потоком и очередью сообщений, кольцевой буфер)
+ */
+struct stage_segment_t
+{
+  stage_t * stages;
+  size_t    count;
+
+  pthread_t       thread_id;
+  int             started;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  stage_job_t *   jobs;
+  size_t          capacity;
+  size_t          head;
+  size_t          pending;
+  int             stop;
+
+  struct stage_chain_t * chain;
+  size_t                 index;
+}; // struct stage_segment_t
+typedef struct stage_segment_t stage_segment_t;
+
+/*
+ * Цепочка этапов
+ */
+struct stage_chain_t
+{
+  stage_t           stages[STAGE_MAX_CHAIN];
+  stage_segment_t * segments;
+  size_t            count;      // участков
+  stage_done_fn     done;
+
+  void *            libraries[STAGE_MAX_CHAIN];
+  size_t            library_count;
+}; // struct stage_chain_t
+
+/*
+ * Встроенные этапы
+ */
+static int stage_reverse(char * data, size_t size, void * arg)
+{
+  reverse_bytes_inplace(data, size);
+  return 0;
+}
+
+static int stage_reverse_iov(const struct iovec * iov, size_t count, void * arg)
+{
+  reverse_bytes_iov(iov, count);
+  return 0;
+}
+
+/*
+ * Зарегистрированные этапы
+ */
+static stage_t stage_registry[STAGE_MAX_REGISTERED] =
+{
+  { "reverse", stage_reverse, stage_reverse_iov, NULL },
+};
+static size_t stage_registry_count = 1;
+
+int stage_register(const char * name, stage_fn process, void * arg)
+{
+  return stage_register_iov(name, process, NULL, arg);
+}
+
+int stage_register_iov(const char * name, stage_fn process, stage_iov_fn process_iov, void * arg)
+{
+  if (stage_registry_count == STAGE_MAX_REGISTERED || strpbrk(name, ",|:/") != NULL ||
+      (process == NULL && process_iov == NULL))
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  stage_registry[stage_registry_count].name        = name;
+  stage_registry[stage_registry_count].process     = process;
+  stage_registry[stage_registry_count].process_iov = process_iov;
+  stage_registry[stage_registry_count].arg         = arg;
+  ++stage_registry_count;
+  return 0;
+}
+
+/*
+ * выполнить этапы участка
+ */
+static int stage_segment_run(stage_segment_t * segment, message_buffer_t * buffer, size_t header_size)
+{
+  struct iovec single;
+  struct iovec * iov = &single;
+  size_t count = 1;
+  int rc = 0;
+
+  if (segment->count == 0)
+    return 0;
+
+  if (buffer->chunks == NULL)
+  {
+    single.iov_base = buffer->buffer + header_size;
+    single.iov_len  = buffer->size - header_size;
+  }
+  else
+  {
+    // сообщение частями - список областей данных
+    count = message_buffer_iov_count(buffer, header_size, buffer->size - header_size);
+    iov = malloc(count * sizeof(struct iovec));
+    if (iov == NULL)
+      return -1;
+    message_buffer_data_iov(buffer, header_size, buffer->size - header_size, iov, count);
+  }
+
+  for (size_t i = 0; i < segment->count && rc == 0; ++i)
+  {
+    const stage_t * stage = segment->stages + i;
+
+    if (buffer->chunks == NULL && stage->process != NULL)
+    {
+      rc = stage->process(single.iov_base, single.iov_len, stage->arg);
+    }
+    else if (stage->process_iov != NULL)
+    {
+      rc = stage->process_iov(iov, count, stage->arg);
+    }
+    else
+    {
+      fprintf(stderr, "Этап обработки не принимает сообщение частями (%zu байт)\n", buffer->size);
+      rc = -1;
+    }
+  }
+
+  if (iov != &single)
+  {
+    free(iov);
+  }
+  return rc != 0 ? -1 : 0;
+}
+
+/*
+ * поставить сообщение в очередь потока участка
+ */
+static int stage_segment_push(stage_segment_t * segment, const stage_job_t * job)
+{
+  pthread_mutex_lock(&(segment->lock));
+  if (segment->pending == segment->capacity)
+  {
+    size_t capacity = segment->capacity * 2;
+    stage_job_t * jobs = malloc(capacity * sizeof(stage_job_t));
+    if (jobs == NULL)
+    {
+      pthread_mutex_unlock(&(segment->lock));
+      return -1;
+    }
+    for (size_t i = 0; i < segment->pending; ++i)
+    {
+      jobs[i] = segment->jobs[(segment->head + i) % segment->capacity];
+    }
+    free(segment->jobs);
+    segment->jobs     = jobs;
+    segment->capacity = capacity;
+    segment->head     = 0;
+  }
+
+  segment->jobs[(segment->head + segment->pending) % segment->capacity] = *job;
+  // поток участка ожидает, только если очередь пуста
+  if (segment->pending++ == 0)
+  {
+    pthread_cond_signal(&(segment->cond));
+  }
+  pthread_mutex_unlock(&(segment->lock));
+  return 0;
+}
+
+/*
+ * Поток участка: этапы участка, затем передача следующему участку
+ * или завершение обработки сообщения
+ */
+static void * stage_segment_routine(void * params)
+{
+  stage_segment_t * segment = (stage_segment_t *)(params);
+  stage_chain_t * chain = segment->chain;
+  stage_job_t job;
+  int status;
+
+  metrics_set_role("stage");
+  // потоки есть у участков начиная со второго
+  affinity_bind(AFFINITY_STAGE, segment->index - 1);
+
+  while (1)
+  {
+    pthread_mutex_lock(&(segment->lock));
+    while (segment->pending == 0 && !segment->stop)
+    {
+      pthread_cond_wait(&(segment->cond), &(segment->lock));
+    }
+    if (segment->stop)
+    {
+      pthread_mutex_unlock(&(segment->lock));
+      break;
+    }
+    job = segment->jobs[segment->head];
+    segment->head = (segment->head + 1) % segment->capacity;
+    --segment->pending;
+    pthread_mutex_unlock(&(segment->lock));
+
+    status = stage_segment_run(segment, job.buffer, job.header_size);
+    if (status == 0 && segment->index + 1 < chain->count)
+    {
+      if (stage_segment_push(segment + 1, &job) == 0)
+        continue;
+      status = -1;
+    }
+    chain->done(job.owner, job.buffer, job.sequence, status);
+  }
+
+  DEBUG("%s done\n", __FUNCTION__);
+  return NULL;
+}
+
+/*
+ * этап по имени или из библиотеки
+ */
+static int stage_chain_resolve(stage_chain_t * chain, const char * name, stage_t * stage)
+{
+  char path[1024];
+  const char * symbol = STAGE_DEFAULT_SYMBOL;
+  const char * colon;
+  void * library;
+
+  if (strchr(name, '/') == NULL)
+  {
+    for (size_t i = 0; i < stage_registry_count; ++i)
+    {
+      if (strcmp(stage_registry[i].name, name) == 0)
+      {
+        *stage = stage_registry[i];
+        return 0;
+      }
+    }
+    fprintf(stderr, "Неизвестный этап обработки: '%s'\n", name);
+    errno = EINVAL;
+    return -1;
+  }
+
+  colon = strrchr(name, ':');
+  if (colon != NULL && strchr(colon, '/') == NULL)
+  {
+    symbol = colon + 1;
+  }
+  else
+  {
+    colon = name + strlen(name);
+  }
+  if ((size_t)(colon - name) >= sizeof(path))
+  {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memcpy(path, name, colon - name);
+  path[colon - name] = 0;
+
+  library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (library == NULL)
+  {
+    fprintf(stderr, "Ошибка загрузки этапа обработки: %s\n", dlerror());
+    errno = ENOENT;
+    return -1;
+  }
+  chain->libraries[chain->library_count++] = library;
+
+  stage->name        = NULL;
+  stage->process     = (stage_fn)(dlsym(library, symbol));
+  stage->process_iov = NULL;
+  stage->arg         = NULL;
+  if (stage->process == NULL)
+  {
+    fprintf(stderr, "Функция этапа обработки не найдена: %s\n", dlerror());
+    errno = ENOENT;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * создание цепочки по описанию
+ */
+stage_chain_t * stage_chain_create(const char * spec, stage_done_fn done)
+{
+  stage_chain_t * chain;
+  char name[1024];
+  size_t stages = 0;
+  size_t segment = 0;
+  const char * token = spec;
+  int error;
+
+  chain = calloc(1, sizeof(stage_chain_t));
+  if (chain == NULL)
+    return NULL;
+  chain->done = done;
+
+  // участков на один больше, чем разделителей '|'
+  chain->count = 1;
+  for (const char * c = spec; *c != 0; ++c)
+  {
+    chain->count += *c == '|';
+  }
+  chain->segments = calloc(chain->count, sizeof(stage_segment_t));
+  if (chain->segments == NULL)
+  {
+    error = errno;
+    free(chain);
+    errno = error;
+    return NULL;
+  }
+
+  chain->segments[0].stages = chain->stages;
+  while (1)
+  {
+    size_t length = strcspn(token, ",|");
+
+    // пустой первый участок допустим: все этапы выполняются в своих потоках
+    if (length > 0 || token[length] != '|' || token != spec)
+    {
+      if (length == 0 || length >= sizeof(name) || stages == STAGE_MAX_CHAIN)
+      {
+        fprintf(stderr, "Некорректное описание цепочки этапов обработки: '%s'\n", spec);
+        errno = EINVAL;
+        goto failed;
+      }
+      memcpy(name, token, length);
+      name[length] = 0;
+      if (stage_chain_resolve(chain, name, chain->stages + stages) != 0)
+        goto failed;
+      ++stages;
+      ++chain->segments[segment].count;
+    }
+
+    if (token[length] == 0)
+      break;
+    if (token[length] == '|')
+    {
+      chain->segments[++segment].stages = chain->stages + stages;
+    }
+    token += length + 1;
+  }
+
+  for (size_t i = 0; i < chain->count; ++i)
+  {
+    chain->segments[i].chain = chain;
+    chain->segments[i].index = i;
+  }
+
+  // первый участок выполняется в потоке, передающем сообщение на обработку
+  for (size_t i = 1; i < chain->count; ++i)
+  {
+    stage_segment_t * current = chain->segments + i;
+
+    current->capacity = STAGE_QUEUE_INITIAL_SIZE;
+    current->jobs = malloc(current->capacity * sizeof(stage_job_t));
+    if (current->jobs == NULL)
+      goto failed;
+    if (pthread_mutex_init(&(current->lock), NULL) != 0 || pthread_cond_init(&(current->cond), NULL) != 0)
+      goto failed;
+
+    error = pthread_create(&(current->thread_id), NULL, stage_segment_routine, current);
+    if (error != 0)
+    {
+      errno = error;
+      goto failed;
+    }
+    current->started = 1;
+  }
+
+  return chain;
+
+failed:
+  error = errno;
+  stage_chain_destroy(chain);
+  errno = error;
+  return NULL;
+}
+
+/*
+ * остановить потоки этапов и освободить цепочку
+ */
+void stage_chain_destroy(stage_chain_t * chain)
+{
+  for (size_t i = 1; i < chain->count; ++i)
+  {
+    stage_segment_t * segment = chain->segments + i;
+
+    if (segment->started)
+    {
+      pthread_mutex_lock(&(segment->lock));
+      segment->stop = 1;
+      pthread_cond_signal(&(segment->cond));
+      pthread_mutex_unlock(&(segment->lock));
+      pthread_join(segment->thread_id, NULL);
+      pthread_cond_destroy(&(segment->cond));
+      pthread_mutex_destroy(&(segment->lock));
+    }
+    free(segment->jobs);
+  }
+  for (size_t i = 0; i < chain->library_count; ++i)
+  {
+    dlclose(chain->libraries[i]);
+  }
+  free(chain->segments);
+  free(chain);
+}
+
+int stage_chain_threaded(const stage_chain_t * chain)
+{
+  return chain->count > 1;
+}
+
+/*
+ * обработать сообщение
+ */
+int stage_chain_process(stage_chain_t * chain, void * owner, message_buffer_t * buffer, size_t header_size,
+                        unsigned long sequence)
+{
+  stage_job_t job;
+
+  if (stage_segment_run(chain->segments, buffer, header_size) != 0)
+    return -1;
+  if (chain->count == 1)
+    return 0;
+
+  job.owner       = owner;
+  job.buffer      = buffer;
+  job.header_size = header_size;
+  job.sequence    = sequence;
+  return stage_segment_push(chain->segments + 1, &job) == 0 ? 1 : -1;
+}
@@ -0,0 +1,102 @@
+/*
+ * Этапы обработки сообщений
+ *
+ * Обработка сообщения - цепочка этапов. Этап - функция, обрабатывающая
+ * данные сообщения на месте (размер сообщения не меняется). Этапы
+ * регистрируются по имени (stage_register) или загружаются из разделяемой
+ * библиотеки. Встроенный этап "reverse" - обращение порядка байт.
+ * Большое сообщение (см. message_buffer.h) хранится частями и передается
+ * только этапам, обрабатывающим список областей (stage_register_iov).
+ *
+ * Цепочка задается строкой: этапы через ',' выполняются в одном потоке,
+ * '|' перед этапом - этап и следующие за ним через ',' выполняются в своем
+ * потоке со своей очередью. Так разные сообщения проходят этапы
+ * многошаговой обработки одновременно на разных ядрах (конвейер).
+ * Этап из библиотеки: путь к библиотеке (содержит '/') и необязательное
+ * имя функции через ':' (по умолчанию stage_process).
+ * Примеры: "reverse", "reverse|reverse|reverse", "|./libstage.so:encode"
+ */
+
+#ifndef __STAGE_H__
+#define __STAGE_H__
+
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#include "message_buffer.h"
+
+/*
+ * Функция этапа: обработать size байт data на месте
+ * arg - аргумент, указанный при регистрации (NULL для этапа из библиотеки)
+ * возвращает 0 или -1 при ошибке (сообщение не передается дальше)
+ */
+typedef int (*stage_fn)(char * data, size_t size, void * arg);
+
+/*
+ * Функция этапа для данных из count областей iov (сообщение частями):
+ * данные обрабатываются как одна последовательность, размеры областей
+ * не меняются
+ */
+typedef int (*stage_iov_fn)(const struct iovec * iov, size_t count, void * arg);
+
+/*
+ * Имя функции этапа в разделяемой библиотеке по умолчанию
+ */
+#define STAGE_DEFAULT_SYMBOL "stage_process"
+
+/*
+ * Цепочка этапов по умолчанию
+ */
+#define STAGE_DEFAULT_CHAIN "reverse"
+
+/*
+ * зарегистрировать этап (до создания цепочек, строка имени не копируется)
+ */
+int stage_register(const char * name, stage_fn process, void * arg);
+
+/*
+ * зарегистрировать этап, обрабатывающий и сообщения частями
+ * (process может быть NULL - сообщение целиком передается одной областью)
+ */
+int stage_register_iov(const char * name, stage_fn process, stage_iov_fn process_iov, void * arg);
+
+/*
+ * Завершение обработки сообщения, переданного потоку этапа
+ * (вызывается в потоке последнего этапа или этапа, завершившегося ошибкой)
+ * status: 0 - сообщение обработано, -1 - ошибка этапа
+ */
+typedef void (*stage_done_fn)(void * owner, message_buffer_t * buffer, unsigned long sequence, int status);
+
+/*
+ * Цепочка этапов
+ */
+struct stage_chain_t;
+typedef struct stage_chain_t stage_chain_t;
+
+/*
+ * создание цепочки по описанию spec и запуск потоков этапов
+ * при ошибке возвращается NULL (errno), причина выводится в stderr
+ */
+stage_chain_t * stage_chain_create(const char * spec, stage_done_fn done);
+
+/*
+ * остановить потоки этапов и освободить цепочку
+ * сообщения, не обработанные потоками, отбрасываются
+ */
+void stage_chain_destroy(stage_chain_t * chain);
+
+/*
+ * есть этапы со своим потоком (сообщения завершаются через done)
+ */
+int stage_chain_threaded(const stage_chain_t * chain);
+
+/*
+ * обработать сообщение: данные после header_size байт заголовка
+ * этапы до первого этапа со своим потоком выполняются в вызывающем потоке
+ * возвращает 0 - сообщение обработано, 1 - передано потоку этапа
+ * (по завершении вызывается done с owner и sequence), -1 - ошибка
+ */
+int stage_chain_process(stage_chain_t * chain, void * owner, message_buffer_t * buffer, size_t header_size,
+                        unsigned long sequence);
+
+#endif // __STAGE_H__
@@ -0,0 +1,164 @@
+/*
+ * Трассировка этапов обработки сообщений
+ */
+
+#include "trace.h"
+
+#include <string.h>
+
+/*
+ * Гистограмма: 8 линейных частей на каждую степень двойки наносекунд
+ * (погрешность до 12.5%)
+ */
+#define TRACE_SUB_BITS 3
+#define TRACE_BUCKETS ((64 - TRACE_SUB_BITS + 1) << TRACE_SUB_BITS)
+
+/*
+ * Интервалы между этапами и полное время
+ */
+enum trace_interval_t
+{
+  TRACE_INTERVAL_READ = 0,  // чтение - передача на обработку
+  TRACE_INTERVAL_QUEUE,     // ожидание в to_process_queue (включая уведомление)
+  TRACE_INTERVAL_PROCESS,   // обработка
+  TRACE_INTERVAL_REORDER,   // восстановление порядка результатов
+  TRACE_INTERVAL_SEND,      // ожидание в from_process_queue и запись в сокет
+  TRACE_INTERVAL_TOTAL,     // чтение - отправка
+  TRACE_INTERVALS
+}; // enum trace_interval_t
+
+static const char * const TRACE_INTERVAL_NAMES[TRACE_INTERVALS] =
+{
+  "read", "queue", "process", "reorder", "send", "total",
+};
+
+struct trace_histogram_t
+{
+  unsigned long counts[TRACE_BUCKETS];
+  unsigned long long sum;
+  unsigned long long max;
+} __attribute__((aligned(64))); // struct trace_histogram_t
+typedef struct trace_histogram_t trace_histogram_t;
+
+int trace_enabled = 0;
+
+static trace_histogram_t histograms[TRACE_INTERVALS];
+
+void trace_init(int enabled)
+{
+  memset(histograms, 0, sizeof(histograms));
+  trace_enabled = enabled;
+}
+
+static int trace_bucket(unsigned long long value)
+{
+  int exponent;
+
+  if (value < (1u << TRACE_SUB_BITS))
+    return (int)(value);
+  exponent = 63 - __builtin_clzll(value);
+  return ((exponent - TRACE_SUB_BITS + 1) << TRACE_SUB_BITS) +
+         (int)((value >> (exponent - TRACE_SUB_BITS)) & ((1u << TRACE_SUB_BITS) - 1));
+}
+
+/*
+ * наибольшее значение корзины bucket
+ */
+static unsigned long long trace_bucket_value(int bucket)
+{
+  int exponent = (bucket >> TRACE_SUB_BITS) + TRACE_SUB_BITS - 1;
+  unsigned long long sub = bucket & ((1u << TRACE_SUB_BITS) - 1);
+
+  if (bucket < (1 << TRACE_SUB_BITS))
+    return (unsigned long long)(bucket);
+  return (((1ull << TRACE_SUB_BITS) + sub + 1) << (exponent - TRACE_SUB_BITS)) - 1;
+}
+
+static void trace_record(trace_histogram_t * histogram, unsigned long long from, unsigned long long to)
+{
+  unsigned long long value;
+  unsigned long long max;
+
+  if (from == 0 || to == 0)
+    return;
+  value = to > from ? to - from : 0;
+
+  __atomic_add_fetch(histogram->counts + trace_bucket(value), 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&(histogram->sum), value, __ATOMIC_RELAXED);
+
+  max = __atomic_load_n(&(histogram->max), __ATOMIC_RELAXED);
+  while (value > max &&
+         !__atomic_compare_exchange_n(&(histogram->max), &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+  {
+  }
+}
+
+void trace_complete(message_buffer_t * buffer, unsigned long long now)
+{
+  unsigned long long * trace = buffer->trace;
+
+  if (!trace_enabled)
+    return;
+
+  trace[TRACE_SEND] = now;
+  for (int i = 0; i < TRACE_INTERVAL_TOTAL; ++i)
+  {
+    trace_record(histograms + i, trace[i], trace[i + 1]);
+  }
+  trace_record(histograms + TRACE_INTERVAL_TOTAL, trace[TRACE_READ], trace[TRACE_SEND]);
+  memset(trace, 0, sizeof(buffer->trace));
+}
+
+/*
+ * значение, не меньше которого percentile процентов записанных
+ */
+static unsigned long long trace_percentile(const unsigned long * counts, unsigned long total,
+                                           unsigned long long max, double percentile)
+{
+  unsigned long target = (unsigned long)(total * percentile / 100.0);
+  unsigned long count = 0;
+
+  for (int i = 0; i < TRACE_BUCKETS; ++i)
+  {
+    count += counts[i];
+    if (count > target)
+      return trace_bucket_value(i) < max ? trace_bucket_value(i) : max;
+  }
+  return max;
+}
+
+void trace_dump(FILE * stream)
+{
+  static unsigned long counts[TRACE_BUCKETS];
+
+  if (!trace_enabled)
+  {
+    fprintf(stream, "# trace: трассировка выключена (параметр --trace)\n");
+    return;
+  }
+
+  fprintf(stream, "# trace interval count mean_us p50_us p90_us p99_us p999_us max_us\n");
+  for (int i = 0; i < TRACE_INTERVALS; ++i)
+  {
+    trace_histogram_t * histogram = histograms + i;
+    unsigned long total = 0;
+    unsigned long long sum = __atomic_load_n(&(histogram->sum), __ATOMIC_RELAXED);
+    unsigned long long max = __atomic_load_n(&(histogram->max), __ATOMIC_RELAXED);
+
+    // снимок счетчиков: потоки продолжают запись
+    for (int j = 0; j < TRACE_BUCKETS; ++j)
+    {
+      counts[j] = __atomic_load_n(histogram->counts + j, __ATOMIC_RELAXED);
+      total += counts[j];
+    }
+
+    fprintf(stream, "trace %s %lu %.1f %.1f %.1f %.1f %.1f %.1f\n", TRACE_INTERVAL_NAMES[i], total,
+            total > 0 ? sum / 1000.0 / total : 0.0,
+            trace_percentile(counts, total, max, 50.0) / 1000.0,
+            trace_percentile(counts, total, max, 90.0) / 1000.0,
+            trace_percentile(counts, total, max, 99.0) / 1000.0,
+            trace_percentile(counts, total, max, 99.9) / 1000.0,
+            max / 1000.0);
+  }
+  fflush(stream);
+}
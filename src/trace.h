@@ -0,0 +1,72 @@
+/*
+ * Трассировка этапов обработки сообщений
+ *
+ * При включенной трассировке в буфере сообщения отмечается время каждого
+ * этапа (CLOCK_MONOTONIC), после отправки интервалы между этапами
+ * добавляются в общие гистограммы (атомарные счетчики без блокировок).
+ * Буфер передается между очередями обменом (message_buffer_swap),
+ * отметки переходят вместе с данными.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+#include <time.h>
+
+#include "message_buffer.h"
+
+/*
+ * Этапы обработки сообщения
+ */
+enum trace_stage_t
+{
+  TRACE_READ = 0,         // сообщение прочитано из сокета
+  TRACE_ENQUEUE_PROCESS,  // передано в to_process_queue
+  TRACE_PROCESS_START,    // начало обработки
+  TRACE_PROCESS_END,      // конец обработки
+  TRACE_ENQUEUE_SEND,     // передано в from_process_queue (после восстановления порядка)
+  TRACE_SEND,             // отправлено в сокет
+  TRACE_STAGES
+}; // enum trace_stage_t
+typedef enum trace_stage_t trace_stage_t;
+
+_Static_assert(TRACE_STAGES == MESSAGE_BUFFER_TRACE_POINTS, "число этапов трассировки");
+
+/*
+ * Трассировка включена (trace_init)
+ */
+extern int trace_enabled;
+
+void trace_init(int enabled);
+
+static inline unsigned long long trace_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * отметить этап stage сообщения buffer
+ * отметка делается до передачи буфера другому потоку
+ */
+static inline void trace_mark(message_buffer_t * buffer, trace_stage_t stage)
+{
+  if (trace_enabled)
+    buffer->trace[stage] = trace_now();
+}
+
+/*
+ * сообщение отправлено (отметка TRACE_SEND временем now):
+ * интервалы между этапами добавляются в гистограммы, отметки сбрасываются
+ */
+void trace_complete(message_buffer_t * buffer, unsigned long long now);
+
+/*
+ * вывести гистограммы (накопленные с запуска)
+ */
+void trace_dump(FILE * stream);
+
+#endif // __TRACE_H__
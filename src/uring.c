@@ -0,0 +1,281 @@
+/*
+ * Минимальная обертка io_uring (системные вызовы без liburing)
+ */
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifdef _DEBUG
+#include <stdio.h>
+#include <pthread.h>
+#define DEBUG(msg...) fprintf(stderr, "%u: ", (int)(pthread_self())); fprintf(stderr, msg)
+#else
+#define DEBUG(mag...)
+#endif
+
+static int uring_setup(unsigned entries, struct io_uring_params * params)
+{
+  return (int)(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return (int)(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0));
+}
+
+static int uring_register(int fd, unsigned opcode, void * arg, unsigned count)
+{
+  return (int)(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+/*
+ * создание кольца на entries запросов
+ */
+int uring_init(uring_t * ring, unsigned entries, unsigned cq_factor)
+{
+  struct io_uring_params params;
+  char * sq;
+  char * cq;
+
+  memset(ring, 0, sizeof(uring_t));
+  memset(&params, 0, sizeof(params));
+  params.flags      = IORING_SETUP_CQSIZE;
+  params.cq_entries = entries * cq_factor;
+
+  ring->fd = uring_setup(entries, &params);
+  if (ring->fd < 0)
+    return -1;
+
+  // кольца запросов и результатов отображаются одной областью
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+  {
+    close(ring->fd);
+    errno = ENOTSUP;
+    return -1;
+  }
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (ring->cq_ring_size > ring->sq_ring_size)
+    ring->sq_ring_size = ring->cq_ring_size;
+  ring->cq_ring_size = ring->sq_ring_size;
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+  {
+    int error = errno;
+    close(ring->fd);
+    errno = error;
+    return -1;
+  }
+  ring->cq_ring = ring->sq_ring;
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+  {
+    int error = errno;
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    errno = error;
+    return -1;
+  }
+
+  sq = (char *)(ring->sq_ring);
+  ring->sq_head    = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail    = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_array   = (unsigned *)(sq + params.sq_off.array);
+  ring->sq_mask    = *(unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_local_tail = *(ring->sq_tail);
+
+  cq = (char *)(ring->cq_ring);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes    = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  // позиция запроса в кольце совпадает с его номером в массиве sqes
+  for (unsigned i = 0; i < ring->sq_entries; ++i)
+  {
+    ring->sq_array[i] = i;
+  }
+
+  DEBUG("uring_init: fd = %d, sq = %u, cq = %u\n", ring->fd, params.sq_entries, params.cq_entries);
+  return 0;
+}
+
+void uring_destroy(uring_t * ring)
+{
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+  ring->fd = -1;
+}
+
+/*
+ * очередной запрос
+ */
+struct io_uring_sqe * uring_get_sqe(uring_t * ring)
+{
+  struct io_uring_sqe * sqe;
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  if (ring->sq_local_tail - head >= ring->sq_entries)
+    return NULL;
+
+  sqe = ring->sqes + (ring->sq_local_tail & ring->sq_mask);
+  ++ring->sq_local_tail;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+/*
+ * передать ядру накопленные запросы
+ */
+int uring_submit(uring_t * ring)
+{
+  // запросы, не принятые ядром при прошлой передаче, передаются повторно
+  unsigned pending = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  int rc;
+
+  if (pending == 0)
+    return 0;
+
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  do
+  {
+    rc = uring_enter(ring->fd, pending, 0, 0);
+  }
+  while (rc < 0 && errno == EINTR);
+
+  DEBUG("uring_submit: %u pending, rc = %d\n", pending, rc);
+  return rc;
+}
+
+/*
+ * очередной результат без ожидания
+ */
+struct io_uring_cqe * uring_peek_cqe(uring_t * ring)
+{
+  unsigned head = *(ring->cq_head);
+
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return ring->cqes + (head & ring->cq_mask);
+}
+
+void uring_cqe_seen(uring_t * ring)
+{
+  __atomic_store_n(ring->cq_head, *(ring->cq_head) + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * многократный прием соединений: результат на каждое соединение
+ */
+void uring_prep_accept_multishot(struct io_uring_sqe * sqe, int fd)
+{
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd     = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/*
+ * многократный прием данных в буферы группы group
+ */
+void uring_prep_recv_multishot(struct io_uring_sqe * sqe, int fd, unsigned short group)
+{
+  sqe->opcode    = IORING_OP_RECV;
+  sqe->fd        = fd;
+  sqe->ioprio    = IORING_RECV_MULTISHOT;
+  sqe->flags     = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = group;
+}
+
+/*
+ * msg и данные должны быть доступны до получения результата
+ */
+void uring_prep_sendmsg(struct io_uring_sqe * sqe, int fd, const struct msghdr * msg, unsigned flags)
+{
+  sqe->opcode    = IORING_OP_SENDMSG;
+  sqe->fd        = fd;
+  sqe->addr      = (unsigned long)(msg);
+  sqe->len       = 1;
+  sqe->msg_flags = flags;
+}
+
+/*
+ * отмена всех запросов к дескриптору fd
+ */
+void uring_prep_cancel_fd(struct io_uring_sqe * sqe, int fd)
+{
+  sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+  sqe->fd           = fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+}
+
+/*
+ * Кольцо буферов (память выравнивается на страницу)
+ */
+struct io_uring_buf_ring * uring_buf_ring_create(unsigned entries)
+{
+  void * buffers = mmap(NULL, entries * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffers == MAP_FAILED)
+    return NULL;
+  return (struct io_uring_buf_ring *)(buffers);
+}
+
+void uring_buf_ring_free(struct io_uring_buf_ring * buffers, unsigned entries)
+{
+  munmap(buffers, entries * sizeof(struct io_uring_buf));
+}
+
+int uring_buf_ring_register(uring_t * ring, struct io_uring_buf_ring * buffers, unsigned entries,
+                            unsigned short group)
+{
+  struct io_uring_buf_reg reg;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr    = (unsigned long)(buffers);
+  reg.ring_entries = entries;
+  reg.bgid         = group;
+
+  buffers->tail = 0;
+  return uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0 ? -1 : 0;
+}
+
+int uring_buf_ring_unregister(uring_t * ring, unsigned short group)
+{
+  struct io_uring_buf_reg reg;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.bgid = group;
+  return uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1) < 0 ? -1 : 0;
+}
+
+void uring_buf_ring_add(struct io_uring_buf_ring * buffers, unsigned entries,
+                        void * addr, unsigned len, unsigned short bid, unsigned offset)
+{
+  struct io_uring_buf * buffer = buffers->bufs + ((buffers->tail + offset) & (entries - 1));
+
+  buffer->addr = (unsigned long)(addr);
+  buffer->len  = len;
+  buffer->bid  = bid;
+}
+
+void uring_buf_ring_advance(struct io_uring_buf_ring * buffers, unsigned count)
+{
+  __atomic_store_n(&(buffers->tail), (unsigned short)(buffers->tail + count), __ATOMIC_RELEASE);
+}
+
+#endif // HAVE_IO_URING
@@ -0,0 +1,117 @@
+/*
+ * Минимальная обертка io_uring (системные вызовы без liburing)
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdlib.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <sys/socket.h>
+
+/*
+ * Кольца запросов (SQ) и результатов (CQ), отображенные из ядра
+ * Запросы накапливаются и передаются ядру одним вызовом uring_submit
+ */
+struct uring_t
+{
+  int fd;
+
+  unsigned * sq_head;
+  unsigned * sq_tail;
+  unsigned * sq_array;
+  unsigned   sq_mask;
+  unsigned   sq_entries;
+  unsigned   sq_local_tail;            // tail с учетом еще не переданных запросов
+  struct io_uring_sqe * sqes;
+
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned   cq_mask;
+  struct io_uring_cqe * cqes;
+
+  void * sq_ring;
+  size_t sq_ring_size;
+  void * cq_ring;                      // совпадает с sq_ring (IORING_FEAT_SINGLE_MMAP)
+  size_t cq_ring_size;
+  size_t sqes_size;
+}; // struct uring_t
+typedef struct uring_t uring_t;
+
+/*
+ * создание кольца на entries запросов
+ * кольцо результатов в cq_factor раз больше (многократные запросы)
+ */
+int uring_init(uring_t * ring, unsigned entries, unsigned cq_factor);
+
+void uring_destroy(uring_t * ring);
+
+/*
+ * очередной запрос (обнуленный); NULL - кольцо запросов заполнено
+ */
+struct io_uring_sqe * uring_get_sqe(uring_t * ring);
+
+/*
+ * передать ядру накопленные запросы
+ * возвращает число переданных запросов или -1 (errno)
+ */
+int uring_submit(uring_t * ring);
+
+/*
+ * очередной результат без ожидания; NULL - результатов нет
+ * после обработки результат освобождается uring_cqe_seen
+ */
+struct io_uring_cqe * uring_peek_cqe(uring_t * ring);
+
+void uring_cqe_seen(uring_t * ring);
+
+/*
+ * Запросы
+ */
+void uring_prep_accept_multishot(struct io_uring_sqe * sqe, int fd);
+void uring_prep_recv_multishot(struct io_uring_sqe * sqe, int fd, unsigned short group);
+void uring_prep_sendmsg(struct io_uring_sqe * sqe, int fd, const struct msghdr * msg, unsigned flags);
+void uring_prep_cancel_fd(struct io_uring_sqe * sqe, int fd);
+
+/*
+ * Кольцо буферов, предоставляемых ядру для приема данных (provided buffers)
+ * entries - степень двойки; буфер выбирается ядром при выполнении запроса,
+ * его номер (bid) возвращается в флагах результата
+ */
+struct io_uring_buf_ring * uring_buf_ring_create(unsigned entries);
+
+void uring_buf_ring_free(struct io_uring_buf_ring * buffers, unsigned entries);
+
+/*
+ * зарегистрировать кольцо буферов как группу group (кольцо должно быть пустым)
+ */
+int uring_buf_ring_register(uring_t * ring, struct io_uring_buf_ring * buffers, unsigned entries,
+                            unsigned short group);
+
+int uring_buf_ring_unregister(uring_t * ring, unsigned short group);
+
+/*
+ * добавить буфер; offset - номер среди добавленных с последнего uring_buf_ring_advance
+ */
+void uring_buf_ring_add(struct io_uring_buf_ring * buffers, unsigned entries,
+                        void * addr, unsigned len, unsigned short bid, unsigned offset);
+
+/*
+ * передать ядру count добавленных буферов
+ */
+void uring_buf_ring_advance(struct io_uring_buf_ring * buffers, unsigned count);
+
+#endif // HAVE_IO_URING
+
+#endif // __URING_H__
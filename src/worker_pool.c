@@ -0,0 +1,314 @@
+/*
+ * Пул потоков обработки
+ */
+
+#include "worker_pool.h"
+#include "metrics.h"
+#include "affinity.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#ifdef _DEBUG
+#include <stdio.h>
+#define DEBUG(msg...) fprintf(stderr, "%u: ", (int)(pthread_self())); fprintf(stderr, msg)
+#else
+#define DEBUG(mag...)
+#endif
+
+/*
+ * Начальный размер очереди задач потока
+ */
+static const size_t WORKER_QUEUE_INITIAL_SIZE = 64;
+
+/*
+ * Внутренние структуры
+ *
+ * Задача
+ */
+struct worker_task_t
+{
+  worker_task_fn task;
+  void *         arg;
+}; // struct worker_task_t
+typedef struct worker_task_t worker_task_t;
+
+/*
+ * Внутренние структуры
+ *
+ * Поток пула и его очередь задач (кольцевой буфер)
+ * Владелец берет задачи из начала очереди, другие потоки - из конца
+ */
+struct worker_t
+{
+  pthread_mutex_t lock;
+  pthread_t       thread_id;
+
+  worker_task_t * tasks;
+  size_t          capacity;
+  size_t          head;
+  size_t          count;
+
+  size_t               index;
+  struct worker_pool_t * pool;
+}; // struct worker_t
+typedef struct worker_t worker_t;
+
+/*
+ * Пул потоков обработки
+ */
+struct worker_pool_t
+{
+  worker_t * workers;
+  size_t     count;
+  size_t     started;
+
+  size_t     next_worker;  // поток для следующей задачи
+
+  pthread_mutex_t idle_lock;
+  pthread_cond_t  idle_cond;
+  size_t          pending; // задач в очередях
+  size_t          idle;    // потоков в ожидании задач
+  int             stop;
+}; // struct worker_pool_t
+
+/*
+ * добавить задачу в конец очереди потока
+ */
+static int worker_push(worker_t * worker, worker_task_fn task, void * arg)
+{
+  pthread_mutex_lock(&(worker->lock));
+  if (worker->count == worker->capacity)
+  {
+    size_t capacity = worker->capacity * 2;
+    worker_task_t * tasks = malloc(capacity * sizeof(worker_task_t));
+    if (tasks == NULL)
+    {
+      pthread_mutex_unlock(&(worker->lock));
+      return -1;
+    }
+    for (size_t i = 0; i < worker->count; ++i)
+    {
+      tasks[i] = worker->tasks[(worker->head + i) % worker->capacity];
+    }
+    free(worker->tasks);
+    worker->tasks    = tasks;
+    worker->capacity = capacity;
+    worker->head     = 0;
+  }
+
+  worker->tasks[(worker->head + worker->count) % worker->capacity].task = task;
+  worker->tasks[(worker->head + worker->count) % worker->capacity].arg  = arg;
+  ++worker->count;
+  pthread_mutex_unlock(&(worker->lock));
+  return 0;
+}
+
+/*
+ * взять задачу из начала очереди (владелец очереди)
+ */
+static int worker_pop(worker_t * worker, worker_task_t * task)
+{
+  int found = 0;
+
+  pthread_mutex_lock(&(worker->lock));
+  if (worker->count > 0)
+  {
+    *task = worker->tasks[worker->head];
+    worker->head = (worker->head + 1) % worker->capacity;
+    --worker->count;
+    found = 1;
+  }
+  pthread_mutex_unlock(&(worker->lock));
+  return found;
+}
+
+/*
+ * забрать задачу из конца очереди другого потока
+ */
+static int worker_steal(worker_t * worker, worker_task_t * task)
+{
+  int found = 0;
+
+  if (__atomic_load_n(&(worker->count), __ATOMIC_RELAXED) == 0)
+    return 0;
+
+  pthread_mutex_lock(&(worker->lock));
+  if (worker->count > 0)
+  {
+    --worker->count;
+    *task = worker->tasks[(worker->head + worker->count) % worker->capacity];
+    found = 1;
+  }
+  pthread_mutex_unlock(&(worker->lock));
+  return found;
+}
+
+/*
+ * найти задачу: сначала в своей очереди, затем в очередях других потоков
+ */
+static int worker_find_task(worker_t * worker, worker_task_t * task)
+{
+  worker_pool_t * pool = worker->pool;
+
+  if (worker_pop(worker, task))
+    return 1;
+
+  for (size_t i = 1; i < pool->count; ++i)
+  {
+    if (worker_steal(pool->workers + (worker->index + i) % pool->count, task))
+    {
+      DEBUG("worker %zu stole task from worker %zu\n", worker->index, (worker->index + i) % pool->count);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Поток пула
+ */
+static void * worker_routine(void * params)
+{
+  worker_t * worker = (worker_t *)(params);
+  worker_pool_t * pool = worker->pool;
+  worker_task_t task;
+
+  DEBUG("%s %zu\n", __FUNCTION__, worker->index);
+  metrics_set_role("worker");
+  affinity_bind(AFFINITY_WORKER, worker->index);
+
+  while (1)
+  {
+    if (worker_find_task(worker, &task))
+    {
+      __atomic_sub_fetch(&(pool->pending), 1, __ATOMIC_ACQ_REL);
+      task.task(task.arg);
+      continue;
+    }
+
+    pthread_mutex_lock(&(pool->idle_lock));
+    ++pool->idle;
+    while (__atomic_load_n(&(pool->pending), __ATOMIC_ACQUIRE) == 0 && !pool->stop)
+    {
+      pthread_cond_wait(&(pool->idle_cond), &(pool->idle_lock));
+    }
+    --pool->idle;
+    if (pool->stop)
+    {
+      pthread_mutex_unlock(&(pool->idle_lock));
+      break;
+    }
+    pthread_mutex_unlock(&(pool->idle_lock));
+  }
+
+  DEBUG("%s %zu done\n", __FUNCTION__, worker->index);
+  return NULL;
+}
+
+/*
+ * создание пула из count потоков
+ */
+worker_pool_t * worker_pool_create(size_t count)
+{
+  worker_pool_t * pool;
+
+  pool = calloc(1, sizeof(worker_pool_t));
+  if (pool == NULL)
+    return NULL;
+
+  pool->workers = calloc(count, sizeof(worker_t));
+  if (pool->workers == NULL)
+  {
+    free(pool);
+    return NULL;
+  }
+
+  pthread_mutex_init(&(pool->idle_lock), NULL);
+  pthread_cond_init(&(pool->idle_cond), NULL);
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    worker_t * worker = pool->workers + i;
+
+    worker->tasks = calloc(WORKER_QUEUE_INITIAL_SIZE, sizeof(worker_task_t));
+    if (worker->tasks == NULL)
+    {
+      int error = errno;
+      worker_pool_destroy(pool);
+      errno = error;
+      return NULL;
+    }
+    worker->capacity = WORKER_QUEUE_INITIAL_SIZE;
+    worker->index    = i;
+    worker->pool     = pool;
+    pthread_mutex_init(&(worker->lock), NULL);
+    ++pool->count;
+  }
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    int status = pthread_create(&(pool->workers[i].thread_id), NULL, worker_routine, pool->workers + i);
+    if (status != 0)
+    {
+      worker_pool_destroy(pool);
+      errno = status;
+      return NULL;
+    }
+    ++pool->started;
+  }
+
+  return pool;
+}
+
+/*
+ * остановить потоки и освободить память
+ */
+void worker_pool_destroy(worker_pool_t * pool)
+{
+  pthread_mutex_lock(&(pool->idle_lock));
+  pool->stop = 1;
+  pthread_cond_broadcast(&(pool->idle_cond));
+  pthread_mutex_unlock(&(pool->idle_lock));
+
+  for (size_t i = 0; i < pool->started; ++i)
+  {
+    pthread_join(pool->workers[i].thread_id, NULL);
+  }
+
+  for (size_t i = 0; i < pool->count; ++i)
+  {
+    pthread_mutex_destroy(&(pool->workers[i].lock));
+    free(pool->workers[i].tasks);
+  }
+
+  pthread_cond_destroy(&(pool->idle_cond));
+  pthread_mutex_destroy(&(pool->idle_lock));
+  free(pool->workers);
+  free(pool);
+}
+
+/*
+ * поставить задачу в очередь одного из потоков
+ */
+int worker_pool_submit(worker_pool_t * pool, worker_task_fn task, void * arg)
+{
+  size_t index = __atomic_fetch_add(&(pool->next_worker), 1, __ATOMIC_RELAXED) % pool->count;
+
+  // счетчик увеличивается заранее, чтобы не уйти в минус при быстром выполнении задачи
+  __atomic_add_fetch(&(pool->pending), 1, __ATOMIC_ACQ_REL);
+  if (worker_push(pool->workers + index, task, arg) != 0)
+  {
+    __atomic_sub_fetch(&(pool->pending), 1, __ATOMIC_ACQ_REL);
+    return -1;
+  }
+
+  pthread_mutex_lock(&(pool->idle_lock));
+  if (pool->idle > 0)
+  {
+    pthread_cond_signal(&(pool->idle_cond));
+  }
+  pthread_mutex_unlock(&(pool->idle_lock));
+  return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * Пул потоков обработки
+ */
+
+#ifndef __WORKER_POOL_H__
+#define __WORKER_POOL_H__
+
+#include <stdlib.h>
+
+/*
+ * Задача для потока обработки
+ */
+typedef void (*worker_task_fn)(void * arg);
+
+/*
+ * Пул потоков обработки
+ * У каждого потока своя очередь задач, освободившийся поток
+ * забирает задачи из очередей других потоков
+ */
+struct worker_pool_t;
+typedef struct worker_pool_t worker_pool_t;
+
+/*
+ * создание пула из count потоков
+ */
+worker_pool_t * worker_pool_create(size_t count);
+
+/*
+ * остановить потоки и освободить память
+ * задачи, не взятые на выполнение, отбрасываются
+ */
+void worker_pool_destroy(worker_pool_t * pool);
+
+/*
+ * поставить задачу в очередь одного из потоков
+ */
+int worker_pool_submit(worker_pool_t * pool, worker_task_fn task, void * arg);
+
+#endif // __WORKER_POOL_H__
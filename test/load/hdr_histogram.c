@@ -0,0 +1,152 @@
+/*
+ * Гистограмма значений с заданной относительной точностью (алгоритм HdrHistogram)
+ */
+
+#include "hdr_histogram.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+
+/*
+ * номер корзины: степень двойки значения сверх линейной части
+ */
+static int hdr_bucket_index(const hdr_histogram_t * h, uint64_t value)
+{
+  int pow2ceiling = 64 - __builtin_clzll(value | h->sub_bucket_mask);
+  return pow2ceiling - (h->sub_bucket_half_count_magnitude + 1);
+}
+
+static int hdr_counts_index(const hdr_histogram_t * h, int bucket, int sub_bucket)
+{
+  return ((bucket + 1) << h->sub_bucket_half_count_magnitude) + (sub_bucket - h->sub_bucket_half_count);
+}
+
+/*
+ * наименьшее значение, попадающее в элемент index
+ */
+static uint64_t hdr_value_at_index(const hdr_histogram_t * h, int index)
+{
+  int bucket = (index >> h->sub_bucket_half_count_magnitude) - 1;
+  int sub_bucket = (index & (h->sub_bucket_half_count - 1)) + h->sub_bucket_half_count;
+
+  if (bucket < 0)
+  {
+    sub_bucket -= h->sub_bucket_half_count;
+    bucket = 0;
+  }
+  return (uint64_t)(sub_bucket) << bucket;
+}
+
+/*
+ * наибольшее значение, неотличимое от value
+ */
+static uint64_t hdr_highest_equivalent(const hdr_histogram_t * h, uint64_t value)
+{
+  int bucket = hdr_bucket_index(h, value);
+  int sub_bucket = (int)(value >> bucket);
+  uint64_t lowest = (uint64_t)(sub_bucket) << bucket;
+  int range_bucket = sub_bucket >= h->sub_bucket_count ? bucket + 1 : bucket;
+
+  return lowest + ((uint64_t)(1) << range_bucket) - 1;
+}
+
+int hdr_init(hdr_histogram_t * h, uint64_t highest, int significant_figures)
+{
+  uint64_t largest_single_unit;
+  uint64_t smallest_untrackable;
+  int bucket_count = 1;
+
+  if (significant_figures < 1 || significant_figures > 5 || highest < 2)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  largest_single_unit = 2 * (uint64_t)(pow(10, significant_figures));
+  h->sub_bucket_half_count_magnitude = (int)(ceil(log2((double)(largest_single_unit)))) - 1;
+  h->sub_bucket_half_count = 1 << h->sub_bucket_half_count_magnitude;
+  h->sub_bucket_count = h->sub_bucket_half_count * 2;
+  h->sub_bucket_mask = (uint64_t)(h->sub_bucket_count) - 1;
+
+  smallest_untrackable = (uint64_t)(h->sub_bucket_count);
+  while (smallest_untrackable <= highest)
+  {
+    if (smallest_untrackable > UINT64_MAX / 2)
+    {
+      ++bucket_count;
+      break;
+    }
+    smallest_untrackable <<= 1;
+    ++bucket_count;
+  }
+
+  h->highest = highest;
+  h->counts_len = (bucket_count + 1) * h->sub_bucket_half_count;
+  h->counts = calloc(h->counts_len, sizeof(uint64_t));
+  if (h->counts == NULL)
+    return -1;
+
+  h->total_count = 0;
+  h->min = UINT64_MAX;
+  h->max = 0;
+  h->sum = 0;
+  return 0;
+}
+
+void hdr_destroy(hdr_histogram_t * h)
+{
+  free(h->counts);
+  h->counts = NULL;
+}
+
+void hdr_record(hdr_histogram_t * h, uint64_t value)
+{
+  int bucket;
+  int index;
+
+  if (value > h->highest)
+    value = h->highest;
+
+  bucket = hdr_bucket_index(h, value);
+  index = hdr_counts_index(h, bucket, (int)(value >> bucket));
+  ++h->counts[index];
+
+  ++h->total_count;
+  h->sum += (double)(value);
+  if (value < h->min)
+    h->min = value;
+  if (value > h->max)
+    h->max = value;
+}
+
+uint64_t hdr_value_at_percentile(const hdr_histogram_t * h, double percentile)
+{
+  uint64_t target;
+  uint64_t count = 0;
+
+  if (h->total_count == 0)
+    return 0;
+
+  if (percentile > 100.0)
+    percentile = 100.0;
+  target = (uint64_t)(ceil(percentile / 100.0 * (double)(h->total_count)));
+  if (target == 0)
+    target = 1;
+
+  for (int i = 0; i < h->counts_len; ++i)
+  {
+    count += h->counts[i];
+    if (count >= target)
+    {
+      uint64_t value = hdr_highest_equivalent(h, hdr_value_at_index(h, i));
+      return value < h->max ? value : h->max;
+    }
+  }
+  return h->max;
+}
+
+double hdr_mean(const hdr_histogram_t * h)
+{
+  return h->total_count > 0 ? h->sum / (double)(h->total_count) : 0.0;
+}
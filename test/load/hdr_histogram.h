@@ -0,0 +1,48 @@
+/*
+ * Гистограмма значений с заданной относительной точностью (алгоритм HdrHistogram)
+ *
+ * Значения от 0 до highest хранятся в логарифмических корзинах, каждая
+ * разбита на линейные подкорзины: относительная погрешность не больше
+ * 10^-significant_figures при постоянном времени записи
+ */
+
+#ifndef __HDR_HISTOGRAM_H__
+#define __HDR_HISTOGRAM_H__
+
+#include <stdint.h>
+
+struct hdr_histogram_t
+{
+  uint64_t   highest;                    // наибольшее значение (большие ограничиваются им)
+  int        sub_bucket_half_count_magnitude;
+  int        sub_bucket_half_count;
+  int        sub_bucket_count;
+  uint64_t   sub_bucket_mask;
+  int        counts_len;
+  uint64_t * counts;
+
+  uint64_t   total_count;
+  uint64_t   min;
+  uint64_t   max;
+  double     sum;
+}; // struct hdr_histogram_t
+typedef struct hdr_histogram_t hdr_histogram_t;
+
+/*
+ * significant_figures - от 1 до 5
+ */
+int hdr_init(hdr_histogram_t * h, uint64_t highest, int significant_figures);
+
+void hdr_destroy(hdr_histogram_t * h);
+
+void hdr_record(hdr_histogram_t * h, uint64_t value);
+
+/*
+ * значение, не меньше которого percentile процентов записанных
+ * (с точностью гистограммы); 0 - гистограмма пуста
+ */
+uint64_t hdr_value_at_percentile(const hdr_histogram_t * h, double percentile);
+
+double hdr_mean(const hdr_histogram_t * h);
+
+#endif // __HDR_HISTOGRAM_H__
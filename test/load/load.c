@@ -0,0 +1,634 @@
+/*
+ * Генератор нагрузки
+ *
+ * Несколько соединений обслуживаются одним циклом libev без ожиданий.
+ * Замкнутый цикл (-r 0): на каждом соединении depth сообщений без ответа,
+ * следующее отправляется по получении ответа.
+ * Разомкнутый цикл (-r RATE): сообщения планируются с постоянной частотой
+ * (по кругу между соединениями) независимо от ответов; задержка считается от
+ * запланированного времени отправки, если сообщение задержано заполненным
+ * окном (depth сообщений без ответа): ожидание ответов сервера входит в
+ * задержку. Запаздывание таймера планирования (до TICK_INTERVAL) не учитывается.
+ * В режиме кадров ответ проверяется (данные в обратном порядке).
+ *
+ * Результат выводится строками "имя значение".
+ */
+
+#include "load_params.h"
+#include "hdr_histogram.h"
+
+#include <ev.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifdef _DEBUG
+#define DEBUG(msg...) fprintf(stderr, msg)
+#else
+#define DEBUG(mag...)
+#endif
+
+#define HEADER_SIZE 4
+
+/*
+ * Сдвиги начала данных сообщения в общем образце
+ */
+static const int PATTERN_SLACK = 4096;
+
+/*
+ * Размер буфера приема (общий для всех соединений)
+ */
+static const size_t RECEIVE_SIZE = 256 * 1024;
+
+/*
+ * Период планирования в разомкнутом цикле, секунд
+ */
+static const double TICK_INTERVAL = 0.001;
+
+/*
+ * Наибольшая учитываемая задержка, нс
+ */
+static const uint64_t LATENCY_HIGHEST = 60ull * 1000 * 1000 * 1000;
+
+/*
+ * Отправленное сообщение, ожидающее ответа
+ */
+struct request_t
+{
+  uint64_t start;       // время отправки (в разомкнутом цикле - запланированное), нс
+  int      size;
+  int      offset;      // начало данных в образце
+}; // struct request_t
+typedef struct request_t request_t;
+
+struct load_t;
+
+struct connection_t
+{
+  struct load_t * load;
+  int             index;
+  int             fd;
+  ev_io           watcher;
+
+  request_t *     requests;       // кольцо на depth сообщений
+  int             first;
+  int             count;
+  uint64_t        sequence;       // число отправленных сообщений
+  int             blocked;        // очередное сообщение задержано заполненным окном
+
+  size_t          received;       // принято байт текущего ответа (с заголовком)
+  unsigned char   header[HEADER_SIZE];
+
+  char *          out;            // данные, ожидающие отправки
+  size_t          out_size;
+  size_t          out_sent;
+  size_t          out_capacity;
+}; // struct connection_t
+typedef struct connection_t connection_t;
+
+struct load_t
+{
+  const LoadParams * params;
+  struct ev_loop *   loop;
+  ev_timer           tick_watcher;
+  ev_timer           stop_watcher;
+
+  connection_t *     connections;
+  int                active;      // число открытых соединений
+  int                stopping;
+
+  char *             pattern;     // данные сообщений
+  char *             in;
+  uint64_t           random;
+
+  uint64_t           start;       // начало (нс)
+  uint64_t           measure;     // начало измерения (нс)
+  double             interval;    // интервал между сообщениями в разомкнутом цикле (нс)
+
+  hdr_histogram_t    latency;
+  uint64_t           completed;   // ответов за время измерения
+  uint64_t           bytes;
+  uint64_t           errors;
+}; // struct load_t
+typedef struct load_t load_t;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * xorshift64*
+ */
+static uint64_t next_random(load_t * load)
+{
+  load->random ^= load->random >> 12;
+  load->random ^= load->random << 25;
+  load->random ^= load->random >> 27;
+  return load->random * 2685821657736338717ull;
+}
+
+static int next_size(load_t * load)
+{
+  const LoadParams * params = load->params;
+
+  switch (params->sizeDistribution_)
+  {
+    case SIZE_UNIFORM:
+      return params->minSize_ + (int)(next_random(load) % (uint64_t)(params->maxSize_ - params->minSize_ + 1));
+
+    case SIZE_EXPONENTIAL:
+      {
+        double u = (double)(next_random(load) >> 11) / (double)(1ull << 53);
+        double size = ceil(-params->meanSize_ * log(1.0 - u));
+
+        if (size < params->minSize_)
+          return params->minSize_;
+        if (size > params->maxSize_)
+          return params->maxSize_;
+        return (int)(size);
+      }
+
+    default:
+      return params->minSize_;
+  }
+}
+
+/*
+ * Закрыть соединение после ошибки
+ */
+static void connection_fail(connection_t * connection, const char * reason)
+{
+  load_t * load = connection->load;
+
+  if (connection->fd < 0)
+    return;
+
+  if (!load->stopping)
+  {
+    warnx("Соединение %d: %s", connection->index, reason);
+    ++load->errors;
+  }
+  ev_io_stop(load->loop, &connection->watcher);
+  close(connection->fd);
+  connection->fd = -1;
+
+  if (--load->active == 0)
+    ev_break(load->loop, EVBREAK_ALL);
+}
+
+static void connection_set_events(connection_t * connection, int events)
+{
+  if (connection->watcher.events == events)
+    return;
+
+  ev_io_stop(connection->load->loop, &connection->watcher);
+  ev_io_set(&connection->watcher, connection->fd, events);
+  ev_io_start(connection->load->loop, &connection->watcher);
+}
+
+/*
+ * Отправка накопленных данных (сколько примет сокет)
+ */
+static void connection_flush(connection_t * connection)
+{
+  while (connection->out_sent < connection->out_size)
+  {
+    ssize_t sent = send(connection->fd, connection->out + connection->out_sent,
+                        connection->out_size - connection->out_sent, MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      connection_fail(connection, strerror(errno));
+      return;
+    }
+    connection->out_sent += sent;
+  }
+
+  if (connection->out_sent == connection->out_size)
+  {
+    connection->out_sent = connection->out_size = 0;
+    connection_set_events(connection, EV_READ);
+  }
+  else
+  {
+    connection_set_events(connection, EV_READ | EV_WRITE);
+  }
+}
+
+/*
+ * Добавить сообщение к данным для отправки
+ */
+static void connection_append(connection_t * connection, const request_t * request)
+{
+  const char * data = connection->load->pattern + request->offset;
+  size_t size = request->size + (connection->load->params->framed_ ? HEADER_SIZE : 0);
+  char * out;
+
+  if (connection->out_sent > 0)
+  {
+    memmove(connection->out, connection->out + connection->out_sent, connection->out_size - connection->out_sent);
+    connection->out_size -= connection->out_sent;
+    connection->out_sent = 0;
+  }
+
+  if (connection->out_size + size > connection->out_capacity)
+  {
+    size_t capacity = connection->out_capacity * 2;
+
+    if (capacity < connection->out_size + size)
+      capacity = connection->out_size + size;
+    if ((out = realloc(connection->out, capacity)) == NULL)
+      err(EXIT_FAILURE, "Ошибка выделения памяти");
+    connection->out = out;
+    connection->out_capacity = capacity;
+  }
+
+  out = connection->out + connection->out_size;
+  if (connection->load->params->framed_)
+  {
+    out[0] = (request->size >> 24) & 0xFF;
+    out[1] = (request->size >> 16) & 0xFF;
+    out[2] = (request->size >> 8) & 0xFF;
+    out[3] = request->size & 0xFF;
+    out += HEADER_SIZE;
+  }
+  memcpy(out, data, request->size);
+  connection->out_size += size;
+}
+
+/*
+ * Отправить сообщения, которые можно отправить к моменту now
+ */
+static void connection_issue(connection_t * connection, uint64_t now)
+{
+  load_t * load = connection->load;
+  const LoadParams * params = load->params;
+  int issued = 0;
+
+  while (connection->fd >= 0 && !load->stopping && connection->count < params->depth_)
+  {
+    request_t * request;
+    uint64_t start = now;
+
+    if (params->rate_ > 0)
+    {
+      // сообщение k (по всем соединениям) запланировано на start + k * interval
+      double k = (double)(connection->sequence) * params->connections_ + connection->index;
+
+      start = load->start + (uint64_t)(k * load->interval);
+      if (start > now)
+        break;
+      if (!connection->blocked)
+        start = now;
+    }
+
+    request = connection->requests + (connection->first + connection->count) % params->depth_;
+    request->start  = start;
+    request->size   = next_size(load);
+    request->offset = (int)(next_random(load) % PATTERN_SLACK);
+    ++connection->count;
+    ++connection->sequence;
+
+    connection_append(connection, request);
+    ++issued;
+  }
+
+  if (params->rate_ > 0)
+  {
+    double k = (double)(connection->sequence) * params->connections_ + connection->index;
+    connection->blocked = connection->count == params->depth_ && load->start + (uint64_t)(k * load->interval) <= now;
+  }
+
+  if (issued > 0)
+    connection_flush(connection);
+}
+
+static void connection_complete(connection_t * connection, uint64_t now)
+{
+  load_t * load = connection->load;
+  request_t * request = connection->requests + connection->first;
+
+  if (now >= load->measure)
+  {
+    hdr_record(&load->latency, now > request->start ? now - request->start : 0);
+    ++load->completed;
+    load->bytes += request->size;
+  }
+
+  connection->first = (connection->first + 1) % load->params->depth_;
+  --connection->count;
+  connection->received = 0;
+}
+
+/*
+ * Разбор принятых данных: ответы приходят в порядке отправки
+ * возвращает -1 при несовпадении ответа с ожидаемым
+ */
+static int connection_parse(connection_t * connection, const char * data, size_t size, uint64_t now)
+{
+  load_t * load = connection->load;
+  int framed = load->params->framed_;
+
+  while (size > 0)
+  {
+    request_t * request = connection->requests + connection->first;
+    const char * expected;
+    size_t offset;
+    size_t chunk;
+
+    if (connection->count == 0)
+    {
+      connection_fail(connection, "Ответ без запроса");
+      return -1;
+    }
+
+    if (framed && connection->received < HEADER_SIZE)
+    {
+      connection->header[connection->received++] = *data++;
+      --size;
+      if (connection->received == HEADER_SIZE)
+      {
+        uint32_t length = ((uint32_t)(connection->header[0]) << 24) | ((uint32_t)(connection->header[1]) << 16) |
+                          ((uint32_t)(connection->header[2]) << 8) | connection->header[3];
+        if (length != (uint32_t)(request->size))
+        {
+          connection_fail(connection, "Неверная длина ответа");
+          return -1;
+        }
+        if (length == 0)
+          connection_complete(connection, now);
+      }
+      continue;
+    }
+
+    offset = connection->received - (framed ? HEADER_SIZE : 0);
+    chunk = request->size - offset;
+    if (chunk > size)
+      chunk = size;
+
+    // без кадров сервер может обратить сообщение по частям
+    if (framed)
+    {
+      expected = load->pattern + request->offset + request->size - 1 - offset;
+      for (size_t i = 0; i < chunk; ++i)
+      {
+        if (data[i] != *(expected - i))
+        {
+          connection_fail(connection, "Неверные данные ответа");
+          return -1;
+        }
+      }
+    }
+
+    connection->received += chunk;
+    data += chunk;
+    size -= chunk;
+    if (offset + chunk == (size_t)(request->size))
+      connection_complete(connection, now);
+  }
+  return 0;
+}
+
+static void connection_callback(EV_P_ ev_io * watcher, int revents)
+{
+  connection_t * connection = (connection_t *)(watcher->data);
+  load_t * load = connection->load;
+
+  if (revents & EV_WRITE)
+  {
+    connection_flush(connection);
+    if (connection->fd < 0)
+      return;
+  }
+
+  if (revents & EV_READ)
+  {
+    ssize_t received = recv(connection->fd, load->in, RECEIVE_SIZE, 0);
+    uint64_t now = now_ns();
+
+    if (received <= 0)
+    {
+      if (received < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+      connection_fail(connection, received == 0 ? "Соединение закрыто сервером" : strerror(errno));
+      return;
+    }
+
+    if (connection_parse(connection, load->in, received, now) == 0)
+      connection_issue(connection, now);
+  }
+}
+
+/*
+ * Разомкнутый цикл: отправка запланированных сообщений
+ */
+static void tick_callback(EV_P_ ev_timer * watcher, int revents)
+{
+  load_t * load = (load_t *)(watcher->data);
+  uint64_t now = now_ns();
+
+  for (int i = 0; i < load->params->connections_; ++i)
+  {
+    connection_issue(load->connections + i, now);
+  }
+}
+
+static void stop_callback(EV_P_ ev_timer * watcher, int revents)
+{
+  load_t * load = (load_t *)(watcher->data);
+
+  load->stopping = 1;
+  ev_break(EV_A_ EVBREAK_ALL);
+}
+
+static int open_connection(const LoadParams * params)
+{
+  struct sockaddr_in addr;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+
+  if (fd < 0)
+    err(EXIT_FAILURE, "Ошибка создания сокета");
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port   = htons(params->port_);
+  if (inet_pton(AF_INET, params->ip_, &addr.sin_addr) != 1)
+    errx(EXIT_FAILURE, "Неверный IP адрес: '%s'", params->ip_);
+
+  if (connect(fd, (struct sockaddr *)(&addr), sizeof(addr)) < 0)
+    err(EXIT_FAILURE, "Ошибка подключения к %s:%d", params->ip_, params->port_);
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+    err(EXIT_FAILURE, "Ошибка перевода сокета в неблокирующий режим");
+  return fd;
+}
+
+static const char * size_description(const LoadParams * params, char * buffer, size_t size)
+{
+  switch (params->sizeDistribution_)
+  {
+    case SIZE_UNIFORM:
+      snprintf(buffer, size, "uniform:%d:%d", params->minSize_, params->maxSize_);
+      break;
+    case SIZE_EXPONENTIAL:
+      snprintf(buffer, size, "exp:%g", params->meanSize_);
+      break;
+    default:
+      snprintf(buffer, size, "%d", params->minSize_);
+      break;
+  }
+  return buffer;
+}
+
+static void print_report(const load_t * load, double seconds)
+{
+  const LoadParams * params = load->params;
+  const hdr_histogram_t * latency = &load->latency;
+  uint64_t sent = 0;
+  char size[64];
+
+  for (int i = 0; i < params->connections_; ++i)
+  {
+    sent += load->connections[i].sequence;
+  }
+
+  fprintf(stdout, "# connections %d depth %d rate %g size %s framed %d duration %g warmup %g\n",
+          params->connections_, params->depth_, params->rate_, size_description(params, size, sizeof(size)),
+          params->framed_, params->duration_, params->warmup_);
+  fprintf(stdout, "sent %lu\n", (unsigned long)(sent));
+  if (params->rate_ > 0)
+  {
+    // отставание от графика к концу измерения
+    double scheduled = (params->warmup_ + seconds) * params->rate_;
+    fprintf(stdout, "behind %lu\n", scheduled > sent ? (unsigned long)(scheduled - sent) : 0ul);
+  }
+  fprintf(stdout, "completed %lu\n", (unsigned long)(load->completed));
+  fprintf(stdout, "errors %lu\n", (unsigned long)(load->errors));
+  fprintf(stdout, "duration_s %.3f\n", seconds);
+  fprintf(stdout, "throughput_rps %.1f\n", load->completed / seconds);
+  fprintf(stdout, "throughput_mbps %.3f\n", load->bytes / seconds / (1024 * 1024));
+  fprintf(stdout, "latency_us_min %.1f\n", (latency->total_count ? latency->min : 0) / 1000.0);
+  fprintf(stdout, "latency_us_p50 %.1f\n", hdr_value_at_percentile(latency, 50.0) / 1000.0);
+  fprintf(stdout, "latency_us_p90 %.1f\n", hdr_value_at_percentile(latency, 90.0) / 1000.0);
+  fprintf(stdout, "latency_us_p99 %.1f\n", hdr_value_at_percentile(latency, 99.0) / 1000.0);
+  fprintf(stdout, "latency_us_p999 %.1f\n", hdr_value_at_percentile(latency, 99.9) / 1000.0);
+  fprintf(stdout, "latency_us_max %.1f\n", latency->max / 1000.0);
+  fprintf(stdout, "latency_us_mean %.1f\n", hdr_mean(latency) / 1000.0);
+}
+
+int main(int argc, const char * argv[])
+{
+  LoadParams params;
+  load_t load;
+  uint64_t finish;
+  size_t pattern_size;
+
+  if (ProcessCmdLine(&params, argc, argv) != 0)
+    return EXIT_SUCCESS;
+
+  memset(&load, 0, sizeof(load));
+  load.params = &params;
+  load.random = (uint64_t)(time(NULL)) ^ ((uint64_t)(getpid()) << 32) ^ 0x9E3779B97F4A7C15ull;
+  if (params.rate_ > 0)
+    load.interval = 1e9 / params.rate_;
+
+  if (hdr_init(&load.latency, LATENCY_HIGHEST, 3) != 0)
+    err(EXIT_FAILURE, "Ошибка создания гистограммы");
+
+  pattern_size = params.maxSize_ + PATTERN_SLACK;
+  load.pattern = malloc(pattern_size);
+  load.in = malloc(RECEIVE_SIZE);
+  load.connections = calloc(params.connections_, sizeof(connection_t));
+  if (load.pattern == NULL || load.in == NULL || load.connections == NULL)
+    err(EXIT_FAILURE, "Ошибка выделения памяти");
+  for (size_t i = 0; i < pattern_size; ++i)
+  {
+    load.pattern[i] = (char)(next_random(&load));
+  }
+
+  load.loop = ev_default_loop(EVFLAG_AUTO);
+  if (load.loop == NULL)
+    errx(EXIT_FAILURE, "Ошибка создания цикла обработки событий");
+
+  for (int i = 0; i < params.connections_; ++i)
+  {
+    connection_t * connection = load.connections + i;
+
+    connection->load  = &load;
+    connection->index = i;
+    connection->fd    = open_connection(&params);
+    connection->requests = calloc(params.depth_, sizeof(request_t));
+    if (connection->requests == NULL)
+      err(EXIT_FAILURE, "Ошибка выделения памяти");
+
+    ev_io_init(&connection->watcher, connection_callback, connection->fd, EV_READ);
+    connection->watcher.data = connection;
+    ev_io_start(load.loop, &connection->watcher);
+    ++load.active;
+  }
+
+  load.start = now_ns();
+  load.measure = load.start + (uint64_t)(params.warmup_ * 1e9);
+
+  ev_timer_init(&load.stop_watcher, stop_callback, params.warmup_ + params.duration_, 0.);
+  load.stop_watcher.data = &load;
+  ev_timer_start(load.loop, &load.stop_watcher);
+
+  if (params.rate_ > 0)
+  {
+    ev_timer_init(&load.tick_watcher, tick_callback, 0., TICK_INTERVAL);
+    load.tick_watcher.data = &load;
+    ev_timer_start(load.loop, &load.tick_watcher);
+  }
+
+  for (int i = 0; i < params.connections_; ++i)
+  {
+    connection_issue(load.connections + i, load.start);
+  }
+
+  ev_run(load.loop, 0);
+  load.stopping = 1;
+  finish = now_ns();
+  if (finish < load.measure)
+    finish = load.measure;
+
+  print_report(&load, finish > load.measure ? (finish - load.measure) / 1e9 : 1e-9);
+
+  for (int i = 0; i < params.connections_; ++i)
+  {
+    connection_t * connection = load.connections + i;
+
+    if (connection->fd >= 0)
+      close(connection->fd);
+    free(connection->requests);
+    free(connection->out);
+  }
+  free(load.connections);
+  free(load.pattern);
+  free(load.in);
+  hdr_destroy(&load.latency);
+  ev_loop_destroy(load.loop);
+
+  return load.errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,210 @@
+#include "load_params.h"
+
+#include <stdio.h>
+#include <getopt.h>
+#include <error.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/*
+ * Наибольший размер сообщения (как у сервера в режиме кадров)
+ */
+static const int MAX_MESSAGE_SIZE = 64 * 1024 * 1024;
+
+static void print_help(const char * programName)
+{
+  fprintf(stdout, "Использование: %s [опции]\n"
+                  "опции:\n"
+                  "	-?	--help		эта справка\n"
+                  "	-h	--host		IP адрес сервера (127.0.0.1)\n"
+                  "	-p	--port		порт сервера (1032)\n"
+                  "	-c	--connections	число соединений (1)\n"
+                  "	-d	--depth		число сообщений без ответа на соединение (1)\n"
+                  "			(больше 1 - только в режиме кадров)\n"
+                  "	-r	--rate		сообщений в секунду по всем соединениям:\n"
+                  "			задержка считается от запланированного времени отправки;\n"
+                  "			0 - следующее сообщение по получении ответа (0)\n"
+                  "	-s	--data-size	размер сообщения (64 байта):\n"
+                  "			N - постоянный, uniform:MIN:MAX - равномерный,\n"
+                  "			exp:MEAN - экспоненциальный (не больше 32 средних)\n"
+                  "	-t	--time		продолжительность измерения, секунд (10)\n"
+                  "	-w	--warmup	продолжительность прогрева, секунд (0)\n"
+                  "	-f	--framed	сообщения передаются кадрами: длина (4 байта) и данные\n", programName);
+}
+
+static double parse_number(const char * value, const char * name)
+{
+  char * end;
+  double number = strtod(value, &end);
+
+  if (end == value || *end != 0 || number < 0)
+  {
+    error(EXIT_FAILURE, 0, "Некорректное значение %s: '%s'", name, value);
+  }
+  return number;
+}
+
+static void parse_size(LoadParams * loadParams, const char * value)
+{
+  int min, max;
+  double mean;
+  int n = 0;
+
+  if (sscanf(value, "uniform:%d:%d%n", &min, &max, &n) == 2 && value[n] == 0)
+  {
+    loadParams->sizeDistribution_ = SIZE_UNIFORM;
+  }
+  else if (sscanf(value, "exp:%lf%n", &mean, &n) == 1 && value[n] == 0)
+  {
+    if (mean < 1)
+    {
+      error(EXIT_FAILURE, 0, "Некорректный средний размер сообщения: '%s'", value);
+    }
+    loadParams->sizeDistribution_ = SIZE_EXPONENTIAL;
+    loadParams->meanSize_ = mean;
+    min = 1;
+    max = mean * 32 < MAX_MESSAGE_SIZE ? (int)(mean * 32) : MAX_MESSAGE_SIZE;
+  }
+  else if (sscanf(value, "%d%n", &min, &n) == 1 && value[n] == 0)
+  {
+    loadParams->sizeDistribution_ = SIZE_FIXED;
+    max = min;
+  }
+  else
+  {
+    error(EXIT_FAILURE, 0, "Неверный формат размера сообщения: '%s'", value);
+  }
+
+  if (min <= 0 || max < min || max > MAX_MESSAGE_SIZE)
+  {
+    error(EXIT_FAILURE, 0, "Некорректное значение размера сообщения: '%s'", value);
+  }
+  loadParams->minSize_ = min;
+  loadParams->maxSize_ = max;
+  if (loadParams->sizeDistribution_ != SIZE_EXPONENTIAL)
+    loadParams->meanSize_ = (min + max) / 2.0;
+}
+
+int ProcessCmdLine(LoadParams * loadParams, int argc, const char * argv[])
+{
+  int c;
+  int ret = 0;
+
+  loadParams->ip_          = "127.0.0.1";
+  loadParams->port_        = 1032;
+  loadParams->connections_ = 1;
+  loadParams->depth_       = 1;
+  loadParams->rate_        = 0;
+  loadParams->sizeDistribution_ = SIZE_FIXED;
+  loadParams->minSize_     = 64;
+  loadParams->maxSize_     = 64;
+  loadParams->meanSize_    = 64;
+  loadParams->duration_    = 10;
+  loadParams->warmup_      = 0;
+  loadParams->framed_      = 0;
+
+  while (1)
+  {
+    int option_index = 0;
+    static struct option long_options[] =
+                     {
+                         {"help",        no_argument,       0, '?'},
+                         {"host",        required_argument, 0, 'h'},
+                         {"port",        required_argument, 0, 'p'},
+                         {"connections", required_argument, 0, 'c'},
+                         {"depth",       required_argument, 0, 'd'},
+                         {"rate",        required_argument, 0, 'r'},
+                         {"data-size",   required_argument, 0, 's'},
+                         {"time",        required_argument, 0, 't'},
+                         {"warmup",      required_argument, 0, 'w'},
+                         {"framed",      no_argument,       0, 'f'},
+                         {0, 0, 0, 0},
+                     };
+
+    c = getopt_long (argc, (char * const *)(argv), "?h:p:c:d:r:s:t:w:f", long_options, &option_index);
+    if (c == -1)
+    {
+      break;
+    }
+    switch (c)
+    {
+      case '?':
+        print_help(argv[0]);
+        ret = 1;
+        break;
+
+      case 'h':
+        {
+          int a, b, c, d;
+          if (sscanf(optarg, "%d.%d.%d.%d", &a, &b, &c, &d) != 4)
+          {
+            error(EXIT_FAILURE, 0, "Неверный формат IP адреса: '%s'", optarg);
+          }
+          loadParams->ip_ = optarg;
+          break;
+        }
+
+      case 'p':
+        for (int i = 0; optarg[i] != 0; ++i)
+        {
+          if (!isdigit(optarg[i]))
+          {
+            error(EXIT_FAILURE, 0, "Недопустимый символ в номера порта: '%s'", optarg);
+          }
+        }
+        if ((loadParams->port_ = atoi(optarg)) <= 0)
+        {
+          error(EXIT_FAILURE, 0, "Некорректное значение порта");
+        }
+        break;
+
+      case 'c':
+        if ((loadParams->connections_ = (int)(parse_number(optarg, "числа соединений"))) <= 0)
+        {
+          error(EXIT_FAILURE, 0, "Некорректное значение числа соединений");
+        }
+        break;
+
+      case 'd':
+        if ((loadParams->depth_ = (int)(parse_number(optarg, "числа сообщений"))) <= 0)
+        {
+          error(EXIT_FAILURE, 0, "Некорректное значение числа сообщений");
+        }
+        break;
+
+      case 'r':
+        loadParams->rate_ = parse_number(optarg, "частоты сообщений");
+        break;
+
+      case 's':
+        parse_size(loadParams, optarg);
+        break;
+
+      case 't':
+        if ((loadParams->duration_ = parse_number(optarg, "продолжительности")) <= 0)
+        {
+          error(EXIT_FAILURE, 0, "Некорректное значение продолжительности");
+        }
+        break;
+
+      case 'w':
+        loadParams->warmup_ = parse_number(optarg, "продолжительности прогрева");
+        break;
+
+      case 'f':
+        loadParams->framed_ = 1;
+        break;
+
+      default:
+        error(EXIT_FAILURE, 0, "Неверный параметр командной строки:\n"
+                               "\t\tиспользуйте параметр --help для справки\n");
+        break;
+    }
+  }
+  if (ret == 0 && loadParams->depth_ > 1 && !loadParams->framed_)
+  {
+    error(EXIT_FAILURE, 0, "Несколько сообщений без ожидания ответа передаются только в режиме кадров");
+  }
+  return ret;
+}
@@ -0,0 +1,33 @@
+#ifndef __LOAD_PARAMS_H__
+#define __LOAD_PARAMS_H__
+
+/*
+ * Распределение размеров сообщений
+ */
+typedef enum
+{
+  SIZE_FIXED,           // все сообщения размера minSize_
+  SIZE_UNIFORM,         // равномерно от minSize_ до maxSize_
+  SIZE_EXPONENTIAL,     // экспоненциально со средним meanSize_, не больше maxSize_
+} size_distribution_t;
+
+struct LoadParams
+{
+  const char *        ip_;
+  int                 port_;
+  int                 connections_;   // число соединений
+  int                 depth_;         // сообщений без ответа на соединение
+  double              rate_;          // сообщений в секунду по всем соединениям (0 - замкнутый цикл)
+  size_distribution_t sizeDistribution_;
+  int                 minSize_;
+  int                 maxSize_;
+  double              meanSize_;
+  double              duration_;      // секунд измерения
+  double              warmup_;        // секунд прогрева (не учитываются)
+  int                 framed_;        // сообщения передаются кадрами с заголовком длины
+}; // struct LoadParams
+typedef struct LoadParams LoadParams;
+
+int ProcessCmdLine(LoadParams * loadParams, int argc, const char * argv[]);
+
+#endif
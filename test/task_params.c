@@ -14,7 +14,10 @@ static void print_help(const char * programName)
                   "	-?	--help		эта справка\n"
                   "	-h	--host		IP адрес сервера (127.0.0.1)\n"
                   "	-p	--port		порт сервера (1032)\n"
-                  "	-s	--data-size	размер сообщения (64 байта)\n", programName);
+                  "	-s	--data-size	размер сообщения (64 байта)\n"
+                  "	-f	--framed	сообщения передаются кадрами: длина (4 байта) и данные\n"
+                  "	-c	--count		число сообщений, отправляемых без ожидания ответа\n"
+                  "			(только в режиме кадров, 1)\n", programName);
 }
 
 int ProcessCmdLine(TaskParams * taskParams, int argc, const char * argv[])
@@ -25,6 +28,8 @@ int ProcessCmdLine(TaskParams * taskParams, int argc, const char * argv[])
   taskParams->ip_   = "127.0.0.1";
   taskParams->port_ = 1032;
   taskParams->messageSize_ = 64;
+  taskParams->framed_ = 0;
+  taskParams->count_  = 1;
 
   while (1)
   {
@@ -35,10 +40,12 @@ int ProcessCmdLine(TaskParams * taskParams, int argc, const char * argv[])
                          {"host",      required_argument, 0, 'h'},
                          {"port",      required_argument, 0, 'p'},
                          {"data-size", required_argument, 0, 's'},
+                         {"framed",    no_argument,       0, 'f'},
+                         {"count",     required_argument, 0, 'c'},
                          {0, 0, 0, 0},
                      };
 
-    c = getopt_long (argc, (char * const *)(argv), "?h:p:s:", long_options, &option_index);
+    c = getopt_long (argc, (char * const *)(argv), "?h:p:s:fc:", long_options, &option_index);
     if (c == -1)
     {
       break;
@@ -89,12 +96,34 @@ int ProcessCmdLine(TaskParams * taskParams, int argc, const char * argv[])
         }
         break;
 
+      case 'f':
+        taskParams->framed_ = 1;
+        break;
+
+      case 'c':
+        for (int i = 0; optarg[i] != 0; ++i)
+        {
+          if (!isdigit(optarg[i]))
+          {
+            error(EXIT_FAILURE, 0, "Недопустимый символ в числе сообщений: '%s'", optarg);
+          }
+        }
+        if ((taskParams->count_ = atoi(optarg)) <= 0)
+        {
+          error(EXIT_FAILURE, 0, "Некорректное значение числа сообщений");
+        }
+        break;
+
       default:
         error(EXIT_FAILURE, 0, "Неверный параметр командной строки:\n"
                                "\t\tиспользуйте параметр --help для справки\n");
         break;
     }
   }
+  if (ret == 0 && taskParams->count_ > 1 && !taskParams->framed_)
+  {
+    error(EXIT_FAILURE, 0, "Несколько сообщений без ожидания ответа передаются только в режиме кадров");
+  }
   return ret;
 }
 
@@ -7,6 +7,8 @@ struct TaskParams
   const char * ip_;
   int          port_;
   int          messageSize_;
+  int          framed_;    // сообщения передаются кадрами с заголовком длины
+  int          count_;     // число сообщений, отправляемых без ожидания ответа (режим кадров)
 }; // struct TaskParams
 typedef struct TaskParams TaskParams;
 
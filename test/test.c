@@ -8,6 +8,9 @@
 #include <err.h>
 #include <errno.h>
 #include <ctype.h>
+#include <string.h>
+#include <poll.h>
+#include <fcntl.h>
 
 #include <sys/ioctl.h>
 #include <sys/socket.h>
@@ -115,6 +118,99 @@ int read_data(int fd, char * buffer, int size, double timeout_sec)
   return received;
 }
 
+/*
+ * Обмен кадрами (режим --framed)
+ * Все count кадров отправляются без ожидания ответов, одновременно
+ * принимаются ответы; длина ответа известна из заголовка кадра
+ */
+static int exchange_frames(int fd, const char * data, int size, int count)
+{
+  const int header_size = 4;
+  const int frame_size = header_size + size;
+  unsigned char header[4] = { (size >> 24) & 0xFF, (size >> 16) & 0xFF, (size >> 8) & 0xFF, size & 0xFF };
+  long long total = (long long)(frame_size) * count;
+  long long sent = 0;
+  long long received = 0;
+  char * frame;
+  char * response;
+  int rc = 0;
+
+  frame    = malloc(frame_size);
+  response = malloc(frame_size);
+  if (frame == NULL || response == NULL)
+  {
+    free(frame);
+    free(response);
+    return -1;
+  }
+  memcpy(frame, header, header_size);
+  memcpy(frame + header_size, data, size);
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  while (received < total && rc == 0)
+  {
+    struct pollfd pfd = { fd, POLLIN | (sent < total ? POLLOUT : 0), 0 };
+
+    if (poll(&pfd, 1, 5000) <= 0)
+    {
+      DEBUG("Нет ответа от сервера\n");
+      rc = -1;
+      break;
+    }
+
+    if (sent < total && (pfd.revents & POLLOUT))
+    {
+      long long offset = sent % frame_size;
+      int snt = send(fd, frame + offset, frame_size - offset, 0);
+      if (snt < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        rc = -1;
+        break;
+      }
+      if (snt > 0)
+        sent += snt;
+    }
+
+    if (pfd.revents & (POLLIN | POLLERR | POLLHUP))
+    {
+      long long offset = received % frame_size;
+      int rcv = recv(fd, response + offset, frame_size - offset, 0);
+      if (rcv == 0 || (rcv < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+      {
+        rc = -1;
+        break;
+      }
+      if (rcv < 0)
+        continue;
+      received += rcv;
+
+      if (received % frame_size == 0)
+      {
+        // кадр получен: заголовок без изменений, данные в обратном порядке
+        if (memcmp(response, header, header_size) != 0)
+        {
+          fprintf(stderr, "Неверный заголовок ответа\n");
+          rc = -1;
+        }
+        for (int i = 0; i < size && rc == 0; ++i)
+        {
+          if (response[header_size + i] != data[size-1 - i])
+          {
+            fprintf(stderr, "Ответ %lld не совпадает с обращенным сообщением\n", received / frame_size);
+            rc = -1;
+          }
+        }
+      }
+    }
+  }
+
+  DEBUG("Получено кадров: %lld\n", received / frame_size);
+  free(frame);
+  free(response);
+  return rc;
+}
+
 /*
  *
  */
@@ -166,6 +262,18 @@ int main (int argc, const char * argv[])
     data[i] = (i%10) + '0';
   }
 
+  if (params.framed_)
+  {
+    int rc = exchange_frames(sock_id, data, params.messageSize_, params.count_);
+    free(data);
+    close_socket(sock_id);
+    if (rc != 0)
+    {
+      errx(EXIT_FAILURE, "Ошибка обмена кадрами");
+    }
+    exit(EXIT_SUCCESS);
+  }
+
   DEBUG("Запсь сообщения размером %d байт\n", params.messageSize_);
   if (send_data(sock_id, data, params.messageSize_) != params.messageSize_)
   {